@@ -0,0 +1,200 @@
+import { describe, it, expect, afterEach } from "bun:test";
+import net from "node:net";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import { Result } from "better-result";
+import { VsockError } from "@hyperfleet/errors";
+import {
+  AgentCapabilityCache,
+  failedBeforeAccepted,
+  LEGACY_AGENT_CAPABILITIES,
+  selectTransport,
+  sendAgentRawRequest,
+  supportsOperation,
+  type AgentCapabilities,
+} from "../../services/agent";
+
+const modernAgent: AgentCapabilities = {
+  ...LEGACY_AGENT_CAPABILITIES,
+  version: "0.2.0",
+  operations: [...LEGACY_AGENT_CAPABILITIES.operations, "hello", "batch"],
+  framing: ["json", "raw"],
+  codecs: ["base64", "lz4"],
+  control_port: 53,
+};
+
+describe("selectTransport", () => {
+  it("prefers the host's fastest option the guest supports", () => {
+    const plan = selectTransport(modernAgent, { framing: ["raw", "json"], codecs: ["lz4", "base64"] });
+    expect(plan).toEqual({ framing: "raw", codec: "lz4", controlPort: 53 });
+  });
+
+  it("falls back to JSON and base64 for legacy agents", () => {
+    const plan = selectTransport(LEGACY_AGENT_CAPABILITIES, { framing: ["raw", "json"], codecs: ["lz4", "base64"] });
+    expect(plan).toEqual({ framing: "json", codec: "base64", controlPort: null });
+  });
+});
+
+describe("supportsOperation", () => {
+  it("checks the reported operation list", () => {
+    expect(supportsOperation(modernAgent, "batch")).toBe(true);
+    expect(supportsOperation(LEGACY_AGENT_CAPABILITIES, "batch")).toBe(false);
+  });
+});
+
+describe("AgentCapabilityCache", () => {
+  it("fetches once per machine and shares in-flight requests", async () => {
+    let calls = 0;
+    const cache = new AgentCapabilityCache(async () => {
+      calls++;
+      return Result.ok(modernAgent);
+    });
+
+    const [a, b] = await Promise.all([cache.get("m1", "/tmp/m1.vsock"), cache.get("m1", "/tmp/m1.vsock")]);
+    await cache.get("m1", "/tmp/m1.vsock");
+
+    expect(a.unwrap().version).toBe("0.2.0");
+    expect(b.unwrap().version).toBe("0.2.0");
+    expect(calls).toBe(1);
+  });
+
+  it("refetches after invalidation", async () => {
+    let calls = 0;
+    const cache = new AgentCapabilityCache(async () => {
+      calls++;
+      return Result.ok(modernAgent);
+    });
+
+    await cache.get("m1", "/tmp/m1.vsock");
+    cache.invalidate("m1");
+    await cache.get("m1", "/tmp/m1.vsock");
+
+    expect(calls).toBe(2);
+  });
+
+  it("does not cache failures", async () => {
+    let calls = 0;
+    const cache = new AgentCapabilityCache(async () => {
+      calls++;
+      return calls === 1
+        ? Result.err(new VsockError({ message: "Agent request timed out" }))
+        : Result.ok(modernAgent);
+    });
+
+    const first = await cache.get("m1", "/tmp/m1.vsock");
+    const second = await cache.get("m1", "/tmp/m1.vsock");
+
+    expect(first.isErr()).toBe(true);
+    expect(second.isOk()).toBe(true);
+    expect(calls).toBe(2);
+  });
+});
+
+/**
+ * Minimal stand-in for Firecracker's vsock proxy plus agent: acknowledges the
+ * CONNECT line, then answers the request with the given chunks.
+ */
+function mockAgent(reply: (string | Buffer)[]): Promise<{ path: string; server: net.Server }> {
+  const path = join(tmpdir(), `hyperfleet-agent-test-${Date.now()}-${Math.random()}.sock`);
+  const server = net.createServer((conn) => {
+    let received = "";
+    conn.on("data", (chunk) => {
+      received += chunk.toString();
+      if (received === "CONNECT 52\n") {
+        conn.write("OK 1073741824\n");
+      } else if (received.split("\n").length > 2) {
+        for (const part of reply) conn.write(part);
+        conn.end();
+      }
+    });
+  });
+  return new Promise((resolve) => server.listen(path, () => resolve({ path, server })));
+}
+
+describe("sendAgentRawRequest", () => {
+  let server: net.Server | null = null;
+
+  afterEach(() => {
+    server?.close();
+    server = null;
+  });
+
+  it("reads the raw body announced by the header", async () => {
+    const payload = Buffer.from(Array.from({ length: 200_000 }, (_, i) => i & 0xff));
+    const agent = await mockAgent([
+      `{"success":true,"data":{"size":${payload.length},"framing":"raw","send_mode":"zerocopy"}}\n`,
+      payload.subarray(0, 1000),
+      payload.subarray(1000),
+    ]);
+    server = agent.server;
+
+    const result = await sendAgentRawRequest(agent.path, { operation: "file_read", path: "/x", framing: "raw" }, 5000);
+    expect(result.unwrap().body.equals(payload)).toBe(true);
+  });
+
+  it("skips benchmark segments and returns the final response", async () => {
+    const agent = await mockAgent([
+      `{"segment":"copy","size":4}\n`,
+      "\n\n\n\n",
+      `{"success":true,"data":{"size":4,"results":[]}}\n`,
+    ]);
+    server = agent.server;
+
+    const result = await sendAgentRawRequest(agent.path, { operation: "transfer_bench" }, 5000);
+    expect(result.unwrap().response.data).toEqual({ size: 4, results: [] });
+  });
+
+  it("delivers segments to onSegment", async () => {
+    const agent = await mockAgent([
+      `{"segment":"stdout","size":3}\n`,
+      Buffer.from([0xff, 0x00, 0x0a]),
+      `{"segment":"stderr","size":2}\nok{"segment":"stdout","size":1}\n`,
+      "!",
+      `{"success":true,"data":{"exit_code":0,"stdout_size":4,"stderr_size":2}}\n`,
+    ]);
+    server = agent.server;
+
+    const segments: Record<string, Buffer[]> = { stdout: [], stderr: [] };
+    const result = await sendAgentRawRequest(agent.path, { operation: "exec", cmd: ["/x"], framing: "raw" }, 5000, {
+      onSegment: (segment, chunk) => segments[segment].push(chunk),
+    });
+    expect(result.unwrap().response.data).toEqual({ exit_code: 0, stdout_size: 4, stderr_size: 2 });
+    expect(Buffer.concat(segments.stdout)).toEqual(Buffer.from([0xff, 0x00, 0x0a, 0x21]));
+    expect(Buffer.concat(segments.stderr).toString()).toBe("ok");
+  });
+
+  it("fails on a short body", async () => {
+    const agent = await mockAgent([`{"success":true,"data":{"size":100,"framing":"raw"}}\n`, Buffer.alloc(50)]);
+    server = agent.server;
+
+    const result = await sendAgentRawRequest(agent.path, { operation: "file_read", path: "/x", framing: "raw" }, 5000);
+    expect(result.isErr()).toBe(true);
+  });
+
+  it("refuses bodies over the limit", async () => {
+    const agent = await mockAgent([`{"success":true,"data":{"size":100,"framing":"raw"}}\n`, Buffer.alloc(100)]);
+    server = agent.server;
+
+    const result = await sendAgentRawRequest(agent.path, { operation: "file_read", path: "/x", framing: "raw" }, 5000, {
+      maxBodyBytes: 10,
+    });
+    expect(result.isErr() && result.error.message).toContain("too large");
+  });
+
+  it("tells failures before the agent took the request from later ones", async () => {
+    const nowhere = join(tmpdir(), "hyperfleet-agent-test-missing.sock");
+    const missing = await sendAgentRawRequest(nowhere, { operation: "ping" }, 5000);
+    expect(missing.isErr() && failedBeforeAccepted(missing.error)).toBe(true);
+
+    const silent = await mockAgent([]);
+    server = silent.server;
+    const empty = await sendAgentRawRequest(silent.path, { operation: "exec", cmd: ["/x"], framing: "raw" }, 5000);
+    expect(empty.isErr() && failedBeforeAccepted(empty.error)).toBe(true);
+    server.close();
+
+    const cut = await mockAgent([`{"segment":"stdout","size":10}\n`, "partial"]);
+    server = cut.server;
+    const midway = await sendAgentRawRequest(cut.path, { operation: "exec", cmd: ["/x"], framing: "raw" }, 5000);
+    expect(midway.isErr() && failedBeforeAccepted(midway.error)).toBe(false);
+  });
+});
@@ -0,0 +1,105 @@
+import { describe, it, expect } from "bun:test";
+import { Result } from "better-result";
+import type { Machine as FirecrackerMachine } from "@hyperfleet/firecracker";
+import {
+  BalloonController,
+  decideBalloon,
+  type BalloonInput,
+  type GuestMemoryStatus,
+} from "../../services/balloon";
+
+const MIB = 1024 * 1024;
+
+function guest(availableMib: number, pressure = 0): GuestMemoryStatus {
+  return {
+    total_bytes: 2048 * MIB,
+    free_bytes: availableMib * MIB,
+    available_bytes: availableMib * MIB,
+    swap_total_bytes: 0,
+    swap_free_bytes: 0,
+    refaulted_bytes: 0,
+    psi: { some_avg10: pressure, some_avg60: pressure, full_avg10: 0, full_avg60: 0 },
+  };
+}
+
+function input(overrides: Partial<BalloonInput> & { guest: GuestMemoryStatus }): BalloonInput {
+  return {
+    limits: { memSizeMib: 2048, floorMib: 256, ceilingMib: 2048 },
+    balloonMib: 0,
+    ...overrides,
+  };
+}
+
+describe("decideBalloon", () => {
+  it("inflates an idle guest gradually", () => {
+    expect(decideBalloon(input({ guest: guest(1800) }))).toMatchObject({ action: "inflate", balloonMib: 256 });
+  });
+
+  it("inflates faster when the host is short of memory", () => {
+    const decision = decideBalloon(input({ guest: guest(1800), hostAvailableMib: 512 }));
+    expect(decision).toMatchObject({ action: "inflate", balloonMib: 512 });
+  });
+
+  it("never leaves the guest below its floor", () => {
+    // 348 MiB usable, 48 MiB of it used
+    const decision = decideBalloon(input({ balloonMib: 1700, guest: guest(300) }));
+    expect(decision).toMatchObject({ action: "inflate", balloonMib: 2048 - 256 });
+  });
+
+  it("deflates at once under memory pressure", () => {
+    const decision = decideBalloon(input({ balloonMib: 1024, guest: guest(100, 20) }));
+    expect(decision).toMatchObject({ action: "deflate", balloonMib: 2048 - 1280 });
+  });
+
+  it("deflates ahead of pressure when usage is growing", () => {
+    const decision = decideBalloon(input({ balloonMib: 1024, guest: guest(500), previousUsedMib: 324 }));
+    expect(decision.action).toBe("deflate");
+    expect(decision.balloonMib).toBe(2048 - Math.round((524 + 600) * 1.25));
+  });
+
+  it("settles on a steady workload instead of undoing its own inflation", () => {
+    // 600 MiB used throughout; inflating shrinks MemAvailable by as much
+    const sizes: number[] = [];
+    let balloonMib = 0;
+    let previousUsedMib: number | undefined;
+    for (let round = 0; round < 12; round++) {
+      const decision = decideBalloon(input({ balloonMib, guest: guest(2048 - balloonMib - 600), previousUsedMib }));
+      expect(decision.action).not.toBe("deflate");
+      previousUsedMib = 600;
+      balloonMib = decision.balloonMib;
+      sizes.push(balloonMib);
+    }
+    // 600 MiB plus a quarter of headroom
+    expect(sizes.at(-1)).toBe(2048 - 750);
+    expect(sizes.at(-2)).toBe(2048 - 750);
+  });
+
+  it("keeps a busy guest's memory even when it has some to spare", () => {
+    expect(decideBalloon(input({ balloonMib: 512, guest: guest(1000, 2) })).action).toBe("hold");
+  });
+
+  it("stops at the ceiling", () => {
+    const limits = { memSizeMib: 2048, floorMib: 256, ceilingMib: 1024 };
+    expect(decideBalloon(input({ limits, balloonMib: 1024, guest: guest(50, 30) })).action).toBe("hold");
+    // A guest above its ceiling is brought down to it
+    expect(decideBalloon(input({ limits, guest: guest(100, 30) }))).toMatchObject({ action: "inflate", balloonMib: 1024 });
+  });
+
+  it("ignores changes too small to be worth making", () => {
+    // 830 MiB used of 1048 calls for 1038 MiB, 10 MiB less than it has
+    const decision = decideBalloon(input({ balloonMib: 1000, guest: guest(218) }));
+    expect(decision.action).toBe("hold");
+  });
+});
+
+describe("BalloonController", () => {
+  it("resumes a machine's balloon at the size it was left at", async () => {
+    const controller = new BalloonController();
+    const vm = {
+      getBalloonConfig: async () => Result.ok({ amount_mib: 768, deflate_on_oom: true }),
+    } as unknown as FirecrackerMachine;
+
+    await controller.resume("vm-1", "/tmp/vm-1.vsock", { memSizeMib: 2048, floorMib: 256, ceilingMib: 2048 }, vm);
+    expect(controller.balloonMib("vm-1")).toBe(768);
+  });
+});
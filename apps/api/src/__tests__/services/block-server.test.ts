@@ -0,0 +1,183 @@
+import { describe, it, expect, beforeAll, afterAll, afterEach } from "bun:test";
+import net from "node:net";
+import { existsSync, mkdtempSync, readFileSync, rmSync, writeFileSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import { BlockServer, BLOCK_PORT } from "../../services/block-server";
+
+const NBD_CMD_READ = 0;
+const NBD_CMD_WRITE = 1;
+const NBD_CMD_FLUSH = 3;
+
+/**
+ * Stands in for the guest: the handshake line init sends, then the NBD
+ * requests the kernel client would
+ */
+class NbdClient {
+  private buffer = Buffer.alloc(0);
+  private waiters: (() => void)[] = [];
+  private nextHandle = 1n;
+
+  constructor(private socket: net.Socket) {
+    socket.on("data", (chunk: Buffer) => {
+      this.buffer = Buffer.concat([this.buffer, chunk]);
+      this.waiters.splice(0).forEach((wake) => wake());
+    });
+  }
+
+  static connect(udsPath: string): Promise<NbdClient> {
+    return new Promise((resolve) => {
+      const socket = net.createConnection({ path: `${udsPath}_${BLOCK_PORT}` }, () => resolve(new NbdClient(socket)));
+    });
+  }
+
+  private async take(size: number): Promise<Buffer> {
+    while (this.buffer.length < size) {
+      await new Promise<void>((resolve) => this.waiters.push(resolve));
+    }
+    const taken = this.buffer.subarray(0, size);
+    this.buffer = this.buffer.subarray(size);
+    return taken;
+  }
+
+  async handshake(name = "root"): Promise<Record<string, unknown>> {
+    this.socket.write(`${JSON.stringify({ export: name })}\n`);
+    while (!this.buffer.includes(0x0a)) {
+      await new Promise<void>((resolve) => this.waiters.push(resolve));
+    }
+    const line = await this.take(this.buffer.indexOf(0x0a) + 1);
+    return JSON.parse(line.toString());
+  }
+
+  async request(type: number, offset: number, length: number, data?: Buffer): Promise<{ error: number; data: Buffer }> {
+    const handle = this.nextHandle++;
+    const header = Buffer.alloc(28);
+    header.writeUInt32BE(0x25609513, 0);
+    header.writeUInt16BE(type, 6);
+    header.writeBigUInt64BE(handle, 8);
+    header.writeBigUInt64BE(BigInt(offset), 16);
+    header.writeUInt32BE(length, 24);
+    this.socket.write(data ? Buffer.concat([header, data]) : header);
+
+    const reply = await this.take(16);
+    expect(reply.readUInt32BE(0)).toBe(0x67446698);
+    expect(reply.readBigUInt64BE(8)).toBe(handle);
+    const error = reply.readUInt32BE(4);
+    return { error, data: type === NBD_CMD_READ && error === 0 ? await this.take(length) : Buffer.alloc(0) };
+  }
+
+  close(): void {
+    this.socket.destroy();
+  }
+}
+
+describe("BlockServer", () => {
+  const server = new BlockServer();
+  let dir: string;
+  let udsPath: string;
+  let image: Buffer;
+  let client: NbdClient | null = null;
+  const imageDigest = "sha256:aaaa";
+
+  beforeAll(() => {
+    dir = mkdtempSync(join(tmpdir(), "hyperfleet-block-test-"));
+    udsPath = join(dir, "vm.vsock");
+    // 1 MiB of recognizable bytes
+    image = Buffer.alloc(1024 * 1024);
+    for (let i = 0; i < image.length; i++) image[i] = (i * 7 + (i >> 12)) & 0xff;
+  });
+
+  afterEach(async () => {
+    client?.close();
+    client = null;
+    await server.close("m1");
+    for (const name of ["image.ext4", "image.ext4.boot-profile.json", "m1.overlay", "m1.overlay.map", "m1.overlay.base"]) {
+      rmSync(join(dir, name), { force: true });
+    }
+  });
+
+  afterAll(() => {
+    rmSync(dir, { recursive: true, force: true });
+  });
+
+  async function serve(): Promise<NbdClient> {
+    if (!existsSync(join(dir, "image.ext4"))) writeFileSync(join(dir, "image.ext4"), image);
+    const opened = await server.open("m1", udsPath, {
+      image: join(dir, "image.ext4"),
+      imageDigest,
+      overlay: join(dir, "m1.overlay"),
+    });
+    expect(opened.isOk()).toBe(true);
+    client = await NbdClient.connect(udsPath);
+    return client;
+  }
+
+  it("describes the export and serves reads from the image", async () => {
+    const nbd = await serve();
+    expect(await nbd.handshake()).toMatchObject({ ok: true, size: image.length, block_size: 4096 });
+
+    const read = await nbd.request(NBD_CMD_READ, 60 * 1024, 12 * 1024);
+    expect(read.error).toBe(0);
+    expect(read.data.equals(image.subarray(60 * 1024, 72 * 1024))).toBe(true);
+
+    // Past the end of the device
+    expect((await nbd.request(NBD_CMD_READ, image.length - 4096, 8192)).error).toBe(22);
+  });
+
+  it("refuses unknown exports", async () => {
+    const nbd = await serve();
+    expect(await nbd.handshake("other")).toMatchObject({ ok: false });
+  });
+
+  it("keeps writes in the overlay and the image untouched", async () => {
+    let nbd = await serve();
+    await nbd.handshake();
+
+    const data = Buffer.alloc(4096, 0xab);
+    expect((await nbd.request(NBD_CMD_WRITE, 68 * 1024, 4096, data)).error).toBe(0);
+    expect((await nbd.request(NBD_CMD_FLUSH, 0, 0)).error).toBe(0);
+
+    // The rest of the written chunk still reads as the image
+    const read = await nbd.request(NBD_CMD_READ, 64 * 1024, 16 * 1024);
+    expect(read.data.subarray(0, 4096).equals(image.subarray(64 * 1024, 68 * 1024))).toBe(true);
+    expect(read.data.subarray(4096, 8192).equals(data)).toBe(true);
+    expect(read.data.subarray(8192).equals(image.subarray(72 * 1024, 80 * 1024))).toBe(true);
+    expect(readFileSync(join(dir, "image.ext4")).equals(image)).toBe(true);
+    expect(server.stats("m1")).toMatchObject({ chunksWritten: 1 });
+
+    // The next boot sees the same disk
+    nbd.close();
+    await server.close("m1");
+    nbd = await serve();
+    await nbd.handshake();
+    expect((await nbd.request(NBD_CMD_READ, 68 * 1024, 4096)).data.equals(data)).toBe(true);
+
+    // But not once the image it was written against has been replaced
+    nbd.close();
+    await server.close("m1");
+    const refused = await server.open("m1", udsPath, {
+      image: join(dir, "image.ext4"),
+      imageDigest: "sha256:bbbb",
+      overlay: join(dir, "m1.overlay"),
+    });
+    expect(refused.isErr()).toBe(true);
+  });
+
+  it("records the first boot's reads and prefetches them on the next", async () => {
+    let nbd = await serve();
+    await nbd.handshake();
+    await nbd.request(NBD_CMD_READ, 512 * 1024, 4096);
+    await nbd.request(NBD_CMD_READ, 0, 4096);
+    await nbd.request(NBD_CMD_READ, 512 * 1024 + 4096, 4096);
+    nbd.close();
+    await server.close("m1");
+
+    const profile = JSON.parse(readFileSync(join(dir, "image.ext4.boot-profile.json"), "utf-8"));
+    expect(profile.ranges).toEqual([[8, 1], [0, 1]]);
+
+    nbd = await serve();
+    await nbd.handshake();
+    await new Promise((resolve) => setTimeout(resolve, 50));
+    expect(server.stats("m1")?.bytesPrefetched).toBe(128 * 1024);
+  });
+});
@@ -0,0 +1,47 @@
+import { describe, it, expect } from "bun:test";
+import { randomBytes } from "node:crypto";
+import { compressPayload, decompressPayload, sampleEntropy, wireCodec } from "../../services/compression";
+
+const text = Buffer.from(Array.from({ length: 5000 }, (_, i) => `line ${i % 40} hello\n`).join(""));
+
+describe("compression", () => {
+  it("round-trips both codecs", () => {
+    for (const codec of ["lz4", "zstd"] as const) {
+      const payload = compressPayload(text, codec);
+      expect(payload).not.toBeNull();
+      expect(decompressPayload(payload!, codec, text.length)?.equals(text)).toBe(true);
+    }
+  });
+
+  it("compresses denser with zstd", () => {
+    expect(compressPayload(text, "zstd")!.length).toBeLessThan(compressPayload(text, "lz4")!.length);
+  });
+
+  it("only compresses payloads that shrink", () => {
+    for (const codec of ["lz4", "zstd"] as const) {
+      expect(compressPayload(Buffer.from("short"), codec)).toBeNull();
+      expect(compressPayload(randomBytes(8192), codec)).toBeNull();
+      expect(compressPayload(Buffer.alloc(8192, "x"), codec)).not.toBeNull();
+    }
+  });
+
+  it("rejects zstd frames that don't decode to the stated size", () => {
+    const frame = compressPayload(text, "zstd")!;
+    expect(decompressPayload(frame, "zstd", text.length - 1)).toBeNull();
+    expect(decompressPayload(frame, "zstd", text.length + 1)).toBeNull();
+    expect(decompressPayload(frame.subarray(0, frame.length - 4), "zstd", text.length)).toBeNull();
+    expect(decompressPayload(Buffer.from("not a frame"), "zstd", 11)).toBeNull();
+  });
+
+  it("estimates entropy from samples", () => {
+    expect(sampleEntropy(Buffer.alloc(100_000, "a"))).toBe(0);
+    expect(sampleEntropy(randomBytes(100_000))).toBeGreaterThan(7.5);
+  });
+
+  it("maps transport codecs", () => {
+    expect(wireCodec("zstd")).toBe("zstd");
+    expect(wireCodec("lz4")).toBe("lz4");
+    expect(wireCodec("base64")).toBeNull();
+    expect(wireCodec(undefined)).toBeNull();
+  });
+});
@@ -0,0 +1,133 @@
+import { describe, it, expect, afterEach } from "bun:test";
+import net from "node:net";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import { HostChannelHub, HOST_CHANNEL_PORT } from "../../services/host-channel";
+
+/**
+ * Connect the way Firecracker does when the guest dials the host channel port
+ */
+function connectGuest(udsPath: string): Promise<net.Socket> {
+  return new Promise((resolve) => {
+    const socket = net.createConnection({ path: `${udsPath}_${HOST_CHANNEL_PORT}` }, () => resolve(socket));
+  });
+}
+
+function nextLine(socket: net.Socket): Promise<string> {
+  return new Promise((resolve) => {
+    let buffer = "";
+    const onData = (chunk: Buffer) => {
+      buffer += chunk.toString();
+      const newlineIndex = buffer.indexOf("\n");
+      if (newlineIndex === -1) return;
+      socket.off("data", onData);
+      resolve(buffer.slice(0, newlineIndex));
+    };
+    socket.on("data", onData);
+  });
+}
+
+describe("HostChannelHub", () => {
+  const hub = new HostChannelHub();
+  const udsPath = join(tmpdir(), `hyperfleet-channel-test-${Date.now()}-${Math.random()}.vsock`);
+  let guest: net.Socket | null = null;
+
+  afterEach(() => {
+    guest?.destroy();
+    guest = null;
+    hub.close("m1");
+  });
+
+  it("collects guest messages in order", async () => {
+    expect((await hub.open("m1", udsPath)).isOk()).toBe(true);
+    guest = await connectGuest(udsPath);
+
+    const waiting = hub.waitForMessages("m1", 0, 5000);
+    guest.write(`{"client":1,"pid":42,"message":{"type":"ready"}}\n{"client":2,"pid":7,`);
+    const first = await waiting;
+    expect(first).toHaveLength(1);
+    expect(first[0]).toMatchObject({ seq: 1, client: 1, pid: 42, message: { type: "ready" } });
+
+    guest.write(`"message":{"type":"scale","to":3}}\nnot json\n`);
+    const second = await hub.waitForMessages("m1", first[0].seq, 5000);
+    expect(second.map((m) => m.message)).toEqual([{ type: "scale", to: 3 }]);
+    expect(hub.messages("m1")).toHaveLength(2);
+  });
+
+  it("times out when nothing arrives", async () => {
+    await hub.open("m1", udsPath);
+    const started = Date.now();
+    expect(await hub.waitForMessages("m1", 0, 50)).toEqual([]);
+    expect(Date.now() - started).toBeGreaterThanOrEqual(40);
+  });
+
+  it("sends messages to the connected guest", async () => {
+    await hub.open("m1", udsPath);
+    expect(hub.send("m1", { cmd: "checkpoint" }).isErr()).toBe(true);
+
+    guest = await connectGuest(udsPath);
+    const line = nextLine(guest);
+    // The accept callback runs on the next tick
+    await new Promise((resolve) => setTimeout(resolve, 10));
+    expect(hub.send("m1", { cmd: "checkpoint" }, 3).isOk()).toBe(true);
+    expect(JSON.parse(await line)).toEqual({ client: 3, message: { cmd: "checkpoint" } });
+  });
+
+  it("gives the guest its probes and keeps the transitions it reports", async () => {
+    await hub.open("m1", udsPath);
+    hub.configureProbes("m1", [{ name: "web", type: "http", port: 8080, path: "/healthz" }]);
+    expect(hub.probeStatuses("m1")).toEqual([{ name: "web", status: "unknown", detail: null, changed_at: null }]);
+
+    guest = await connectGuest(udsPath);
+    expect(JSON.parse(await nextLine(guest))).toEqual({
+      probes: [{ name: "web", type: "http", port: 8080, path: "/healthz" }],
+    });
+
+    const waiting = hub.waitForMessages("m1", 0, 5000);
+    guest.write(`{"probe":{"name":"web","status":"unhealthy","previous":"unknown","detail":"HTTP 503"}}\n`);
+    guest.write(`{"probe":{"name":"gone","status":"healthy"}}\n{"client":1,"pid":1,"message":{"type":"ready"}}\n`);
+    // Probe reports aren't workload messages
+    expect((await waiting).map((m) => m.message)).toEqual([{ type: "ready" }]);
+    const [web] = hub.probeStatuses("m1");
+    expect(web).toMatchObject({ name: "web", status: "unhealthy", detail: "HTTP 503" });
+
+    // The same status repeated after a reconnect isn't a new transition
+    guest.write(`{"probe":{"name":"web","status":"unhealthy","previous":"unknown","detail":"HTTP 502"}}\n`);
+    await new Promise((resolve) => setTimeout(resolve, 20));
+    expect(hub.probeStatuses("m1")[0]).toMatchObject({ detail: "HTTP 502", changed_at: web.changed_at });
+  });
+
+  it("keeps the listening ports the guest reports and announces changes", async () => {
+    await hub.open("m1", udsPath);
+    const changes: number[][] = [];
+    const unsubscribe = hub.onPortsChanged((machineId, ports) => {
+      if (machineId === "m1") changes.push(ports.map((p) => p.port));
+    });
+
+    guest = await connectGuest(udsPath);
+    const ports = `{"ports":[{"protocol":"tcp","address":"0.0.0.0","port":8080,"pid":412,"process":"node"}]}\n`;
+    guest.write(ports);
+    // Sent again after a reconnect: not a change
+    guest.write(ports);
+    guest.write(`{"ports":[]}\n`);
+    await new Promise((resolve) => setTimeout(resolve, 20));
+    expect(changes).toEqual([[8080], []]);
+    expect(hub.listeningPorts("m1")).toEqual([]);
+
+    guest.write(ports);
+    await new Promise((resolve) => setTimeout(resolve, 20));
+    expect(hub.listeningPorts("m1")).toEqual([
+      { protocol: "tcp", address: "0.0.0.0", port: 8080, pid: 412, process: "node" },
+    ]);
+    hub.close("m1");
+    expect(changes.at(-1)).toEqual([]);
+    unsubscribe();
+  });
+
+  it("forgets a machine once closed", async () => {
+    await hub.open("m1", udsPath);
+    hub.close("m1");
+    expect(hub.isOpen("m1")).toBe(false);
+    expect(hub.messages("m1")).toEqual([]);
+  });
+});
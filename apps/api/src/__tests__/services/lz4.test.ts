@@ -0,0 +1,43 @@
+import { describe, it, expect } from "bun:test";
+import { randomBytes } from "node:crypto";
+import { compressBlock, decompressBlock } from "../../services/lz4";
+
+function roundTrip(input: Buffer): Buffer | null {
+  return decompressBlock(compressBlock(input), input.length);
+}
+
+describe("lz4", () => {
+  it("round-trips text", () => {
+    const input = Buffer.from(Array.from({ length: 5000 }, (_, i) => `line ${i % 40} hello\n`).join(""));
+    const block = compressBlock(input);
+    expect(block.length).toBeLessThan(input.length / 10);
+    expect(decompressBlock(block, input.length)?.equals(input)).toBe(true);
+  });
+
+  it("round-trips incompressible and tiny inputs", () => {
+    for (const input of [randomBytes(70_000), Buffer.alloc(0), Buffer.from("abc"), Buffer.from("0123456789abcdef")]) {
+      expect(roundTrip(input)?.equals(input)).toBe(true);
+    }
+  });
+
+  it("round-trips long runs with overlapping matches", () => {
+    const input = Buffer.concat([Buffer.alloc(100_000, "a"), Buffer.from("ab".repeat(70_000))]);
+    expect(roundTrip(input)?.equals(input)).toBe(true);
+  });
+
+  it("decodes a block produced by the reference implementation", () => {
+    // Block from the `lz4` CLI for "hello hello hello hello hello!"
+    const block = Buffer.from([
+      0x6f, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x20, 0x06, 0x00, 0x00, 0x50, 0x65, 0x6c, 0x6c, 0x6f, 0x21,
+    ]);
+    expect(decompressBlock(block, 30)?.toString()).toBe("hello hello hello hello hello!");
+  });
+
+  it("rejects malformed blocks", () => {
+    const input = Buffer.from("abcabcabcabcabcabcabcabcabcabcabc");
+    const block = compressBlock(input);
+    expect(decompressBlock(block, input.length + 1)).toBeNull();
+    expect(decompressBlock(block.subarray(0, block.length - 3), input.length)).toBeNull();
+    expect(decompressBlock(Buffer.from([0x00, 0x05, 0x00]), 8)).toBeNull();
+  });
+});
@@ -3,6 +3,7 @@ import { createInMemoryDatabase, runMigrations } from "@hyperfleet/worker/databa
 import type { Kysely } from "@hyperfleet/worker/database";
 import type { Database } from "@hyperfleet/worker/database";
 import { createReverseProxyHandler } from "../../proxy";
+import type { ListeningPort } from "../../types";
 
 describe("Reverse proxy", () => {
   let db: Kysely<Database>;
@@ -206,4 +207,65 @@ describe("Reverse proxy", () => {
     const payload = (await response.json()) as { error: string; message: string };
     expect(payload.error).toBe("ValidationError");
   });
+
+  it("routes to the port a guest listens on when the machine opts in", async () => {
+    const upstreamCalls: string[] = [];
+    const listening: ListeningPort[] = [
+      { protocol: "tcp", address: "0.0.0.0", port: 3000, pid: 80, process: "node" },
+      // Not reachable from the host, and not TCP
+      { protocol: "tcp", address: "127.0.0.1", port: 9229, pid: 80, process: "node" },
+      { protocol: "udp", address: "0.0.0.0", port: 53, pid: 12, process: "dnsmasq" },
+    ];
+    const ports = { listeningPorts: () => listening };
+    const fetchFn = async (request: Request) => {
+      upstreamCalls.push(request.url);
+      return new Response("ok");
+    };
+    const handler = createReverseProxyHandler({ db, ports, fetchFn });
+    const hostHandler = createReverseProxyHandler({ db, ports, fetchFn, hostSuffix: "palmframe.com", defaultPort: 4000 });
+
+    const insertMachine = (id: string, guestIp: string, config: object) =>
+      db
+        .insertInto("machines")
+        .values({
+          id,
+          name: "proxy-machine",
+          status: "running",
+          runtime_type: "firecracker",
+          vcpu_count: 1,
+          mem_size_mib: 128,
+          kernel_image_path: "vmlinuz",
+          kernel_args: null,
+          rootfs_path: null,
+          socket_path: "/tmp/firecracker.sock",
+          tap_device: null,
+          tap_ip: null,
+          guest_ip: guestIp,
+          guest_mac: null,
+          config_json: JSON.stringify(config),
+          pid: null,
+          error_message: null,
+        })
+        .execute();
+    await insertMachine("machine-proxy-5", "172.16.0.6", { discoverPorts: true });
+    await insertMachine("machine-proxy-6", "172.16.0.7", {});
+
+    const response = await handler(new Request("http://proxy.local/proxy/machine-proxy-5/hello"));
+    expect(response.status).toBe(200);
+    expect(upstreamCalls[0]).toBe("http://172.16.0.6:3000/hello");
+
+    // An explicit port still goes through, even one not seen listening yet
+    await handler(new Request("http://proxy.local/proxy/machine-proxy-5/?port=8000"));
+    expect(upstreamCalls[1]).toBe("http://172.16.0.6:8000/");
+
+    // Host routing goes through the proxy's own listener, with the port from ?port=
+    await hostHandler(new Request("http://machine-proxy-5.palmframe.com:4000/hello"));
+    expect(upstreamCalls[2]).toBe("http://172.16.0.6:3000/hello");
+    await hostHandler(new Request("http://machine-proxy-5.palmframe.com:4000/hello?port=8000&q=1"));
+    expect(upstreamCalls[3]).toBe("http://172.16.0.6:8000/hello?q=1");
+
+    // Without the opt-in, reported ports are ignored
+    await handler(new Request("http://proxy.local/proxy/machine-proxy-6/hello"));
+    expect(upstreamCalls[4]).toBe("http://172.16.0.7/hello");
+  });
 });
@@ -0,0 +1,169 @@
+import { describe, it, expect, beforeAll, afterAll, afterEach } from "bun:test";
+import net from "node:net";
+import { mkdtempSync, mkdirSync, readFileSync, rmSync, statSync, symlinkSync, writeFileSync } from "node:fs";
+import { constants, tmpdir } from "node:os";
+import { join } from "node:path";
+import { ShareServer, SHARE_PORT } from "../../services/shares";
+
+/**
+ * A guest worker connection: sends one request at a time and reads the reply
+ * line plus, for reads, the raw bytes after it
+ */
+class GuestConnection {
+  private buffer = Buffer.alloc(0);
+  private waiting: (() => void) | null = null;
+
+  constructor(private socket: net.Socket) {
+    socket.on("data", (chunk: Buffer) => {
+      this.buffer = Buffer.concat([this.buffer, chunk]);
+      this.waiting?.();
+    });
+  }
+
+  static open(udsPath: string): Promise<GuestConnection> {
+    return new Promise((resolve) => {
+      const path = `${udsPath}_${SHARE_PORT}`;
+      const socket = net.createConnection({ path }, () => resolve(new GuestConnection(socket)));
+    });
+  }
+
+  async call(request: Record<string, unknown>, body?: Buffer): Promise<{ reply: Record<string, any>; data: Buffer }> {
+    this.socket.write(`${JSON.stringify(request)}\n`);
+    if (body) this.socket.write(body);
+
+    const line = await this.take(() => this.buffer.indexOf(0x0a) + 1);
+    const reply = JSON.parse(line.toString()) as Record<string, any>;
+    if (request.op !== "read" || !reply.ok) {
+      return { reply, data: Buffer.alloc(0) };
+    }
+    const data = await this.take(() => (this.buffer.length >= reply.size ? reply.size : 0));
+    return { reply, data };
+  }
+
+  close(): void {
+    this.socket.destroy();
+  }
+
+  private async take(ready: () => number): Promise<Buffer> {
+    while (ready() === 0) {
+      await new Promise<void>((resolve) => (this.waiting = resolve));
+    }
+    const length = ready();
+    const taken = this.buffer.subarray(0, length);
+    this.buffer = this.buffer.subarray(length);
+    return taken;
+  }
+}
+
+describe("ShareServer", () => {
+  const server = new ShareServer();
+  const udsPath = join(tmpdir(), `hyperfleet-share-test-${Date.now()}-${Math.random()}.vsock`);
+  let root = "";
+  let outside = "";
+  let guest: GuestConnection | null = null;
+
+  beforeAll(() => {
+    root = mkdtempSync(join(tmpdir(), "hyperfleet-share-root-"));
+    outside = mkdtempSync(join(tmpdir(), "hyperfleet-share-outside-"));
+    mkdirSync(join(root, "models"));
+    const weights = Buffer.from(Array.from({ length: 10_000 }, (_, i) => i & 0xff));
+    writeFileSync(join(root, "models", "weights.bin"), weights);
+    writeFileSync(join(outside, "secret"), "secret");
+    symlinkSync(outside, join(root, "escape"));
+  });
+
+  afterAll(() => {
+    rmSync(root, { recursive: true, force: true });
+    rmSync(outside, { recursive: true, force: true });
+  });
+
+  afterEach(() => {
+    guest?.close();
+    guest = null;
+    server.close("m1");
+  });
+
+  async function serve(writable: boolean): Promise<GuestConnection> {
+    await server.open("m1", udsPath);
+    await server.export("m1", "data", { root, target: "/mnt/data", writable, cacheSeconds: 60 });
+    guest = await GuestConnection.open(udsPath);
+    return guest;
+  }
+
+  it("answers lookups, listings and reads", async () => {
+    const conn = await serve(false);
+
+    const { reply: attr } = await conn.call({ op: "lookup", share: "data", path: "/models/weights.bin" });
+    expect(attr).toMatchObject({ ok: true, size: 10_000, nlink: 1 });
+
+    const { reply: listing } = await conn.call({ op: "readdir", share: "data", path: "/models" });
+    expect(listing.entries.map((e: { name: string }) => e.name)).toEqual([".", "..", "weights.bin"]);
+
+    const { reply, data } = await conn.call({
+      op: "read",
+      share: "data",
+      path: "/models/weights.bin",
+      offset: 9_990,
+      size: 4096,
+    });
+    expect(reply).toEqual({ ok: true, size: 10 });
+    expect([...data]).toEqual([6, 7, 8, 9, 10, 11, 12, 13, 14, 15]);
+
+    const { reply: missing } = await conn.call({ op: "getattr", share: "data", path: "/nope" });
+    expect(missing).toEqual({ ok: false, errno: constants.errno.ENOENT });
+  });
+
+  it("never leaves the exported directory", async () => {
+    const conn = await serve(false);
+
+    const lookup = async (share: string, path: string) => (await conn.call({ op: "lookup", share, path })).reply;
+
+    expect((await lookup("data", "/../etc/passwd")).errno).toBe(constants.errno.EINVAL);
+    expect((await lookup("data", "/escape/secret")).errno).toBe(constants.errno.EACCES);
+    expect((await lookup("other", "/")).errno).toBe(constants.errno.ENOENT);
+    // The link itself is visible so the guest can resolve it in its own namespace
+    const { reply } = await conn.call({ op: "readlink", share: "data", path: "/escape" });
+    expect(reply).toEqual({ ok: true, target: outside });
+  });
+
+  it("refuses changes to read-only shares", async () => {
+    const conn = await serve(false);
+    const { reply } = await conn.call(
+      { op: "write", share: "data", path: "/models/weights.bin", offset: 0, size: 2 },
+      Buffer.from("hi")
+    );
+    expect(reply.errno).toBe(constants.errno.EROFS);
+
+    // The body was consumed, so the next request still lines up
+    expect((await conn.call({ op: "getattr", share: "data", path: "/" })).reply.ok).toBe(true);
+  });
+
+  it("creates and writes files in writable shares", async () => {
+    const conn = await serve(true);
+
+    const created = await conn.call({ op: "create", share: "data", path: "/out.txt", mode: 0o644 });
+    expect(created.reply).toMatchObject({ ok: true, size: 0 });
+
+    const payload = Buffer.from("checkpoint\n");
+    const { reply } = await conn.call(
+      { op: "write", share: "data", path: "/out.txt", offset: 0, size: payload.length },
+      payload
+    );
+    expect(reply).toEqual({ ok: true, size: payload.length });
+    expect(readFileSync(join(root, "out.txt")).toString()).toBe("checkpoint\n");
+
+    expect((await conn.call({ op: "unlink", share: "data", path: "/out.txt" })).reply).toEqual({ ok: true });
+  });
+
+  it("never creates setuid or setgid files on the host", async () => {
+    const conn = await serve(true);
+
+    await conn.call({ op: "create", share: "data", path: "/suid", mode: 0o6755 });
+    expect(statSync(join(root, "suid")).mode & 0o7000).toBe(0);
+    await conn.call({ op: "mkdir", share: "data", path: "/sgid", mode: 0o3777 });
+    expect(statSync(join(root, "sgid")).mode & 0o6000).toBe(0);
+
+    await conn.call({ op: "unlink", share: "data", path: "/suid" });
+    await conn.call({ op: "rmdir", share: "data", path: "/sgid" });
+  });
+});
@@ -1,6 +1,9 @@
+import { createLogger } from "@hyperfleet/logger";
 import { createDatabase, runMigrations } from "@hyperfleet/worker/database";
 import { createApp } from "./app";
 import { parseProxyPort, startReverseProxy } from "./proxy";
+import { balloonController } from "./services/balloon";
+import { MachineService } from "./services/machines";
 
 const DB_PATH = process.env.DATABASE_PATH ?? "./hyperfleet.db";
 const PORT = process.env.PORT ?? 3000;
@@ -9,6 +12,7 @@ const PROXY_PORT = parseProxyPort(process.env.PROXY_PORT);
 const PROXY_PREFIX = process.env.PROXY_PREFIX ?? "/proxy";
 const PROXY_HOST_SUFFIX = process.env.PROXY_HOST_SUFFIX;
 const PROXY_EXPOSED_PORT_POLL_INTERVAL_MS = process.env.PROXY_EXPOSED_PORT_POLL_INTERVAL_MS;
+const BALLOON_INTERVAL_MS = Number(process.env.HYPERFLEET_BALLOON_INTERVAL_MS ?? 5000);
 
 async function main() {
   if (PROXY_PORT.isErr()) {
@@ -34,6 +38,9 @@ async function main() {
   console.log("Running migrations...");
   await runMigrations(db);
 
+  // Machines left running by a previous process still need their host side
+  await new MachineService(db, createLogger({ correlationId: "startup" })).resumeRunning();
+
   // Create and start the app
   const app = createApp({ db, disableAuth: DISABLE_AUTH });
 
@@ -41,6 +48,9 @@ async function main() {
     console.log(`Hyperfleet API running at http://localhost:${PORT}`);
   });
 
+  // Machines created with memory limits give idle memory back to the host
+  balloonController.start(BALLOON_INTERVAL_MS);
+
   const proxyServer = startReverseProxy({
     db,
     port: PROXY_PORT.unwrap(),
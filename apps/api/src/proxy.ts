@@ -9,6 +9,8 @@ import {
   type HyperfleetError,
 } from "@hyperfleet/errors";
 import { createLogger, generateCorrelationId } from "@hyperfleet/logger";
+import { hostChannels } from "./services/host-channel";
+import type { ListeningPort } from "./types";
 
 const DEFAULT_PROXY_PORT = 4000;
 const DEFAULT_PROXY_PREFIX = "/proxy";
@@ -24,12 +26,21 @@ type ProxyMachineConfig = Pick<Machine, "id" | "runtime_type" | "status" | "conf
 
 type VmProxyConfig = {
   exposedPorts?: number[];
+  discoverPorts?: boolean;
 };
 
 type FetchFn = (request: Request) => Promise<Response>;
 
+/**
+ * Where the proxy learns which ports guests listen on
+ */
+export interface PortDiscovery {
+  listeningPorts(machineId: string): ListeningPort[];
+}
+
 export interface ReverseProxyConfig {
   db: Kysely<Database>;
+  ports?: PortDiscovery;
   port?: number;
   prefix?: string;
   hostSuffix?: string;
@@ -38,6 +49,7 @@ export interface ReverseProxyConfig {
 
 export interface ReverseProxyHandlerConfig {
   db: Kysely<Database>;
+  ports?: PortDiscovery;
   prefix?: string;
   fetchFn?: FetchFn;
   hostSuffix?: string;
@@ -169,6 +181,27 @@ function getVmExposedPorts(
   return Result.ok(normalizedResult.unwrap());
 }
 
+/**
+ * Whether a machine opted into being proxied to the ports its guest reports.
+ * Declared exposed_ports take precedence.
+ */
+function routesDiscoveredPorts(machine: ProxyMachineConfig): boolean {
+  const config = Result.try(() => JSON.parse(machine.config_json) as VmProxyConfig);
+  return config.isOk() && config.unwrap().discoverPorts === true;
+}
+
+/**
+ * TCP ports the guest listens on that the proxy can reach, i.e. not only on
+ * loopback
+ */
+function getVmDiscoveredPorts(ports: PortDiscovery, machineId: string): number[] {
+  const reachable = ports
+    .listeningPorts(machineId)
+    .filter((p) => p.protocol === "tcp" && !p.address.startsWith("127.") && p.address !== "::1")
+    .map((p) => p.port);
+  return Array.from(new Set(reachable));
+}
+
 function resolveVmPort(
   requestedPort: number | null,
   exposedPorts: number[] | null
@@ -244,11 +277,13 @@ export function startReverseProxy(config: ReverseProxyConfig): ReturnType<typeof
   const prefix = config.prefix ?? DEFAULT_PROXY_PREFIX;
   const port = config.port ?? DEFAULT_PROXY_PORT;
   const hostSuffix = normalizeHostSuffix(config.hostSuffix);
+  const ports = config.ports ?? hostChannels;
 
   const controlServer = Bun.serve({
     port,
     fetch: createReverseProxyHandler({
       db: config.db,
+      ports,
       prefix,
       hostSuffix: hostSuffix ?? undefined,
       defaultPort: port,
@@ -261,6 +296,8 @@ export function startReverseProxy(config: ReverseProxyConfig): ReturnType<typeof
     const portServers = new Map<number, ReturnType<typeof Bun.serve>>();
     let syncing = false;
 
+    // Host listeners only ever come from declared exposed_ports, never from
+    // ports a guest reports
     const syncPorts = async () => {
       if (syncing) return;
       syncing = true;
@@ -296,6 +333,7 @@ export function startReverseProxy(config: ReverseProxyConfig): ReturnType<typeof
               port,
               fetch: createReverseProxyHandler({
                 db: config.db,
+                ports,
                 prefix,
                 hostSuffix,
                 defaultPort: port,
@@ -331,6 +369,7 @@ export function createReverseProxyHandler(
   config: ReverseProxyHandlerConfig
 ): (request: Request) => Promise<Response> {
   const prefix = config.prefix ?? DEFAULT_PROXY_PREFIX;
+  const ports = config.ports ?? hostChannels;
   const fetchFn: FetchFn = config.fetchFn ?? ((request) => fetch(request));
   const hostSuffix = normalizeHostSuffix(config.hostSuffix);
   const defaultPort = config.defaultPort ?? DEFAULT_HOST_PORT;
@@ -414,12 +453,30 @@ export function createReverseProxyHandler(
       return errorResponse(exposedPortsResult.error);
     }
 
+    const discovery = exposedPortsResult.unwrap() === null && routesDiscoveredPorts(machine);
+    if (discovery && routeMode === "host") {
+      // These machines get no listener of their own, so the port comes from ?port=
+      const portResult = parsePortParam(url.searchParams);
+      if (portResult.isErr()) {
+        logger.warn("Invalid proxy port parameter", { error: portResult.error.message });
+        return errorResponse(portResult.error);
+      }
+      requestedPort = portResult.unwrap();
+    }
+
     const resolvedPortResult = resolveVmPort(requestedPort, exposedPortsResult.unwrap());
     if (resolvedPortResult.isErr()) {
       logger.warn("Requested port not exposed", { error: resolvedPortResult.error.message });
       return errorResponse(resolvedPortResult.error);
     }
     requestedPort = resolvedPortResult.unwrap();
+    if (requestedPort === null && discovery) {
+      // A guest serving on a single port needs no ?port=
+      const discovered = getVmDiscoveredPorts(ports, machine.id);
+      if (discovered.length === 1) {
+        requestedPort = discovered[0];
+      }
+    }
 
     const targetResult = resolveProxyTarget(machine, requestedPort);
     if (targetResult.isErr()) {
@@ -428,7 +485,7 @@ export function createReverseProxyHandler(
     }
 
     const forwardedParams = new URLSearchParams(url.searchParams);
-    if (routeMode === "path") {
+    if (routeMode === "path" || discovery) {
       forwardedParams.delete("port");
     }
     const target = targetResult.unwrap();
@@ -2,7 +2,7 @@ import { Elysia, t } from "elysia";
 import type { FileService } from "../services/files";
 import type { AuthService } from "../services/auth";
 import type { Logger } from "@hyperfleet/logger";
-import { getHttpStatus } from "@hyperfleet/errors";
+import { getHttpStatus, getRetryAfterMs } from "@hyperfleet/errors";
 
 const errorResponse = t.Object({
   error: t.String(),
@@ -17,9 +17,51 @@ const fileStatResponse = t.Object({
   is_dir: t.Boolean(),
 });
 
+const cacheMode = t.Union([t.Literal("normal"), t.Literal("dontneed"), t.Literal("direct")]);
+
+const compression = t.Union([t.Literal("lz4"), t.Literal("zstd"), t.Literal("none")], {
+  description:
+    "Codec for the transfer inside the VM link: lz4 is fastest, zstd densest. Defaults to the fastest one the guest supports",
+});
+
 const uploadResponse = t.Object({
   success: t.Boolean(),
   bytes_written: t.Number(),
+  cache: t.Optional(cacheMode),
+});
+
+const cacheStatusResponse = t.Object({
+  path: t.String(),
+  file_size: t.Number(),
+  offset: t.Number(),
+  length: t.Number(),
+  page_size: t.Number(),
+  pages: t.Number(),
+  cached_pages: t.Number(),
+  cached_bytes: t.Number({ description: "Cached bytes inside the range" }),
+  extents: t.Array(t.Object({ offset: t.Number(), length: t.Number() }), {
+    description: "Cached extents, the first 64 of them",
+  }),
+  extents_truncated: t.Boolean(),
+});
+
+const sendMode = t.Union([t.Literal("copy"), t.Literal("sendfile"), t.Literal("zerocopy")]);
+
+const transferBenchResponse = t.Object({
+  size: t.Number({ description: "Bytes sent per mode" }),
+  results: t.Array(
+    t.Object({
+      mode: sendMode,
+      used: sendMode,
+      fallback: t.Boolean(),
+      seconds: t.Number(),
+      mb_per_s: t.Number(),
+      cpu_ms_per_gib: t.Number(),
+      guest_cpu_ms_per_gib: t.Number(),
+      zerocopy_sends: t.Number(),
+      zerocopy_copied: t.Number(),
+    })
+  ),
 });
 
 // Type for context with our derived services
@@ -73,14 +115,18 @@ export const fileRoutes = (disableAuth: boolean) =>
         // Get file content from body
         const content = Buffer.from(body.content, "base64");
 
-        const result = await fileService.uploadFile(params.id, body.path, content);
+        const result = await fileService.uploadFile(params.id, body.path, content, body.cache, body.compression);
         if (result.isErr()) {
           set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
           return { error: result.error._tag, message: result.error.message };
         }
 
         const data = result.unwrap();
-        return { success: true, bytes_written: data.bytes_written };
+        return { success: true, bytes_written: data.bytes_written, cache: data.cache };
       },
       {
         params: t.Object({
@@ -89,6 +135,8 @@ export const fileRoutes = (disableAuth: boolean) =>
         body: t.Object({
           path: t.String({ description: "Absolute path on the VM where the file will be written" }),
           content: t.String({ description: "Base64-encoded file content" }),
+          cache: t.Optional(cacheMode),
+          compression: t.Optional(compression),
         }),
         response: {
           200: uploadResponse,
@@ -96,10 +144,12 @@ export const fileRoutes = (disableAuth: boolean) =>
           401: errorResponse,
           404: errorResponse,
           502: errorResponse,
+          503: errorResponse,
         },
         detail: {
           summary: "Upload file",
-          description: "Upload a file to a running VM. Content must be base64-encoded.",
+          description:
+            "Upload a file to a running VM. Content must be base64-encoded. With cache dontneed or direct the upload doesn't push the workload's files out of the guest page cache.",
         },
       }
     )
@@ -114,9 +164,13 @@ export const fileRoutes = (disableAuth: boolean) =>
           return { error: "unauthorized", message: "Invalid or missing API key" };
         }
 
-        const result = await fileService.downloadFile(params.id, query.path);
+        const result = await fileService.downloadFile(params.id, query.path, query.cache, query.compression);
         if (result.isErr()) {
           set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
           return { error: result.error._tag, message: result.error.message };
         }
 
@@ -133,6 +187,12 @@ export const fileRoutes = (disableAuth: boolean) =>
         }),
         query: t.Object({
           path: t.String({ description: "Absolute path on the VM to download" }),
+          cache: t.Optional(
+            t.Union([t.Literal("normal"), t.Literal("dontneed")], {
+              description: "dontneed drops the pages the download read in, keeping ones that were already cached",
+            })
+          ),
+          compression: t.Optional(compression),
         }),
         response: {
           200: t.Object({
@@ -143,6 +203,7 @@ export const fileRoutes = (disableAuth: boolean) =>
           401: errorResponse,
           404: errorResponse,
           502: errorResponse,
+          503: errorResponse,
         },
         detail: {
           summary: "Download file",
@@ -190,6 +251,55 @@ export const fileRoutes = (disableAuth: boolean) =>
       }
     )
 
+    // GET /machines/:id/files/cache - Page cache residency
+    .get(
+      "/cache",
+      async (ctx) => {
+        const { params, query, set, fileService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await fileService.cacheStatus(params.id, query.path, {
+          offset: query.offset,
+          length: query.length,
+        });
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          path: t.String({ description: "Absolute path of a regular file on the VM" }),
+          offset: t.Optional(t.Numeric({ minimum: 0, description: "Start of the range (default 0)" })),
+          length: t.Optional(t.Numeric({ minimum: 0, description: "Length of the range (default the rest of the file)" })),
+        }),
+        response: {
+          200: cacheStatusResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Get page cache residency",
+          description: "Report how much of a file on a running VM is in its page cache, without reading it",
+        },
+      }
+    )
+
     // DELETE /machines/:id/files - Delete file
     .delete(
       "/",
@@ -227,4 +337,50 @@ export const fileRoutes = (disableAuth: boolean) =>
           description: "Delete a file from a running VM",
         },
       }
+    )
+
+    // POST /machines/:id/files/bench - Benchmark download send modes
+    .post(
+      "/bench",
+      async (ctx) => {
+        const { params, body, set, fileService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await fileService.benchTransfer(params.id, body ?? {});
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Optional(t.Object({
+          size_mb: t.Optional(t.Number({ minimum: 1, maximum: 1024, description: "Payload size per mode (default 64)" })),
+          modes: t.Optional(t.Array(sendMode, { minItems: 1, maxItems: 3, description: "Send modes to compare (default all)" })),
+        })),
+        response: {
+          200: transferBenchResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Benchmark downloads",
+          description:
+            "Stream an in-memory payload from the VM once per send mode (copy, sendfile, zerocopy) and report throughput and guest CPU per GiB",
+        },
+      }
     );
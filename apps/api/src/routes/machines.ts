@@ -1,9 +1,10 @@
 import { Elysia, t } from "elysia";
 import type { MachineStatus } from "@hyperfleet/worker/database";
 import type { MachineService } from "../services/machines";
+import type { LatencyTraceEvents } from "../types";
 import type { AuthService } from "../services/auth";
 import type { Logger } from "@hyperfleet/logger";
-import { getHttpStatus } from "@hyperfleet/errors";
+import { getHttpStatus, getRetryAfterMs } from "@hyperfleet/errors";
 
 const machineStatusEnum = t.Union([
   t.Literal("pending"),
@@ -56,6 +57,208 @@ const execResponse = t.Object({
   exit_code: t.Number(),
   stdout: t.String(),
   stderr: t.String(),
+  stdout_lossy: t.Optional(t.Boolean()),
+  stderr_lossy: t.Optional(t.Boolean()),
+  job_id: t.Optional(t.String()),
+  signal: t.Optional(t.Number()),
+  timed_out: t.Optional(t.Boolean()),
+});
+
+const workingSetResponse = t.Object({
+  method: t.Union([t.Literal("damon"), t.Literal("page_idle"), t.Literal("memory_stat")]),
+  window_ms: t.Number(),
+  hot_bytes: t.Number(),
+  warm_bytes: t.Number(),
+  cold_bytes: t.Number(),
+  working_set_bytes: t.Number(),
+  total_bytes: t.Number(),
+  free_bytes: t.Number(),
+  available_bytes: t.Number(),
+  refault_bytes_per_sec: t.Number(),
+});
+
+const latencyHistogram = t.Object({
+  count: t.Number(),
+  total_us: t.Number(),
+  max_us: t.Number(),
+  p50_us: t.Number(),
+  p99_us: t.Number(),
+  buckets: t.Array(t.Tuple([t.Number(), t.Number()])),
+});
+
+const latencyTraceResponse = t.Object({
+  duration_ms: t.Number(),
+  events: t.Array(t.Union([t.Literal("io"), t.Literal("sched"), t.Literal("syscall")])),
+  events_seen: t.Number(),
+  lost_events: t.Number(),
+  unmatched_requests: t.Optional(t.Number()),
+  devices: t.Optional(
+    t.Array(
+      t.Object({
+        device: t.String(),
+        dev: t.String(),
+        read_bytes: t.Number(),
+        read: latencyHistogram,
+        write_bytes: t.Number(),
+        write: latencyHistogram,
+        other_bytes: t.Number(),
+        other: latencyHistogram,
+      })
+    )
+  ),
+  run_queue: t.Optional(latencyHistogram),
+  syscalls: t.Optional(latencyHistogram),
+  top_syscalls: t.Optional(
+    t.Array(t.Object({ nr: t.Number(), count: t.Number(), total_us: t.Number(), max_us: t.Number() }))
+  ),
+  processes: t.Optional(
+    t.Array(
+      t.Object({
+        pid: t.Number(),
+        comm: t.String(),
+        threads: t.Number(),
+        on_cpu_us: t.Optional(t.Number()),
+        sleep_us: t.Optional(t.Number()),
+        io_wait_us: t.Optional(t.Number()),
+        run_queue: t.Optional(latencyHistogram),
+        io_wait: t.Optional(latencyHistogram),
+        syscalls: t.Optional(latencyHistogram),
+      })
+    )
+  ),
+});
+
+const metricsHistoryResponse = t.Object({
+  interval_ms: t.Number(),
+  clock_ticks_per_sec: t.Number(),
+  fields: t.Array(t.String()),
+  samples: t.Array(
+    t.Object({
+      t: t.Number(),
+      v: t.Array(t.Number()),
+      top: t.Array(t.Tuple([t.Number(), t.String(), t.Number()])),
+    })
+  ),
+  oldest_ms: t.Number(),
+  next_from_ms: t.Union([t.Number(), t.Null()]),
+});
+
+const logRecord = t.Object({
+  source: t.Union([t.Literal("kernel"), t.Literal("init")]),
+  seq: t.Number(),
+  ts_us: t.Number(),
+  level: t.Number(),
+  text: t.String(),
+});
+
+const machineLogsResponse = t.Object({
+  boot_id: t.String(),
+  records: t.Array(logRecord),
+  kernel_seq: t.Optional(t.Number()),
+  kernel_dropped: t.Optional(t.Number()),
+  init_seq: t.Optional(t.Number()),
+  init_dropped: t.Optional(t.Number()),
+});
+
+const jobFreezeResponse = t.Object({
+  frozen: t.Boolean(),
+  settled: t.Boolean(),
+  method: t.Union([t.Literal("cgroup"), t.Literal("signal")]),
+});
+
+const sessionResponse = t.Object({
+  session_id: t.Number(),
+  pid: t.Number(),
+});
+
+const agentCapabilitiesResponse = t.Object({
+  agent: t.String(),
+  version: t.String(),
+  protocol_versions: t.Array(t.Number()),
+  operations: t.Array(t.String()),
+  framing: t.Array(t.String()),
+  codecs: t.Array(t.String()),
+  output_encodings: t.Optional(t.Array(t.String())),
+  sandbox_roots: t.Optional(t.Array(t.String())),
+  limits: t.Record(t.String(), t.Number()),
+  control_port: t.Number(),
+  host_channel_port: t.Optional(t.Number()),
+  share_port: t.Optional(t.Number()),
+  cgroups: t.Optional(t.Boolean()),
+  cpu_features: t.Array(t.String()),
+});
+
+const guestMessage = t.Object({
+  seq: t.Number(),
+  client: t.Number(),
+  pid: t.Number(),
+  received_at: t.String(),
+  message: t.Record(t.String(), t.Unknown()),
+});
+
+const guestMessagesResponse = t.Object({
+  messages: t.Array(guestMessage),
+  next_since: t.Number(),
+});
+
+const shareResponse = t.Object({
+  name: t.String(),
+  host_path: t.String(),
+  guest_path: t.String(),
+  writable: t.Boolean(),
+  cache_seconds: t.Number(),
+});
+
+const probeConfig = t.Object({
+  name: t.String({ pattern: "^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$", description: "Probe name, unique per machine" }),
+  type: t.Union([t.Literal("tcp"), t.Literal("http"), t.Literal("exec"), t.Literal("file")]),
+  port: t.Optional(t.Number({ minimum: 1, maximum: 65535, description: "Guest localhost port (tcp, http)" })),
+  path: t.Optional(t.String({ description: "Request path (http) or file to check (file)" })),
+  command: t.Optional(t.Array(t.String(), { description: "Command and arguments; exit 0 is healthy (exec)" })),
+  max_age_seconds: t.Optional(t.Number({ minimum: 0, description: "Longest the file may go unmodified (file)" })),
+  interval_seconds: t.Optional(t.Number({ minimum: 0.1, description: "Time between checks (default: 10)" })),
+  timeout_seconds: t.Optional(t.Number({ minimum: 0.01, description: "Time allowed per check (default: 1)" })),
+  healthy_threshold: t.Optional(t.Number({ minimum: 1, description: "Passes in a row to become healthy (default: 1)" })),
+  unhealthy_threshold: t.Optional(t.Number({ minimum: 1, description: "Failures in a row to become unhealthy (default: 3)" })),
+});
+
+const probeStatus = t.Object({
+  name: t.String(),
+  status: t.Union([t.Literal("unknown"), t.Literal("healthy"), t.Literal("unhealthy")]),
+  detail: t.Union([t.String(), t.Null()]),
+  changed_at: t.Union([t.String(), t.Null()]),
+});
+
+const listeningPort = t.Object({
+  protocol: t.Union([t.Literal("tcp"), t.Literal("udp")]),
+  address: t.String(),
+  port: t.Number(),
+  pid: t.Number(),
+  process: t.String(),
+});
+
+const workspaceResponse = t.Object({
+  name: t.String(),
+  path: t.String(),
+  base: t.Union([t.String(), t.Null()]),
+});
+
+const batchResponse = t.Object({
+  results: t.Array(t.Object({
+    success: t.Boolean(),
+    data: t.Optional(t.Unknown()),
+    error: t.Optional(t.String()),
+    skipped: t.Optional(t.Boolean()),
+  })),
+  failed: t.Number(),
+});
+
+const sessionExecResponse = t.Object({
+  exit_code: t.Number(),
+  stdout: t.String(),
+  stderr: t.String(),
+  timed_out: t.Boolean(),
+  session_closed: t.Boolean(),
 });
 
 // Type for context with our derived services
@@ -146,6 +349,16 @@ export const machineRoutes = (disableAuth: boolean) =>
           image: t.Optional(t.String({ description: "OCI image reference (e.g., 'alpine:latest')" })),
           image_size_mib: t.Optional(t.Number({ minimum: 64, description: "Size of generated rootfs in MiB (default: 1024)" })),
           registry_auth: t.Optional(registryAuth),
+          lazy_rootfs: t.Optional(t.Boolean({
+            description: "Fetch the image's blocks over vsock as the guest reads them instead of attaching it as a drive (requires image)",
+          })),
+          memory: t.Optional(t.Object({
+            floor_mib: t.Number({ minimum: 4, description: "Least memory the guest is left with" }),
+            ceiling_mib: t.Optional(t.Number({ minimum: 4, description: "Most memory the guest gets (default: mem_size_mib)" })),
+          }, { description: "Reclaim idle guest memory through a balloon device, within these bounds" })),
+          probes: t.Optional(t.Array(probeConfig, {
+            description: "Health checks the guest runs itself, reporting only state changes",
+          })),
           network: t.Optional(t.Object({
             enable: t.Optional(t.Boolean({ description: "Enable automatic network allocation" })),
             tap_device: t.Optional(t.String({ description: "TAP device name" })),
@@ -157,6 +370,9 @@ export const machineRoutes = (disableAuth: boolean) =>
             t.Number({ minimum: 1, maximum: 65535 }),
             { description: "Ports to expose via reverse proxy" }
           )),
+          discover_ports: t.Optional(t.Boolean({
+            description: "Without exposed_ports, proxy to the TCP ports the guest listens on, through the proxy's own listener only",
+          })),
         }),
         response: {
           201: machineResponse,
@@ -401,6 +617,10 @@ export const machineRoutes = (disableAuth: boolean) =>
         const result = await machineService.exec(params.id, body);
         if (result.isErr()) {
           set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
           return { error: result.error._tag, message: result.error.message };
         }
         return result.unwrap();
@@ -413,6 +633,27 @@ export const machineRoutes = (disableAuth: boolean) =>
           command: t.Optional(t.Array(t.String(), { description: "Command and arguments to execute" })),
           cmd: t.Optional(t.Array(t.String(), { description: "Deprecated alias for command" })),
           timeout: t.Optional(t.Number({ minimum: 1, description: "Timeout in seconds" })),
+          job_id: t.Optional(t.String({
+            pattern: "^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$",
+            description: "Job ID used to signal, freeze or thaw the command while it runs",
+          })),
+          output_encoding: t.Optional(t.Union([t.Literal("text"), t.Literal("base64")], {
+            description: "text (default) replaces invalid UTF-8 with U+FFFD; base64 returns the exact bytes",
+          })),
+          compression: t.Optional(t.Union([t.Literal("lz4"), t.Literal("zstd"), t.Literal("none")], {
+            description: "Codec for large output inside the VM link: lz4 is fastest, zstd densest. Defaults to the fastest one the guest supports",
+          })),
+          sandbox: t.Optional(t.Union([
+            t.Boolean(),
+            t.Object({
+              root: t.Optional(t.Union([t.Literal("overlay"), t.Literal("tmpfs")], {
+                description: "overlay (default): private copy-on-write view of /; tmpfs: empty root with system directories read-only",
+              })),
+              network: t.Optional(t.Boolean({ description: "Keep the guest's network instead of loopback only" })),
+              memory_mb: t.Optional(t.Number({ minimum: 1, description: "Memory limit in MiB" })),
+              pids_max: t.Optional(t.Number({ minimum: 1, description: "Process limit" })),
+            }),
+          ], { description: "Run the command in its own mount, PID, IPC, UTS and network namespaces" })),
         }),
         response: {
           200: execResponse,
@@ -420,10 +661,1083 @@ export const machineRoutes = (disableAuth: boolean) =>
           401: errorResponse,
           404: errorResponse,
           502: errorResponse,
+          503: errorResponse,
         },
         detail: {
           summary: "Execute command",
           description: "Execute a command on a running machine and return stdout, stderr, and exit code",
         },
       }
+    )
+
+    // POST /machines/:id/jobs/:jobId/signal - Signal a running exec job
+    .post(
+      "/:id/jobs/:jobId/signal",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.signalJob(params.id, params.jobId, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          jobId: t.String({ description: "Job ID given to exec" }),
+        }),
+        body: t.Object({
+          signal: t.Union([t.Number({ minimum: 1 }), t.String()], {
+            description: "Signal number or name (e.g. 15, \"TERM\", \"SIGTERM\")",
+          }),
+        }),
+        response: {
+          200: t.Object({ signal: t.Number() }),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Signal job",
+          description: "Deliver a signal to the process group of a running exec job",
+        },
+      }
+    )
+
+    // POST /machines/:id/jobs/:jobId/freeze - Freeze a running exec job
+    .post(
+      "/:id/jobs/:jobId/freeze",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.setJobFrozen(params.id, params.jobId, true);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          jobId: t.String({ description: "Job ID given to exec" }),
+        }),
+        response: {
+          200: jobFreezeResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Freeze job",
+          description: "Pause a running exec job via its cgroup freezer. Frozen time does not count toward the exec timeout.",
+        },
+      }
+    )
+
+    // POST /machines/:id/jobs/:jobId/thaw - Resume a frozen exec job
+    .post(
+      "/:id/jobs/:jobId/thaw",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.setJobFrozen(params.id, params.jobId, false);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          jobId: t.String({ description: "Job ID given to exec" }),
+        }),
+        response: {
+          200: jobFreezeResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Thaw job",
+          description: "Resume a frozen exec job",
+        },
+      }
+    )
+
+    // POST /machines/:id/sessions - Open a shell session
+    .post(
+      "/:id/sessions",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.openSession(params.id, body ?? {});
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 201;
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Optional(t.Object({
+          cwd: t.Optional(t.String({ description: "Initial working directory" })),
+          env: t.Optional(t.Array(t.String(), { description: "Extra environment variables as KEY=VALUE" })),
+        })),
+        response: {
+          201: sessionResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Open shell session",
+          description: "Start a persistent shell that keeps cwd and environment between commands",
+        },
+      }
+    )
+
+    // POST /machines/:id/sessions/:sessionId/exec - Run a command in a session
+    .post(
+      "/:id/sessions/:sessionId/exec",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.sessionExec(params.id, params.sessionId, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          sessionId: t.Numeric({ description: "Session ID" }),
+        }),
+        body: t.Object({
+          command: t.String({ minLength: 1, description: "Shell command line to run in the session" }),
+          timeout: t.Optional(t.Number({ minimum: 1, description: "Timeout in seconds" })),
+        }),
+        response: {
+          200: sessionExecResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Run command in session",
+          description: "Run a shell command in an open session. A timeout kills the session.",
+        },
+      }
+    )
+
+    // DELETE /machines/:id/sessions/:sessionId - Close a shell session
+    .delete(
+      "/:id/sessions/:sessionId",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.closeSession(params.id, params.sessionId);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 204;
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          sessionId: t.Numeric({ description: "Session ID" }),
+        }),
+        response: {
+          204: t.Void(),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Close shell session",
+          description: "Terminate a shell session and its processes",
+        },
+      }
+    )
+
+    // GET /machines/:id/working-set - Estimate how much memory the guest uses
+    .get(
+      "/:id/working-set",
+      async (ctx) => {
+        const { params, query, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getWorkingSet(params.id, query.window_ms, query.method);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          window_ms: t.Optional(
+            t.Number({ minimum: 200, maximum: 300000, description: "How long to watch memory for (default: 10000)" })
+          ),
+          method: t.Optional(
+            t.Union([t.Literal("damon"), t.Literal("page_idle"), t.Literal("memory_stat")], {
+              description: "Force a measurement method instead of the best available",
+            })
+          ),
+        }),
+        response: {
+          200: workingSetResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Estimate working set",
+          description: "Sort guest memory into hot, warm and cold by watching accesses for a window, for right-sizing",
+        },
+      }
+    )
+
+    // GET /machines/:id/latency-trace - Trace IO and scheduler latency for a while
+    .get(
+      "/:id/latency-trace",
+      async (ctx) => {
+        const { params, query, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const events = query.events?.split(",").map((event) => event.trim()) as LatencyTraceEvents[] | undefined;
+        const result = await machineService.getLatencyTrace(params.id, query.duration_ms, events, query.top);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          duration_ms: t.Optional(
+            t.Number({ minimum: 100, maximum: 60000, description: "How long to trace for (default: 5000)" })
+          ),
+          events: t.Optional(
+            t.String({
+              pattern: "^(io|sched|syscall)(,(io|sched|syscall))*$",
+              description: "Comma-separated tracepoint groups: io, sched, syscall (default: io,sched)",
+            })
+          ),
+          top: t.Optional(t.Number({ minimum: 1, maximum: 100, description: "Processes and syscalls to list (default: 10)" })),
+        }),
+        response: {
+          200: latencyTraceResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Trace latency",
+          description: "Enable IO, scheduler and syscall tracepoints in the guest for a while and return latency histograms per device and process",
+        },
+      }
+    )
+
+    // GET /machines/:id/metrics/history - What the guest recorded over a time range
+    .get(
+      "/:id/metrics/history",
+      async (ctx) => {
+        const { params, query, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getMetricsHistory(params.id, query);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          from_ms: t.Optional(t.Number({ minimum: 0, description: "Start of the range, Unix milliseconds" })),
+          to_ms: t.Optional(t.Number({ minimum: 0, description: "End of the range, Unix milliseconds" })),
+          last_seconds: t.Optional(
+            t.Number({ minimum: 1, description: "Instead of from_ms: this many seconds back from now" })
+          ),
+          max_samples: t.Optional(
+            t.Number({ minimum: 1, maximum: 86400, description: "Most samples to return (default: 3600)" })
+          ),
+        }),
+        response: {
+          200: metricsHistoryResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Get metrics history",
+          description: "CPU, memory, pressure, disk, network and top-process samples the guest took every second, kept in a fixed-size ring in the guest",
+        },
+      }
+    )
+
+    // GET /machines/:id/logs - Kernel and init log records, resumable by sequence number
+    .get(
+      "/:id/logs",
+      async (ctx) => {
+        const { params, query, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getLogs(params.id, query);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          source: t.Optional(t.Union([t.Literal("kernel"), t.Literal("init")], { description: "Only this source" })),
+          level: t.Optional(
+            t.String({ description: "Syslog level name or 0-7; keeps that level and more severe (default: debug)" })
+          ),
+          kernel_seq: t.Optional(t.Number({ minimum: 0, description: "First kernel record wanted" })),
+          init_seq: t.Optional(t.Number({ minimum: 0, description: "First init record wanted" })),
+          boot_id: t.Optional(t.String({ description: "Boot the cursors belong to" })),
+          limit: t.Optional(t.Number({ minimum: 1, maximum: 10000, description: "Most records to return (default: 1000)" })),
+          wait_ms: t.Optional(
+            t.Number({ minimum: 0, maximum: 60000, description: "Wait this long for a record when there is none yet" })
+          ),
+        }),
+        response: {
+          200: machineLogsResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Get guest logs",
+          description: "Kernel (/dev/kmsg) and init log records in time order, with cursors to resume from",
+        },
+      }
+    )
+
+    // GET /machines/:id/agent - Guest agent capabilities
+    .get(
+      "/:id/agent",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getAgentCapabilities(params.id);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        response: {
+          200: agentCapabilitiesResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Get agent capabilities",
+          description: "Report the guest init's version, supported operations, codecs and limits",
+        },
+      }
+    )
+
+    // GET /machines/:id/messages - Messages workloads sent over /run/hyperfleet.sock
+    .get(
+      "/:id/messages",
+      async (ctx) => {
+        const { params, query, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getGuestMessages(params.id, query.since, query.wait);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        query: t.Object({
+          since: t.Optional(t.Number({ minimum: 0, description: "Only return messages after this seq" })),
+          wait: t.Optional(
+            t.Number({ minimum: 0, maximum: 30, description: "Seconds to wait for a new message (max: 30)" })
+          ),
+        }),
+        response: {
+          200: guestMessagesResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Read guest messages",
+          description: "Messages workloads wrote to /run/hyperfleet.sock, optionally waiting for the next one",
+        },
+      }
+    )
+
+    // POST /machines/:id/messages - Send a message to workloads in the guest
+    .post(
+      "/:id/messages",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.sendGuestMessage(params.id, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Object({
+          message: t.Record(t.String(), t.Unknown(), { description: "JSON object delivered as one line" }),
+          client: t.Optional(t.Number({ minimum: 1, description: "Client to deliver to (default: all)" })),
+        }),
+        response: {
+          200: t.Object({ sent: t.Boolean() }),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Send guest message",
+          description: "Deliver a message to workloads connected to /run/hyperfleet.sock",
+        },
+      }
+    )
+
+    // GET /machines/:id/probes - Health probe states reported by the guest
+    .get(
+      "/:id/probes",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getProbes(params.id);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        response: {
+          200: t.Array(probeStatus),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Get probe states",
+          description: "Last state each health probe reported. The guest runs the probes and only reports changes, so this never contacts it.",
+        },
+      }
+    )
+
+    // PUT /machines/:id/probes - Replace a machine's health probes
+    .put(
+      "/:id/probes",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.setProbes(params.id, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Object({
+          probes: t.Array(probeConfig),
+        }),
+        response: {
+          200: t.Array(probeStatus),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Set probes",
+          description: "Replace the machine's health probes. A running guest switches at once; unchanged probes keep their state.",
+        },
+      }
+    )
+
+    // GET /machines/:id/ports - Sockets listening in the guest
+    .get(
+      "/:id/ports",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.getListeningPorts(params.id);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        response: {
+          200: t.Array(listeningPort),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "List listening ports",
+          description: "TCP and UDP sockets listening in the guest, with the process holding each. The guest reports changes as they happen, so this never contacts it.",
+        },
+      }
+    )
+
+    // POST /machines/:id/shares - Mount a host directory in the guest
+    .post(
+      "/:id/shares",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.mountShare(params.id, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 201;
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Object({
+          host_path: t.String({ description: "Absolute host directory to share" }),
+          guest_path: t.String({ description: "Absolute guest path to mount it on" }),
+          writable: t.Optional(t.Boolean({ description: "Let the guest modify files (default: false)" })),
+          cache_seconds: t.Optional(
+            t.Number({ minimum: 0, description: "How long the guest caches metadata (default: 60)" })
+          ),
+        }),
+        response: {
+          201: shareResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Mount shared directory",
+          description: "Mount a host directory in the guest; files are fetched over vsock on first access and cached",
+        },
+      }
+    )
+
+    // GET /machines/:id/shares - Host directories mounted in the guest
+    .get(
+      "/:id/shares",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.listShares(params.id);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        response: {
+          200: t.Array(shareResponse),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+        },
+        detail: {
+          summary: "List shared directories",
+          description: "Host directories currently mounted in the guest",
+        },
+      }
+    )
+
+    // DELETE /machines/:id/shares/:name - Unmount a shared directory
+    .delete(
+      "/:id/shares/:name",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.unmountShare(params.id, params.name);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 204;
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          name: t.String({ description: "Share name" }),
+        }),
+        response: {
+          204: t.Void(),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Unmount shared directory",
+          description: "Lazily unmount a share in the guest and stop serving it",
+        },
+      }
+    )
+
+    // POST /machines/:id/workspaces - Create an overlay workspace in the guest
+    .post(
+      "/:id/workspaces",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.createWorkspace(params.id, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 201;
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Object({
+          name: t.String({ pattern: "^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$", description: "Workspace name" }),
+          path: t.String({ description: "Absolute guest path to mount the workspace on" }),
+          base: t.Optional(t.String({ description: "Layer to start from, or an absolute guest directory" })),
+        }),
+        response: {
+          201: workspaceResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Create workspace",
+          description: "Mount a writable overlay on a base layer that can be reset in constant time",
+        },
+      }
+    )
+
+    // GET /machines/:id/workspaces - Workspaces and layers in the guest
+    .get(
+      "/:id/workspaces",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.listWorkspaces(params.id);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        response: {
+          200: t.Object({
+            workspaces: t.Array(workspaceResponse),
+            layers: t.Array(t.Object({ name: t.String(), base: t.Union([t.String(), t.Null()]) })),
+          }),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "List workspaces",
+          description: "Workspaces mounted in the guest and the layers committed from them",
+        },
+      }
+    )
+
+    // POST /machines/:id/workspaces/:name/reset - Drop a workspace's changes
+    .post(
+      "/:id/workspaces/:name/reset",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.resetWorkspace(params.id, params.name);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          name: t.String({ description: "Workspace name" }),
+        }),
+        response: {
+          200: workspaceResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Reset workspace",
+          description: "Discard everything written to the workspace since it was created or last committed. Fails while a process is using it.",
+        },
+      }
+    )
+
+    // POST /machines/:id/workspaces/:name/commit - Fold a workspace's changes into a layer
+    .post(
+      "/:id/workspaces/:name/commit",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.commitWorkspace(params.id, params.name, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          name: t.String({ description: "Workspace name" }),
+        }),
+        body: t.Object({
+          layer: t.String({ pattern: "^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$", description: "Name of the layer to create" }),
+        }),
+        response: {
+          200: workspaceResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Commit workspace",
+          description: "Turn the workspace's changes into a new layer, which the workspace and new ones can start from",
+        },
+      }
+    )
+
+    // DELETE /machines/:id/workspaces/:name - Unmount a workspace
+    .delete(
+      "/:id/workspaces/:name",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.deleteWorkspace(params.id, params.name);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 204;
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          name: t.String({ description: "Workspace name" }),
+        }),
+        response: {
+          204: t.Void(),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Delete workspace",
+          description: "Unmount a workspace and delete its uncommitted changes",
+        },
+      }
+    )
+
+    // DELETE /machines/:id/layers/:layer - Delete a committed layer
+    .delete(
+      "/:id/layers/:layer",
+      async (ctx) => {
+        const { params, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.deleteWorkspaceLayer(params.id, params.layer);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          return { error: result.error._tag, message: result.error.message };
+        }
+        set.status = 204;
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+          layer: t.String({ description: "Layer name" }),
+        }),
+        response: {
+          204: t.Void(),
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+        },
+        detail: {
+          summary: "Delete layer",
+          description: "Delete a workspace layer that no workspace or other layer is built on",
+        },
+      }
+    )
+
+    // POST /machines/:id/batch - Run several operations in one round trip
+    .post(
+      "/:id/batch",
+      async (ctx) => {
+        const { params, body, set, machineService, authService, logger, request } = ctx as typeof ctx & Context;
+
+        if (!disableAuth && !(await validateAuth(request, set, authService, logger))) {
+          return { error: "unauthorized", message: "Invalid or missing API key" };
+        }
+
+        const result = await machineService.batch(params.id, body);
+        if (result.isErr()) {
+          set.status = getHttpStatus(result.error);
+          const retryAfterMs = getRetryAfterMs(result.error);
+          if (retryAfterMs !== undefined) {
+            set.headers["retry-after"] = String(Math.ceil(retryAfterMs / 1000));
+          }
+          return { error: result.error._tag, message: result.error.message };
+        }
+        return result.unwrap();
+      },
+      {
+        params: t.Object({
+          id: t.String({ description: "Machine ID" }),
+        }),
+        body: t.Object({
+          items: t.Array(
+            t.Object({
+              operation: t.Union([
+                t.Literal("ping"),
+                t.Literal("file_stat"),
+                t.Literal("file_read"),
+                t.Literal("file_write"),
+                t.Literal("file_delete"),
+                t.Literal("exec"),
+              ]),
+              path: t.Optional(t.String({ description: "Absolute path, for file operations" })),
+              content: t.Optional(t.String({ description: "Base64-encoded content, for file_write" })),
+              command: t.Optional(t.Array(t.String(), { description: "Command and arguments, for exec" })),
+              timeout: t.Optional(t.Number({ minimum: 1, description: "Timeout in seconds, for exec" })),
+              job_id: t.Optional(t.String({
+                pattern: "^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$",
+                description: "Job ID, for exec",
+              })),
+            }),
+            { minItems: 1, maxItems: 64 }
+          ),
+          stop_on_error: t.Optional(t.Boolean({ description: "Skip remaining items after the first failure" })),
+          parallel: t.Optional(t.Boolean({ description: "Run all items concurrently" })),
+        }),
+        response: {
+          200: batchResponse,
+          400: errorResponse,
+          401: errorResponse,
+          404: errorResponse,
+          502: errorResponse,
+          503: errorResponse,
+        },
+        detail: {
+          summary: "Run batch",
+          description: "Run several file and exec operations in one vsock round trip, returning a result per item",
+        },
+      }
     );
@@ -0,0 +1,430 @@
+import net from "node:net";
+import { Result } from "better-result";
+import { AgentBusyError, VsockError } from "@hyperfleet/errors";
+
+// Vsock port used by the init system
+export const VSOCK_GUEST_PORT = 52;
+
+// Vsock port that only serves cheap control operations (signals, freeze, ping)
+export const VSOCK_CONTROL_PORT = 53;
+
+// Prefix of errors raised before the guest accepted the connection
+const HANDSHAKE_FAILED = "Vsock connection failed";
+// Prefix of errors for a connection the agent closed without replying
+const EMPTY_RESPONSE = "Empty response";
+
+/**
+ * Request payload for the guest agent
+ */
+export interface AgentRequest {
+  operation: string;
+  [key: string]: unknown;
+}
+
+/**
+ * Response from the guest agent
+ */
+export interface AgentResponse<T = unknown> {
+  success: boolean;
+  error?: string;
+  data?: T;
+  // Set when the agent refused the request to shed load
+  busy?: boolean;
+  retry_after_ms?: number;
+  // Set when the agent abandoned the request (deadline passed, client gone)
+  cancelled?: boolean;
+}
+
+/**
+ * Convert a failed agent response into an error
+ */
+export function agentFailure(
+  response: Pick<AgentResponse, "error" | "busy" | "retry_after_ms">,
+  fallbackMessage: string
+): VsockError | AgentBusyError {
+  const message = response.error ?? fallbackMessage;
+  if (response.busy) {
+    return new AgentBusyError({ message, retryAfterMs: response.retry_after_ms ?? 1000 });
+  }
+  return new VsockError({ message });
+}
+
+/**
+ * A response together with the raw bytes that followed it
+ */
+export interface AgentRawResponse<T = unknown> {
+  response: AgentResponse<T>;
+  body: Buffer;
+}
+
+/**
+ * Send a single request to the guest agent and wait for its response line.
+ * The time left before `timeoutMs` is sent along as `budget_ms` so the agent
+ * can abandon work whose result would arrive too late.
+ */
+export async function sendAgentRequest<T = unknown>(
+  udsPath: string,
+  request: AgentRequest,
+  timeoutMs: number,
+  port: number = VSOCK_GUEST_PORT
+): Promise<Result<AgentResponse<T>, VsockError>> {
+  const result = await sendAgentRawRequest<T>(udsPath, request, timeoutMs, { port });
+  if (result.isErr()) {
+    return Result.err(result.error);
+  }
+  return Result.ok(result.unwrap().response);
+}
+
+/**
+ * Send a request whose reply may be followed by raw bytes. A successful
+ * response with `data.framing === "raw"` announces `data.size` bytes of body.
+ * `{"segment": ..., "size": N}` lines (exec output, benchmark runs) are
+ * followed by N bytes, which go to `onSegment` or are discarded. Segment
+ * bytes count towards `maxBodyBytes` as well.
+ */
+export function sendAgentRawRequest<T = unknown>(
+  udsPath: string,
+  request: AgentRequest,
+  timeoutMs: number,
+  options: {
+    port?: number;
+    maxBodyBytes?: number;
+    onSegment?: (segment: string, chunk: Buffer) => void;
+  } = {}
+): Promise<Result<AgentRawResponse<T>, VsockError>> {
+  const port = options.port ?? VSOCK_GUEST_PORT;
+  const maxBodyBytes = options.maxBodyBytes ?? Number.POSITIVE_INFINITY;
+
+  return new Promise((resolve) => {
+    const socket = net.createConnection({ path: udsPath });
+    const startedAt = Date.now();
+    let settled = false;
+    let buffer = Buffer.alloc(0);
+    let connected = false; // Track if we've completed the CONNECT handshake
+    let response: AgentResponse<T> | null = null;
+    const body: Buffer[] = [];
+    let pendingBytes = 0; // Raw bytes still expected after the last line
+    let segment: string | null = null; // Those bytes belong to a segment
+    let segmentBytes = 0;
+
+    const finish = (err?: VsockError, result?: AgentRawResponse<T>) => {
+      if (settled) return;
+      settled = true;
+      clearTimeout(timer);
+      socket.removeAllListeners();
+      socket.destroy();
+
+      if (err) {
+        resolve(Result.err(err));
+      } else if (result) {
+        resolve(Result.ok(result));
+      } else {
+        resolve(Result.err(new VsockError({ message: "Empty response from agent" })));
+      }
+    };
+
+    const timer = setTimeout(() => {
+      socket.destroy();
+      finish(new VsockError({ message: "Agent request timed out" }));
+    }, timeoutMs);
+
+    // Handle one line after the handshake. Returns false once the exchange is over.
+    const handleLine = (line: string): boolean => {
+      let parsed: Record<string, unknown>;
+      try {
+        parsed = JSON.parse(line) as Record<string, unknown>;
+      } catch {
+        finish(new VsockError({ message: "Invalid JSON response from agent" }));
+        return false;
+      }
+
+      if (typeof parsed.segment === "string") {
+        pendingBytes = Number(parsed.size) || 0;
+        segment = parsed.segment;
+        segmentBytes += pendingBytes;
+        if (options.onSegment && segmentBytes > maxBodyBytes) {
+          finish(new VsockError({ message: `Agent response too large: over ${maxBodyBytes} bytes` }));
+          return false;
+        }
+        return true;
+      }
+
+      response = parsed as unknown as AgentResponse<T>;
+      const data = response.data as { framing?: string; size?: number } | undefined;
+      if (!response.success || data?.framing !== "raw") {
+        finish(undefined, { response, body: Buffer.alloc(0) });
+        return false;
+      }
+
+      const size = data.size ?? 0;
+      if (size > maxBodyBytes) {
+        finish(new VsockError({ message: `Agent response too large: ${size} bytes` }));
+        return false;
+      }
+      pendingBytes = size;
+      segment = null;
+      return true;
+    };
+
+    const drain = () => {
+      while (!settled) {
+        if (pendingBytes > 0) {
+          if (buffer.length === 0) return;
+          const take = Math.min(pendingBytes, buffer.length);
+          if (segment === null) body.push(buffer.subarray(0, take));
+          else options.onSegment?.(segment, buffer.subarray(0, take));
+          buffer = buffer.subarray(take);
+          pendingBytes -= take;
+          if (pendingBytes > 0) return;
+        }
+        if (response && segment === null) {
+          finish(undefined, { response, body: Buffer.concat(body) });
+          return;
+        }
+
+        const newlineIndex = buffer.indexOf(0x0a);
+        if (newlineIndex === -1) return;
+        const line = buffer.subarray(0, newlineIndex).toString("utf8").trim();
+        buffer = buffer.subarray(newlineIndex + 1);
+
+        // If we haven't completed the CONNECT handshake yet
+        if (!connected) {
+          if (!line.startsWith("OK ")) {
+            finish(new VsockError({ message: `${HANDSHAKE_FAILED}: ${line}` }));
+            return;
+          }
+          // Connection established, now send the actual request
+          connected = true;
+          const budget_ms = Math.max(0, timeoutMs - (Date.now() - startedAt));
+          socket.write(`${JSON.stringify({ ...request, budget_ms })}\n`);
+          continue;
+        }
+
+        if (!handleLine(line)) return;
+      }
+    };
+
+    socket.on("connect", () => {
+      // Firecracker vsock protocol: send CONNECT <port>\n first
+      socket.write(`CONNECT ${port}\n`);
+    });
+
+    socket.on("data", (chunk: Buffer) => {
+      buffer = buffer.length > 0 ? Buffer.concat([buffer, chunk]) : chunk;
+      drain();
+    });
+
+    socket.on("end", () => {
+      if (!connected) {
+        // Firecracker hangs up when nothing listens on the guest port
+        finish(new VsockError({ message: `${HANDSHAKE_FAILED}: closed during handshake` }));
+        return;
+      }
+      if (pendingBytes > 0) {
+        finish(new VsockError({ message: "Agent closed the connection mid-transfer" }));
+        return;
+      }
+      const remaining = buffer.toString("utf8").trim();
+      if (!remaining) {
+        finish(new VsockError({ message: "Empty response from agent" }));
+        return;
+      }
+      if (handleLine(remaining)) {
+        drain();
+      }
+      if (!settled) {
+        finish(new VsockError({ message: "Agent closed the connection mid-transfer" }));
+      }
+    });
+
+    socket.on("error", (err) => {
+      const message = connected
+        ? `Agent connection error: ${err.message}`
+        : `${HANDSHAKE_FAILED}: ${err.message}`;
+      finish(new VsockError({ message }));
+    });
+  });
+}
+
+/**
+ * Whether a request failed before the agent accepted it, so it can be sent
+ * again without running twice. Anything later, like a connection dropped
+ * mid-reply, may have come after the agent acted on it.
+ */
+export function failedBeforeAccepted(error: Error): boolean {
+  return error.message.startsWith(HANDSHAKE_FAILED) || error.message.startsWith(EMPTY_RESPONSE);
+}
+
+/**
+ * Send a control operation over the agent's control port, so it doesn't queue
+ * behind bulk transfers. Falls back to the main port for agents started
+ * without one.
+ */
+export async function sendControlRequest<T = unknown>(
+  udsPath: string,
+  request: AgentRequest,
+  timeoutMs: number
+): Promise<Result<AgentResponse<T>, VsockError>> {
+  const startedAt = Date.now();
+  const result = await sendAgentRequest<T>(udsPath, request, timeoutMs, VSOCK_CONTROL_PORT);
+  if (result.isOk() || !result.error.message.startsWith(HANDSHAKE_FAILED)) {
+    return result;
+  }
+  const remainingMs = Math.max(1, timeoutMs - (Date.now() - startedAt));
+  return sendAgentRequest<T>(udsPath, request, remainingMs);
+}
+
+/**
+ * What a guest's init binary supports, as reported by the `hello` operation
+ */
+export interface AgentCapabilities {
+  agent: string;
+  version: string;
+  protocol_versions: number[];
+  operations: string[];
+  framing: string[];
+  codecs: string[];
+  /** How exec can encode captured output; absent on agents that only send text */
+  output_encodings?: string[];
+  /** Roots exec can sandbox commands in; absent on agents without sandboxes */
+  sandbox_roots?: string[];
+  /** Page cache modes file transfers take; absent on agents that always cache */
+  cache_modes?: string[];
+  limits: Record<string, number>;
+  /** Vsock port serving control operations only, 0 if disabled */
+  control_port: number;
+  /** Vsock port init connects out on to relay /run/hyperfleet.sock, 0 if disabled */
+  host_channel_port?: number;
+  /** Vsock port init connects out on to serve shared directories */
+  share_port?: number;
+  cgroups?: boolean;
+  /** Online vCPUs; bounds how many parallel streams pay off */
+  cpus?: number;
+  cpu_features: string[];
+}
+
+/**
+ * Capabilities assumed for init binaries that predate `hello`
+ */
+export const LEGACY_AGENT_CAPABILITIES: AgentCapabilities = {
+  agent: "hyperfleet-init",
+  version: "legacy",
+  protocol_versions: [1],
+  operations: ["ping", "file_read", "file_write", "file_stat", "file_delete", "exec"],
+  framing: ["json"],
+  codecs: ["base64"],
+  limits: { max_request_size: 128 * 1024 * 1024, max_response_size: 128 * 1024 * 1024 },
+  control_port: 0,
+  cpu_features: [],
+};
+
+/**
+ * Framings and codecs this host can speak, fastest first
+ */
+export const HOST_TRANSPORT = {
+  framing: ["raw", "json"],
+  codecs: ["lz4", "zstd", "base64"],
+};
+
+/**
+ * The transport chosen for a guest
+ */
+export interface TransportPlan {
+  framing: string;
+  codec: string;
+  /** Port for control operations, or null to use the main port */
+  controlPort: number | null;
+}
+
+/**
+ * Pick the fastest transport both sides support
+ */
+export function selectTransport(
+  capabilities: AgentCapabilities,
+  host: { framing: string[]; codecs: string[] } = HOST_TRANSPORT
+): TransportPlan {
+  const framing = host.framing.find((f) => capabilities.framing.includes(f)) ?? "json";
+  const codec = host.codecs.find((c) => capabilities.codecs.includes(c)) ?? "base64";
+  return {
+    framing,
+    codec,
+    controlPort: capabilities.control_port > 0 ? capabilities.control_port : null,
+  };
+}
+
+export function supportsOperation(capabilities: AgentCapabilities, operation: string): boolean {
+  return capabilities.operations.includes(operation);
+}
+
+const HELLO_TIMEOUT_MS = 5_000;
+
+/**
+ * Ask a guest for its capabilities. Agents that don't know `hello` are legacy.
+ */
+export async function fetchAgentCapabilities(
+  udsPath: string
+): Promise<Result<AgentCapabilities, VsockError | AgentBusyError>> {
+  const response = await sendAgentRequest<AgentCapabilities>(udsPath, { operation: "hello" }, HELLO_TIMEOUT_MS);
+  if (response.isErr()) {
+    return Result.err(response.error);
+  }
+
+  const agentResp = response.unwrap();
+  if (!agentResp.success) {
+    if (agentResp.error === "unknown operation") {
+      return Result.ok(LEGACY_AGENT_CAPABILITIES);
+    }
+    return Result.err(agentFailure(agentResp, "hello failed"));
+  }
+  if (!agentResp.data) {
+    return Result.err(new VsockError({ message: "Invalid hello response from agent" }));
+  }
+  return Result.ok(agentResp.data);
+}
+
+type CapabilityFetcher = (udsPath: string) => Promise<Result<AgentCapabilities, VsockError | AgentBusyError>>;
+
+/**
+ * Per-machine cache of guest capabilities. The init binary can only change
+ * across a boot, so entries are dropped when a machine starts or stops.
+ */
+export class AgentCapabilityCache {
+  private entries = new Map<string, AgentCapabilities>();
+  private pending = new Map<string, Promise<Result<AgentCapabilities, VsockError | AgentBusyError>>>();
+
+  constructor(private fetcher: CapabilityFetcher = fetchAgentCapabilities) {}
+
+  async get(
+    machineId: string,
+    udsPath: string
+  ): Promise<Result<AgentCapabilities, VsockError | AgentBusyError>> {
+    const cached = this.entries.get(machineId);
+    if (cached) {
+      return Result.ok(cached);
+    }
+
+    // Share one in-flight hello between concurrent callers
+    let request = this.pending.get(machineId);
+    if (!request) {
+      request = this.fetcher(udsPath);
+      this.pending.set(machineId, request);
+    }
+
+    const result = await request;
+    if (this.pending.get(machineId) === request) {
+      this.pending.delete(machineId);
+      if (result.isOk()) {
+        this.entries.set(machineId, result.unwrap());
+      }
+    }
+    return result;
+  }
+
+  invalidate(machineId: string): void {
+    this.entries.delete(machineId);
+    this.pending.delete(machineId);
+  }
+}
+
+// Shared by every service that talks to guest agents
+export const agentCapabilities = new AgentCapabilityCache();
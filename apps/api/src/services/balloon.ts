@@ -0,0 +1,279 @@
+import { readFile } from "node:fs/promises";
+import { Machine as FirecrackerMachine } from "@hyperfleet/firecracker";
+import type { Logger } from "@hyperfleet/logger";
+import { sendControlRequest } from "./agent";
+import { getGlobalRuntimeManager, type RuntimeManager } from "./runtime-manager";
+
+const MIB = 1024 * 1024;
+// How long a guest gets to report its memory before the VM is skipped this round
+const MEMORY_STATUS_TIMEOUT_MS = 2_000;
+
+/**
+ * Guest memory as reported by init's memory_status operation
+ */
+export interface GuestMemoryStatus {
+  total_bytes: number;
+  free_bytes: number;
+  available_bytes: number;
+  swap_total_bytes: number;
+  swap_free_bytes: number;
+  refaulted_bytes: number;
+  psi: { some_avg10: number; some_avg60: number; full_avg10: number; full_avg60: number } | null;
+}
+
+/**
+ * How much memory a managed VM may be left with, in MiB of guest-usable memory
+ */
+export interface BalloonLimits {
+  /** Boot memory size; the balloon takes memory from this */
+  memSizeMib: number;
+  /** Never leave the guest with less */
+  floorMib: number;
+  /** Never give the guest more, even under pressure */
+  ceilingMib: number;
+}
+
+export interface BalloonPolicy {
+  /** Memory to keep available beyond what the guest uses, as a fraction of its used memory */
+  headroomRatio: number;
+  /** ...but never less than this */
+  minHeadroomMib: number;
+  /** PSI memory "some" avg10 (%) at which the guest is under pressure and gets memory back at once */
+  pressureThreshold: number;
+  /** Below this PSI the guest counts as idle and may give memory up */
+  idleThreshold: number;
+  /** Largest inflation per round; deflation is never limited */
+  maxInflateMib: number;
+  /** Rounds ahead to extrapolate growing usage over, to deflate before pressure builds */
+  lookaheadRounds: number;
+  /** Changes smaller than this aren't worth a balloon round trip */
+  minChangeMib: number;
+  /** Host MemAvailable below which idle guests are squeezed twice as fast */
+  hostReserveMib: number;
+}
+
+export const DEFAULT_BALLOON_POLICY: BalloonPolicy = {
+  headroomRatio: 0.25,
+  minHeadroomMib: 64,
+  pressureThreshold: 5,
+  idleThreshold: 0.5,
+  maxInflateMib: 256,
+  lookaheadRounds: 3,
+  minChangeMib: 16,
+  hostReserveMib: 1024,
+};
+
+export interface BalloonInput {
+  limits: BalloonLimits;
+  /** Balloon size currently requested from Firecracker */
+  balloonMib: number;
+  guest: GuestMemoryStatus;
+  /** Guest used memory one round earlier */
+  previousUsedMib?: number;
+  /** Host MemAvailable, when known */
+  hostAvailableMib?: number;
+}
+
+export interface BalloonDecision {
+  balloonMib: number;
+  action: "inflate" | "deflate" | "hold";
+  reason: string;
+}
+
+/**
+ * Memory the guest uses, in MiB: what the balloon leaves it minus what it
+ * has available
+ */
+function guestUsedMib(limits: BalloonLimits, balloonMib: number, guest: GuestMemoryStatus): number {
+  return Math.max(0, limits.memSizeMib - balloonMib - guest.available_bytes / MIB);
+}
+
+/**
+ * Pick a balloon size from one round of guest signals. Pure, so the policy
+ * can be tested without VMs.
+ *
+ * The guest is sized to what it uses plus headroom. It gets memory back
+ * immediately when it stalls on memory (PSI) or its usage is growing fast
+ * enough to run out within the lookahead, and gives memory up
+ * gradually, only while idle. The result always stays within the limits.
+ */
+export function decideBalloon(input: BalloonInput, policy: BalloonPolicy = DEFAULT_BALLOON_POLICY): BalloonDecision {
+  const { limits, guest } = input;
+  const usableMib = limits.memSizeMib - input.balloonMib;
+  const usedMib = guestUsedMib(limits, input.balloonMib, guest);
+  const pressure = guest.psi?.some_avg10 ?? 0;
+
+  // Extrapolate growing usage so memory comes back before it's needed. Used
+  // rather than available memory, which also falls when the balloon inflates.
+  const growingMib = Math.max(0, usedMib - (input.previousUsedMib ?? usedMib));
+  const expectedUsedMib = usedMib + growingMib * policy.lookaheadRounds;
+  let targetMib = expectedUsedMib + Math.max(policy.minHeadroomMib, expectedUsedMib * policy.headroomRatio);
+  let reason = growingMib > 0 ? "usage growing" : "sized to usage";
+
+  if (pressure >= policy.pressureThreshold) {
+    targetMib = Math.max(targetMib, usableMib * 1.25);
+    reason = `memory pressure ${pressure.toFixed(1)}%`;
+  } else if (targetMib < usableMib) {
+    if (pressure > policy.idleThreshold) {
+      targetMib = usableMib;
+      reason = "not idle";
+    } else {
+      const hostTight = input.hostAvailableMib !== undefined && input.hostAvailableMib < policy.hostReserveMib;
+      const step = policy.maxInflateMib * (hostTight ? 2 : 1);
+      targetMib = Math.max(targetMib, usableMib - step);
+      reason = hostTight ? "idle, host short of memory" : "idle";
+    }
+  }
+
+  const clampedMib = Math.min(limits.ceilingMib, Math.max(limits.floorMib, Math.round(targetMib)));
+  const balloonMib = Math.max(0, limits.memSizeMib - clampedMib);
+  const outOfBounds = usableMib < limits.floorMib || usableMib > limits.ceilingMib;
+  if (balloonMib === input.balloonMib || (!outOfBounds && Math.abs(balloonMib - input.balloonMib) < policy.minChangeMib)) {
+    return { balloonMib: input.balloonMib, action: "hold", reason };
+  }
+  return { balloonMib, action: balloonMib > input.balloonMib ? "inflate" : "deflate", reason };
+}
+
+interface ManagedMachine {
+  udsPath: string;
+  limits: BalloonLimits;
+  balloonMib: number;
+  previousUsedMib?: number;
+  /** Booted by an earlier API process, so not in the runtime registry */
+  vm?: FirecrackerMachine;
+}
+
+/**
+ * Moves memory between running VMs through their balloon devices: polls
+ * each managed guest's memory_status, inflates balloons on idle guests so
+ * the host can overcommit, and deflates them ahead of pressure.
+ */
+export class BalloonController {
+  private machines = new Map<string, ManagedMachine>();
+  private timer: ReturnType<typeof setInterval> | null = null;
+  private running = false;
+
+  constructor(
+    private policy: BalloonPolicy = DEFAULT_BALLOON_POLICY,
+    private logger?: Logger,
+    // Looked up on use so the global one keeps the logger it is created with
+    private runtimes?: RuntimeManager
+  ) {}
+
+  /**
+   * Control a started machine's balloon. Machines start with it deflated.
+   */
+  manage(machineId: string, udsPath: string, limits: BalloonLimits): void {
+    this.machines.set(machineId, { udsPath, limits, balloonMib: 0 });
+  }
+
+  /**
+   * Control the balloon of a machine an earlier API process started, from
+   * the size it was left at
+   */
+  async resume(machineId: string, udsPath: string, limits: BalloonLimits, vm: FirecrackerMachine): Promise<void> {
+    const balloon = await vm.getBalloonConfig();
+    if (balloon.isErr()) {
+      this.logger?.warn("Failed to read balloon size", { machineId, error: balloon.error.message });
+      return;
+    }
+    this.machines.set(machineId, { udsPath, limits, balloonMib: balloon.unwrap().amount_mib, vm });
+  }
+
+  release(machineId: string): void {
+    this.machines.delete(machineId);
+  }
+
+  /**
+   * Current balloon size of a managed machine, in MiB
+   */
+  balloonMib(machineId: string): number | undefined {
+    return this.machines.get(machineId)?.balloonMib;
+  }
+
+  start(intervalMs: number): void {
+    if (this.timer || intervalMs <= 0) return;
+    this.timer = setInterval(() => void this.tick(), intervalMs);
+    this.timer.unref?.();
+  }
+
+  stop(): void {
+    if (this.timer) clearInterval(this.timer);
+    this.timer = null;
+  }
+
+  /**
+   * One control round over every managed machine
+   */
+  async tick(): Promise<void> {
+    if (this.running) return;
+    this.running = true;
+    try {
+      const hostAvailableMib = await readHostAvailableMib();
+      await Promise.all(
+        [...this.machines.entries()].map(([id, machine]) => this.adjust(id, machine, hostAvailableMib))
+      );
+    } finally {
+      this.running = false;
+    }
+  }
+
+  private async adjust(id: string, machine: ManagedMachine, hostAvailableMib?: number): Promise<void> {
+    const runtime = machine.vm ?? (this.runtimes ?? getGlobalRuntimeManager()).get(id);
+    if (!(runtime instanceof FirecrackerMachine)) {
+      return;
+    }
+
+    const response = await sendControlRequest<GuestMemoryStatus>(
+      machine.udsPath,
+      { operation: "memory_status" },
+      MEMORY_STATUS_TIMEOUT_MS
+    );
+    if (response.isErr() || !response.unwrap().success) {
+      return;
+    }
+    const guest = response.unwrap().data as GuestMemoryStatus;
+
+    const decision = decideBalloon(
+      {
+        limits: machine.limits,
+        balloonMib: machine.balloonMib,
+        guest,
+        previousUsedMib: machine.previousUsedMib,
+        hostAvailableMib,
+      },
+      this.policy
+    );
+    machine.previousUsedMib = guestUsedMib(machine.limits, machine.balloonMib, guest);
+    if (decision.action === "hold") {
+      return;
+    }
+
+    const updated = await runtime.updateBalloon(decision.balloonMib);
+    if (updated.isErr()) {
+      this.logger?.warn("Failed to resize balloon", { machineId: id, error: updated.error.message });
+      return;
+    }
+    this.logger?.debug("Balloon resized", {
+      machineId: id,
+      action: decision.action,
+      fromMib: machine.balloonMib,
+      toMib: decision.balloonMib,
+      reason: decision.reason,
+    });
+    machine.balloonMib = decision.balloonMib;
+  }
+}
+
+async function readHostAvailableMib(): Promise<number | undefined> {
+  try {
+    const meminfo = await readFile("/proc/meminfo", "utf-8");
+    const match = /^MemAvailable:\s+(\d+) kB/m.exec(meminfo);
+    return match ? Number(match[1]) / 1024 : undefined;
+  } catch {
+    return undefined;
+  }
+}
+
+// One controller for every machine started by this API process
+export const balloonController = new BalloonController();
@@ -0,0 +1,486 @@
+import net from "node:net";
+import { constants as fsConstants, unlinkSync } from "node:fs";
+import { open, readFile, rename, stat, writeFile, type FileHandle } from "node:fs/promises";
+import { Result } from "better-result";
+import { VsockError } from "@hyperfleet/errors";
+
+// Vsock port init dials from the initramfs; Firecracker forwards it to `<uds_path>_1054`
+export const BLOCK_PORT = 1054;
+// The only export a machine has
+export const ROOT_EXPORT = "root";
+
+// Block size the guest's NBD device is given
+const BLOCK_SIZE = 4096;
+// Copy-on-write granularity: the first write to a chunk copies it from the image
+const CHUNK_SIZE = 64 * 1024;
+// Largest request the kernel sends is its max_sectors, far below this
+const MAX_REQUEST_BYTES = 32 * 1024 * 1024;
+const MAX_LINE_BYTES = 4096;
+// How long after boot starts reads are recorded as the image's boot profile
+const PROFILE_WINDOW_MS = 30_000;
+// Profile ranges are read back this many bytes at a time while prefetching
+const PREFETCH_READ_BYTES = 1024 * 1024;
+
+// NBD transmission protocol
+const NBD_REQUEST_MAGIC = 0x25609513;
+const NBD_REPLY_MAGIC = 0x67446698;
+const NBD_REQUEST_HEADER = 28;
+const NBD_REPLY_HEADER = 16;
+const NBD_CMD_READ = 0;
+const NBD_CMD_WRITE = 1;
+const NBD_CMD_DISC = 2;
+const NBD_CMD_FLUSH = 3;
+const NBD_CMD_FLAG_FUA = 1 << 0;
+const NBD_FLAG_HAS_FLAGS = 1 << 0;
+const NBD_FLAG_SEND_FLUSH = 1 << 2;
+const NBD_FLAG_SEND_FUA = 1 << 3;
+const NBD_EIO = 5;
+const NBD_EINVAL = 22;
+
+export interface BlockExport {
+  /** Cached ext4 image the machine boots from; only ever read */
+  image: string;
+  /** Digest of the image, so an overlay is never applied to a different one */
+  imageDigest: string;
+  /** Sparse per-machine file holding every chunk the guest has written */
+  overlay: string;
+}
+
+export interface BlockStats {
+  /** Bytes the guest has read */
+  bytesRead: number;
+  /** Bytes of those that came from the image rather than the overlay */
+  bytesFromImage: number;
+  /** Chunks the guest has written so far, across boots */
+  chunksWritten: number;
+  /** Bytes read ahead from the image's boot profile */
+  bytesPrefetched: number;
+}
+
+/** First-touch reads of an image's boot, in the order they happened */
+interface BootProfile {
+  version: 1;
+  chunkSize: number;
+  /** [first chunk, chunk count] */
+  ranges: [number, number][];
+}
+
+interface MachineBlocks {
+  path: string;
+  server: net.Server;
+  sockets: Set<net.Socket>;
+  export: BlockExport;
+  size: number;
+  image: FileHandle;
+  overlay: FileHandle;
+  /** One bit per chunk present in the overlay */
+  written: Uint8Array;
+  writtenDirty: boolean;
+  stats: BlockStats;
+  /** Set while this boot's reads are being recorded as the image's profile */
+  recording: { touched: Uint8Array; ranges: [number, number][]; timer?: ReturnType<typeof setTimeout> } | null;
+  closed: boolean;
+}
+
+function hasBit(bits: Uint8Array, index: number): boolean {
+  return (bits[index >> 3] & (1 << (index & 7))) !== 0;
+}
+
+function setBit(bits: Uint8Array, index: number): void {
+  bits[index >> 3] |= 1 << (index & 7);
+}
+
+function countBits(bits: Uint8Array): number {
+  let count = 0;
+  for (let byte of bits) {
+    for (; byte; byte &= byte - 1) count++;
+  }
+  return count;
+}
+
+function profilePath(image: string): string {
+  return `${image}.boot-profile.json`;
+}
+
+async function readFully(file: FileHandle, buffer: Buffer, offset: number, position: number, length: number) {
+  let done = 0;
+  while (done < length) {
+    const { bytesRead } = await file.read(buffer, offset + done, length - done, position + done);
+    // Past the end of a sparse file reads as zeros
+    if (bytesRead === 0) {
+      buffer.fill(0, offset + done, offset + length);
+      break;
+    }
+    done += bytesRead;
+  }
+}
+
+/**
+ * Serves a machine's root filesystem to the kernel NBD client in its
+ * initramfs. The cached image is shared by every machine booted from it and
+ * never written: the first write to a chunk copies it into the machine's
+ * overlay, which then answers reads for it. Which chunks are in the overlay
+ * is kept next to it in `<overlay>.map`, saved whenever the guest flushes.
+ *
+ * The first boot from an image records which chunks boot reads, in order,
+ * as `<image>.boot-profile.json`. Later boots read those chunks ahead in
+ * the background so the guest's first reads hit the host page cache.
+ */
+export class BlockServer {
+  private machines = new Map<string, MachineBlocks>();
+
+  /**
+   * Listen for a machine's guest. Safe to call again; an existing listener is kept.
+   */
+  async open(machineId: string, udsPath: string, exported: BlockExport): Promise<Result<void, VsockError>> {
+    if (this.machines.has(machineId)) {
+      return Result.ok(undefined);
+    }
+
+    const files = await Result.tryPromise(() => this.openFiles(exported));
+    if (files.isErr()) {
+      const cause = files.error instanceof Error ? files.error.message : String(files.error);
+      return Result.err(new VsockError({ message: `Cannot serve ${exported.image}: ${cause}` }));
+    }
+
+    const path = `${udsPath}_${BLOCK_PORT}`;
+    const machine: MachineBlocks = {
+      ...files.unwrap(),
+      path,
+      server: net.createServer((socket) => this.accept(machine, socket)),
+      sockets: new Set(),
+      export: exported,
+      closed: false,
+    };
+    this.machines.set(machineId, machine);
+
+    // A previous API process may have left its socket behind
+    try {
+      unlinkSync(path);
+    } catch {
+      // Nothing to clean up
+    }
+
+    const listening = await new Promise<Result<void, VsockError>>((resolve) => {
+      machine.server.once("error", (err) => {
+        resolve(Result.err(new VsockError({ message: `Block server listen failed: ${err.message}` })));
+      });
+      machine.server.listen(path, () => resolve(Result.ok(undefined)));
+    });
+    if (listening.isErr()) {
+      this.machines.delete(machineId);
+      await Promise.all([machine.image.close(), machine.overlay.close()]);
+      return listening;
+    }
+
+    void this.prefetch(machine);
+    return listening;
+  }
+
+  /**
+   * Stop serving a machine, keeping its overlay for the next boot
+   */
+  async close(machineId: string): Promise<void> {
+    const machine = this.machines.get(machineId);
+    if (!machine) return;
+    this.machines.delete(machineId);
+    machine.closed = true;
+
+    for (const socket of machine.sockets) socket.destroy();
+    machine.server.close();
+    try {
+      unlinkSync(machine.path);
+    } catch {
+      // Already gone
+    }
+
+    await this.saveProfile(machine).catch(() => {});
+    await this.saveWritten(machine).catch(() => {});
+    await Promise.all([machine.image.close(), machine.overlay.close()]);
+  }
+
+  stats(machineId: string): BlockStats | null {
+    const machine = this.machines.get(machineId);
+    return machine ? { ...machine.stats } : null;
+  }
+
+  private async openFiles(exported: BlockExport) {
+    const size = (await stat(exported.image)).size;
+    const chunks = Math.ceil(size / CHUNK_SIZE);
+    const image = await open(exported.image, "r");
+    const overlay = await open(exported.overlay, fsConstants.O_RDWR | fsConstants.O_CREAT, 0o600);
+    await overlay.truncate(size);
+
+    // A map from an earlier boot says which chunks the overlay already holds
+    const written = new Uint8Array(Math.ceil(chunks / 8));
+    const saved = await readFile(`${exported.overlay}.map`).catch(() => null);
+    if (saved && saved.length === written.length) written.set(saved);
+
+    // Blocks written on top of another image would corrupt the filesystem
+    const base = await readFile(`${exported.overlay}.base`, "utf-8").catch(() => null);
+    if (base !== null && base !== exported.imageDigest && countBits(written) > 0) {
+      await Promise.all([image.close(), overlay.close()]);
+      throw new Error(`overlay was written on top of image ${base}`);
+    }
+    await writeFile(`${exported.overlay}.base`, exported.imageDigest);
+
+    const hasProfile = await stat(profilePath(exported.image)).then(() => true, () => false);
+    return {
+      size,
+      image,
+      overlay,
+      written,
+      writtenDirty: false,
+      stats: { bytesRead: 0, bytesFromImage: 0, chunksWritten: countBits(written), bytesPrefetched: 0 },
+      recording: hasProfile ? null : { touched: new Uint8Array(written.length), ranges: [] },
+    };
+  }
+
+  private accept(machine: MachineBlocks, socket: net.Socket): void {
+    machine.sockets.add(socket);
+    const session = new BlockSession(this, machine, socket);
+    socket.on("data", (chunk: Buffer) => session.receive(chunk));
+    socket.on("close", () => machine.sockets.delete(socket));
+    socket.on("error", () => socket.destroy());
+
+    // Boot starts with the first connection; stop recording once it is surely over
+    if (machine.recording && !machine.recording.timer) {
+      machine.recording.timer = setTimeout(() => void this.saveProfile(machine).catch(() => {}), PROFILE_WINDOW_MS);
+      machine.recording.timer.unref?.();
+    }
+  }
+
+  /** @internal */
+  async read(machine: MachineBlocks, offset: number, length: number): Promise<Buffer> {
+    const data = Buffer.allocUnsafe(length);
+    const end = offset + length;
+    machine.stats.bytesRead += length;
+
+    // Serve runs of consecutive chunks from whichever file holds them
+    let position = offset;
+    while (position < end) {
+      const chunk = Math.floor(position / CHUNK_SIZE);
+      const fromOverlay = hasBit(machine.written, chunk);
+      let runEnd = Math.min(end, (chunk + 1) * CHUNK_SIZE);
+      while (runEnd < end && hasBit(machine.written, runEnd / CHUNK_SIZE) === fromOverlay) {
+        runEnd = Math.min(end, runEnd + CHUNK_SIZE);
+      }
+
+      if (!fromOverlay) {
+        machine.stats.bytesFromImage += runEnd - position;
+        this.record(machine, chunk, Math.floor((runEnd - 1) / CHUNK_SIZE));
+      }
+      const file = fromOverlay ? machine.overlay : machine.image;
+      await readFully(file, data, position - offset, position, runEnd - position);
+      position = runEnd;
+    }
+    return data;
+  }
+
+  /** @internal */
+  async write(machine: MachineBlocks, offset: number, data: Buffer, fua: boolean): Promise<void> {
+    const first = Math.floor(offset / CHUNK_SIZE);
+    const last = Math.floor((offset + data.length - 1) / CHUNK_SIZE);
+
+    // Chunks the write only partly covers start out as the image's copy
+    for (const chunk of new Set([first, last])) {
+      const chunkStart = chunk * CHUNK_SIZE;
+      const covered = offset <= chunkStart && offset + data.length >= Math.min(chunkStart + CHUNK_SIZE, machine.size);
+      if (hasBit(machine.written, chunk) || covered) continue;
+      const length = Math.min(CHUNK_SIZE, machine.size - chunkStart);
+      const base = Buffer.allocUnsafe(length);
+      await readFully(machine.image, base, 0, chunkStart, length);
+      await machine.overlay.write(base, 0, length, chunkStart);
+    }
+
+    await machine.overlay.write(data, 0, data.length, offset);
+    for (let chunk = first; chunk <= last; chunk++) {
+      if (hasBit(machine.written, chunk)) continue;
+      setBit(machine.written, chunk);
+      machine.stats.chunksWritten++;
+      machine.writtenDirty = true;
+    }
+    if (fua) await this.flush(machine);
+  }
+
+  /** @internal */
+  async flush(machine: MachineBlocks): Promise<void> {
+    await machine.overlay.datasync();
+    await this.saveWritten(machine);
+  }
+
+  private record(machine: MachineBlocks, first: number, last: number): void {
+    const recording = machine.recording;
+    if (!recording) return;
+
+    for (let chunk = first; chunk <= last; chunk++) {
+      if (hasBit(recording.touched, chunk)) continue;
+      setBit(recording.touched, chunk);
+      const previous = recording.ranges[recording.ranges.length - 1];
+      if (previous && previous[0] + previous[1] === chunk) {
+        previous[1]++;
+      } else {
+        recording.ranges.push([chunk, 1]);
+      }
+    }
+  }
+
+  private async saveWritten(machine: MachineBlocks): Promise<void> {
+    if (!machine.writtenDirty) return;
+    machine.writtenDirty = false;
+    const mapPath = `${machine.export.overlay}.map`;
+    await writeFile(`${mapPath}.tmp`, machine.written);
+    await rename(`${mapPath}.tmp`, mapPath);
+  }
+
+  private async saveProfile(machine: MachineBlocks): Promise<void> {
+    const recording = machine.recording;
+    if (!recording) return;
+    machine.recording = null;
+    clearTimeout(recording.timer);
+    if (recording.ranges.length === 0) return;
+
+    const profile: BootProfile = { version: 1, chunkSize: CHUNK_SIZE, ranges: recording.ranges };
+    // Machines booting the same image at once each record one; any of them will do
+    const path = profilePath(machine.export.image);
+    const tempPath = `${path}.${process.pid}.${Date.now()}.tmp`;
+    await writeFile(tempPath, JSON.stringify(profile));
+    await rename(tempPath, path);
+  }
+
+  /**
+   * Read the image's boot profile ahead of the guest, warming the host page cache
+   */
+  private async prefetch(machine: MachineBlocks): Promise<void> {
+    if (machine.recording) return;
+    const profile = await readFile(profilePath(machine.export.image), "utf-8")
+      .then((text) => JSON.parse(text) as BootProfile)
+      .catch(() => null);
+    if (!profile || profile.version !== 1 || !Array.isArray(profile.ranges)) return;
+
+    const scratch = Buffer.allocUnsafe(PREFETCH_READ_BYTES);
+    try {
+      for (const [first, count] of profile.ranges) {
+        let position = first * profile.chunkSize;
+        const end = Math.min(machine.size, (first + count) * profile.chunkSize);
+        while (position < end) {
+          if (machine.closed) return;
+          const length = Math.min(PREFETCH_READ_BYTES, end - position);
+          await machine.image.read(scratch, 0, length, position);
+          machine.stats.bytesPrefetched += length;
+          position += length;
+        }
+      }
+    } catch {
+      // The image was closed under us
+    }
+  }
+}
+
+/**
+ * One connection from the guest: a JSON handshake line, then NBD requests
+ * handled strictly in order
+ */
+class BlockSession {
+  private buffer = Buffer.alloc(0);
+  private busy = false;
+  private negotiated = false;
+
+  constructor(private blocks: BlockServer, private machine: MachineBlocks, private socket: net.Socket) {}
+
+  receive(chunk: Buffer): void {
+    this.buffer = this.buffer.length ? Buffer.concat([this.buffer, chunk]) : chunk;
+    void this.pump();
+  }
+
+  private async pump(): Promise<void> {
+    if (this.busy) return;
+    this.busy = true;
+
+    while (!this.socket.destroyed) {
+      if (!this.negotiated) {
+        if (!this.handshake()) break;
+        continue;
+      }
+
+      if (this.buffer.length < NBD_REQUEST_HEADER) break;
+      const magic = this.buffer.readUInt32BE(0);
+      const flags = this.buffer.readUInt16BE(4);
+      const type = this.buffer.readUInt16BE(6);
+      const handle = this.buffer.subarray(8, 16);
+      const offset = Number(this.buffer.readBigUInt64BE(16));
+      const length = this.buffer.readUInt32BE(24);
+      if (magic !== NBD_REQUEST_MAGIC || length > MAX_REQUEST_BYTES) {
+        this.socket.destroy();
+        break;
+      }
+
+      const bodySize = type === NBD_CMD_WRITE ? length : 0;
+      if (this.buffer.length < NBD_REQUEST_HEADER + bodySize) break;
+      const body = this.buffer.subarray(NBD_REQUEST_HEADER, NBD_REQUEST_HEADER + bodySize);
+      this.buffer = this.buffer.subarray(NBD_REQUEST_HEADER + bodySize);
+
+      if (type === NBD_CMD_DISC) {
+        await this.blocks.flush(this.machine).catch(() => {});
+        this.socket.end();
+        break;
+      }
+
+      const reply = Buffer.alloc(NBD_REPLY_HEADER);
+      reply.writeUInt32BE(NBD_REPLY_MAGIC, 0);
+      handle.copy(reply, 8);
+      let data: Buffer | null = null;
+
+      const supported = type === NBD_CMD_READ || type === NBD_CMD_WRITE || type === NBD_CMD_FLUSH;
+      if (!supported || offset + length > this.machine.size) {
+        reply.writeUInt32BE(NBD_EINVAL, 4);
+      } else {
+        const served = await Result.tryPromise(async () => {
+          if (type === NBD_CMD_READ) data = await this.blocks.read(this.machine, offset, length);
+          else if (type === NBD_CMD_WRITE) await this.blocks.write(this.machine, offset, body, (flags & NBD_CMD_FLAG_FUA) !== 0);
+          else await this.blocks.flush(this.machine);
+        });
+        if (served.isErr()) {
+          reply.writeUInt32BE(NBD_EIO, 4);
+          data = null;
+        }
+      }
+
+      this.socket.write(reply);
+      if (data) this.socket.write(data);
+    }
+
+    this.busy = false;
+  }
+
+  private handshake(): boolean {
+    const newlineIndex = this.buffer.indexOf(0x0a);
+    if (newlineIndex === -1) {
+      if (this.buffer.length > MAX_LINE_BYTES) this.socket.destroy();
+      return false;
+    }
+
+    const request = Result.try(
+      () => JSON.parse(this.buffer.subarray(0, newlineIndex).toString()) as Record<string, unknown>
+    ).unwrapOr(null);
+    this.buffer = this.buffer.subarray(newlineIndex + 1);
+    if (request?.export !== ROOT_EXPORT) {
+      this.socket.end(`${JSON.stringify({ ok: false, error: "unknown export" })}\n`);
+      return false;
+    }
+
+    this.negotiated = true;
+    this.socket.write(
+      `${JSON.stringify({
+        ok: true,
+        size: this.machine.size,
+        block_size: BLOCK_SIZE,
+        flags: NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA,
+      })}\n`
+    );
+    return true;
+  }
+}
+
+// One listener per machine booted from a network root, shared by the API
+export const blockServers = new BlockServer();
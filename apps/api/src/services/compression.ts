@@ -0,0 +1,85 @@
+/**
+ * Payload compression for agent transfers. LZ4 is the fast codec and zstd
+ * the dense one; the guest init has both, so either can be picked per
+ * transfer from the codecs its `hello` lists.
+ */
+
+import { constants, zstdCompressSync, zstdDecompressSync } from "node:zlib";
+import { Result } from "better-result";
+import { compressBlock, decompressBlock } from "./lz4";
+
+export type Codec = "lz4" | "zstd";
+
+// Payloads smaller than this aren't worth compressing
+export const COMPRESS_MIN_SIZE = 4096;
+
+// Same level as the guest; zstd's default trades little speed for a lot of ratio
+const ZSTD_LEVEL = 3;
+
+// Sampled entropy (bits per byte) above which data is treated as incompressible
+const ENTROPY_SKIP_BITS = 7.5;
+const ENTROPY_SAMPLES = 16;
+const ENTROPY_SAMPLE_SIZE = 4096;
+
+/**
+ * Estimate the Shannon entropy (bits per byte) from a few samples spread
+ * over the buffer, the same way the guest agent does
+ */
+export function sampleEntropy(src: Uint8Array): number {
+  if (src.length === 0) return 0;
+
+  const counts = new Uint32Array(256);
+  let total = 0;
+  const stride = Math.floor(src.length / ENTROPY_SAMPLES);
+  for (let s = 0; s < ENTROPY_SAMPLES; s++) {
+    const start = s * stride;
+    const end = Math.min(start + ENTROPY_SAMPLE_SIZE, src.length);
+    for (let i = start; i < end; i++) counts[src[i]]++;
+    total += end - start;
+    if (stride === 0) break; // small buffer: one pass covers it
+  }
+
+  let entropy = 0;
+  for (const count of counts) {
+    if (count === 0) continue;
+    const p = count / total;
+    entropy -= p * Math.log2(p);
+  }
+  return entropy;
+}
+
+/**
+ * Compress a payload for the wire, or return null when it isn't worth it:
+ * too small, already compressed or encrypted, or it doesn't shrink
+ */
+export function compressPayload(src: Uint8Array, codec: Codec): Buffer | null {
+  if (src.length < COMPRESS_MIN_SIZE || sampleEntropy(src) > ENTROPY_SKIP_BITS) {
+    return null;
+  }
+  const out =
+    codec === "zstd"
+      ? zstdCompressSync(src, { params: { [constants.ZSTD_c_compressionLevel]: ZSTD_LEVEL } })
+      : compressBlock(src);
+  return out.length < src.length ? out : null;
+}
+
+/**
+ * Decode a payload that must come out as exactly `size` bytes. Returns null
+ * if it is malformed or decodes to a different size.
+ */
+export function decompressPayload(src: Uint8Array, codec: Codec, size: number): Buffer | null {
+  if (codec === "lz4") {
+    return decompressBlock(src, size);
+  }
+  // Capped so a frame can't inflate past what the agent said it sent
+  const out = Result.try(() => zstdDecompressSync(src, { maxOutputLength: Math.max(size, 1) }));
+  return out.isOk() && out.unwrap().length === size ? out.unwrap() : null;
+}
+
+/**
+ * The codec a transport plan settled on, or null when payloads go as plain
+ * base64
+ */
+export function wireCodec(codec: string | undefined): Codec | null {
+  return codec === "lz4" || codec === "zstd" ? codec : null;
+}
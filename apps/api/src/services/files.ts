@@ -1,8 +1,19 @@
-import net from "node:net";
 import { Result } from "better-result";
 import type { Kysely, Database } from "@hyperfleet/worker/database";
 import type { Logger } from "@hyperfleet/logger";
 import { NotFoundError, ValidationError, VsockError, type HyperfleetError } from "@hyperfleet/errors";
+import {
+  agentCapabilities,
+  agentFailure,
+  selectTransport,
+  sendAgentRawRequest,
+  sendAgentRequest,
+  supportsOperation,
+  type AgentCapabilities,
+  type AgentRequest,
+  type TransportPlan,
+} from "./agent";
+import { compressPayload, decompressPayload, wireCodec, type Codec } from "./compression";
 
 // Default timeout for file operations (1 minute)
 const DEFAULT_FILE_TIMEOUT_MS = parseInt(process.env.HYPERFLEET_FILE_TRANSFER_TIMEOUT ?? "60000", 10);
@@ -10,8 +21,17 @@ const DEFAULT_FILE_TIMEOUT_MS = parseInt(process.env.HYPERFLEET_FILE_TRANSFER_TI
 // Maximum file size (100MB)
 const MAX_FILE_SIZE = parseInt(process.env.HYPERFLEET_FILE_MAX_SIZE ?? "104857600", 10);
 
-// Vsock port used by the init system
-const VSOCK_GUEST_PORT = 52;
+// Files at least this large are split into ranges over parallel connections
+const PARALLEL_MIN_SIZE = 16 * 1024 * 1024;
+
+// Bytes per range request in a parallel transfer
+const PARALLEL_CHUNK_SIZE = 8 * 1024 * 1024;
+
+// Most concurrent agent connections used by one transfer
+const MAX_FILE_STREAMS = parseInt(process.env.HYPERFLEET_FILE_STREAMS ?? "4", 10);
+
+// A benchmark sends up to 1 GiB once per send mode
+const TRANSFER_BENCH_TIMEOUT_MS = 300_000;
 
 /**
  * File stat information
@@ -24,31 +44,180 @@ export interface FileStat {
   is_dir: boolean;
 }
 
+interface FileReadData {
+  content: string;
+  size: number;
+  // Present on agents that serve byte ranges
+  offset?: number;
+  file_size?: number;
+  // Present when the agent was asked to compress
+  encoding?: Codec | "none";
+  compression_skipped?: string;
+  compressed_size?: number;
+  ratio?: number;
+  compress_us?: number;
+}
+
+interface FileWriteData {
+  bytes_written: number;
+  // Present on agents with cache modes; the mode the write actually used
+  cache?: CacheMode;
+}
+
+interface FileReadRawData {
+  size: number;
+  offset: number;
+  file_size: number;
+  framing: "raw";
+  send_mode: string;
+}
+
+interface FileAllocData {
+  partial_path: string;
+  size: number;
+}
+
+interface FileRange {
+  offset: number;
+  length: number;
+}
+
+export type SendMode = "copy" | "sendfile" | "zerocopy";
+
 /**
- * Request payload for the guest agent
+ * What a transfer does to the guest's page cache. "dontneed" drops the
+ * pages it brought in once they are moved; "direct" writes with O_DIRECT
+ * and is for uploads only.
  */
-interface AgentRequest {
-  operation: "file_read" | "file_write" | "file_stat" | "file_delete" | "ping";
-  path?: string;
-  content?: string; // Base64 encoded for file_write
+export type CacheMode = "normal" | "dontneed" | "direct";
+
+export type ReadCacheMode = Exclude<CacheMode, "direct">;
+
+/**
+ * Page cache residency of a file, or of a range of it
+ */
+export interface CacheStatus {
+  path: string;
+  file_size: number;
+  offset: number;
+  length: number;
+  page_size: number;
+  pages: number;
+  cached_pages: number;
+  /** Cached bytes inside the range */
+  cached_bytes: number;
+  /** Cached extents, the first 64 of them */
+  extents: { offset: number; length: number }[];
+  extents_truncated: boolean;
 }
 
 /**
- * Response from the guest agent
+ * One send mode's run in a transfer benchmark
  */
-interface AgentResponse {
-  success: boolean;
-  error?: string;
-  data?: unknown;
+export interface TransferBenchResult {
+  mode: SendMode;
+  /** Mode the transfer actually finished in */
+  used: SendMode;
+  fallback: boolean;
+  seconds: number;
+  mb_per_s: number;
+  /** CPU time of the sending thread per GiB */
+  cpu_ms_per_gib: number;
+  /** CPU time of the whole guest per GiB, including softirqs */
+  guest_cpu_ms_per_gib: number;
+  zerocopy_sends: number;
+  /** Zerocopy sends the kernel ended up copying anyway */
+  zerocopy_copied: number;
 }
 
-interface FileReadData {
-  content: string;
+export interface TransferBench {
   size: number;
+  results: TransferBenchResult[];
 }
 
-interface FileWriteData {
-  bytes_written: number;
+/**
+ * How many connections to split a large transfer over. Agents that take
+ * parallel uploads (file_alloc/file_commit) also serve byte ranges.
+ */
+function parallelStreams(capabilities: AgentCapabilities | null): number {
+  if (
+    !capabilities ||
+    !supportsOperation(capabilities, "file_alloc") ||
+    !supportsOperation(capabilities, "file_commit")
+  ) {
+    return 1;
+  }
+  const bulkWorkers = capabilities.limits.bulk_workers ?? 1;
+  return Math.max(1, Math.min(MAX_FILE_STREAMS, capabilities.cpus ?? 1, bulkWorkers));
+}
+
+/**
+ * Error for a cache mode the agent can't honor. Agents that can't be asked
+ * are sent the mode anyway; older ones ignore it.
+ */
+function unsupportedCacheMode(capabilities: AgentCapabilities | null, cache: CacheMode): ValidationError | null {
+  if (cache === "normal" || !capabilities || capabilities.cache_modes?.includes(cache)) {
+    return null;
+  }
+  return new ValidationError({
+    message: `The guest agent on this machine does not support cache mode ${cache}; rebuild its rootfs`,
+  });
+}
+
+/**
+ * Compression for one transfer: a codec, or "none" to send it uncompressed.
+ * Left unset, the fastest codec both sides have is used.
+ */
+export type Compression = Codec | "none";
+
+/**
+ * Error for a codec the agent can't decode. Unlike cache modes, an agent
+ * that can't be asked gets nothing it might misread.
+ */
+function unsupportedCompression(
+  capabilities: AgentCapabilities | null,
+  compression: Compression | undefined
+): ValidationError | null {
+  if (!compression || compression === "none" || capabilities?.codecs.includes(compression)) {
+    return null;
+  }
+  return new ValidationError({
+    message: `The guest agent on this machine does not support ${compression} compression; rebuild its rootfs`,
+  });
+}
+
+/**
+ * The transport for one transfer. Asking for a codec also picks JSON
+ * framing, since raw framing sends the bytes as they are.
+ */
+function transferPlan(transport: TransportPlan | null, compression: Compression | undefined): TransportPlan | null {
+  if (!transport || !compression) return transport;
+  if (compression === "none") return { ...transport, codec: "base64" };
+  return { ...transport, framing: "json", codec: compression };
+}
+
+/**
+ * Run `task` for each index in [0, count) with at most `concurrency` in
+ * flight. No new tasks start after the first failure, which is returned.
+ */
+async function runRanges<E>(
+  count: number,
+  concurrency: number,
+  task: (index: number) => Promise<Result<void, E>>
+): Promise<Result<void, E>> {
+  const state: { next: number; failure: E | null } = { next: 0, failure: null };
+
+  const worker = async () => {
+    while (state.failure === null && state.next < count) {
+      const result = await task(state.next++);
+      if (result.isErr() && state.failure === null) {
+        state.failure = result.error;
+      }
+    }
+  };
+  await Promise.all(Array.from({ length: Math.min(concurrency, count) }, worker));
+
+  return state.failure === null ? Result.ok(undefined) : Result.err(state.failure);
 }
 
 type MachineConfig = {
@@ -73,8 +242,10 @@ export class FileService {
   async uploadFile(
     machineId: string,
     remotePath: string,
-    content: Buffer
-  ): Promise<Result<{ bytes_written: number }, HyperfleetError>> {
+    content: Buffer,
+    cache: CacheMode = "normal",
+    compression?: Compression
+  ): Promise<Result<{ bytes_written: number; cache?: CacheMode }, HyperfleetError>> {
     // Validate file size
     if (content.length > MAX_FILE_SIZE) {
       return Result.err(
@@ -100,29 +271,49 @@ export class FileService {
     }
 
     const udsPath = vsockResult.unwrap();
+    const capabilities = await this.getCapabilities(machineId, udsPath);
+    const transport = transferPlan(capabilities ? selectTransport(capabilities) : null, compression);
+    const unsupported = unsupportedCacheMode(capabilities, cache) ?? unsupportedCompression(capabilities, compression);
+    if (unsupported) {
+      return Result.err(unsupported);
+    }
+
+    // Large files are written as ranges over parallel connections
+    const streams = Math.min(parallelStreams(capabilities), Math.ceil(content.length / PARALLEL_CHUNK_SIZE));
+    if (content.length >= PARALLEL_MIN_SIZE && streams > 1) {
+      return this.uploadFileParallel(machineId, udsPath, remotePath, content, streams, transport, cache);
+    }
 
-    // Encode content as base64
-    const base64Content = content.toString("base64");
+    // Compress when the agent can decode it and it actually shrinks the payload
+    const codec = wireCodec(transport?.codec);
+    const compressed = codec ? compressPayload(content, codec) : null;
 
     // Send file write request to agent
-    const request: AgentRequest = {
-      operation: "file_write",
-      path: remotePath,
-      content: base64Content,
-    };
+    const request: AgentRequest = compressed
+      ? {
+          operation: "file_write",
+          path: remotePath,
+          content: compressed.toString("base64"),
+          encoding: codec,
+          size: content.length,
+        }
+      : {
+          operation: "file_write",
+          path: remotePath,
+          content: content.toString("base64"),
+        };
+    if (cache !== "normal") {
+      request.cache = cache;
+    }
 
-    const response = await this.sendAgentRequest(udsPath, request);
+    const response = await sendAgentRequest(udsPath, request, DEFAULT_FILE_TIMEOUT_MS);
     if (response.isErr()) {
       return Result.err(response.error);
     }
 
     const agentResp = response.unwrap();
     if (!agentResp.success) {
-      return Result.err(
-        new VsockError({
-          message: agentResp.error ?? "Failed to write file",
-        })
-      );
+      return Result.err(agentFailure(agentResp, "Failed to write file"));
     }
 
     const data = agentResp.data as FileWriteData;
@@ -130,9 +321,125 @@ export class FileService {
       machineId,
       path: remotePath,
       bytesWritten: data.bytes_written,
+      encoding: compressed ? codec : "none",
+      ratio: compressed ? Number((content.length / compressed.length).toFixed(2)) : undefined,
+      cache: data.cache,
     });
 
-    return Result.ok({ bytes_written: data.bytes_written });
+    return Result.ok({ bytes_written: data.bytes_written, cache: data.cache });
+  }
+
+  /**
+   * Write a file as ranges over several connections into a preallocated
+   * partial file, then have the agent check its size and rename it into place.
+   */
+  private async uploadFileParallel(
+    machineId: string,
+    udsPath: string,
+    remotePath: string,
+    content: Buffer,
+    streams: number,
+    transport: TransportPlan | null,
+    cache: CacheMode
+  ): Promise<Result<{ bytes_written: number; cache?: CacheMode }, HyperfleetError>> {
+    const startedAt = Date.now();
+    const codec = wireCodec(transport?.codec);
+    // Ranges land on 8 MiB boundaries, so each can go direct; the weakest mode used is reported
+    const modesUsed = new Set<CacheMode>();
+
+    const alloc = await sendAgentRequest<FileAllocData>(
+      udsPath,
+      { operation: "file_alloc", path: remotePath, size: content.length },
+      DEFAULT_FILE_TIMEOUT_MS
+    );
+    if (alloc.isErr()) {
+      return Result.err(alloc.error);
+    }
+    const allocResp = alloc.unwrap();
+    if (!allocResp.success || !allocResp.data) {
+      return Result.err(agentFailure(allocResp, "Failed to allocate file"));
+    }
+    const partialPath = allocResp.data.partial_path;
+
+    const chunks = Math.ceil(content.length / PARALLEL_CHUNK_SIZE);
+    const written = await runRanges<HyperfleetError>(chunks, streams, async (index) => {
+      const offset = index * PARALLEL_CHUNK_SIZE;
+      const range = content.subarray(offset, offset + PARALLEL_CHUNK_SIZE);
+      const compressed = codec ? compressPayload(range, codec) : null;
+
+      // The agent checks the CRC of the decoded range before writing it
+      const request: AgentRequest = {
+        operation: "file_write",
+        path: partialPath,
+        offset,
+        crc32: Bun.hash.crc32(range),
+        content: (compressed ?? range).toString("base64"),
+      };
+      if (compressed) {
+        request.encoding = codec;
+        request.size = range.length;
+      }
+      if (cache !== "normal") {
+        request.cache = cache;
+      }
+
+      const response = await sendAgentRequest<FileWriteData>(udsPath, request, DEFAULT_FILE_TIMEOUT_MS);
+      if (response.isErr()) {
+        return Result.err(response.error);
+      }
+      const agentResp = response.unwrap();
+      if (!agentResp.success) {
+        return Result.err(agentFailure(agentResp, "Failed to write file range"));
+      }
+      if (agentResp.data?.cache) {
+        modesUsed.add(agentResp.data.cache);
+      }
+      return Result.ok(undefined);
+    });
+
+    const committed = written.isOk()
+      ? await this.commitUpload(udsPath, partialPath, remotePath, content.length)
+      : written;
+    if (committed.isErr()) {
+      // Don't leave the partial file behind
+      await sendAgentRequest(udsPath, { operation: "file_delete", path: partialPath }, DEFAULT_FILE_TIMEOUT_MS);
+      return Result.err(committed.error);
+    }
+
+    const usedCache = (["normal", "dontneed", "direct"] as const).find((mode) => modesUsed.has(mode));
+    const elapsedMs = Math.max(1, Date.now() - startedAt);
+    this.logger?.info("File uploaded successfully", {
+      machineId,
+      path: remotePath,
+      bytesWritten: content.length,
+      streams,
+      ranges: chunks,
+      mbPerSecond: Number((content.length / 1048576 / (elapsedMs / 1000)).toFixed(1)),
+      cache: usedCache,
+    });
+
+    return Result.ok({ bytes_written: content.length, cache: usedCache });
+  }
+
+  private async commitUpload(
+    udsPath: string,
+    partialPath: string,
+    remotePath: string,
+    size: number
+  ): Promise<Result<void, HyperfleetError>> {
+    const response = await sendAgentRequest(
+      udsPath,
+      { operation: "file_commit", path: partialPath, target: remotePath, size },
+      DEFAULT_FILE_TIMEOUT_MS
+    );
+    if (response.isErr()) {
+      return Result.err(response.error);
+    }
+    const agentResp = response.unwrap();
+    if (!agentResp.success) {
+      return Result.err(agentFailure(agentResp, "Failed to commit file"));
+    }
+    return Result.ok(undefined);
   }
 
   /**
@@ -140,7 +447,9 @@ export class FileService {
    */
   async downloadFile(
     machineId: string,
-    remotePath: string
+    remotePath: string,
+    cache: ReadCacheMode = "normal",
+    compression?: Compression
   ): Promise<Result<Buffer, HyperfleetError>> {
     // Validate path
     if (!remotePath.startsWith("/")) {
@@ -158,37 +467,201 @@ export class FileService {
     }
 
     const udsPath = vsockResult.unwrap();
+    const capabilities = await this.getCapabilities(machineId, udsPath);
+    const transport = transferPlan(capabilities ? selectTransport(capabilities) : null, compression);
+    const streams = parallelStreams(capabilities);
+    const unsupported = unsupportedCacheMode(capabilities, cache) ?? unsupportedCompression(capabilities, compression);
+    if (unsupported) {
+      return Result.err(unsupported);
+    }
 
-    // Send file read request to agent
-    const request: AgentRequest = {
-      operation: "file_read",
+    // With parallel streams available, start with the first range; its reply
+    // tells us whether the rest is worth fetching concurrently
+    const first = await this.readRange(
+      udsPath,
+      remotePath,
+      transport,
+      streams > 1 ? { offset: 0, length: PARALLEL_CHUNK_SIZE } : null,
+      cache
+    );
+    if (first.isErr()) {
+      return Result.err(first.error);
+    }
+
+    const { body, fileSize } = first.unwrap();
+    let content = body;
+    if (fileSize > body.length) {
+      const rest = await this.downloadRest(udsPath, remotePath, transport, streams, body, fileSize, cache);
+      if (rest.isErr()) {
+        return Result.err(rest.error);
+      }
+      content = rest.unwrap();
+    }
+
+    this.logger?.info("File downloaded successfully", {
+      machineId,
       path: remotePath,
-    };
+      size: content.length,
+      framing: transport?.framing ?? "json",
+      codec: transport?.codec,
+      streams: fileSize > body.length ? streams : 1,
+      cache,
+    });
+
+    return Result.ok(content);
+  }
+
+  /**
+   * Fetch everything after the first range of a file over parallel connections
+   */
+  private async downloadRest(
+    udsPath: string,
+    remotePath: string,
+    transport: TransportPlan | null,
+    streams: number,
+    first: Buffer,
+    fileSize: number,
+    cache: ReadCacheMode
+  ): Promise<Result<Buffer, HyperfleetError>> {
+    if (fileSize > MAX_FILE_SIZE) {
+      return Result.err(
+        new ValidationError({ message: `File too large: ${fileSize} bytes (max ${MAX_FILE_SIZE})` })
+      );
+    }
+
+    const content = Buffer.allocUnsafe(fileSize);
+    first.copy(content, 0);
+
+    const chunks = Math.ceil((fileSize - first.length) / PARALLEL_CHUNK_SIZE);
+    const read = await runRanges<HyperfleetError>(chunks, Math.min(streams, chunks), async (index) => {
+      const offset = first.length + index * PARALLEL_CHUNK_SIZE;
+      const length = Math.min(PARALLEL_CHUNK_SIZE, fileSize - offset);
+
+      const range = await this.readRange(udsPath, remotePath, transport, { offset, length }, cache);
+      if (range.isErr()) {
+        return Result.err(range.error);
+      }
+      const { body, fileSize: currentSize } = range.unwrap();
+      if (body.length !== length || currentSize !== fileSize) {
+        return Result.err(new VsockError({ message: "File changed during download" }));
+      }
+      body.copy(content, offset);
+      return Result.ok(undefined);
+    });
+
+    return read.isOk() ? Result.ok(content) : Result.err(read.error);
+  }
+
+  /**
+   * Read a whole file, or one range of it, with the given transport
+   */
+  private async readRange(
+    udsPath: string,
+    remotePath: string,
+    transport: TransportPlan | null,
+    range: FileRange | null,
+    cache: ReadCacheMode
+  ): Promise<Result<{ body: Buffer; fileSize: number }, HyperfleetError>> {
+    const request: AgentRequest = { operation: "file_read", path: remotePath, ...range };
+    if (cache !== "normal") {
+      request.cache = cache;
+    }
+
+    // Raw framing streams the bytes without base64, zero-copy where possible
+    if (transport?.framing === "raw") {
+      request.framing = "raw";
+      const response = await sendAgentRawRequest<FileReadRawData>(udsPath, request, DEFAULT_FILE_TIMEOUT_MS, {
+        maxBodyBytes: MAX_FILE_SIZE,
+      });
+      if (response.isErr()) {
+        return Result.err(response.error);
+      }
+      const { response: agentResp, body } = response.unwrap();
+      if (!agentResp.success) {
+        return Result.err(agentFailure(agentResp, "Failed to read file"));
+      }
+      return Result.ok({ body, fileSize: agentResp.data?.file_size ?? body.length });
+    }
 
-    const response = await this.sendAgentRequest(udsPath, request);
+    const codec = wireCodec(transport?.codec);
+    if (codec) {
+      request.compression = codec;
+    }
+
+    const response = await sendAgentRequest<FileReadData>(udsPath, request, DEFAULT_FILE_TIMEOUT_MS);
     if (response.isErr()) {
       return Result.err(response.error);
     }
 
     const agentResp = response.unwrap();
-    if (!agentResp.success) {
+    if (!agentResp.success || !agentResp.data) {
+      return Result.err(agentFailure(agentResp, "Failed to read file"));
+    }
+
+    const data = agentResp.data;
+    let content = Buffer.from(data.content, "base64");
+    if (data.encoding && data.encoding !== "none") {
+      const decoded = decompressPayload(content, data.encoding, data.size);
+      if (!decoded) {
+        return Result.err(new VsockError({ message: `Invalid ${data.encoding} content from agent` }));
+      }
+      content = decoded;
+    }
+    if (data.compression_skipped || data.ratio) {
+      this.logger?.debug("File read compression", {
+        path: remotePath,
+        encoding: data.encoding,
+        compressionSkipped: data.compression_skipped,
+        ratio: data.ratio,
+        compressUs: data.compress_us,
+      });
+    }
+
+    return Result.ok({ body: content, fileSize: data.file_size ?? content.length });
+  }
+
+  /**
+   * Measure copy, sendfile and zerocopy download throughput from a running VM
+   */
+  async benchTransfer(
+    machineId: string,
+    options: { size_mb?: number; modes?: SendMode[] }
+  ): Promise<Result<TransferBench, HyperfleetError>> {
+    const vsockResult = await this.getVsockPath(machineId);
+    if (vsockResult.isErr()) {
+      return Result.err(vsockResult.error);
+    }
+
+    const udsPath = vsockResult.unwrap();
+
+    const capabilities = await agentCapabilities.get(machineId, udsPath);
+    if (capabilities.isErr()) {
+      return Result.err(capabilities.error);
+    }
+    if (!supportsOperation(capabilities.unwrap(), "transfer_bench")) {
       return Result.err(
-        new VsockError({
-          message: agentResp.error ?? "Failed to read file",
+        new ValidationError({
+          message: "The guest agent on this machine does not support transfer_bench; rebuild its rootfs",
         })
       );
     }
 
-    const data = agentResp.data as FileReadData;
-    const content = Buffer.from(data.content, "base64");
+    const response = await sendAgentRawRequest<TransferBench>(
+      udsPath,
+      { operation: "transfer_bench", size_mb: options.size_mb, modes: options.modes },
+      TRANSFER_BENCH_TIMEOUT_MS
+    );
+    if (response.isErr()) {
+      return Result.err(response.error);
+    }
 
-    this.logger?.info("File downloaded successfully", {
-      machineId,
-      path: remotePath,
-      size: content.length,
-    });
+    const agentResp = response.unwrap().response;
+    if (!agentResp.success || !agentResp.data) {
+      return Result.err(agentFailure(agentResp, "Transfer benchmark failed"));
+    }
 
-    return Result.ok(content);
+    this.logger?.info("Transfer benchmark finished", { machineId, results: agentResp.data.results });
+    return Result.ok(agentResp.data);
   }
 
   /**
@@ -221,21 +694,69 @@ export class FileService {
       path: remotePath,
     };
 
-    const response = await this.sendAgentRequest(udsPath, request);
+    const response = await sendAgentRequest(udsPath, request, DEFAULT_FILE_TIMEOUT_MS);
     if (response.isErr()) {
       return Result.err(response.error);
     }
 
     const agentResp = response.unwrap();
     if (!agentResp.success) {
+      return Result.err(agentFailure(agentResp, "Failed to stat file"));
+    }
+
+    return Result.ok(agentResp.data as FileStat);
+  }
+
+  /**
+   * How much of a file on a running VM is in its page cache
+   */
+  async cacheStatus(
+    machineId: string,
+    remotePath: string,
+    range?: Partial<FileRange>
+  ): Promise<Result<CacheStatus, HyperfleetError>> {
+    if (!remotePath.startsWith("/")) {
       return Result.err(
-        new VsockError({
-          message: agentResp.error ?? "Failed to stat file",
+        new ValidationError({
+          message: "Remote path must be absolute",
         })
       );
     }
 
-    return Result.ok(agentResp.data as FileStat);
+    const vsockResult = await this.getVsockPath(machineId);
+    if (vsockResult.isErr()) {
+      return Result.err(vsockResult.error);
+    }
+
+    const udsPath = vsockResult.unwrap();
+
+    const capabilities = await agentCapabilities.get(machineId, udsPath);
+    if (capabilities.isErr()) {
+      return Result.err(capabilities.error);
+    }
+    if (!supportsOperation(capabilities.unwrap(), "cache_status")) {
+      return Result.err(
+        new ValidationError({
+          message: "The guest agent on this machine does not support cache_status; rebuild its rootfs",
+        })
+      );
+    }
+
+    const response = await sendAgentRequest<CacheStatus>(
+      udsPath,
+      { operation: "cache_status", path: remotePath, offset: range?.offset, length: range?.length },
+      DEFAULT_FILE_TIMEOUT_MS
+    );
+    if (response.isErr()) {
+      return Result.err(response.error);
+    }
+
+    const agentResp = response.unwrap();
+    if (!agentResp.success || !agentResp.data) {
+      return Result.err(agentFailure(agentResp, "Failed to read cache status"));
+    }
+
+    return Result.ok(agentResp.data);
   }
 
   /**
@@ -268,18 +789,14 @@ export class FileService {
       path: remotePath,
     };
 
-    const response = await this.sendAgentRequest(udsPath, request);
+    const response = await sendAgentRequest(udsPath, request, DEFAULT_FILE_TIMEOUT_MS);
     if (response.isErr()) {
       return Result.err(response.error);
     }
 
     const agentResp = response.unwrap();
     if (!agentResp.success) {
-      return Result.err(
-        new VsockError({
-          message: agentResp.error ?? "Failed to delete file",
-        })
-      );
+      return Result.err(agentFailure(agentResp, "Failed to delete file"));
     }
 
     this.logger?.info("File deleted successfully", {
@@ -290,6 +807,15 @@ export class FileService {
     return Result.ok(undefined);
   }
 
+  /**
+   * Capabilities of this machine's agent. Null if they can't be fetched, in
+   * which case plain single-stream JSON and base64 are used.
+   */
+  private async getCapabilities(machineId: string, udsPath: string): Promise<AgentCapabilities | null> {
+    const capabilities = await agentCapabilities.get(machineId, udsPath);
+    return capabilities.isOk() ? capabilities.unwrap() : null;
+  }
+
   /**
    * Get the vsock UDS path for a machine
    */
@@ -327,99 +853,4 @@ export class FileService {
 
     return Result.ok(udsPath);
   }
-
-  /**
-   * Send a request to the guest agent and wait for response
-   */
-  private sendAgentRequest(
-    udsPath: string,
-    request: AgentRequest
-  ): Promise<Result<AgentResponse, VsockError>> {
-    return new Promise((resolve) => {
-      const socket = net.createConnection({ path: udsPath });
-      let settled = false;
-      let buffer = "";
-      let connected = false; // Track if we've completed the CONNECT handshake
-
-      const finish = (err?: VsockError, response?: AgentResponse) => {
-        if (settled) return;
-        settled = true;
-        clearTimeout(timer);
-        socket.removeAllListeners();
-        socket.destroy();
-
-        if (err) {
-          resolve(Result.err(err));
-        } else if (response) {
-          resolve(Result.ok(response));
-        } else {
-          resolve(Result.err(new VsockError({ message: "Empty response from agent" })));
-        }
-      };
-
-      const timer = setTimeout(() => {
-        socket.destroy();
-        finish(new VsockError({ message: "File operation timed out" }));
-      }, DEFAULT_FILE_TIMEOUT_MS);
-
-      socket.setEncoding("utf8");
-
-      socket.on("connect", () => {
-        // Firecracker vsock protocol: send CONNECT <port>\n first
-        socket.write(`CONNECT ${VSOCK_GUEST_PORT}\n`);
-      });
-
-      socket.on("data", (chunk) => {
-        buffer += chunk;
-
-        // If we haven't completed the CONNECT handshake yet
-        if (!connected) {
-          const newlineIndex = buffer.indexOf("\n");
-          if (newlineIndex !== -1) {
-            const line = buffer.slice(0, newlineIndex).trim();
-            buffer = buffer.slice(newlineIndex + 1);
-
-            if (line.startsWith("OK ")) {
-              // Connection established, now send the actual request
-              connected = true;
-              socket.write(`${JSON.stringify(request)}\n`);
-            } else {
-              finish(new VsockError({ message: `Vsock connection failed: ${line}` }));
-            }
-          }
-          return;
-        }
-
-        // After connection is established, look for the response
-        const newlineIndex = buffer.indexOf("\n");
-        if (newlineIndex !== -1) {
-          const line = buffer.slice(0, newlineIndex).trim();
-          try {
-            const response = JSON.parse(line) as AgentResponse;
-            finish(undefined, response);
-          } catch {
-            finish(new VsockError({ message: "Invalid JSON response from agent" }));
-          }
-        }
-      });
-
-      socket.on("end", () => {
-        const remaining = buffer.trim();
-        if (!remaining) {
-          finish(new VsockError({ message: "Empty response from agent" }));
-          return;
-        }
-        try {
-          const response = JSON.parse(remaining) as AgentResponse;
-          finish(undefined, response);
-        } catch {
-          finish(new VsockError({ message: "Invalid JSON response from agent" }));
-        }
-      });
-
-      socket.on("error", (err) => {
-        finish(new VsockError({ message: `Agent connection error: ${err.message}` }));
-      });
-    });
-  }
 }
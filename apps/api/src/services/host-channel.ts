@@ -0,0 +1,299 @@
+import net from "node:net";
+import { unlinkSync } from "node:fs";
+import { Result } from "better-result";
+import { VsockError } from "@hyperfleet/errors";
+import type { GuestMessage, ListeningPort, ProbeStatus } from "../types";
+
+// Vsock port the guest init connects out to; Firecracker forwards it to `<uds_path>_1052`
+export const HOST_CHANNEL_PORT = 1052;
+
+// Messages kept per machine for callers that read them later
+const MAX_STORED_MESSAGES = 256;
+// Longest line accepted from a guest before the connection is dropped
+const MAX_LINE_BYTES = 128 * 1024;
+
+/**
+ * A health probe as init runs it (intervals in milliseconds)
+ */
+export interface GuestProbe {
+  name: string;
+  type: "tcp" | "http" | "exec" | "file";
+  port?: number;
+  path?: string;
+  command?: string[];
+  max_age_ms?: number;
+  interval_ms?: number;
+  timeout_ms?: number;
+  healthy_threshold?: number;
+  unhealthy_threshold?: number;
+}
+
+interface MachineChannel {
+  machineId: string;
+  path: string;
+  server: net.Server;
+  sockets: Set<net.Socket>;
+  messages: GuestMessage[];
+  nextSeq: number;
+  waiters: Set<() => void>;
+  // Sent to the guest each time it connects, so probes survive reconnects
+  probeLine: string | null;
+  probes: Map<string, ProbeStatus>;
+  // Replaced whole each time the guest reports a change
+  ports: ListeningPort[];
+}
+
+type PortsListener = (machineId: string, ports: ListeningPort[]) => void;
+
+/**
+ * Host end of the guest's outbound channel. Init relays each workload line
+ * as `{"client","pid","message"}` and delivers `{"client","message"}` lines
+ * written back, so guests can signal readiness or ask to be scaled without
+ * the host polling files. Init also runs the machine's health probes and
+ * reports only their transitions here, so probe state costs nothing to keep,
+ * and sends the set of listening sockets whenever it changes.
+ */
+export class HostChannelHub {
+  private channels = new Map<string, MachineChannel>();
+  private portsListeners = new Set<PortsListener>();
+
+  /**
+   * Listen for a machine's guest. Safe to call again; an existing listener is kept.
+   */
+  open(machineId: string, udsPath: string): Promise<Result<void, VsockError>> {
+    if (this.channels.has(machineId)) {
+      return Promise.resolve(Result.ok(undefined));
+    }
+
+    const path = `${udsPath}_${HOST_CHANNEL_PORT}`;
+    const channel: MachineChannel = {
+      machineId,
+      path,
+      server: net.createServer((socket) => this.accept(channel, socket)),
+      sockets: new Set(),
+      messages: [],
+      nextSeq: 1,
+      waiters: new Set(),
+      probeLine: null,
+      probes: new Map(),
+      ports: [],
+    };
+    this.channels.set(machineId, channel);
+
+    // A previous API process may have left its socket behind
+    try {
+      unlinkSync(path);
+    } catch {
+      // Nothing to clean up
+    }
+
+    return new Promise((resolve) => {
+      channel.server.once("error", (err) => {
+        this.channels.delete(machineId);
+        resolve(Result.err(new VsockError({ message: `Host channel listen failed: ${err.message}` })));
+      });
+      channel.server.listen(path, () => resolve(Result.ok(undefined)));
+    });
+  }
+
+  /**
+   * Stop listening for a machine and wake anyone waiting on it
+   */
+  close(machineId: string): void {
+    const channel = this.channels.get(machineId);
+    if (!channel) return;
+    this.channels.delete(machineId);
+
+    for (const socket of channel.sockets) socket.destroy();
+    channel.server.close();
+    try {
+      unlinkSync(channel.path);
+    } catch {
+      // Already gone
+    }
+    for (const wake of channel.waiters) wake();
+    if (channel.ports.length > 0) {
+      for (const listener of this.portsListeners) listener(machineId, []);
+    }
+  }
+
+  isOpen(machineId: string): boolean {
+    return this.channels.has(machineId);
+  }
+
+  /**
+   * Messages received after `since`, oldest first
+   */
+  messages(machineId: string, since = 0): GuestMessage[] {
+    const channel = this.channels.get(machineId);
+    return channel ? channel.messages.filter((m) => m.seq > since) : [];
+  }
+
+  /**
+   * Like `messages`, but waits up to `timeoutMs` for one to arrive if there are none yet
+   */
+  async waitForMessages(machineId: string, since: number, timeoutMs: number): Promise<GuestMessage[]> {
+    const pending = this.messages(machineId, since);
+    const channel = this.channels.get(machineId);
+    if (pending.length > 0 || !channel || timeoutMs <= 0) {
+      return pending;
+    }
+
+    await new Promise<void>((resolve) => {
+      const wake = () => {
+        clearTimeout(timer);
+        channel.waiters.delete(wake);
+        resolve();
+      };
+      const timer = setTimeout(wake, timeoutMs);
+      channel.waiters.add(wake);
+    });
+    return this.messages(machineId, since);
+  }
+
+  /**
+   * Deliver a message to one workload, or to all of them when `client` is omitted
+   */
+  send(machineId: string, message: Record<string, unknown>, client?: number): Result<void, VsockError> {
+    const channel = this.channels.get(machineId);
+    if (!channel || channel.sockets.size === 0) {
+      return Result.err(new VsockError({ message: "Guest is not connected to the host channel" }));
+    }
+
+    const line = `${JSON.stringify({ client: client ?? 0, message })}\n`;
+    for (const socket of channel.sockets) socket.write(line);
+    return Result.ok(undefined);
+  }
+
+  /**
+   * Have the guest run these probes, replacing any it had. Kept and sent
+   * again whenever the guest reconnects.
+   */
+  configureProbes(machineId: string, probes: GuestProbe[]): void {
+    const channel = this.channels.get(machineId);
+    if (!channel) return;
+
+    const previous = channel.probes;
+    channel.probes = new Map(
+      probes.map((probe) => [
+        probe.name,
+        previous.get(probe.name) ?? { name: probe.name, status: "unknown", detail: null, changed_at: null },
+      ])
+    );
+    channel.probeLine = `${JSON.stringify({ probes })}\n`;
+    for (const socket of channel.sockets) socket.write(channel.probeLine);
+  }
+
+  /**
+   * Last reported state of each configured probe
+   */
+  probeStatuses(machineId: string): ProbeStatus[] {
+    return [...(this.channels.get(machineId)?.probes.values() ?? [])];
+  }
+
+  /**
+   * Sockets listening in the guest, as last reported
+   */
+  listeningPorts(machineId: string): ListeningPort[] {
+    return this.channels.get(machineId)?.ports ?? [];
+  }
+
+  /**
+   * Call `listener` whenever a machine's listening sockets change, including
+   * when its channel closes. Returns a function that unsubscribes.
+   */
+  onPortsChanged(listener: PortsListener): () => void {
+    this.portsListeners.add(listener);
+    return () => this.portsListeners.delete(listener);
+  }
+
+  private accept(channel: MachineChannel, socket: net.Socket): void {
+    channel.sockets.add(socket);
+    if (channel.probeLine) socket.write(channel.probeLine);
+    let buffer = "";
+
+    socket.setEncoding("utf8");
+    socket.on("data", (chunk: string) => {
+      buffer += chunk;
+      let newlineIndex: number;
+      while ((newlineIndex = buffer.indexOf("\n")) !== -1) {
+        this.receive(channel, buffer.slice(0, newlineIndex));
+        buffer = buffer.slice(newlineIndex + 1);
+      }
+      if (buffer.length > MAX_LINE_BYTES) {
+        socket.destroy();
+      }
+    });
+    socket.on("close", () => channel.sockets.delete(socket));
+    socket.on("error", () => socket.destroy());
+  }
+
+  private receive(channel: MachineChannel, line: string): void {
+    const parsed = Result.try(() => JSON.parse(line) as Record<string, unknown>).unwrapOr(null);
+    if (parsed?.probe && typeof parsed.probe === "object") {
+      this.receiveProbe(channel, parsed.probe as Record<string, unknown>);
+      return;
+    }
+    if (Array.isArray(parsed?.ports)) {
+      this.receivePorts(channel, parsed.ports);
+      return;
+    }
+
+    const message = parsed?.message;
+    if (!parsed || !message || typeof message !== "object" || Array.isArray(message)) {
+      return;
+    }
+
+    channel.messages.push({
+      seq: channel.nextSeq++,
+      client: Number(parsed.client) || 0,
+      pid: Number(parsed.pid) || 0,
+      received_at: new Date().toISOString(),
+      message: message as Record<string, unknown>,
+    });
+    if (channel.messages.length > MAX_STORED_MESSAGES) {
+      channel.messages.shift();
+    }
+    for (const wake of channel.waiters) wake();
+  }
+
+  private receiveProbe(channel: MachineChannel, report: Record<string, unknown>): void {
+    const name = String(report.name);
+    const status = report.status;
+    // Reports for probes dropped since are stale
+    if (!channel.probes.has(name) || (status !== "healthy" && status !== "unhealthy")) {
+      return;
+    }
+    const current = channel.probes.get(name);
+    channel.probes.set(name, {
+      name,
+      status,
+      detail: typeof report.detail === "string" ? report.detail : null,
+      // A repeated status (after a reconnect) isn't a new transition
+      changed_at: current?.status === status ? current.changed_at : new Date().toISOString(),
+    });
+  }
+
+  private receivePorts(channel: MachineChannel, reported: unknown[]): void {
+    const ports: ListeningPort[] = [];
+    for (const entry of reported) {
+      const port = entry as Record<string, unknown>;
+      if ((port.protocol !== "tcp" && port.protocol !== "udp") || !Number.isInteger(port.port)) continue;
+      ports.push({
+        protocol: port.protocol,
+        address: String(port.address ?? ""),
+        port: port.port as number,
+        pid: Number(port.pid) || 0,
+        process: String(port.process ?? ""),
+      });
+    }
+
+    // The guest sends the set again on every reconnect
+    if (JSON.stringify(ports) === JSON.stringify(channel.ports)) return;
+    channel.ports = ports;
+    for (const listener of this.portsListeners) listener(channel.machineId, ports);
+  }
+}
+
+// One listener per running machine, shared by the API
+export const hostChannels = new HostChannelHub();
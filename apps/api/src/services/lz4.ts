@@ -0,0 +1,154 @@
+/**
+ * LZ4 block format (no frame), matching the codec built into the guest init.
+ * Blocks don't record their decoded length, so it travels alongside them.
+ */
+
+const HASH_LOG = 16;
+const MIN_MATCH = 4;
+const MF_LIMIT = 12; // a match can't start in the last 12 bytes
+const LAST_LITERALS = 5; // the last 5 bytes are always literals
+const MAX_OFFSET = 65535;
+
+function read32(buf: Uint8Array, pos: number): number {
+  return (buf[pos] | (buf[pos + 1] << 8) | (buf[pos + 2] << 16) | (buf[pos + 3] << 24)) >>> 0;
+}
+
+function hash(value: number): number {
+  return Math.imul(value, 2654435761) >>> (32 - HASH_LOG);
+}
+
+function writeLength(out: Uint8Array, pos: number, len: number): number {
+  while (len >= 255) {
+    out[pos++] = 255;
+    len -= 255;
+  }
+  out[pos++] = len;
+  return pos;
+}
+
+export function compressBound(len: number): number {
+  return len + Math.floor(len / 255) + 16;
+}
+
+/**
+ * Compress a buffer into a single LZ4 block
+ */
+export function compressBlock(src: Uint8Array): Buffer {
+  const len = src.length;
+  const out = Buffer.allocUnsafe(compressBound(len));
+  const table = new Uint32Array(1 << HASH_LOG); // position + 1, 0 = empty
+  let op = 0;
+  let anchor = 0;
+  let ip = 0;
+
+  if (len > MF_LIMIT) {
+    const limit = len - MF_LIMIT;
+    while (ip < limit) {
+      const seq = read32(src, ip);
+      const h = hash(seq);
+      let ref = table[h];
+      table[h] = ip + 1;
+
+      if (ref === 0 || ip - (ref - 1) > MAX_OFFSET || read32(src, ref - 1) !== seq) {
+        // Skip faster through data that isn't matching
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      ref--;
+
+      while (ip > anchor && ref > 0 && src[ip - 1] === src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+
+      let matchLen = MIN_MATCH;
+      const maxMatch = len - LAST_LITERALS - ip;
+      while (matchLen < maxMatch && src[ip + matchLen] === src[ref + matchLen]) matchLen++;
+
+      const litLen = ip - anchor;
+      const token = op++;
+      out[token] = Math.min(litLen, 15) << 4;
+      if (litLen >= 15) op = writeLength(out, op, litLen - 15);
+      out.set(src.subarray(anchor, ip), op);
+      op += litLen;
+
+      const offset = ip - ref;
+      out[op++] = offset & 0xff;
+      out[op++] = offset >> 8;
+
+      const ml = matchLen - MIN_MATCH;
+      out[token] |= Math.min(ml, 15);
+      if (ml >= 15) op = writeLength(out, op, ml - 15);
+
+      ip += matchLen;
+      anchor = ip;
+    }
+  }
+
+  const litLen = len - anchor;
+  out[op++] = Math.min(litLen, 15) << 4;
+  if (litLen >= 15) op = writeLength(out, op, litLen - 15);
+  out.set(src.subarray(anchor), op);
+  op += litLen;
+
+  return out.subarray(0, op);
+}
+
+/**
+ * Decompress a block that decodes to exactly `size` bytes. Returns null if
+ * the block is malformed or decodes to a different size.
+ */
+export function decompressBlock(src: Uint8Array, size: number): Buffer | null {
+  const out = Buffer.allocUnsafe(size);
+  const len = src.length;
+  let ip = 0;
+  let op = 0;
+
+  while (ip < len) {
+    const token = src[ip++];
+
+    let litLen = token >> 4;
+    if (litLen === 15) {
+      let b: number;
+      do {
+        if (ip >= len) return null;
+        b = src[ip++];
+        litLen += b;
+      } while (b === 255);
+    }
+    if (litLen > len - ip || litLen > size - op) return null;
+    out.set(src.subarray(ip, ip + litLen), op);
+    ip += litLen;
+    op += litLen;
+
+    // The last sequence has no match
+    if (ip === len) break;
+
+    if (len - ip < 2) return null;
+    const offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if (offset === 0 || offset > op) return null;
+
+    let matchLen = token & 15;
+    if (matchLen === 15) {
+      let b: number;
+      do {
+        if (ip >= len) return null;
+        b = src[ip++];
+        matchLen += b;
+      } while (b === 255);
+    }
+    matchLen += MIN_MATCH;
+    if (matchLen > size - op) return null;
+
+    if (offset >= matchLen) {
+      out.copyWithin(op, op - offset, op - offset + matchLen);
+    } else {
+      // Overlapping copy repeats the last `offset` bytes
+      for (let i = 0; i < matchLen; i++) out[op + i] = out[op - offset + i];
+    }
+    op += matchLen;
+  }
+
+  return op === size ? out : null;
+}
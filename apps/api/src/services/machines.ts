@@ -1,21 +1,78 @@
 import net from "node:net";
+import { isUtf8 } from "node:buffer";
+import { mkdir, realpath, rm, stat } from "node:fs/promises";
 import { customAlphabet } from "nanoid";
 import { Result } from "better-result";
 import type { Kysely, Database, MachineStatus, Machine } from "@hyperfleet/worker/database";
 import type { Logger } from "@hyperfleet/logger";
+import { Machine as FirecrackerMachine } from "@hyperfleet/firecracker";
 import {
   NotFoundError,
   ValidationError,
   VsockError,
+  AgentBusyError,
   RuntimeError,
   TimeoutError,
   type HyperfleetError,
 } from "@hyperfleet/errors";
 import { NetworkManager, type VMNetworkConfig } from "@hyperfleet/network";
+import { getImageService } from "@hyperfleet/oci";
 import { validateMachinePaths } from "./validation";
-import type { CreateMachineBody, MachineResponse, ExecBody, ExecResponse, NetworkConfig } from "../types";
+import type {
+  CreateMachineBody,
+  MachineResponse,
+  ExecBody,
+  ExecResponse,
+  NetworkConfig,
+  OpenSessionBody,
+  SessionResponse,
+  SessionExecBody,
+  SessionExecResponse,
+  JobSignalBody,
+  JobFreezeResponse,
+  WorkingSetMethod,
+  WorkingSetResponse,
+  LatencyTraceEvents,
+  LatencyTraceResponse,
+  MetricsHistoryQuery,
+  MetricsHistoryResponse,
+  MachineLogsQuery,
+  MachineLogsResponse,
+  BatchBody,
+  BatchResponse,
+  GuestMessagesResponse,
+  SendGuestMessageBody,
+  MountShareBody,
+  ShareResponse,
+  CreateWorkspaceBody,
+  CommitWorkspaceBody,
+  WorkspaceResponse,
+  WorkspaceListResponse,
+  ProbeConfig,
+  ProbeStatus,
+  SetProbesBody,
+  ListeningPort,
+} from "../types";
 import { RuntimeFactory } from "./runtime-factory";
 import { getGlobalRuntimeManager } from "./runtime-manager";
+import {
+  agentCapabilities,
+  agentFailure,
+  failedBeforeAccepted,
+  selectTransport,
+  supportsOperation,
+  sendAgentRequest,
+  sendAgentRawRequest,
+  sendControlRequest,
+  type AgentCapabilities,
+  type AgentRequest,
+  type AgentResponse,
+} from "./agent";
+import { decompressPayload, wireCodec, type Codec } from "./compression";
+import { hostChannels, type GuestProbe } from "./host-channel";
+import { shareServers, type ShareExport } from "./shares";
+import { blockServers, ROOT_EXPORT } from "./block-server";
+import { balloonController } from "./balloon";
 
 // Global network manager instance
 let networkManager: NetworkManager | null = null;
@@ -33,16 +90,39 @@ function getNetManager(): NetworkManager {
 }
 
 const DEFAULT_EXEC_TIMEOUT_SECONDS = 30;
+// Time budgeted for each non-exec item of a batch
+const BATCH_ITEM_TIMEOUT_MS = 30_000;
+const MAX_BATCH_ITEMS = 64;
+const SESSION_CONTROL_TIMEOUT_MS = 10_000;
+const JOB_CONTROL_TIMEOUT_MS = 5_000;
+const DEFAULT_WORKING_SET_WINDOW_MS = 10_000;
+const METRICS_HISTORY_TIMEOUT_MS = 10_000;
+const DEFAULT_LATENCY_TRACE_MS = 5_000;
+const LOG_READ_TIMEOUT_MS = 10_000;
+// Extra time allowed for the agent to report back after a command's own timeout
+const AGENT_RESPONSE_GRACE_MS = 5_000;
+// Cap on binary exec output streamed with raw framing (stdout + stderr)
+const MAX_EXEC_OUTPUT_BYTES = parseInt(process.env.HYPERFLEET_EXEC_MAX_OUTPUT ?? "268435456", 10);
 const DEFAULT_WAIT_TIMEOUT_SECONDS = 30;
 const MAX_WAIT_TIMEOUT_SECONDS = 30;
 const WAIT_POLL_INTERVAL_MS = 250;
+const SHARE_CONTROL_TIMEOUT_MS = 10_000;
+const DEFAULT_SHARE_CACHE_SECONDS = 60;
+const WORKSPACE_CONTROL_TIMEOUT_MS = 10_000;
+// Workspace failures the guest reports that are the caller's to fix
+const WORKSPACE_CLIENT_ERRORS = ["workspace exists", "target in use", "unknown base", "layer exists", "layer in use", "too many layers", "too many workspaces"];
 const generateMachineId = customAlphabet("0123456789abcdefghijklmnopqrstuvwxyz", 12);
+const generateShareName = customAlphabet("0123456789abcdefghijklmnopqrstuvwxyz", 8);
 
 // Default machine configuration from environment variables
 const DEFAULT_SOCKET_DIR = process.env.HYPERFLEET_SOCKET_DIR ?? "/tmp";
 const DEFAULT_KERNEL_IMAGE_PATH = process.env.HYPERFLEET_KERNEL_IMAGE_PATH ?? "assets/vmlinux";
 const DEFAULT_KERNEL_ARGS = process.env.HYPERFLEET_KERNEL_ARGS ?? "console=ttyS0 reboot=k panic=1 pci=off init=/init";
 const DEFAULT_ROOTFS_PATH = process.env.HYPERFLEET_ROOTFS_PATH ?? "assets/alpine-rootfs.ext4";
+// Where machines with a lazy root keep the blocks they have written
+const DEFAULT_OVERLAY_DIR = process.env.HYPERFLEET_OVERLAY_DIR ?? "/var/lib/hyperfleet/overlays";
+// The only host directory tree shares may come from; unset disables shares
+const SHARE_ROOT = process.env.HYPERFLEET_SHARE_ROOT;
 
 /**
  * Convert a path to absolute if it's relative
@@ -61,8 +141,19 @@ type MachineConfig = {
   };
   exec_port?: number;
   exposedPorts?: number[];
+  discoverPorts?: boolean;
+  imageRef?: string;
+  imageSizeMib?: number;
+  registryAuth?: { username: string; password: string };
+  lazyRootfs?: boolean;
+  balloonLimits?: { floorMib: number; ceilingMib: number };
+  probes?: GuestProbe[];
 };
 
+function overlayPath(machineId: string): string {
+  return `${DEFAULT_OVERLAY_DIR}/${machineId}.overlay`;
+}
+
 function normalizeExposedPorts(
   ports?: number[]
 ): Result<number[] | undefined, ValidationError> {
@@ -82,6 +173,58 @@ function normalizeExposedPorts(
   return Result.ok(unique);
 }
 
+const PROBE_NAME_PATTERN = /^[A-Za-z0-9_-][A-Za-z0-9_.-]{0,62}$/;
+
+/**
+ * Check probes and convert them to what init runs (milliseconds)
+ */
+function toGuestProbes(probes: ProbeConfig[]): Result<GuestProbe[], ValidationError> {
+  const names = new Set<string>();
+  const guestProbes: GuestProbe[] = [];
+  for (const probe of probes) {
+    const invalid = (message: string) =>
+      Result.err(new ValidationError({ message: `probe ${probe.name}: ${message}` }));
+    if (!PROBE_NAME_PATTERN.test(probe.name) || names.has(probe.name)) {
+      return Result.err(new ValidationError({ message: "probe names must be unique and use letters, digits, '-', '_' and '.'" }));
+    }
+    names.add(probe.name);
+
+    const guestProbe: GuestProbe = {
+      name: probe.name,
+      type: probe.type,
+      interval_ms: probe.interval_seconds !== undefined ? Math.round(probe.interval_seconds * 1000) : undefined,
+      timeout_ms: probe.timeout_seconds !== undefined ? Math.round(probe.timeout_seconds * 1000) : undefined,
+      healthy_threshold: probe.healthy_threshold,
+      unhealthy_threshold: probe.unhealthy_threshold,
+    };
+    if (probe.type === "tcp" || probe.type === "http") {
+      if (!probe.port || !Number.isInteger(probe.port) || probe.port < 1 || probe.port > 65535) {
+        return invalid("port must be a valid TCP port");
+      }
+      guestProbe.port = probe.port;
+      if (probe.type === "http") {
+        if (probe.path !== undefined && (!probe.path.startsWith("/") || /\s/.test(probe.path))) {
+          return invalid("path must start with / and contain no whitespace");
+        }
+        guestProbe.path = probe.path;
+      }
+    } else if (probe.type === "exec") {
+      if (!probe.command || probe.command.length === 0) {
+        return invalid("command is required");
+      }
+      guestProbe.command = probe.command;
+    } else if (probe.type === "file") {
+      if (!probe.path?.startsWith("/") || probe.max_age_seconds === undefined) {
+        return invalid("an absolute path and max_age_seconds are required");
+      }
+      guestProbe.path = probe.path;
+      guestProbe.max_age_ms = Math.round(probe.max_age_seconds * 1000);
+    }
+    guestProbes.push(guestProbe);
+  }
+  return Result.ok(guestProbes);
+}
+
 const isExecResponse = (value: unknown): value is ExecResponse => {
   if (!value || typeof value !== "object") return false;
   const record = value as Record<string, unknown>;
@@ -101,6 +244,8 @@ interface InitResponse {
     stderr: string;
   };
   error?: string;
+  busy?: boolean;
+  retry_after_ms?: number;
 }
 
 // Vsock port used by the init system
@@ -110,18 +255,78 @@ const VSOCK_RETRY_DELAY_MS = 500;
 
 const sleep = (ms: number) => new Promise(resolve => setTimeout(resolve, ms));
 
+type ExecPayload = {
+  cmd: string[];
+  timeout: number;
+  job_id?: string;
+  compression?: Codec;
+  output_encoding?: "text" | "base64" | "auto";
+  framing?: "raw";
+  sandbox?: ExecBody["sandbox"];
+};
+
+// A workspace as init reports it
+type GuestWorkspace = { workspace: string; target: string; base: string | null };
+
+type ExecOutputEncoding = NonNullable<ExecBody["output_encoding"]>;
+
+/**
+ * Turn each stream the agent sent (text, base64, lz4 or zstd) back into the
+ * bytes the command wrote. Returns null if a block doesn't decode.
+ */
+const decodeExecStream = (data: Record<string, unknown>, name: string): Buffer | null => {
+  const value = String(data[name]);
+  const encoding = data[`${name}_encoding`];
+  switch (encoding) {
+    case "lz4":
+    case "zstd":
+      return decompressPayload(Buffer.from(value, "base64"), encoding, Number(data[`${name}_size`]));
+    case "base64":
+      return Buffer.from(value, "base64");
+    default:
+      return Buffer.from(value, "utf8");
+  }
+};
+
+/**
+ * Rewrite stdout and stderr in the encoding the caller asked for. Text that
+ * wasn't valid UTF-8 is marked `<name>_lossy`. Returns false if a block
+ * doesn't decode.
+ */
+const decodeExecOutput = (data: Record<string, unknown>, encoding: ExecOutputEncoding): boolean => {
+  for (const name of ["stdout", "stderr"]) {
+    const plainText = data[`${name}_encoding`] === undefined;
+    if (plainText && encoding === "text") continue;
+
+    const bytes = decodeExecStream(data, name);
+    if (!bytes) return false;
+    for (const suffix of ["_encoding", "_size", "_ratio", "_compress_us"]) {
+      delete data[`${name}${suffix}`];
+    }
+    if (encoding === "base64") {
+      data[name] = bytes.toString("base64");
+      continue;
+    }
+    data[name] = bytes.toString("utf8");
+    if (!isUtf8(bytes)) data[`${name}_lossy`] = true;
+  }
+  return true;
+};
+
 const execViaVsockOnce = (
   udsPath: string,
-  payload: { cmd: string[]; timeout: number },
-  timeoutMs: number
-): Promise<Result<ExecResponse, VsockError>> =>
+  payload: ExecPayload,
+  timeoutMs: number,
+  encoding: ExecOutputEncoding
+): Promise<Result<ExecResponse, VsockError | AgentBusyError>> =>
   new Promise((resolve) => {
     const socket = net.createConnection({ path: udsPath });
+    const startedAt = Date.now();
     let settled = false;
     let buffer = "";
     let connected = false; // Track if we've completed the CONNECT handshake
 
-    const finish = (err?: VsockError, data?: string) => {
+    const finish = (err?: VsockError | AgentBusyError, data?: string) => {
       if (settled) return;
       settled = true;
       clearTimeout(timer);
@@ -143,13 +348,17 @@ const execViaVsockOnce = (
       const parsed = parseResult.unwrap();
       // Handle init's response format: { success: boolean, data: { exit_code, stdout, stderr } }
       if (!parsed.success) {
-        resolve(Result.err(new VsockError({ message: parsed.error ?? "Command failed" })));
+        resolve(Result.err(agentFailure(parsed, "Command failed")));
         return;
       }
       if (!parsed.data || !isExecResponse(parsed.data)) {
         resolve(Result.err(new VsockError({ message: "Invalid response format from vsock" })));
         return;
       }
+      if (!decodeExecOutput(parsed.data as unknown as Record<string, unknown>, encoding)) {
+        resolve(Result.err(new VsockError({ message: "Invalid compressed output from vsock" })));
+        return;
+      }
       resolve(Result.ok(parsed.data));
     };
 
@@ -178,8 +387,10 @@ const execViaVsockOnce = (
           if (line.startsWith("OK ")) {
             // Connection established, now send the actual request after a small delay
             connected = true;
-            const request = { operation: "exec", ...payload };
             setTimeout(() => {
+              // Tell the agent how long we'll wait so it can kill the job once we stop
+              const budget_ms = Math.max(0, timeoutMs - (Date.now() - startedAt));
+              const request = { operation: "exec", ...payload, budget_ms };
               socket.write(`${JSON.stringify(request)}\n`);
             }, 50);
           } else {
@@ -207,32 +418,92 @@ const execViaVsockOnce = (
     });
 
     socket.on("error", (err) => {
-      finish(new VsockError({ message: `Vsock connection error: ${err.message}` }));
+      const message = connected
+        ? `Vsock connection error: ${err.message}`
+        : `Vsock connection failed: ${err.message}`;
+      finish(new VsockError({ message }));
     });
   });
 
+interface ExecRawData {
+  exit_code: number;
+  stdout_size: number;
+  stderr_size: number;
+  job_id?: string;
+  signal?: number;
+  timed_out?: boolean;
+}
+
+/**
+ * Run a command with raw framing: output arrives as raw byte segments, so
+ * binary data needs no base64 on the wire and isn't capped by the agent's
+ * response size. Output is returned base64-encoded.
+ */
+const execViaRawFramingOnce = async (
+  udsPath: string,
+  payload: ExecPayload,
+  timeoutMs: number
+): Promise<Result<ExecResponse, VsockError | AgentBusyError>> => {
+  const chunks: Record<string, Buffer[]> = { stdout: [], stderr: [] };
+  const response = await sendAgentRawRequest<ExecRawData>(udsPath, { operation: "exec", ...payload }, timeoutMs, {
+    maxBodyBytes: MAX_EXEC_OUTPUT_BYTES,
+    onSegment: (segment, chunk) => chunks[segment]?.push(chunk),
+  });
+  if (response.isErr()) {
+    return Result.err(response.error);
+  }
+
+  const { response: parsed } = response.unwrap();
+  if (!parsed.success) {
+    return Result.err(agentFailure(parsed, "Command failed"));
+  }
+  const data = parsed.data;
+  if (!data || typeof data.exit_code !== "number") {
+    return Result.err(new VsockError({ message: "Invalid response format from vsock" }));
+  }
+
+  const stdout = Buffer.concat(chunks.stdout);
+  const stderr = Buffer.concat(chunks.stderr);
+  if (stdout.length !== data.stdout_size || stderr.length !== data.stderr_size) {
+    return Result.err(new VsockError({ message: "Exec output ended early" }));
+  }
+  return Result.ok({
+    exit_code: data.exit_code,
+    stdout: stdout.toString("base64"),
+    stderr: stderr.toString("base64"),
+    job_id: data.job_id,
+    signal: data.signal,
+    timed_out: data.timed_out,
+  });
+};
+
 /**
  * Execute command via vsock with retry logic
- * Retries help when the guest init hasn't started listening yet
+ * Retries help when the guest init hasn't started listening yet. A command
+ * the agent may already have started is never sent again.
  */
 const execViaVsock = async (
   udsPath: string,
-  payload: { cmd: string[]; timeout: number },
-  timeoutMs: number
-): Promise<Result<ExecResponse, VsockError>> => {
-  let lastError: VsockError | null = null;
+  payload: ExecPayload,
+  timeoutMs: number,
+  encoding: ExecOutputEncoding = "text"
+): Promise<Result<ExecResponse, VsockError | AgentBusyError>> => {
+  let lastError: VsockError | AgentBusyError | null = null;
 
   for (let attempt = 1; attempt <= VSOCK_RETRY_ATTEMPTS; attempt++) {
-    const result = await execViaVsockOnce(udsPath, payload, timeoutMs);
+    const result = payload.framing === "raw"
+      ? await execViaRawFramingOnce(udsPath, payload, timeoutMs)
+      : await execViaVsockOnce(udsPath, payload, timeoutMs, encoding);
 
     if (result.isOk()) {
       return result;
     }
 
     lastError = result.error;
-    // Only retry on connection errors (like empty response when init isn't ready)
-    if (!lastError.message.includes("Empty response") &&
-        !lastError.message.includes("connection")) {
+    // Only retry when init never took the request (like an empty response
+    // when it isn't ready). A busy agent gave its own retry hint, so pass it
+    // through to the caller.
+    if (AgentBusyError.is(lastError) || !failedBeforeAccepted(lastError)) {
       return result; // Don't retry on other errors
     }
 
@@ -344,6 +615,23 @@ export class MachineService {
   async create(body: CreateMachineBody): Promise<Result<MachineResponse, HyperfleetError>> {
     const id = generateMachineId();
 
+    if (body.lazy_rootfs && !body.image) {
+      return Result.err(new ValidationError({ message: "lazy_rootfs requires an image" }));
+    }
+
+    const floorMib = body.memory?.floor_mib;
+    const ceilingMib = body.memory?.ceiling_mib ?? body.mem_size_mib;
+    if (floorMib !== undefined && (floorMib > ceilingMib || ceilingMib > body.mem_size_mib)) {
+      return Result.err(new ValidationError({
+        message: "memory.floor_mib must not exceed memory.ceiling_mib, which must not exceed mem_size_mib",
+      }));
+    }
+
+    const probesResult = toGuestProbes(body.probes ?? []);
+    if (probesResult.isErr()) {
+      return Result.err(probesResult.error);
+    }
+
     // Use paths from environment variables (converted to absolute)
     const inputKernelPath = toAbsolutePath(DEFAULT_KERNEL_IMAGE_PATH);
     // Only use default rootfs if no image is specified
@@ -399,6 +687,10 @@ export class MachineService {
     if (vmNetwork?.kernelArgs) {
       kernelArgs = `${kernelArgs} ${vmNetwork.kernelArgs}`;
     }
+    // Tells init in the initramfs to mount its root from the host
+    if (body.lazy_rootfs) {
+      kernelArgs = `${kernelArgs} hyperfleet.nbd_root=${ROOT_EXPORT}`;
+    }
 
     const exposedPortsResult = normalizeExposedPorts(body.exposed_ports);
     if (exposedPortsResult.isErr()) {
@@ -432,12 +724,21 @@ export class MachineService {
       vcpuCount: body.vcpu_count,
       memSizeMib: body.mem_size_mib,
       exposedPorts: exposedPortsResult.unwrap(),
+      // Proxy to ports the guest reports; opt-in, since the guest's workload chooses them
+      discoverPorts: body.discover_ports || undefined,
       // Drives (for non-OCI case, OCI images use ResolveImageHandler)
       drives,
       // OCI image configuration (will be resolved by ResolveImageHandler)
       imageRef: body.image,
       imageSizeMib: body.image_size_mib,
       registryAuth: body.registry_auth,
+      // Boot from an initramfs and fetch the image's blocks over vsock
+      lazyRootfs: body.lazy_rootfs || undefined,
+      // Let the balloon controller take memory back from the guest while it's idle
+      balloon: floorMib !== undefined ? { amount_mib: 0, deflate_on_oom: true } : undefined,
+      balloonLimits: floorMib !== undefined ? { floorMib, ceilingMib } : undefined,
+      // Run by the guest, which reports only changes over the host channel
+      probes: probesResult.unwrap().length > 0 ? probesResult.unwrap() : undefined,
       // Vsock for guest communication
       vsock,
       // Add network interfaces if configured
@@ -504,6 +805,15 @@ export class MachineService {
       });
     }
 
+    agentCapabilities.invalidate(id);
+    balloonController.release(id);
+    hostChannels.close(id);
+    shareServers.close(id);
+    await blockServers.close(id);
+    for (const suffix of ["", ".map", ".base"]) {
+      await rm(`${overlayPath(id)}${suffix}`, { force: true });
+    }
+
     const result = await this.db
       .deleteFrom("machines")
       .where("id", "=", id)
@@ -520,6 +830,9 @@ export class MachineService {
     status: MachineStatus,
     updates?: { pid?: number | null; error_message?: string | null }
   ): Promise<MachineResponse | null> {
+    // A status change means a new boot (or none); re-ask the guest what it supports
+    agentCapabilities.invalidate(id);
+
     await this.db
       .updateTable("machines")
       .set({
@@ -561,8 +874,24 @@ export class MachineService {
       runtime: machineRecord.runtime_type,
     });
 
+    // Listen before boot so the guest's first messages (like "ready") aren't lost
+    const udsPathResult = this.getVsockPath(machineRecord);
+    if (udsPathResult.isOk()) {
+      const channelResult = await hostChannels.open(id, udsPathResult.unwrap());
+      if (channelResult.isErr()) {
+        this.logger?.warn("Failed to open host channel", { machineId: id, error: channelResult.error.message });
+      }
+      this.configureProbes(machineRecord);
+    }
+
     return Result.tryPromise({
       try: async () => {
+        // The guest fetches its root from us while booting, so serve it first
+        const rootResult = await this.serveLazyRootfs(machineRecord);
+        if (rootResult.isErr()) {
+          throw rootResult.error;
+        }
+
         // Create runtime instance from stored config
         const factory = new RuntimeFactory(this.logger);
         const runtime = factory.createFromMachine(machineRecord);
@@ -579,6 +908,7 @@ export class MachineService {
         // Register in the global runtime manager for later operations
         const runtimeManager = getGlobalRuntimeManager(this.logger);
         runtimeManager.register(id, runtime);
+        this.manageBalloon(machineRecord);
 
         // Update DB with running status and PID
         const updated = await this.updateStatus(id, "running", {
@@ -595,6 +925,7 @@ export class MachineService {
           error: message,
         });
 
+        await blockServers.close(id);
         await this.updateStatus(id, "failed", { error_message: message });
         return new RuntimeError({ message, cause: error });
       },
@@ -642,6 +973,12 @@ export class MachineService {
       });
     }
 
+    // Guest mounts don't survive a reboot, so neither do their exports
+    balloonController.release(id);
+    hostChannels.close(id);
+    shareServers.close(id);
+    await blockServers.close(id);
+
     const updated = await this.updateStatus(id, "stopped", { pid: null });
     return Result.ok(updated!);
   }
@@ -689,10 +1026,934 @@ export class MachineService {
       return Result.err(new ValidationError({ message: "command is required" }));
     }
 
-    const timeoutSeconds = Math.max(1, body.timeout ?? DEFAULT_EXEC_TIMEOUT_SECONDS);
-    const timeoutMs = timeoutSeconds * 1000;
+    const timeoutMs = Math.max(1, body.timeout ?? DEFAULT_EXEC_TIMEOUT_SECONDS) * 1000;
 
     // Use vsock for command execution
+    const udsPathResult = this.getVsockPath(machine);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    // Large output is cheaper to ship compressed when the agent supports it
+    const encoding = body.output_encoding ?? "text";
+    const payload: ExecPayload = { cmd, timeout: timeoutMs, job_id: body.job_id };
+    const capabilities = await agentCapabilities.get(id, udsPathResult.unwrap());
+    if (body.sandbox) {
+      // An older init would ignore the field and run the command unconfined
+      const root = typeof body.sandbox === "object" ? body.sandbox.root ?? "overlay" : "overlay";
+      if (capabilities.isErr() || !capabilities.unwrap().sandbox_roots?.includes(root)) {
+        return Result.err(new ValidationError({
+          message: `Guest agent does not support ${root} sandboxes; rebuild the image to update its init`,
+        }));
+      }
+      payload.sandbox = body.sandbox;
+    }
+    if (body.compression && body.compression !== "none" &&
+        (capabilities.isErr() || !capabilities.unwrap().codecs.includes(body.compression))) {
+      return Result.err(new ValidationError({
+        message: `Guest agent does not support ${body.compression} compression; rebuild the image to update its init`,
+      }));
+    }
+    if (capabilities.isOk()) {
+      const caps = capabilities.unwrap();
+      const codec = wireCodec(body.compression ?? selectTransport(caps).codec);
+      if (codec) {
+        payload.compression = codec;
+      }
+      // Have binary output sent as base64 rather than mangled into text
+      if (caps.output_encodings?.includes("auto")) {
+        payload.output_encoding = "auto";
+        if (encoding === "base64" && caps.framing.includes("raw")) {
+          payload.framing = "raw";
+        }
+      }
+    }
+
+    return execViaVsock(udsPathResult.unwrap(), payload, timeoutMs + AGENT_RESPONSE_GRACE_MS, encoding);
+  }
+
+  /**
+   * Open a persistent shell session on a machine
+   */
+  async openSession(
+    id: string,
+    body: OpenSessionBody
+  ): Promise<Result<SessionResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "session_open");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendAgentRequest<SessionResponse>(
+      udsPathResult.unwrap(),
+      { operation: "session_open", cwd: body.cwd, env: body.env },
+      SESSION_CONTROL_TIMEOUT_MS
+    );
+    return this.unwrapAgentResponse(response, "Failed to open session");
+  }
+
+  /**
+   * Run a command in an open shell session
+   */
+  async sessionExec(
+    id: string,
+    sessionId: number,
+    body: SessionExecBody
+  ): Promise<Result<SessionExecResponse, HyperfleetError>> {
+    if (!body.command) {
+      return Result.err(new ValidationError({ message: "command is required" }));
+    }
+
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const timeoutMs = Math.max(1, body.timeout ?? DEFAULT_EXEC_TIMEOUT_SECONDS) * 1000;
+    const response = await sendAgentRequest<SessionExecResponse>(
+      udsPathResult.unwrap(),
+      { operation: "session_exec", session_id: sessionId, command: body.command, timeout: timeoutMs },
+      timeoutMs + AGENT_RESPONSE_GRACE_MS
+    );
+    return this.unwrapAgentResponse(response, "Session command failed");
+  }
+
+  /**
+   * Close a shell session, terminating its shell
+   */
+  async closeSession(
+    id: string,
+    sessionId: number
+  ): Promise<Result<void, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const response = await sendControlRequest(
+      udsPathResult.unwrap(),
+      { operation: "session_close", session_id: sessionId },
+      SESSION_CONTROL_TIMEOUT_MS
+    );
+    const result = this.unwrapAgentResponse(response, "Failed to close session");
+    if (result.isErr()) {
+      return Result.err(result.error);
+    }
+    return Result.ok(undefined);
+  }
+
+  /**
+   * Send a signal to the process group of a running exec job
+   */
+  async signalJob(
+    id: string,
+    jobId: string,
+    body: JobSignalBody
+  ): Promise<Result<{ signal: number }, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "job_signal");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendControlRequest<{ signal: number }>(
+      udsPathResult.unwrap(),
+      { operation: "job_signal", job_id: jobId, signal: body.signal },
+      JOB_CONTROL_TIMEOUT_MS
+    );
+    return this.unwrapAgentResponse(response, "Failed to signal job");
+  }
+
+  /**
+   * Freeze (freeze = true) or thaw a running exec job without stopping the VM
+   */
+  async setJobFrozen(
+    id: string,
+    jobId: string,
+    freeze: boolean
+  ): Promise<Result<JobFreezeResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), freeze ? "job_freeze" : "job_thaw");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendControlRequest<JobFreezeResponse>(
+      udsPathResult.unwrap(),
+      { operation: freeze ? "job_freeze" : "job_thaw", job_id: jobId },
+      JOB_CONTROL_TIMEOUT_MS
+    );
+    return this.unwrapAgentResponse(response, freeze ? "Failed to freeze job" : "Failed to thaw job");
+  }
+
+  /**
+   * Measure how much of a running machine's memory is in use over a window,
+   * to size it from data
+   */
+  async getWorkingSet(
+    id: string,
+    windowMs = DEFAULT_WORKING_SET_WINDOW_MS,
+    method?: WorkingSetMethod
+  ): Promise<Result<WorkingSetResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "working_set");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendAgentRequest<WorkingSetResponse>(
+      udsPathResult.unwrap(),
+      { operation: "working_set", window_ms: windowMs, method },
+      windowMs + AGENT_RESPONSE_GRACE_MS
+    );
+    return this.unwrapAgentResponse(response, "Failed to estimate working set");
+  }
+
+  /**
+   * Trace IO and scheduler latency in a running guest for a while, for
+   * "why is this VM slow". The guest enables tracepoints through tracefs and
+   * replies with latency histograms per device and process.
+   */
+  async getLatencyTrace(
+    id: string,
+    durationMs = DEFAULT_LATENCY_TRACE_MS,
+    events?: LatencyTraceEvents[],
+    top?: number
+  ): Promise<Result<LatencyTraceResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "latency_trace");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendAgentRequest<LatencyTraceResponse>(
+      udsPathResult.unwrap(),
+      { operation: "latency_trace", duration_ms: durationMs, events, top },
+      durationMs + AGENT_RESPONSE_GRACE_MS
+    );
+    if (response.isOk() && response.unwrap().error === "tracing is not available in this kernel") {
+      return Result.err(new ValidationError({ message: "The guest kernel has no tracefs" }));
+    }
+    return this.unwrapAgentResponse(response, "Failed to trace latency");
+  }
+
+  /**
+   * Second-by-second metrics a running guest kept over a time range, to look
+   * into something that already happened. The history lives in the guest's
+   * memory; the host stores nothing.
+   */
+  async getMetricsHistory(
+    id: string,
+    query: MetricsHistoryQuery
+  ): Promise<Result<MetricsHistoryResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "metrics_history");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    // Over the control port: the guest may well be struggling when this is asked for
+    const response = await sendControlRequest<MetricsHistoryResponse>(
+      udsPathResult.unwrap(),
+      { operation: "metrics_history", ...query },
+      METRICS_HISTORY_TIMEOUT_MS
+    );
+    if (response.isOk() && response.unwrap().error === "metrics history is disabled") {
+      return Result.err(new ValidationError({ message: "Metrics history is disabled in this guest" }));
+    }
+    return this.unwrapAgentResponse(response, "Failed to read metrics history");
+  }
+
+  /**
+   * Kernel and init log records of a running guest, read from its memory
+   * over vsock, so guests can boot with a quiet serial console. Pass the
+   * returned cursors back to continue where the last call stopped.
+   */
+  async getLogs(id: string, query: MachineLogsQuery): Promise<Result<MachineLogsResponse, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "log_read");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const { level, ...rest } = query;
+    const request = { operation: "log_read", ...rest, level: level && /^\d+$/.test(level) ? Number(level) : level };
+    const response = await sendControlRequest<MachineLogsResponse>(
+      udsPathResult.unwrap(),
+      request,
+      LOG_READ_TIMEOUT_MS + (query.wait_ms ?? 0)
+    );
+    return this.unwrapAgentResponse(response, "Failed to read guest logs");
+  }
+
+  /**
+   * Run several agent operations in a single vsock round trip
+   */
+  async batch(
+    id: string,
+    body: BatchBody
+  ): Promise<Result<BatchResponse, HyperfleetError>> {
+    if (body.items.length === 0) {
+      return Result.err(new ValidationError({ message: "items must not be empty" }));
+    }
+    if (body.items.length > MAX_BATCH_ITEMS) {
+      return Result.err(new ValidationError({ message: `At most ${MAX_BATCH_ITEMS} items per batch` }));
+    }
+
+    const items: AgentRequest[] = [];
+    const itemTimeouts: number[] = [];
+    for (const [index, item] of body.items.entries()) {
+      if (item.operation === "exec") {
+        if (!item.command || item.command.length === 0) {
+          return Result.err(new ValidationError({ message: `items[${index}]: command is required` }));
+        }
+        const timeoutMs = Math.max(1, item.timeout ?? DEFAULT_EXEC_TIMEOUT_SECONDS) * 1000;
+        items.push({ operation: "exec", cmd: item.command, timeout: timeoutMs, job_id: item.job_id });
+        itemTimeouts.push(timeoutMs);
+        continue;
+      }
+
+      if (item.operation !== "ping" && !item.path?.startsWith("/")) {
+        return Result.err(new ValidationError({ message: `items[${index}]: path must be absolute` }));
+      }
+      if (item.operation === "file_write" && item.content === undefined) {
+        return Result.err(new ValidationError({ message: `items[${index}]: content is required` }));
+      }
+      items.push({ operation: item.operation, path: item.path, content: item.content });
+      itemTimeouts.push(BATCH_ITEM_TIMEOUT_MS);
+    }
+
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const supported = await this.requireAgentOperation(id, udsPathResult.unwrap(), "batch");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    // Parallel items overlap; sequential ones add up
+    const timeoutMs = body.parallel
+      ? Math.max(...itemTimeouts)
+      : itemTimeouts.reduce((sum, ms) => sum + ms, 0);
+
+    const response = await sendAgentRequest<BatchResponse>(
+      udsPathResult.unwrap(),
+      {
+        operation: "batch",
+        items,
+        stop_on_error: body.stop_on_error ?? false,
+        parallel: body.parallel ?? false,
+      },
+      timeoutMs + AGENT_RESPONSE_GRACE_MS
+    );
+    return this.unwrapAgentResponse(response, "Batch failed");
+  }
+
+  /**
+   * Messages workloads in a running machine wrote to /run/hyperfleet.sock
+   * after `since`. With `waitSeconds`, waits for the next one instead of
+   * returning an empty list.
+   */
+  async getGuestMessages(
+    id: string,
+    since = 0,
+    waitSeconds = 0
+  ): Promise<Result<GuestMessagesResponse, HyperfleetError>> {
+    const machine = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("id", "=", id)
+      .executeTakeFirst();
+    if (!machine) {
+      return Result.err(new NotFoundError({ message: "Machine not found" }));
+    }
+    if (machine.status !== "running") {
+      return Result.err(new ValidationError({ message: "Machine is not running" }));
+    }
+
+    // Machines booted by a previous API process have no listener yet
+    const opened = await this.openHostChannel(machine);
+    if (opened.isErr()) {
+      return Result.err(opened.error);
+    }
+
+    const timeoutMs = Math.min(Math.max(0, waitSeconds), MAX_WAIT_TIMEOUT_SECONDS) * 1000;
+    const messages = await hostChannels.waitForMessages(id, since, timeoutMs);
+    return Result.ok({ messages, next_since: messages.at(-1)?.seq ?? since });
+  }
+
+  /**
+   * Last reported state of a running machine's health probes. Nothing is
+   * polled: the guest runs the probes and reports only transitions.
+   */
+  async getProbes(id: string): Promise<Result<ProbeStatus[], HyperfleetError>> {
+    const machine = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("id", "=", id)
+      .executeTakeFirst();
+    if (!machine) {
+      return Result.err(new NotFoundError({ message: "Machine not found" }));
+    }
+    if (machine.status !== "running") {
+      return Result.err(new ValidationError({ message: "Machine is not running" }));
+    }
+
+    const opened = await this.openHostChannel(machine);
+    if (opened.isErr()) {
+      return Result.err(opened.error);
+    }
+    return Result.ok(hostChannels.probeStatuses(id));
+  }
+
+  /**
+   * Sockets listening in a running machine. The guest reports the set
+   * whenever it changes, so this never contacts it.
+   */
+  async getListeningPorts(id: string): Promise<Result<ListeningPort[], HyperfleetError>> {
+    const machine = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("id", "=", id)
+      .executeTakeFirst();
+    if (!machine) {
+      return Result.err(new NotFoundError({ message: "Machine not found" }));
+    }
+    if (machine.status !== "running") {
+      return Result.err(new ValidationError({ message: "Machine is not running" }));
+    }
+
+    const opened = await this.openHostChannel(machine);
+    if (opened.isErr()) {
+      return Result.err(opened.error);
+    }
+    return Result.ok(hostChannels.listeningPorts(id));
+  }
+
+  /**
+   * Replace a machine's health probes. A running guest switches to the new
+   * set at once; probes whose definition didn't change keep their state.
+   */
+  async setProbes(id: string, body: SetProbesBody): Promise<Result<ProbeStatus[], HyperfleetError>> {
+    const probesResult = toGuestProbes(body.probes);
+    if (probesResult.isErr()) {
+      return Result.err(probesResult.error);
+    }
+
+    const machine = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("id", "=", id)
+      .executeTakeFirst();
+    if (!machine) {
+      return Result.err(new NotFoundError({ message: "Machine not found" }));
+    }
+
+    const config = Result.try(() => JSON.parse(machine.config_json) as MachineConfig).unwrapOr({} as MachineConfig);
+    config.probes = probesResult.unwrap().length > 0 ? probesResult.unwrap() : undefined;
+    const configJson = JSON.stringify(config);
+    await this.db
+      .updateTable("machines")
+      .set({ config_json: configJson, updated_at: new Date().toISOString() })
+      .where("id", "=", id)
+      .execute();
+
+    if (machine.status !== "running") {
+      return Result.ok(probesResult.unwrap().map((probe) => ({
+        name: probe.name,
+        status: "unknown" as const,
+        detail: null,
+        changed_at: null,
+      })));
+    }
+    // Reaches an open channel at once; getProbes opens one with the new set if there's none yet
+    this.configureProbes({ ...machine, config_json: configJson });
+    return this.getProbes(id);
+  }
+
+  /**
+   * Send a message to workloads in a running machine over the host channel
+   */
+  async sendGuestMessage(id: string, body: SendGuestMessageBody): Promise<Result<{ sent: boolean }, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const sent = hostChannels.send(id, body.message, body.client);
+    if (sent.isErr()) {
+      return Result.err(sent.error);
+    }
+    return Result.ok({ sent: true });
+  }
+
+  /**
+   * Mount a host directory in a running machine. The guest serves it through
+   * FUSE and fetches files from the host over vsock on first access.
+   */
+  async mountShare(id: string, body: MountShareBody): Promise<Result<ShareResponse, HyperfleetError>> {
+    if (!SHARE_ROOT) {
+      return Result.err(new ValidationError({ message: "Shares are disabled; set HYPERFLEET_SHARE_ROOT to enable them" }));
+    }
+    if (!body.host_path.startsWith("/") || !body.guest_path.startsWith("/")) {
+      return Result.err(new ValidationError({ message: "host_path and guest_path must be absolute" }));
+    }
+    const hostStat = await Result.tryPromise(() => stat(body.host_path));
+    if (hostStat.isErr() || !hostStat.unwrap().isDirectory()) {
+      return Result.err(new ValidationError({ message: "host_path must be an existing directory" }));
+    }
+    // Compared after resolving symlinks, so a link inside the root can't point out of it
+    const paths = await Result.tryPromise(() => Promise.all([realpath(SHARE_ROOT), realpath(body.host_path)]));
+    if (paths.isErr()) {
+      return Result.err(new ValidationError({ message: "host_path must be an existing directory" }));
+    }
+    const [shareRoot, hostPath] = paths.unwrap();
+    if (hostPath !== shareRoot && !hostPath.startsWith(shareRoot === "/" ? "/" : `${shareRoot}/`)) {
+      return Result.err(new ValidationError({ message: `host_path must be inside ${SHARE_ROOT}` }));
+    }
+
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+    const udsPath = udsPathResult.unwrap();
+
+    const supported = await this.requireAgentOperation(id, udsPath, "share_mount");
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const opened = await shareServers.open(id, udsPath);
+    if (opened.isErr()) {
+      return Result.err(opened.error);
+    }
+
+    const name = generateShareName();
+    const cacheSeconds = Math.max(0, body.cache_seconds ?? DEFAULT_SHARE_CACHE_SECONDS);
+    const exported = await shareServers.export(id, name, {
+      root: hostPath,
+      target: body.guest_path,
+      writable: body.writable ?? false,
+      cacheSeconds,
+    });
+    if (exported.isErr()) {
+      return Result.err(exported.error);
+    }
+
+    const response = await sendControlRequest(
+      udsPath,
+      {
+        operation: "share_mount",
+        share: name,
+        target: body.guest_path,
+        writable: body.writable ?? false,
+        cache_ms: Math.round(cacheSeconds * 1000),
+      },
+      SHARE_CONTROL_TIMEOUT_MS
+    );
+    const mounted = this.unwrapAgentResponse(response, "Failed to mount share");
+    if (mounted.isErr()) {
+      shareServers.unexport(id, name);
+      return Result.err(mounted.error);
+    }
+    return Result.ok(this.toShareResponse(name, exported.unwrap()));
+  }
+
+  /**
+   * Host directories mounted in a running machine
+   */
+  async listShares(id: string): Promise<Result<ShareResponse[], HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+    return Result.ok(
+      Array.from(shareServers.exports(id), ([name, share]) => this.toShareResponse(name, share))
+    );
+  }
+
+  /**
+   * Unmount a share from a running machine and stop serving it
+   */
+  async unmountShare(id: string, name: string): Promise<Result<void, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const share = shareServers.exports(id).get(name);
+    if (!share) {
+      return Result.err(new NotFoundError({ message: "Share not found" }));
+    }
+
+    const response = await sendControlRequest(
+      udsPathResult.unwrap(),
+      { operation: "share_unmount", target: share.target },
+      SHARE_CONTROL_TIMEOUT_MS
+    );
+    const result = this.unwrapAgentResponse(response, "Failed to unmount share");
+    if (result.isErr()) {
+      return Result.err(result.error);
+    }
+    shareServers.unexport(id, name);
+    return Result.ok(undefined);
+  }
+
+  private toShareResponse(name: string, share: ShareExport): ShareResponse {
+    return {
+      name,
+      host_path: share.root,
+      guest_path: share.target,
+      writable: share.writable,
+      cache_seconds: share.cacheSeconds,
+    };
+  }
+
+  /**
+   * Mount an overlay workspace in a running machine. Resetting it later
+   * drops everything written since in constant time.
+   */
+  async createWorkspace(id: string, body: CreateWorkspaceBody): Promise<Result<WorkspaceResponse, HyperfleetError>> {
+    if (!body.path.startsWith("/")) {
+      return Result.err(new ValidationError({ message: "path must be absolute" }));
+    }
+    return this.toWorkspaceResponse(await this.workspaceRequest<GuestWorkspace>(
+      id,
+      { operation: "workspace_create", workspace: body.name, target: body.path, base: body.base },
+      "Failed to create workspace"
+    ));
+  }
+
+  /**
+   * Workspaces and committed layers in a running machine
+   */
+  async listWorkspaces(id: string): Promise<Result<WorkspaceListResponse, HyperfleetError>> {
+    const result = await this.workspaceRequest<{
+      workspaces: GuestWorkspace[];
+      layers: { layer: string; base: string | null }[];
+    }>(id, { operation: "workspace_list" }, "Failed to list workspaces");
+    if (result.isErr()) {
+      return Result.err(result.error);
+    }
+    const { workspaces, layers } = result.unwrap();
+    return Result.ok({
+      workspaces: workspaces.map(({ workspace, target, base }) => ({ name: workspace, path: target, base })),
+      layers: layers.map(({ layer, base }) => ({ name: layer, base })),
+    });
+  }
+
+  /**
+   * Throw away everything written to a workspace since it was created or
+   * last committed
+   */
+  async resetWorkspace(id: string, name: string): Promise<Result<WorkspaceResponse, HyperfleetError>> {
+    return this.toWorkspaceResponse(await this.workspaceRequest<GuestWorkspace>(
+      id,
+      { operation: "workspace_reset", workspace: name },
+      "Failed to reset workspace"
+    ));
+  }
+
+  /**
+   * Turn a workspace's changes into a new layer that it, and new
+   * workspaces, can start from
+   */
+  async commitWorkspace(
+    id: string,
+    name: string,
+    body: CommitWorkspaceBody
+  ): Promise<Result<WorkspaceResponse, HyperfleetError>> {
+    return this.toWorkspaceResponse(await this.workspaceRequest<GuestWorkspace>(
+      id,
+      { operation: "workspace_commit", workspace: name, layer: body.layer },
+      "Failed to commit workspace"
+    ));
+  }
+
+  /**
+   * Unmount a workspace and delete its changes
+   */
+  async deleteWorkspace(id: string, name: string): Promise<Result<void, HyperfleetError>> {
+    const result = await this.workspaceRequest(
+      id,
+      { operation: "workspace_delete", workspace: name },
+      "Failed to delete workspace"
+    );
+    return result.isErr() ? Result.err(result.error) : Result.ok(undefined);
+  }
+
+  /**
+   * Delete a layer no workspace or other layer is built on
+   */
+  async deleteWorkspaceLayer(id: string, layer: string): Promise<Result<void, HyperfleetError>> {
+    const result = await this.workspaceRequest(
+      id,
+      { operation: "workspace_delete", layer },
+      "Failed to delete layer"
+    );
+    return result.isErr() ? Result.err(result.error) : Result.ok(undefined);
+  }
+
+  private async workspaceRequest<T>(
+    id: string,
+    request: Record<string, unknown>,
+    fallbackMessage: string
+  ): Promise<Result<T, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+    const udsPath = udsPathResult.unwrap();
+
+    const supported = await this.requireAgentOperation(id, udsPath, request.operation as string);
+    if (supported.isErr()) {
+      return Result.err(supported.error);
+    }
+
+    const response = await sendControlRequest<T>(udsPath, request, WORKSPACE_CONTROL_TIMEOUT_MS);
+    if (response.isOk() && !response.unwrap().success) {
+      const error = response.unwrap().error ?? "";
+      if (error === "unknown workspace") {
+        return Result.err(new NotFoundError({ message: "Workspace not found" }));
+      }
+      if (error === "unknown layer") {
+        return Result.err(new NotFoundError({ message: "Layer not found" }));
+      }
+      if (WORKSPACE_CLIENT_ERRORS.includes(error) || error.startsWith("workspace in use")) {
+        return Result.err(new ValidationError({ message: error }));
+      }
+    }
+    return this.unwrapAgentResponse(response, fallbackMessage);
+  }
+
+  private toWorkspaceResponse(
+    result: Result<GuestWorkspace, HyperfleetError>
+  ): Result<WorkspaceResponse, HyperfleetError> {
+    if (result.isErr()) {
+      return Result.err(result.error);
+    }
+    const { workspace, target, base } = result.unwrap();
+    return Result.ok({ name: workspace, path: target, base });
+  }
+
+  /**
+   * Get what the guest agent of a running machine supports
+   */
+  async getAgentCapabilities(id: string): Promise<Result<AgentCapabilities, HyperfleetError>> {
+    const udsPathResult = await this.getRunningVsockPath(id);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+    return agentCapabilities.get(id, udsPathResult.unwrap());
+  }
+
+  /**
+   * Fail early if the guest's init binary predates an operation. If the
+   * capabilities can't be fetched, let the request itself report the error.
+   */
+  private async requireAgentOperation(
+    id: string,
+    udsPath: string,
+    operation: string
+  ): Promise<Result<void, HyperfleetError>> {
+    const capabilities = await agentCapabilities.get(id, udsPath);
+    if (capabilities.isOk() && !supportsOperation(capabilities.unwrap(), operation)) {
+      return Result.err(new ValidationError({
+        message: `Guest agent ${capabilities.unwrap().version} does not support ${operation}; rebuild the image to update its init`,
+      }));
+    }
+    return Result.ok(undefined);
+  }
+
+  private unwrapAgentResponse<T>(
+    response: Result<AgentResponse<T>, VsockError>,
+    fallbackMessage: string
+  ): Result<T, HyperfleetError> {
+    if (response.isErr()) {
+      return Result.err(response.error);
+    }
+
+    const agentResp = response.unwrap();
+    if (!agentResp.success) {
+      if (agentResp.error === "unknown session") {
+        return Result.err(new NotFoundError({ message: "Session not found" }));
+      }
+      if (agentResp.error === "unknown job") {
+        return Result.err(new NotFoundError({ message: "Job not found" }));
+      }
+      return Result.err(agentFailure(agentResp, fallbackMessage));
+    }
+
+    return Result.ok(agentResp.data as T);
+  }
+
+  /**
+   * Get the vsock UDS path of a running machine
+   */
+  private async getRunningVsockPath(id: string): Promise<Result<string, HyperfleetError>> {
+    const machine = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("id", "=", id)
+      .executeTakeFirst();
+
+    if (!machine) {
+      return Result.err(new NotFoundError({ message: "Machine not found" }));
+    }
+
+    if (machine.status !== "running") {
+      return Result.err(new ValidationError({ message: "Machine must be running to execute commands" }));
+    }
+
+    return this.getVsockPath(machine);
+  }
+
+  /**
+   * Take back the host side of machines a previous API process booted and
+   * left running. Their guests keep fetching root blocks, which only this
+   * process can serve; the overlay and its map carry over from before. Their
+   * balloons go back under control at the size they were left at.
+   */
+  async resumeRunning(): Promise<void> {
+    const machines = await this.db
+      .selectFrom("machines")
+      .selectAll()
+      .where("status", "=", "running")
+      .execute();
+
+    for (const machine of machines) {
+      const rootResult = await this.serveLazyRootfs(machine);
+      if (rootResult.isErr()) {
+        this.logger?.warn("Failed to serve lazy root", { machineId: machine.id, error: rootResult.error.message });
+      }
+      await this.resumeBalloon(machine);
+    }
+  }
+
+  /**
+   * Serve a lazily booted machine's root: the cached image, with the
+   * machine's own writes layered on top. A no-op for other machines.
+   */
+  private async serveLazyRootfs(machine: Machine): Promise<Result<void, HyperfleetError>> {
+    const config = Result.try(() => JSON.parse(machine.config_json) as MachineConfig).unwrapOr(null);
+    if (!config?.lazyRootfs || !config.imageRef) {
+      return Result.ok(undefined);
+    }
+
+    const udsPathResult = this.getVsockPath(machine);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+
+    const imageResult = await getImageService(this.logger).resolveImage(config.imageRef, {
+      sizeMib: config.imageSizeMib,
+      auth: config.registryAuth,
+    });
+    if (imageResult.isErr()) {
+      return Result.err(
+        new RuntimeError({ message: `Failed to resolve image ${config.imageRef}: ${imageResult.error.message}` })
+      );
+    }
+    const image = imageResult.unwrap();
+
+    await mkdir(DEFAULT_OVERLAY_DIR, { recursive: true });
+    return blockServers.open(machine.id, udsPathResult.unwrap(), {
+      image: image.rootfsPath,
+      imageDigest: image.digest,
+      overlay: overlayPath(machine.id),
+    });
+  }
+
+  /**
+   * Listen for a running machine's guest if this process isn't yet. Machines
+   * booted by a previous API process have no listener; the guest reports its
+   * probe states and ports again once it reconnects.
+   */
+  private async openHostChannel(machine: Machine): Promise<Result<void, HyperfleetError>> {
+    if (hostChannels.isOpen(machine.id)) {
+      return Result.ok(undefined);
+    }
+    const udsPathResult = this.getVsockPath(machine);
+    if (udsPathResult.isErr()) {
+      return Result.err(udsPathResult.error);
+    }
+    const opened = await hostChannels.open(machine.id, udsPathResult.unwrap());
+    if (opened.isErr()) {
+      return Result.err(opened.error);
+    }
+    this.configureProbes(machine);
+    return Result.ok(undefined);
+  }
+
+  /**
+   * Give the guest its probes over the host channel, if it has any
+   */
+  private configureProbes(machine: Machine): void {
+    const config = Result.try(() => JSON.parse(machine.config_json) as MachineConfig).unwrapOr(null);
+    hostChannels.configureProbes(machine.id, config?.probes ?? []);
+  }
+
+  /**
+   * Hand a started machine with memory limits to the balloon controller
+   */
+  private manageBalloon(machine: Machine): void {
+    const config = Result.try(() => JSON.parse(machine.config_json) as MachineConfig).unwrapOr(null);
+    const udsPath = config?.vsock?.uds_path;
+    if (config?.balloonLimits && udsPath) {
+      balloonController.manage(machine.id, udsPath, { memSizeMib: machine.mem_size_mib, ...config.balloonLimits });
+    }
+  }
+
+  /**
+   * Hand a machine an earlier API process started back to the balloon
+   * controller. Its runtime isn't registered here, so the controller gets
+   * one for the Firecracker API socket the machine still listens on.
+   */
+  private async resumeBalloon(machine: Machine): Promise<void> {
+    const config = Result.try(() => JSON.parse(machine.config_json) as MachineConfig).unwrapOr(null);
+    const udsPath = config?.vsock?.uds_path;
+    if (!config?.balloonLimits || !udsPath) {
+      return;
+    }
+    const runtime = Result.try(() => new RuntimeFactory(this.logger).createFromMachine(machine)).unwrapOr(null);
+    if (runtime instanceof FirecrackerMachine) {
+      const limits = { memSizeMib: machine.mem_size_mib, ...config.balloonLimits };
+      await balloonController.resume(machine.id, udsPath, limits, runtime);
+    }
+  }
+
+  private getVsockPath(machine: Machine): Result<string, HyperfleetError> {
     const configResult = Result.try(() => JSON.parse(machine.config_json) as MachineConfig);
     const config = configResult.unwrapOr(null);
     const udsPath = config?.vsock?.uds_path;
@@ -701,7 +1962,7 @@ export class MachineService {
       return Result.err(new VsockError({ message: "Vsock not configured for this machine" }));
     }
 
-    return execViaVsock(udsPath, { cmd, timeout: timeoutSeconds }, timeoutMs);
+    return Result.ok(udsPath);
   }
 
   /**
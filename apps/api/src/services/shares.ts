@@ -0,0 +1,354 @@
+import net from "node:net";
+import { constants as osConstants } from "node:os";
+import { constants as fsConstants, unlinkSync, type BigIntStats, type Dirent } from "node:fs";
+import { lstat, mkdir, open, readdir, readlink, realpath, rmdir, truncate, unlink } from "node:fs/promises";
+import { dirname, posix, relative, resolve } from "node:path";
+import { Result } from "better-result";
+import { VsockError } from "@hyperfleet/errors";
+
+// Vsock port the guest's FUSE client connects out to; Firecracker forwards it to `<uds_path>_1053`
+export const SHARE_PORT = 1053;
+
+// Largest read or write the guest asks for (its max_read / max_write)
+const MAX_IO_BYTES = 1024 * 1024;
+// Longest request line accepted before the connection is dropped
+const MAX_LINE_BYTES = 64 * 1024;
+
+// d_type values for directory entries
+const DT_DIR = 4;
+const DT_REG = 8;
+const DT_LNK = 10;
+const DT_UNKNOWN = 0;
+
+export interface ShareExport {
+  /** Exported host directory, symlinks resolved */
+  root: string;
+  /** Where the guest mounted it */
+  target: string;
+  writable: boolean;
+  cacheSeconds: number;
+}
+
+interface MachineShares {
+  path: string;
+  server: net.Server;
+  sockets: Set<net.Socket>;
+  exports: Map<string, ShareExport>;
+}
+
+type Reply = { fields: Record<string, unknown>; body?: Buffer };
+
+class ShareErrno extends Error {
+  constructor(readonly errno: number) {
+    super(`errno ${errno}`);
+  }
+}
+
+function errnoOf(err: unknown): number {
+  if (err instanceof ShareErrno) return err.errno;
+  const code = (err as NodeJS.ErrnoException | null)?.code;
+  const errno = code ? (osConstants.errno as Record<string, number>)[code] : undefined;
+  return errno ?? osConstants.errno.EIO;
+}
+
+function errnoName(err: unknown): string {
+  return (err as NodeJS.ErrnoException | null)?.code ?? String(err);
+}
+
+function direntType(entry: Dirent): number {
+  if (entry.isDirectory()) return DT_DIR;
+  if (entry.isFile()) return DT_REG;
+  if (entry.isSymbolicLink()) return DT_LNK;
+  return DT_UNKNOWN;
+}
+
+function attrOf(stats: BigIntStats): Record<string, number> {
+  const seconds = (ns: bigint) => Number(ns / 1_000_000_000n);
+  const nanos = (ns: bigint) => Number(ns % 1_000_000_000n);
+  return {
+    ino: Number(stats.ino),
+    mode: Number(stats.mode),
+    nlink: Number(stats.nlink),
+    uid: Number(stats.uid),
+    gid: Number(stats.gid),
+    size: Number(stats.size),
+    blocks: Number(stats.blocks),
+    rdev: Number(stats.rdev),
+    atime: seconds(stats.atimeNs),
+    atimensec: nanos(stats.atimeNs),
+    mtime: seconds(stats.mtimeNs),
+    mtimensec: nanos(stats.mtimeNs),
+    ctime: seconds(stats.ctimeNs),
+    ctimensec: nanos(stats.ctimeNs),
+  };
+}
+
+/**
+ * Host end of the guest's shared directories. Init mounts a FUSE filesystem
+ * per share and forwards each operation as a JSON line naming the share and
+ * a path under it; this answers from the exported host directory.
+ *
+ * Requests never leave an export: ".." is rejected, the final component is
+ * never followed when it is a symlink, and the resolved parent must stay
+ * under the export's root. The guest resolves symlinks itself via readlink.
+ */
+export class ShareServer {
+  private machines = new Map<string, MachineShares>();
+
+  /**
+   * Listen for a machine's guest. Safe to call again; an existing listener is kept.
+   */
+  open(machineId: string, udsPath: string): Promise<Result<void, VsockError>> {
+    if (this.machines.has(machineId)) {
+      return Promise.resolve(Result.ok(undefined));
+    }
+
+    const path = `${udsPath}_${SHARE_PORT}`;
+    const machine: MachineShares = {
+      path,
+      server: net.createServer((socket) => this.accept(machine, socket)),
+      sockets: new Set(),
+      exports: new Map(),
+    };
+    this.machines.set(machineId, machine);
+
+    // A previous API process may have left its socket behind
+    try {
+      unlinkSync(path);
+    } catch {
+      // Nothing to clean up
+    }
+
+    return new Promise((resolve) => {
+      machine.server.once("error", (err) => {
+        this.machines.delete(machineId);
+        resolve(Result.err(new VsockError({ message: `Share listen failed: ${err.message}` })));
+      });
+      machine.server.listen(path, () => resolve(Result.ok(undefined)));
+    });
+  }
+
+  /**
+   * Stop serving a machine and forget its exports
+   */
+  close(machineId: string): void {
+    const machine = this.machines.get(machineId);
+    if (!machine) return;
+    this.machines.delete(machineId);
+
+    for (const socket of machine.sockets) socket.destroy();
+    machine.server.close();
+    try {
+      unlinkSync(machine.path);
+    } catch {
+      // Already gone
+    }
+  }
+
+  /**
+   * Make a host directory available to the guest as `name`. The listener must be open.
+   */
+  async export(
+    machineId: string,
+    name: string,
+    share: ShareExport
+  ): Promise<Result<ShareExport, VsockError>> {
+    const machine = this.machines.get(machineId);
+    if (!machine) {
+      return Result.err(new VsockError({ message: "Share listener is not open" }));
+    }
+    const resolved = await Result.tryPromise(() => realpath(share.root));
+    if (resolved.isErr()) {
+      return Result.err(new VsockError({ message: `Cannot export ${share.root}: ${errnoName(resolved.error)}` }));
+    }
+
+    const exported = { ...share, root: resolved.unwrap() };
+    machine.exports.set(name, exported);
+    return Result.ok(exported);
+  }
+
+  unexport(machineId: string, name: string): void {
+    this.machines.get(machineId)?.exports.delete(name);
+  }
+
+  exports(machineId: string): Map<string, ShareExport> {
+    return this.machines.get(machineId)?.exports ?? new Map();
+  }
+
+  private accept(machine: MachineShares, socket: net.Socket): void {
+    machine.sockets.add(socket);
+    const session = new ShareSession(machine, socket);
+    socket.on("data", (chunk: Buffer) => session.receive(chunk));
+    socket.on("close", () => machine.sockets.delete(socket));
+    socket.on("error", () => socket.destroy());
+  }
+}
+
+/**
+ * One guest worker connection. The worker waits for each reply before
+ * sending its next request, so requests are answered strictly in order.
+ */
+class ShareSession {
+  private buffer = Buffer.alloc(0);
+  private busy = false;
+
+  constructor(private machine: MachineShares, private socket: net.Socket) {}
+
+  receive(chunk: Buffer): void {
+    this.buffer = this.buffer.length ? Buffer.concat([this.buffer, chunk]) : chunk;
+    void this.pump();
+  }
+
+  private async pump(): Promise<void> {
+    if (this.busy) return;
+    this.busy = true;
+
+    while (!this.socket.destroyed) {
+      const newlineIndex = this.buffer.indexOf(0x0a);
+      if (newlineIndex === -1) {
+        if (this.buffer.length > MAX_LINE_BYTES) this.socket.destroy();
+        break;
+      }
+
+      const parsed = Result.try(
+        () => JSON.parse(this.buffer.subarray(0, newlineIndex).toString()) as Record<string, unknown>
+      ).unwrapOr(null);
+      if (!parsed || typeof parsed !== "object") {
+        this.socket.destroy();
+        break;
+      }
+
+      // Writes carry their data after the line
+      const bodySize = parsed.op === "write" ? Number(parsed.size) : 0;
+      if (!Number.isInteger(bodySize) || bodySize < 0 || bodySize > MAX_IO_BYTES) {
+        this.socket.destroy();
+        break;
+      }
+      if (this.buffer.length < newlineIndex + 1 + bodySize) break;
+      const body = this.buffer.subarray(newlineIndex + 1, newlineIndex + 1 + bodySize);
+      this.buffer = this.buffer.subarray(newlineIndex + 1 + bodySize);
+
+      const reply = await this.handle(parsed, body).catch(
+        (err): Reply => ({ fields: { ok: false, errno: errnoOf(err) } })
+      );
+      this.socket.write(`${JSON.stringify(reply.fields)}\n`);
+      if (reply.body) this.socket.write(reply.body);
+    }
+
+    this.busy = false;
+  }
+
+  private async handle(request: Record<string, unknown>, body: Buffer): Promise<Reply> {
+    const share = this.machine.exports.get(String(request.share));
+    if (!share) throw new ShareErrno(osConstants.errno.ENOENT);
+
+    const op = String(request.op);
+    const mutating = !["lookup", "getattr", "readdir", "read", "readlink"].includes(op);
+    if (mutating && !share.writable) throw new ShareErrno(osConstants.errno.EROFS);
+
+    const path = await this.resolvePath(share, request.path);
+    const ok = (fields: Record<string, unknown> = {}): Reply => ({ fields: { ok: true, ...fields } });
+    const attr = async () => attrOf(await lstat(path, { bigint: true }));
+
+    switch (op) {
+      case "lookup":
+      case "getattr":
+        return ok(await attr());
+
+      case "readdir": {
+        const entries = await readdir(path, { withFileTypes: true });
+        const [self, parent] = await Promise.all([
+          lstat(path, { bigint: true }),
+          lstat(dirname(path), { bigint: true }),
+        ]);
+        const listed = await Promise.all(
+          entries.map(async (entry) => {
+            const stats = await lstat(`${path}/${entry.name}`, { bigint: true }).catch(() => null);
+            return { name: entry.name, ino: stats ? Number(stats.ino) : 0, type: direntType(entry) };
+          })
+        );
+        return ok({
+          entries: [
+            { name: ".", ino: Number(self.ino), type: DT_DIR },
+            { name: "..", ino: Number(parent.ino), type: DT_DIR },
+            ...listed,
+          ],
+        });
+      }
+
+      case "read": {
+        const size = Math.min(Math.max(0, Number(request.size) || 0), MAX_IO_BYTES);
+        const handle = await open(path, fsConstants.O_RDONLY | fsConstants.O_NOFOLLOW);
+        const data = Buffer.allocUnsafe(size);
+        const { bytesRead } = await handle
+          .read(data, 0, size, Number(request.offset) || 0)
+          .finally(() => handle.close());
+        return { fields: { ok: true, size: bytesRead }, body: data.subarray(0, bytesRead) };
+      }
+
+      case "write": {
+        const handle = await open(path, fsConstants.O_WRONLY | fsConstants.O_NOFOLLOW);
+        const { bytesWritten } = await handle
+          .write(body, 0, body.length, Number(request.offset) || 0)
+          .finally(() => handle.close());
+        return ok({ size: bytesWritten });
+      }
+
+      case "create": {
+        const flags = fsConstants.O_CREAT | fsConstants.O_WRONLY | fsConstants.O_NOFOLLOW;
+        const handle = await open(path, flags, Number(request.mode) & 0o777);
+        await handle.close();
+        return ok(await attr());
+      }
+
+      case "mkdir":
+        // No setuid or setgid from the guest; the sticky bit only means something on directories
+        await mkdir(path, Number(request.mode) & 0o1777);
+        return ok(await attr());
+
+      case "unlink":
+        await unlink(path);
+        return ok();
+
+      case "rmdir":
+        await rmdir(path);
+        return ok();
+
+      case "truncate":
+        if ((await lstat(path)).isSymbolicLink()) throw new ShareErrno(osConstants.errno.EINVAL);
+        await truncate(path, Number(request.size) || 0);
+        return ok(await attr());
+
+      case "readlink":
+        return ok({ target: await readlink(path) });
+
+      default:
+        throw new ShareErrno(osConstants.errno.ENOSYS);
+    }
+  }
+
+  /**
+   * Map a share-relative path onto the host, refusing anything that escapes the root
+   */
+  private async resolvePath(share: ShareExport, value: unknown): Promise<string> {
+    const path = typeof value === "string" ? value : "";
+    const parts = path.split("/").slice(1);
+    if (!path.startsWith("/") || path.includes("\0") || parts.some((part) => part === "." || part === "..")) {
+      throw new ShareErrno(osConstants.errno.EINVAL);
+    }
+
+    const full = resolve(share.root, `.${posix.normalize(path)}`);
+    if (full === share.root) return full;
+
+    // Symlinked parents must not lead out of the export
+    const parent = await realpath(dirname(full));
+    const rel = relative(share.root, parent);
+    if (rel.startsWith("..") || posix.isAbsolute(rel)) {
+      throw new ShareErrno(osConstants.errno.EACCES);
+    }
+    return `${parent}/${full.slice(dirname(full).length + 1)}`;
+  }
+}
+
+// One listener per machine with shares, shared by the API
+export const shareServers = new ShareServer();
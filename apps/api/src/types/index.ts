@@ -20,6 +20,74 @@ export interface RegistryAuth {
   password: string;
 }
 
+/**
+ * Bounds for memory the balloon controller leaves a guest, in MiB
+ */
+export interface MemoryLimits {
+  /** The guest never gets less */
+  floor_mib: number;
+  /** The guest never gets more (default: mem_size_mib) */
+  ceiling_mib?: number;
+}
+
+/**
+ * A health check run inside the guest
+ */
+export interface ProbeConfig {
+  /** Unique per machine */
+  name: string;
+  /** tcp: connect to a port; http: GET a path; exec: run a command; file: check a file was modified recently */
+  type: "tcp" | "http" | "exec" | "file";
+  /** Port on the guest's localhost (tcp, http) */
+  port?: number;
+  /** Request path (http, default "/") or file to check (file) */
+  path?: string;
+  /** Command and arguments; exit 0 is healthy (exec) */
+  command?: string[];
+  /** How recently the file must have been modified (file) */
+  max_age_seconds?: number;
+  /** Default: 10 */
+  interval_seconds?: number;
+  /** Default: 1 */
+  timeout_seconds?: number;
+  /** Passes in a row to become healthy (default: 1) */
+  healthy_threshold?: number;
+  /** Failures in a row to become unhealthy (default: 3) */
+  unhealthy_threshold?: number;
+}
+
+/**
+ * Last reported state of a probe
+ */
+export interface ProbeStatus {
+  name: string;
+  status: "unknown" | "healthy" | "unhealthy";
+  /** What the last check saw, such as "HTTP 503" or "connect: Connection refused" */
+  detail: string | null;
+  /** When the probe last changed state */
+  changed_at: string | null;
+}
+
+/**
+ * A socket listening inside a machine, as the guest reports it
+ */
+export interface ListeningPort {
+  protocol: "tcp" | "udp";
+  /** Local address, such as "0.0.0.0", "::" or "127.0.0.1" */
+  address: string;
+  port: number;
+  /** Process holding the socket; 0 and "" when none was found */
+  pid: number;
+  process: string;
+}
+
+/**
+ * Request body for replacing a machine's probes
+ */
+export interface SetProbesBody {
+  probes: ProbeConfig[];
+}
+
 /**
  * Request body for creating a new Firecracker machine
  */
@@ -34,9 +102,17 @@ export interface CreateMachineBody {
   image_size_mib?: number;
   /** Registry authentication for private images */
   registry_auth?: RegistryAuth;
+  /** Boot from an initramfs and fetch the image's blocks over vsock on demand */
+  lazy_rootfs?: boolean;
+  /** Let the balloon controller move memory in and out of the guest within these bounds */
+  memory?: MemoryLimits;
+  /** Health checks the guest runs itself, reporting only changes */
+  probes?: ProbeConfig[];
 
   network?: NetworkConfig;
   exposed_ports?: number[];
+  /** Without exposed_ports, proxy to the ports the guest reports listening on */
+  discover_ports?: boolean;
 }
 
 /**
@@ -87,6 +163,28 @@ export interface ExecBody {
   /** Deprecated alias for `command`. */
   cmd?: string[];
   timeout?: number;
+  /** Job ID for signalling or freezing the command while it runs */
+  job_id?: string;
+  /** "base64" returns stdout and stderr base64-encoded, byte for byte */
+  output_encoding?: "text" | "base64";
+  /** Codec for large output on its way out of the VM; defaults to the fastest the guest has */
+  compression?: "lz4" | "zstd" | "none";
+  /** Run the command in its own namespaces; true uses the defaults */
+  sandbox?: boolean | ExecSandbox;
+}
+
+/**
+ * Isolation for a sandboxed exec
+ */
+export interface ExecSandbox {
+  /** "overlay" (default) gives a private copy-on-write view of /; "tmpfs" an empty root with the system directories read-only */
+  root?: "overlay" | "tmpfs";
+  /** Keep the guest's network; by default the command only gets loopback */
+  network?: boolean;
+  /** Memory limit in MiB (needs cgroup v2) */
+  memory_mb?: number;
+  /** Process limit (needs cgroup v2) */
+  pids_max?: number;
 }
 
 /**
@@ -96,4 +194,406 @@ export interface ExecResponse {
   exit_code: number;
   stdout: string;
   stderr: string;
+  /** stdout wasn't valid UTF-8; invalid bytes were replaced with U+FFFD */
+  stdout_lossy?: boolean;
+  /** stderr wasn't valid UTF-8; invalid bytes were replaced with U+FFFD */
+  stderr_lossy?: boolean;
+  /** Job ID the command ran under */
+  job_id?: string;
+  /** Signal that terminated the command (0 if it exited normally) */
+  signal?: number;
+  /** The command was killed because it exceeded its timeout */
+  timed_out?: boolean;
+}
+
+/**
+ * Request body for signalling a running job
+ */
+export interface JobSignalBody {
+  /** Signal number or name, e.g. 15, "TERM" or "SIGTERM" */
+  signal: number | string;
+}
+
+/**
+ * Response from freezing or thawing a job
+ */
+export interface JobFreezeResponse {
+  frozen: boolean;
+  /** The job reached the requested state before the agent replied */
+  settled: boolean;
+  /** "cgroup" (cgroup.freeze) or "signal" (SIGSTOP/SIGCONT fallback) */
+  method: "cgroup" | "signal";
+}
+
+/**
+ * How the guest measured its working set
+ */
+export type WorkingSetMethod = "damon" | "page_idle" | "memory_stat";
+
+/**
+ * Guest memory sorted by how recently it was used during the window
+ */
+export interface WorkingSetResponse {
+  method: WorkingSetMethod;
+  window_ms: number;
+  /** Used in the second half of the window */
+  hot_bytes: number;
+  /** Used only in the first half of the window */
+  warm_bytes: number;
+  /** Not used during the window */
+  cold_bytes: number;
+  /** hot_bytes + warm_bytes */
+  working_set_bytes: number;
+  total_bytes: number;
+  free_bytes: number;
+  available_bytes: number;
+  /** Evicted memory that had to be read back in; sustained refaults mean the machine is too small */
+  refault_bytes_per_sec: number;
+}
+
+/**
+ * Tracepoint groups a latency trace can enable
+ */
+export type LatencyTraceEvents = "io" | "sched" | "syscall";
+
+/**
+ * Latencies in power-of-two buckets. Each bucket is `[lt_us, count]`: the
+ * events shorter than `lt_us` and not shorter than the previous bucket's bound.
+ */
+export interface LatencyHistogram {
+  count: number;
+  total_us: number;
+  max_us: number;
+  /** Bucket bounds, so accurate to a factor of two */
+  p50_us: number;
+  p99_us: number;
+  buckets: [number, number][];
+}
+
+/**
+ * Block request latency of one guest disk
+ */
+export interface DeviceLatency {
+  device: string;
+  /** major:minor */
+  dev: string;
+  read_bytes: number;
+  read: LatencyHistogram;
+  write_bytes: number;
+  write: LatencyHistogram;
+  /** Flushes, discards and the like */
+  other_bytes: number;
+  other: LatencyHistogram;
+}
+
+/**
+ * Where one process's time went while it was traced
+ */
+export interface ProcessLatency {
+  pid: number;
+  comm: string;
+  threads: number;
+  on_cpu_us?: number;
+  /** Blocked in interruptible sleep */
+  sleep_us?: number;
+  /** Blocked in uninterruptible sleep, nearly always IO */
+  io_wait_us?: number;
+  /** Runnable but waiting for a CPU */
+  run_queue?: LatencyHistogram;
+  io_wait?: LatencyHistogram;
+  syscalls?: LatencyHistogram;
+}
+
+/**
+ * What a latency trace found
+ */
+export interface LatencyTraceResponse {
+  duration_ms: number;
+  events: LatencyTraceEvents[];
+  events_seen: number;
+  /** Events the trace buffer dropped; the histograms miss them */
+  lost_events: number;
+  unmatched_requests?: number;
+  devices?: DeviceLatency[];
+  run_queue?: LatencyHistogram;
+  syscalls?: LatencyHistogram;
+  /** Syscall numbers of the guest's architecture, longest total time first */
+  top_syscalls?: { nr: number; count: number; total_us: number; max_us: number }[];
+  /** Longest waiting for a CPU or IO first */
+  processes?: ProcessLatency[];
+}
+
+/**
+ * Which part of a guest's metrics history to return. Times are Unix milliseconds.
+ */
+export interface MetricsHistoryQuery {
+  from_ms?: number;
+  to_ms?: number;
+  /** Instead of from_ms: this many seconds back from now */
+  last_seconds?: number;
+  /** Default: 3600 */
+  max_samples?: number;
+}
+
+/**
+ * One second of guest metrics
+ */
+export interface MetricsSample {
+  /** Guest wall clock, Unix milliseconds */
+  t: number;
+  /** One value per entry in `fields`; counters are their increase since the previous sample */
+  v: number[];
+  /** Processes that used the most CPU since the previous sample: [pid, name, clock ticks] */
+  top: [number, string, number][];
+}
+
+/**
+ * Metrics the guest kept in its history ring
+ */
+export interface MetricsHistoryResponse {
+  interval_ms: number;
+  /** Unit of the cpu_*_ticks fields and of top-process ticks */
+  clock_ticks_per_sec: number;
+  fields: string[];
+  samples: MetricsSample[];
+  /** Oldest sample the guest still holds */
+  oldest_ms: number;
+  /** Where to continue when max_samples cut the range short */
+  next_from_ms: number | null;
+}
+
+/**
+ * Which guest log records to return. Cursors come from the previous response.
+ */
+export interface MachineLogsQuery {
+  /** "kernel" or "init"; both when absent */
+  source?: "kernel" | "init";
+  /** Syslog level name ("err", "warning", "info", ...) or 0-7; keeps that level and more severe */
+  level?: string;
+  /** First kernel record wanted */
+  kernel_seq?: number;
+  /** First init record wanted */
+  init_seq?: number;
+  /** Boot the cursors belong to; they are ignored after the guest rebooted */
+  boot_id?: string;
+  /** Default: 1000 */
+  limit?: number;
+  /** Wait this long for a record when there is none yet */
+  wait_ms?: number;
+}
+
+/**
+ * One kernel or init log record
+ */
+export interface LogRecord {
+  source: "kernel" | "init";
+  seq: number;
+  /** Microseconds since the guest booted */
+  ts_us: number;
+  /** Syslog level, 0 (emerg) to 7 (debug) */
+  level: number;
+  text: string;
+}
+
+/**
+ * Guest log records in time order, with where to continue
+ */
+export interface MachineLogsResponse {
+  boot_id: string;
+  records: LogRecord[];
+  kernel_seq?: number;
+  kernel_dropped?: number;
+  init_seq?: number;
+  init_dropped?: number;
+}
+
+/**
+ * Request body for opening a persistent shell session
+ */
+export interface OpenSessionBody {
+  /** Initial working directory */
+  cwd?: string;
+  /** Extra environment variables as KEY=VALUE strings */
+  env?: string[];
+}
+
+/**
+ * Response from opening a shell session
+ */
+export interface SessionResponse {
+  session_id: number;
+  pid: number;
+}
+
+/**
+ * Request body for running a command in a shell session
+ */
+export interface SessionExecBody {
+  /** Shell command line, run by the session's shell */
+  command: string;
+  /** Timeout in seconds */
+  timeout?: number;
+}
+
+/**
+ * Response from running a command in a shell session
+ */
+export interface SessionExecResponse extends ExecResponse {
+  /** The command exceeded its timeout and the session was killed */
+  timed_out: boolean;
+  /** The session is no longer usable (timeout or the shell exited) */
+  session_closed: boolean;
+}
+
+/**
+ * Operations that can be combined in a batch
+ */
+export type BatchOperation = "ping" | "file_stat" | "file_read" | "file_write" | "file_delete" | "exec";
+
+/**
+ * One operation in a batch request
+ */
+export interface BatchItem {
+  operation: BatchOperation;
+  /** Absolute path, for file operations */
+  path?: string;
+  /** Base64-encoded content, for file_write */
+  content?: string;
+  /** Command and arguments, for exec */
+  command?: string[];
+  /** Timeout in seconds, for exec */
+  timeout?: number;
+  /** Job ID, for exec */
+  job_id?: string;
+}
+
+/**
+ * Request body for running several operations in one round trip
+ */
+export interface BatchBody {
+  items: BatchItem[];
+  /** Skip the remaining items after the first failure (sequential batches only) */
+  stop_on_error?: boolean;
+  /** Run all items concurrently */
+  parallel?: boolean;
+}
+
+/**
+ * Result of one batch item, in the guest agent's response format
+ */
+export interface BatchItemResult {
+  success: boolean;
+  data?: unknown;
+  error?: string;
+  /** The item was not run because an earlier item failed */
+  skipped?: boolean;
+}
+
+/**
+ * Response from a batch request
+ */
+export interface BatchResponse {
+  /** One result per item, in request order */
+  results: BatchItemResult[];
+  /** Number of items that failed or were skipped */
+  failed: number;
+}
+
+/**
+ * A message a workload wrote to /run/hyperfleet.sock inside the guest
+ */
+export interface GuestMessage {
+  /** Increases by one per message, per machine */
+  seq: number;
+  /** Connection the workload used; pass it back to reply to that workload only */
+  client: number;
+  pid: number;
+  received_at: string;
+  message: Record<string, unknown>;
+}
+
+/**
+ * Messages workloads sent to the host over /run/hyperfleet.sock
+ */
+export interface GuestMessagesResponse {
+  messages: GuestMessage[];
+  /** Pass as `since` to get only newer messages */
+  next_since: number;
+}
+
+/**
+ * Request body for sending a message to workloads in a machine
+ */
+export interface SendGuestMessageBody {
+  message: Record<string, unknown>;
+  /** Host channel client to deliver to; all connected workloads if omitted */
+  client?: number;
+}
+
+/**
+ * Request body for sharing a host directory with a running machine
+ */
+export interface MountShareBody {
+  /** Absolute host directory to export */
+  host_path: string;
+  /** Absolute guest path to mount it on; created if missing */
+  guest_path: string;
+  /** Allow the guest to create, write and delete files (default: false) */
+  writable?: boolean;
+  /** How long the guest caches attributes, entries and listings (default: 60) */
+  cache_seconds?: number;
+}
+
+/**
+ * A host directory mounted in a machine
+ */
+export interface ShareResponse {
+  name: string;
+  host_path: string;
+  guest_path: string;
+  writable: boolean;
+  cache_seconds: number;
+}
+
+/**
+ * Request body for creating an overlay workspace in a running machine
+ */
+export interface CreateWorkspaceBody {
+  name: string;
+  /** Absolute guest path to mount the workspace on; created if missing */
+  path: string;
+  /** Layer to start from, or an absolute guest directory (default: empty) */
+  base?: string;
+}
+
+/**
+ * Request body for folding a workspace's changes into a new layer
+ */
+export interface CommitWorkspaceBody {
+  /** Name of the layer to create */
+  layer: string;
+}
+
+/**
+ * An overlay workspace in a machine
+ */
+export interface WorkspaceResponse {
+  name: string;
+  path: string;
+  /** Layer or directory the workspace resets to; null if it starts empty */
+  base: string | null;
+}
+
+/**
+ * A layer committed from a workspace
+ */
+export interface WorkspaceLayer {
+  name: string;
+  /** Layer it was committed on top of */
+  base: string | null;
+}
+
+export interface WorkspaceListResponse {
+  workspaces: WorkspaceResponse[];
+  layers: WorkspaceLayer[];
 }
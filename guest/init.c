@@ -4,8 +4,21 @@
  * A minimal init (PID 1) for Firecracker microVMs.
  * Responsibilities:
  *   - Mount essential filesystems (/proc, /sys, /dev, /dev/pts, /run)
+ *   - Boot from a host block device over vsock when started from an initramfs
  *   - Setup networking (loopback, configure eth0 if present)
  *   - Listen on vsock for file operations and command execution
+ *   - Keep bulk file transfers from evicting the workload's page cache
+ *   - Relay workload messages between /run/hyperfleet.sock and the host
+ *   - Run health probes and report their transitions to the host
+ *   - Report listening ports to the host as they open and close
+ *   - Mount host directories shared over vsock through FUSE
+ *   - Keep resettable overlay workspaces for jobs
+ *   - Run exec jobs in namespace sandboxes
+ *   - Estimate the memory working set for right-sizing
+ *   - Report memory usage and pressure for the host's balloon controller
+ *   - Keep a second-by-second history of core metrics for post-incident retrieval
+ *   - Serve the kernel and init logs to the host, so the console can stay quiet
+ *   - Trace IO and scheduler latency through tracefs for slow-VM diagnosis
  *   - Reap zombie processes
  *   - Handle shutdown signals
  *
@@ -15,35 +28,65 @@
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
 #include <sys/reboot.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/capability.h>
+#include <linux/errqueue.h>
+#include <linux/fuse.h>
+#include <linux/genetlink.h>
 #include <linux/if.h>
+#include <linux/inet_diag.h>
+#include <linux/nbd-netlink.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
 #include <linux/sockios.h>
 #include <linux/vm_sockets.h>
 #include <sys/ioctl.h>
 #include <dirent.h>
 #include <pthread.h>
 
+#include "vendor/zstd/zstd.h"
+
 /* Configuration */
+#define AGENT_VERSION "0.2.0"
+#define PROTOCOL_VERSION 1
 #define HOSTNAME "hyperfleet"
 #define VSOCK_PORT 52
+#define VSOCK_CONTROL_PORT 53
 #define MAX_REQUEST_SIZE (128 * 1024 * 1024) /* 128MB */
 #define MAX_RESPONSE_SIZE (128 * 1024 * 1024)
+#define MAX_BATCH_ITEMS 64
 #define BASE64_ENCODE_SIZE(n) (((n) + 2) / 3 * 4 + 1)
 #define BASE64_DECODE_SIZE(n) (((n) + 3) / 4 * 3)
 
@@ -57,7 +100,30 @@ static int log_level = LOG_INFO;
 static volatile sig_atomic_t shutdown_requested = 0;
 static volatile sig_atomic_t reboot_requested = 0;
 
-/* Logging */
+/*
+ * Logging
+ *
+ * Besides going to the console, every line init logs is kept in a ring so
+ * the host can fetch it later over vsock (see "Log streaming"). The serial
+ * console is slow enough that verbose logging stretches boot, so with
+ * "quiet" on the kernel command line only warnings and errors are printed;
+ * the rest is still in the ring.
+ */
+#define LOG_RING_LINES 512
+#define LOG_LINE_MAX 240
+
+struct log_line {
+    uint64_t seq;
+    long long ts_us; /* CLOCK_MONOTONIC, the clock kernel records are stamped with */
+    int level;
+    char text[LOG_LINE_MAX];
+};
+
+static struct log_line log_ring[LOG_RING_LINES];
+static uint64_t log_next_seq; /* line seq lives in log_ring[seq % LOG_RING_LINES] */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int console_log_level = LOG_DEBUG;
+
 static void log_msg(int level, const char *fmt, ...) {
     if (level < log_level) return;
 
@@ -70,15 +136,32 @@ static void log_msg(int level, const char *fmt, ...) {
         default:        prefix = "[?]    "; break;
     }
 
+    struct timespec mono;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&log_lock);
+    struct log_line *line = &log_ring[log_next_seq % LOG_RING_LINES];
+    line->seq = log_next_seq++;
+    line->ts_us = (long long)mono.tv_sec * 1000000 + mono.tv_nsec / 1000;
+    line->level = level;
+    va_list ring_args;
+    va_copy(ring_args, args);
+    vsnprintf(line->text, sizeof(line->text), fmt, ring_args);
+    va_end(ring_args);
+    pthread_mutex_unlock(&log_lock);
+
+    if (level < console_log_level) {
+        va_end(args);
+        return;
+    }
+
     time_t now = time(NULL);
     struct tm *tm = localtime(&now);
     char timebuf[32];
     strftime(timebuf, sizeof(timebuf), "%H:%M:%S", tm);
 
     fprintf(stderr, "%s %s init: ", timebuf, prefix);
-
-    va_list args;
-    va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
 
@@ -91,6 +174,82 @@ static void log_msg(int level, const char *fmt, ...) {
 #define log_warn(...)  log_msg(LOG_WARN, __VA_ARGS__)
 #define log_error(...) log_msg(LOG_ERROR, __VA_ARGS__)
 
+/*
+ * Request arenas
+ *
+ * Whatever a request allocates while it is served (parsed fields, decoded
+ * payloads, output buffers) comes from its connection's arena and is freed
+ * in one go when the connection closes, rather than through a malloc/free
+ * pair per string. Small allocations are carved out of 64 KiB blocks; large
+ * ones get a block of their own. An arena is only used by one thread.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+struct arena {
+    struct arena_block *blocks; /* the first one is being filled */
+};
+
+static void *arena_alloc(struct arena *arena, size_t size) {
+    size = size ? (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : ARENA_ALIGN;
+
+    struct arena_block *head = arena->blocks;
+    if (head && head->size - head->used >= size) {
+        void *p = head->data + head->used;
+        head->used += size;
+        return p;
+    }
+
+    bool dedicated = size > ARENA_BLOCK_SIZE / 4;
+    size_t block_size = dedicated ? size : ARENA_BLOCK_SIZE;
+    struct arena_block *block = malloc(sizeof(*block) + block_size);
+    if (!block) return NULL;
+    block->size = block_size;
+    block->used = size;
+
+    if (dedicated && head) {
+        /* Keep filling the current block; the large one is just tracked */
+        block->next = head->next;
+        head->next = block;
+    } else {
+        block->next = head;
+        arena->blocks = block;
+    }
+    return block->data;
+}
+
+static char *arena_printf(struct arena *arena, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) return NULL;
+
+    char *out = arena_alloc(arena, n + 1);
+    if (!out) return NULL;
+    va_start(ap, fmt);
+    vsnprintf(out, n + 1, fmt, ap);
+    va_end(ap);
+    return out;
+}
+
+static void arena_release(struct arena *arena) {
+    struct arena_block *block = arena->blocks;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
 /* Base64 encoding table */
 static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const int base64_decode_table[256] = {
@@ -112,35 +271,14 @@ static const int base64_decode_table[256] = {
     -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
 };
 
-static char *base64_encode(const unsigned char *data, size_t len, size_t *out_len) {
-    size_t olen = BASE64_ENCODE_SIZE(len);
-    char *out = malloc(olen);
-    if (!out) return NULL;
-
-    char *p = out;
-    for (size_t i = 0; i < len; i += 3) {
-        unsigned int n = ((unsigned int)data[i]) << 16;
-        if (i + 1 < len) n |= ((unsigned int)data[i + 1]) << 8;
-        if (i + 2 < len) n |= data[i + 2];
-
-        *p++ = base64_table[(n >> 18) & 0x3F];
-        *p++ = base64_table[(n >> 12) & 0x3F];
-        *p++ = (i + 1 < len) ? base64_table[(n >> 6) & 0x3F] : '=';
-        *p++ = (i + 2 < len) ? base64_table[n & 0x3F] : '=';
-    }
-    *p = '\0';
-    if (out_len) *out_len = p - out;
-    return out;
-}
-
-static unsigned char *base64_decode(const char *data, size_t len, size_t *out_len) {
+static unsigned char *base64_decode(struct arena *arena, const char *data, size_t len, size_t *out_len) {
     if (len % 4 != 0) return NULL;
 
     size_t olen = BASE64_DECODE_SIZE(len);
-    if (data[len - 1] == '=') olen--;
-    if (data[len - 2] == '=') olen--;
+    if (len > 0 && data[len - 1] == '=') olen--;
+    if (len > 1 && data[len - 2] == '=') olen--;
 
-    unsigned char *out = malloc(olen + 1);
+    unsigned char *out = arena_alloc(arena, olen + 1);
     if (!out) return NULL;
 
     size_t j = 0;
@@ -150,9 +288,9 @@ static unsigned char *base64_decode(const char *data, size_t len, size_t *out_le
         int c = base64_decode_table[(unsigned char)data[i + 2]];
         int d = base64_decode_table[(unsigned char)data[i + 3]];
 
-        if (a < 0 || b < 0) { free(out); return NULL; }
-        if (data[i + 2] != '=' && c < 0) { free(out); return NULL; }
-        if (data[i + 3] != '=' && d < 0) { free(out); return NULL; }
+        if (a < 0 || b < 0) return NULL;
+        if (data[i + 2] != '=' && c < 0) return NULL;
+        if (data[i + 3] != '=' && d < 0) return NULL;
 
         unsigned int n = (a << 18) | (b << 12) | ((c >= 0 ? c : 0) << 6) | (d >= 0 ? d : 0);
         out[j++] = (n >> 16) & 0xFF;
@@ -165,28 +303,360 @@ static unsigned char *base64_decode(const char *data, size_t len, size_t *out_le
     return out;
 }
 
-/* Simple JSON parsing helpers */
-static char *json_get_string(const char *json, const char *key) {
-    char search[256];
-    snprintf(search, sizeof(search), "\"%s\"", key);
+/*
+ * LZ4 block compression
+ *
+ * A self-contained implementation of the LZ4 block format (no frame), so
+ * the static build needs no extra libraries. Blocks carry no length, so the
+ * uncompressed size travels next to them in the JSON.
+ */
+#define LZ4_HASH_LOG 16
+#define LZ4_MIN_MATCH 4
+#define LZ4_MF_LIMIT 12    /* a match can't start in the last 12 bytes */
+#define LZ4_LAST_LITERALS 5 /* the last 5 bytes are always literals */
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static size_t lz4_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Compress into dst (at least lz4_compress_bound(len) bytes). Returns the compressed size, or 0. */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst) {
+    uint32_t *table = calloc(1u << LZ4_HASH_LOG, sizeof(uint32_t)); /* position + 1, 0 = empty */
+    if (!table) return 0;
+
+    uint8_t *op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    if (len > LZ4_MF_LIMIT) {
+        size_t limit = len - LZ4_MF_LIMIT;
+        while (ip < limit) {
+            uint32_t seq = lz4_read32(src + ip);
+            uint32_t h = lz4_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip + 1;
+
+            if (ref == 0 || ip - (ref - 1) > LZ4_MAX_OFFSET || lz4_read32(src + ref - 1) != seq) {
+                /* Skip faster through data that isn't matching */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            ref--;
+
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t match_len = LZ4_MIN_MATCH;
+            size_t max_match = len - LZ4_LAST_LITERALS - ip;
+            while (match_len < max_match && src[ip + match_len] == src[ref + match_len]) match_len++;
+
+            size_t lit_len = ip - anchor;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+            if (lit_len >= 15) op = lz4_write_length(op, lit_len - 15);
+            memcpy(op, src + anchor, lit_len);
+            op += lit_len;
+
+            size_t offset = ip - ref;
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+
+            size_t ml = match_len - LZ4_MIN_MATCH;
+            *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+            if (ml >= 15) op = lz4_write_length(op, ml - 15);
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    size_t lit_len = len - anchor;
+    *op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = lz4_write_length(op, lit_len - 15);
+    memcpy(op, src + anchor, lit_len);
+    op += lit_len;
+
+    free(table);
+    return op - dst;
+}
+
+/* Decompress exactly out_len bytes. Returns 0, or -1 if the block is malformed. */
+static int lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+
+    while (ip < len) {
+        uint8_t token = src[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > len - ip || lit_len > out_len - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The last sequence has no match */
+        if (ip == len) break;
+
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > out_len - op) return -1;
+
+        const uint8_t *match = dst + op - offset;
+        if (offset >= match_len) {
+            memcpy(dst + op, match, match_len);
+        } else {
+            /* Overlapping copy repeats the last `offset` bytes */
+            for (size_t i = 0; i < match_len; i++) dst[op + i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return op == out_len ? 0 : -1;
+}
+
+/*
+ * Estimate the Shannon entropy (bits per byte) from a few samples spread over
+ * the buffer. Data near 8 bits/byte is already compressed or encrypted and
+ * isn't worth spending CPU on.
+ */
+#define ENTROPY_SAMPLE_SIZE 4096
+#define ENTROPY_SAMPLES 16
+#define ENTROPY_SKIP_BITS 7.5
+
+/* log2 from the IEEE 754 exponent plus a polynomial for the mantissa; avoids libm */
+static double approx_log2(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    return exponent - 1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955 - 0.056570851 * m) * m) * m) * m;
+}
+
+static double sample_entropy(const uint8_t *data, size_t len) {
+    if (len == 0) return 0;
+
+    size_t counts[256] = { 0 };
+    size_t total = 0;
+    size_t stride = len / ENTROPY_SAMPLES;
+
+    for (int s = 0; s < ENTROPY_SAMPLES; s++) {
+        size_t start = (size_t)s * stride;
+        size_t end = start + ENTROPY_SAMPLE_SIZE;
+        if (end > len) end = len;
+        for (size_t i = start; i < end; i++) counts[data[i]]++;
+        total += end - start;
+        if (stride == 0) break; /* small buffer: one pass covers it */
+    }
+
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double)counts[i] / total;
+        entropy -= p * approx_log2(p);
+    }
+    return entropy;
+}
+
+/*
+ * Wire codecs: LZ4 is the fast one, zstd (vendored, see vendor/zstd) the
+ * dense one. The host picks one per transfer from what hello advertises.
+ */
+enum codec { CODEC_NONE, CODEC_LZ4, CODEC_ZSTD };
+
+static const char *const codec_names[] = { "none", "lz4", "zstd" };
+
+#define ZSTD_WIRE_LEVEL 3
+
+/* NULL means none; returns -1 for a codec this agent doesn't have */
+static int codec_parse(const char *name) {
+    if (!name) return CODEC_NONE;
+    for (size_t i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+        if (strcmp(name, codec_names[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+/* Decode exactly out_len bytes. Returns 0, or -1 if the payload is malformed. */
+static int decompress_payload(enum codec codec, const uint8_t *src, size_t len, uint8_t *dst, size_t out_len) {
+    if (codec == CODEC_ZSTD) {
+        size_t n = ZSTD_decompress(dst, out_len, src, len);
+        return ZSTD_isError(n) || n != out_len ? -1 : 0;
+    }
+    return lz4_decompress(src, len, dst, out_len);
+}
+
+/*
+ * Compress a payload for the wire if it's worth it. On success the LZ4 block
+ * or zstd frame (from the arena) is stored in out and NULL is returned;
+ * otherwise returns why it was skipped.
+ */
+#define COMPRESS_MIN_SIZE 4096
+
+struct compress_result {
+    uint8_t *data;
+    size_t len;
+    long long time_us;
+};
+
+static const char *compress_payload(struct arena *arena, enum codec codec, const uint8_t *data, size_t len,
+                                    struct compress_result *out) {
+    memset(out, 0, sizeof(*out));
+    if (len < COMPRESS_MIN_SIZE) return "small";
+    if (sample_entropy(data, len) > ENTROPY_SKIP_BITS) return "entropy";
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t bound = codec == CODEC_ZSTD ? ZSTD_compressBound(len) : lz4_compress_bound(len);
+    uint8_t *buf = arena_alloc(arena, bound);
+    if (!buf) return "memory";
+    size_t clen;
+    if (codec == CODEC_ZSTD) {
+        clen = ZSTD_compress(buf, bound, data, len, ZSTD_WIRE_LEVEL);
+        if (ZSTD_isError(clen)) clen = 0;
+    } else {
+        clen = lz4_compress(data, len, buf);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    out->time_us = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    if (clen == 0 || clen >= len) return "ratio";
+    out->data = buf;
+    out->len = clen;
+    return NULL;
+}
+
+/*
+ * Simple JSON parsing helpers
+ *
+ * Lookups only match keys of the outermost object, so a key that appears
+ * inside a string value or a nested object (a command line, a batch item)
+ * is never mistaken for a top-level field.
+ */
+static const char *json_skip_ws(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+/* p points at the opening quote; returns the position after the closing one */
+static const char *json_skip_string(const char *p) {
+    p++;
+    while (*p && *p != '"') {
+        if (*p == '\\' && *(p + 1)) p++;
+        p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+/* Skip one value of any type and return the position after it */
+static const char *json_skip_value(const char *p) {
+    p = json_skip_ws(p);
+    if (*p == '"') return json_skip_string(p);
 
-    const char *start = strstr(json, search);
-    if (!start) return NULL;
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (*p) {
+            if (*p == '"') {
+                p = json_skip_string(p);
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            p++;
+        }
+        return p;
+    }
 
-    start += strlen(search);
-    while (*start && (*start == ' ' || *start == ':' || *start == '\t')) start++;
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n') p++;
+    return p;
+}
 
-    if (*start != '"') return NULL;
-    start++;
+/* Return the start of the value for a top-level key, or NULL */
+static const char *json_find_key(const char *json, const char *key) {
+    const char *p = json_skip_ws(json);
+    if (*p != '{') return NULL;
+    p++;
+
+    size_t key_len = strlen(key);
+    for (;;) {
+        p = json_skip_ws(p);
+        if (*p != '"') return NULL;
+
+        const char *name = p + 1;
+        p = json_skip_string(p);
+        bool match = (size_t)(p - 1 - name) == key_len && strncmp(name, key, key_len) == 0;
+
+        p = json_skip_ws(p);
+        if (*p != ':') return NULL;
+        p = json_skip_ws(p + 1);
+        if (match) return p;
+
+        p = json_skip_ws(json_skip_value(p));
+        if (*p != ',') return NULL;
+        p++;
+    }
+}
 
+/* p points at the opening quote; copies the unescaped contents into the arena */
+static char *json_copy_string(struct arena *arena, const char *p, const char **end_out) {
+    const char *start = p + 1;
     const char *end = start;
     while (*end && *end != '"') {
         if (*end == '\\' && *(end + 1)) end++;
         end++;
     }
+    if (end_out) *end_out = end;
 
     size_t len = end - start;
-    char *result = malloc(len + 1);
+    char *result = arena_alloc(arena, len + 1);
     if (!result) return NULL;
 
     /* Handle escape sequences */
@@ -210,44 +680,318 @@ static char *json_get_string(const char *json, const char *key) {
     return result;
 }
 
-static int json_get_int(const char *json, const char *key, int *value) {
-    char search[256];
-    snprintf(search, sizeof(search), "\"%s\"", key);
+static char *json_get_string(struct arena *arena, const char *json, const char *key) {
+    const char *start = json_find_key(json, key);
+    if (!start || *start != '"') return NULL;
+    return json_copy_string(arena, start, NULL);
+}
 
-    const char *start = strstr(json, search);
-    if (!start) return -1;
+/*
+ * Like json_get_string, but a value without escapes (such as a base64
+ * payload) is returned in place rather than copied. The result is only
+ * NUL-terminated if it was copied, so use its length.
+ */
+static const char *json_get_string_raw(struct arena *arena, const char *json, const char *key, size_t *len) {
+    const char *start = json_find_key(json, key);
+    if (!start || *start != '"') return NULL;
+
+    const char *end = start + 1;
+    while (*end && *end != '"' && *end != '\\') end++;
+    if (*end == '"') {
+        *len = end - (start + 1);
+        return start + 1;
+    }
+
+    char *copy = json_copy_string(arena, start, NULL);
+    if (copy) *len = strlen(copy);
+    return copy;
+}
 
-    start += strlen(search);
-    while (*start && (*start == ' ' || *start == ':' || *start == '\t')) start++;
+static int json_get_int(const char *json, const char *key, int *value) {
+    const char *start = json_find_key(json, key);
+    if (!start || (*start != '-' && (*start < '0' || *start > '9'))) return -1;
 
     *value = atoi(start);
     return 0;
 }
 
-/* Escape string for JSON */
-static char *json_escape(const char *str) {
-    size_t len = strlen(str);
-    char *out = malloc(len * 2 + 1);
-    if (!out) return NULL;
+/* Like json_get_int, for offsets and sizes past 2 GiB */
+static int json_get_long(const char *json, const char *key, long long *value) {
+    const char *start = json_find_key(json, key);
+    if (!start || (*start != '-' && (*start < '0' || *start > '9'))) return -1;
 
-    size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        switch (str[i]) {
-            case '"':  out[j++] = '\\'; out[j++] = '"'; break;
-            case '\\': out[j++] = '\\'; out[j++] = '\\'; break;
-            case '\n': out[j++] = '\\'; out[j++] = 'n'; break;
-            case '\r': out[j++] = '\\'; out[j++] = 'r'; break;
-            case '\t': out[j++] = '\\'; out[j++] = 't'; break;
+    *value = strtoll(start, NULL, 10);
+    return 0;
+}
+
+static int json_get_bool(const char *json, const char *key, bool *value) {
+    const char *start = json_find_key(json, key);
+    if (!start) return -1;
+
+    if (strncmp(start, "true", 4) == 0) {
+        *value = true;
+    } else if (strncmp(start, "false", 5) == 0) {
+        *value = false;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parse a string array value such as ["cmd", "arg1", "arg2"] into a
+ * NULL-terminated vector of strings from the arena. Returns the number of
+ * elements, or -1 if the key is missing or not an array.
+ */
+static int json_get_string_array(struct arena *arena, const char *json, const char *key, char **out, int max) {
+    const char *p = json_find_key(json, key);
+    if (!p || *p != '[') return -1;
+    p++;
+
+    int count = 0;
+    while (*p && *p != ']' && count < max) {
+        while (*p && (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n')) p++;
+        if (*p == '"') {
+            const char *end;
+            out[count] = json_copy_string(arena, p, &end);
+            if (out[count]) count++;
+            p = end;
+            if (*p == '"') p++;
+        } else if (*p && *p != ']') {
+            p++;
+        }
+    }
+    out[count] = NULL;
+    return count;
+}
+
+/* Length of the well-formed UTF-8 sequence at s, or 0 if there isn't one */
+static size_t utf8_sequence_length(const unsigned char *s, size_t avail) {
+    unsigned char c = s[0];
+    if (c < 0x80) return 1;
+
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF; /* allowed range of the second byte */
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        if (c == 0xE0) lo = 0xA0; /* overlong */
+        if (c == 0xED) hi = 0x9F; /* surrogates */
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        if (c == 0xF0) lo = 0x90; /* overlong */
+        if (c == 0xF4) hi = 0x8F; /* above U+10FFFF */
+    } else {
+        return 0;
+    }
+
+    if (avail < len || s[1] < lo || s[1] > hi) return 0;
+    for (size_t i = 2; i < len; i++) {
+        if (s[i] < 0x80 || s[i] > 0xBF) return 0;
+    }
+    return len;
+}
+
+static bool utf8_valid(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    for (size_t i = 0; i < len;) {
+        if (s[i] < 0x80) {
+            i++;
+            continue;
+        }
+        size_t seq = utf8_sequence_length(s + i, len - i);
+        if (seq == 0) return false;
+        i += seq;
+    }
+    return true;
+}
+
+/*
+ * Response writer
+ *
+ * A reply is serialized straight into one growable buffer, which is then
+ * written to the client as is. Escaped strings and base64 payloads are
+ * encoded in place instead of into temporaries that a final asprintf would
+ * copy again. Once an allocation fails the writer stays failed, and
+ * writer_finish() hands back an out-of-memory reply instead.
+ */
+struct writer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+/* Make room for n more bytes and a terminator; returns where they go, or NULL */
+static char *writer_reserve(struct writer *w, size_t n) {
+    if (w->failed) return NULL;
+    if (w->len + n + 1 > w->cap) {
+        size_t cap = w->cap ? w->cap : 256;
+        while (w->len + n + 1 > cap) cap *= 2;
+        char *buf = realloc(w->buf, cap);
+        if (!buf) {
+            w->failed = true;
+            return NULL;
+        }
+        w->buf = buf;
+        w->cap = cap;
+    }
+    return w->buf + w->len;
+}
+
+static void writer_append(struct writer *w, const char *data, size_t len) {
+    char *p = writer_reserve(w, len);
+    if (!p) return;
+    memcpy(p, data, len);
+    w->len += len;
+}
+
+static void writer_printf(struct writer *w, const char *fmt, ...) {
+    if (w->failed) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(w->buf ? w->buf + w->len : NULL, w->cap - w->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        w->failed = true;
+        return;
+    }
+
+    if (w->len + n + 1 > w->cap) {
+        char *p = writer_reserve(w, n);
+        if (!p) return;
+        va_start(ap, fmt);
+        vsnprintf(p, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    w->len += n;
+}
+
+/*
+ * Append the contents of a JSON string (without quotes). Bytes that aren't
+ * valid UTF-8 become U+FFFD, so the reply always parses; callers that need
+ * the exact bytes send base64 instead.
+ */
+static void writer_json_escaped(struct writer *w, const char *str, size_t len) {
+    if (!writer_reserve(w, len)) return;
+
+    const unsigned char *s = (const unsigned char *)str;
+    size_t run = 0;
+    for (size_t i = 0; i < len;) {
+        unsigned char c = s[i];
+        if (c >= 32 && c < 0x80 && c != '"' && c != '\\') {
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t seq = utf8_sequence_length(s + i, len - i);
+            if (seq > 0) {
+                i += seq;
+                continue;
+            }
+        }
+
+        writer_append(w, str + run, i - run);
+        switch (c) {
+            case '"':  writer_append(w, "\\\"", 2); break;
+            case '\\': writer_append(w, "\\\\", 2); break;
+            case '\n': writer_append(w, "\\n", 2); break;
+            case '\r': writer_append(w, "\\r", 2); break;
+            case '\t': writer_append(w, "\\t", 2); break;
             default:
-                if ((unsigned char)str[i] < 32) {
-                    j += snprintf(out + j, 7, "\\u%04x", (unsigned char)str[i]);
+                if (c >= 0x80) {
+                    writer_append(w, "\\ufffd", 6);
                 } else {
-                    out[j++] = str[i];
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    writer_append(w, esc, 6);
                 }
         }
+        run = ++i;
     }
-    out[j] = '\0';
-    return out;
+    writer_append(w, str + run, len - run);
+}
+
+static void writer_base64(struct writer *w, const unsigned char *data, size_t len) {
+    char *out = writer_reserve(w, BASE64_ENCODE_SIZE(len));
+    if (!out) return;
+
+    char *p = out;
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned int n = ((unsigned int)data[i]) << 16;
+        if (i + 1 < len) n |= ((unsigned int)data[i + 1]) << 8;
+        if (i + 2 < len) n |= data[i + 2];
+
+        *p++ = base64_table[(n >> 18) & 0x3F];
+        *p++ = base64_table[(n >> 12) & 0x3F];
+        *p++ = (i + 1 < len) ? base64_table[(n >> 6) & 0x3F] : '=';
+        *p++ = (i + 2 < len) ? base64_table[n & 0x3F] : '=';
+    }
+    w->len += p - out;
+}
+
+/* Returns the finished reply, which the caller owns */
+static char *writer_finish(struct writer *w) {
+    if (w->failed || !w->buf) {
+        free(w->buf);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+    w->buf[w->len] = '\0';
+    return w->buf;
+}
+
+/* I/O helpers */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_file(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = write_all(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+/* Read a "name value" line from /proc/meminfo, /proc/vmstat or memory.stat; kB values become bytes */
+static bool read_counter(const char *path, const char *name, unsigned long long *value) {
+    FILE *f = fopen(path, "re");
+    if (!f) return false;
+
+    char line[256];
+    size_t name_len = strlen(name);
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        char *p = line + name_len;
+        if (strncmp(line, name, name_len) != 0) continue;
+        if (*p == ':') p++;
+        if (*p != ' ' && *p != '\t') continue;
+        char *end;
+        *value = strtoull(p, &end, 10);
+        if (strstr(end, "kB")) *value *= 1024;
+        found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /* Signal handlers */
@@ -351,6 +1095,7 @@ static int setup_filesystems(void) {
         { "/dev/null",    S_IFCHR | 0666, makedev(1, 3) },
         { "/dev/zero",    S_IFCHR | 0666, makedev(1, 5) },
         { "/dev/full",    S_IFCHR | 0666, makedev(1, 7) },
+        { "/dev/kmsg",    S_IFCHR | 0644, makedev(1, 11) },
         { "/dev/random",  S_IFCHR | 0666, makedev(1, 8) },
         { "/dev/urandom", S_IFCHR | 0666, makedev(1, 9) },
         { "/dev/tty",     S_IFCHR | 0666, makedev(5, 0) },
@@ -424,412 +1169,8050 @@ static int setup_hostname(void) {
     return 0;
 }
 
-/* File operations */
-static char *handle_file_read(const char *path) {
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        char *err = NULL;
-        asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
-        return err;
+/* With "quiet" on the kernel command line, keep info and debug lines off the console */
+static void setup_console_logging(void) {
+    char cmdline[4096];
+    int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, cmdline, sizeof(cmdline) - 1) : -1;
+    if (fd >= 0) close(fd);
+    if (n <= 0) return;
+    cmdline[n] = '\0';
+
+    char *save = NULL;
+    for (char *tok = strtok_r(cmdline, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+        if (strcmp(tok, "quiet") == 0) {
+            console_log_level = LOG_WARN;
+            log_info("quiet boot, only warnings reach the console");
+            return;
+        }
     }
+}
 
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
-        close(fd);
-        char *err = NULL;
-        asprintf(&err, "{\"success\":false,\"error\":\"fstat: %s\"}\n", strerror(errno));
-        return err;
-    }
+/*
+ * Request context
+ *
+ * Hosts send "budget_ms", the time they are willing to wait. It is turned
+ * into an absolute CLOCK_MONOTONIC deadline on receipt, since guest and host
+ * wall clocks are not guaranteed to agree. Long-running handlers poll
+ * request_cancelled() and stop once the deadline passes or the host hangs up.
+ */
+#define FILE_IO_CHUNK (1024 * 1024)
 
-    if (st.st_size > MAX_REQUEST_SIZE) {
-        close(fd);
-        return strdup("{\"success\":false,\"error\":\"file too large\"}\n");
+struct agent_request {
+    int client_fd;
+    long long deadline_ms; /* CLOCK_MONOTONIC, 0 = no deadline */
+    struct arena *arena;   /* freed when the request is done */
+};
+
+static bool peer_hung_up(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+    if (poll(&pfd, 1, 0) <= 0) return false;
+    return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/* Milliseconds left before the deadline, or -1 if there is none */
+static long long request_remaining_ms(const struct agent_request *req) {
+    if (req->deadline_ms == 0) return -1;
+    long long left = req->deadline_ms - monotonic_ms();
+    return left > 0 ? left : 0;
+}
+
+/* Returns why the request should be abandoned, or NULL to keep going */
+static const char *request_cancelled(const struct agent_request *req) {
+    if (req->deadline_ms != 0 && monotonic_ms() >= req->deadline_ms) {
+        return "deadline exceeded";
     }
+    if (peer_hung_up(req->client_fd)) {
+        return "client disconnected";
+    }
+    return NULL;
+}
 
-    unsigned char *buf = malloc(st.st_size);
-    if (!buf) {
-        close(fd);
-        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+static char *cancelled_response(const char *why) {
+    char *response = NULL;
+    asprintf(&response, "{\"success\":false,\"error\":\"%s\",\"cancelled\":true}\n", why);
+    return response;
+}
+
+/*
+ * Priority lanes
+ *
+ * Operations are split into a control lane (cheap, latency sensitive) and a
+ * bulk lane (transfers, exec). Each lane has its own worker budget, so a
+ * burst of uploads or long-running commands can't starve health checks.
+ * Control threads run at an elevated nice value; bulk threads run at the
+ * default, and anything forked for the host is reset to 0.
+ */
+#define CONTROL_NICE (-10)
+#define DEFAULT_CONTROL_WORKERS 16
+#define DEFAULT_BULK_WORKERS 8
+#define DEFAULT_CONTROL_QUEUE 64
+#define DEFAULT_BULK_QUEUE 16
+
+enum op_lane {
+    LANE_CONTROL,
+    LANE_BULK,
+    LANE_COUNT,
+};
+
+struct lane {
+    const char *name;
+    int limit;
+    int active;
+    int waiting;
+    int queue_max; /* requests allowed to wait for a slot before we shed load */
+    int nice;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct lane lanes[LANE_COUNT] = {
+    [LANE_CONTROL] = { .name = "control", .limit = DEFAULT_CONTROL_WORKERS,
+                       .queue_max = DEFAULT_CONTROL_QUEUE, .nice = CONTROL_NICE },
+    [LANE_BULK] = { .name = "bulk", .limit = DEFAULT_BULK_WORKERS,
+                    .queue_max = DEFAULT_BULK_QUEUE, .nice = 0 },
+};
+
+/* limit/active are per operation and guarded by the owning lane's lock */
+struct op_class {
+    const char *operation;
+    enum op_lane lane;
+    int limit; /* 0 = bounded only by the lane */
+    int active;
+};
+
+static struct op_class op_classes[] = {
+    { .operation = "ping", .lane = LANE_CONTROL },
+    { .operation = "hello", .lane = LANE_CONTROL },
+    { .operation = "file_stat", .lane = LANE_CONTROL },
+    { .operation = "file_delete", .lane = LANE_CONTROL },
+    { .operation = "cache_status", .lane = LANE_CONTROL },
+    { .operation = "job_signal", .lane = LANE_CONTROL },
+    { .operation = "job_freeze", .lane = LANE_CONTROL },
+    { .operation = "job_thaw", .lane = LANE_CONTROL },
+    { .operation = "job_list", .lane = LANE_CONTROL },
+    { .operation = "memory_status", .lane = LANE_CONTROL },
+    { .operation = "metrics_history", .lane = LANE_CONTROL },
+    /* Limited, since a request following the log holds its worker while it waits */
+    { .operation = "log_read", .lane = LANE_CONTROL, .limit = 4 },
+    { .operation = "probe_list", .lane = LANE_CONTROL },
+    { .operation = "port_list", .lane = LANE_CONTROL },
+    { .operation = "session_close", .lane = LANE_CONTROL },
+    { .operation = "share_mount", .lane = LANE_CONTROL },
+    { .operation = "share_unmount", .lane = LANE_CONTROL },
+    { .operation = "workspace_create", .lane = LANE_CONTROL },
+    { .operation = "workspace_reset", .lane = LANE_CONTROL },
+    { .operation = "workspace_commit", .lane = LANE_CONTROL },
+    { .operation = "workspace_delete", .lane = LANE_CONTROL },
+    { .operation = "workspace_list", .lane = LANE_CONTROL },
+    { .operation = "file_read", .lane = LANE_BULK },
+    { .operation = "file_write", .lane = LANE_BULK },
+    { .operation = "file_alloc", .lane = LANE_BULK },
+    { .operation = "file_commit", .lane = LANE_BULK },
+    { .operation = "exec", .lane = LANE_BULK },
+    { .operation = "session_open", .lane = LANE_BULK },
+    { .operation = "session_exec", .lane = LANE_BULK },
+    { .operation = "transfer_bench", .lane = LANE_BULK },
+    { .operation = "working_set", .lane = LANE_BULK },
+    { .operation = "latency_trace", .lane = LANE_BULK },
+};
+
+#define OP_CLASS_COUNT (sizeof(op_classes) / sizeof(op_classes[0]))
+
+/*
+ * NULL for operations not in the table. They are rejected before admission,
+ * so every operation has to be listed, and its lane is always a decision.
+ */
+static struct op_class *op_class_find(const char *operation) {
+    for (size_t i = 0; i < OP_CLASS_COUNT; i++) {
+        if (strcmp(op_classes[i].operation, operation) == 0) return &op_classes[i];
     }
+    return NULL;
+}
 
-    ssize_t n = read(fd, buf, st.st_size);
-    close(fd);
+/* Parse "--limit=exec:4" */
+static int op_limit_parse(const char *spec) {
+    const char *colon = strchr(spec, ':');
+    if (!colon) return -1;
+    for (size_t i = 0; i < OP_CLASS_COUNT; i++) {
+        if (strlen(op_classes[i].operation) == (size_t)(colon - spec) &&
+            strncmp(op_classes[i].operation, spec, colon - spec) == 0) {
+            op_classes[i].limit = atoi(colon + 1);
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    if (n < 0) {
-        free(buf);
-        char *err = NULL;
-        asprintf(&err, "{\"success\":false,\"error\":\"read: %s\"}\n", strerror(errno));
-        return err;
+static void lanes_init(void) {
+    for (int i = 0; i < LANE_COUNT; i++) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_mutex_init(&lanes[i].lock, NULL);
+        pthread_cond_init(&lanes[i].cond, &attr);
+        pthread_condattr_destroy(&attr);
     }
+}
 
-    size_t b64_len;
-    char *b64 = base64_encode(buf, n, &b64_len);
-    free(buf);
+static void set_thread_nice(int nice) {
+    if (setpriority(PRIO_PROCESS, gettid(), nice) < 0) {
+        log_debug("setpriority(%d): %s", nice, strerror(errno));
+    }
+}
+
+/*
+ * Admission control
+ *
+ * Bulk work is refused outright while the guest is under CPU, memory or IO
+ * pressure (PSI "some" avg10 above a threshold), or when the lane's wait
+ * queue is full. Refusals carry a retry_after_ms hint so the host can back
+ * off or place the work on another VM instead of piling onto this one.
+ */
+#define PSI_CACHE_MS 500
+#define PSI_RETRY_AFTER_MS 2000
+#define QUEUE_RETRY_AFTER_MS 250
+#define DEFAULT_MAX_CONNECTIONS 256
+
+enum psi_resource {
+    PSI_CPU,
+    PSI_MEMORY,
+    PSI_IO,
+    PSI_COUNT,
+};
+
+static const char *psi_names[PSI_COUNT] = { "cpu", "memory", "io" };
+
+/* Thresholds in percent; 0 disables the check */
+static double psi_thresholds[PSI_COUNT] = { 90.0, 30.0, 60.0 };
+
+static struct {
+    pthread_mutex_t lock;
+    long long read_ms;
+    bool available;
+    double some_avg10[PSI_COUNT];
+} psi_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .available = true };
+
+static int max_connections = DEFAULT_MAX_CONNECTIONS;
+static int active_connections = 0;
+
+/* Read "some avg10=" from /proc/pressure/<resource> */
+static int psi_read(const char *resource, double *avg10) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    FILE *f = fopen(path, "re");
+    if (!f) return -1;
+
+    char line[256];
+    int rc = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "some avg10=%lf", avg10) == 1) {
+            rc = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return rc;
+}
 
-    if (!b64) {
-        return strdup("{\"success\":false,\"error\":\"base64 encode failed\"}\n");
+/* Returns the first resource over its threshold, or -1. Readings are cached briefly. */
+static int psi_over_threshold(double *value) {
+    int over = -1;
+
+    pthread_mutex_lock(&psi_cache.lock);
+    long long now = monotonic_ms();
+    if (psi_cache.available && now - psi_cache.read_ms >= PSI_CACHE_MS) {
+        for (int i = 0; i < PSI_COUNT; i++) {
+            if (psi_read(psi_names[i], &psi_cache.some_avg10[i]) < 0) {
+                /* Kernel without CONFIG_PSI; stop trying */
+                if (i == PSI_CPU) {
+                    psi_cache.available = false;
+                    log_warn("PSI unavailable, pressure-based admission disabled");
+                }
+                psi_cache.some_avg10[i] = 0;
+            }
+        }
+        psi_cache.read_ms = now;
+    }
+    for (int i = 0; psi_cache.available && i < PSI_COUNT; i++) {
+        if (psi_thresholds[i] > 0 && psi_cache.some_avg10[i] >= psi_thresholds[i]) {
+            *value = psi_cache.some_avg10[i];
+            over = i;
+            break;
+        }
     }
+    pthread_mutex_unlock(&psi_cache.lock);
+
+    return over;
+}
 
+static char *busy_response(const char *reason, int retry_after_ms) {
     char *response = NULL;
-    asprintf(&response, "{\"success\":true,\"data\":{\"content\":\"%s\",\"size\":%zd}}\n", b64, n);
-    free(b64);
+    asprintf(&response,
+        "{\"success\":false,\"error\":\"busy: %s\",\"busy\":true,\"retry_after_ms\":%d}\n",
+        reason, retry_after_ms);
+    return response;
+}
 
-    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+static bool op_has_capacity(const struct lane *lane, const struct op_class *op) {
+    return lane->active < lane->limit && (op->limit <= 0 || op->active < op->limit);
 }
 
-static char *handle_file_write(const char *path, const char *content) {
-    size_t content_len = strlen(content);
-    size_t data_len;
-    unsigned char *data = base64_decode(content, content_len, &data_len);
+/* Busy response for bulk work while the guest is under pressure, or NULL */
+static char *pressure_refusal(const struct op_class *op) {
+    if (op->lane != LANE_BULK) return NULL;
 
-    if (!data) {
-        return strdup("{\"success\":false,\"error\":\"base64 decode failed\"}\n");
+    double pressure;
+    int resource = psi_over_threshold(&pressure);
+    if (resource < 0) return NULL;
+
+    char reason[64];
+    snprintf(reason, sizeof(reason), "%s pressure %.1f%%", psi_names[resource], pressure);
+    return busy_response(reason, PSI_RETRY_AFTER_MS);
+}
+
+static char *queue_full_response(const struct lane *lane) {
+    char reason[64];
+    snprintf(reason, sizeof(reason), "%s queue full", lane->name);
+    return busy_response(reason, QUEUE_RETRY_AFTER_MS);
+}
+
+/*
+ * The response op_enter would turn op away with without waiting, or NULL.
+ * Only a hint, since the lane can change before op_enter runs.
+ */
+static char *op_refusal(struct op_class *op) {
+    char *refused = pressure_refusal(op);
+    if (refused) return refused;
+
+    struct lane *lane = &lanes[op->lane];
+    pthread_mutex_lock(&lane->lock);
+    bool full = !op_has_capacity(lane, op) && lane->waiting >= lane->queue_max;
+    pthread_mutex_unlock(&lane->lock);
+    return full ? queue_full_response(lane) : NULL;
+}
+
+/*
+ * Admit an operation into its lane, waiting for a slot if needed. Returns NULL
+ * once admitted, otherwise a busy or cancelled response to send instead.
+ */
+static char *op_enter(const struct agent_request *req, struct op_class *op) {
+    struct lane *lane = &lanes[op->lane];
+
+    char *refused = pressure_refusal(op);
+    if (refused) return refused;
+
+    const char *why = NULL;
+
+    pthread_mutex_lock(&lane->lock);
+    if (!op_has_capacity(lane, op) && lane->waiting >= lane->queue_max) {
+        pthread_mutex_unlock(&lane->lock);
+        return queue_full_response(lane);
+    }
+
+    lane->waiting++;
+    while (!op_has_capacity(lane, op)) {
+        /* Wake periodically to notice a host that gave up while we queued */
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += 100 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&lane->cond, &lane->lock, &ts);
+
+        if (!op_has_capacity(lane, op) && (why = request_cancelled(req)) != NULL) break;
+    }
+    lane->waiting--;
+    if (!why) {
+        lane->active++;
+        op->active++;
+    }
+    pthread_mutex_unlock(&lane->lock);
+
+    if (why) return cancelled_response(why);
+
+    set_thread_nice(lane->nice);
+    return NULL;
+}
+
+static void op_leave(struct op_class *op) {
+    struct lane *lane = &lanes[op->lane];
+
+    pthread_mutex_lock(&lane->lock);
+    lane->active--;
+    op->active--;
+    /* Waiters may be blocked on different per-op limits */
+    pthread_cond_broadcast(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
+}
+
+/*
+ * Bandwidth limit shared by all bulk streams. Chunks are charged up front and
+ * the bucket may go into debt, so a single large chunk is never refused, only
+ * delayed. A rate of 0 disables throttling.
+ */
+struct token_bucket {
+    pthread_mutex_t lock;
+    long long rate;  /* bytes per second */
+    long long tokens;
+    long long last_ms;
+};
+
+static struct token_bucket bulk_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char *bulk_throttle(const struct agent_request *req, size_t bytes) {
+    struct token_bucket *b = &bulk_bucket;
+    if (b->rate <= 0) return NULL;
+
+    pthread_mutex_lock(&b->lock);
+    long long now = monotonic_ms();
+    if (b->last_ms == 0) {
+        b->tokens = b->rate;
+    } else {
+        b->tokens += (now - b->last_ms) * b->rate / 1000;
+        if (b->tokens > b->rate) b->tokens = b->rate; /* one second of burst */
+    }
+    b->last_ms = now;
+    b->tokens -= (long long)bytes;
+    long long wait_ms = b->tokens < 0 ? (-b->tokens * 1000 + b->rate - 1) / b->rate : 0;
+    pthread_mutex_unlock(&b->lock);
+
+    long long until = now + wait_ms;
+    while (monotonic_ms() < until) {
+        const char *why = request_cancelled(req);
+        if (why) return why;
+        long long left = until - monotonic_ms();
+        usleep((left > 50 ? 50 : (left > 0 ? left : 0)) * 1000);
+    }
+    return NULL;
+}
+
+/* Environment for processes spawned on behalf of the host */
+static const char *const exec_default_env[] = {
+    "PATH=/usr/local/bin:/usr/bin:/bin:/usr/local/sbin:/usr/sbin:/sbin",
+    "HOME=/root",
+    "TERM=linux",
+    NULL
+};
+
+/* File operations */
+/*
+ * Byte ranges
+ *
+ * file_read takes an optional "offset" and "length" so a large file can be
+ * fetched over several connections at once; "length" defaults to the rest
+ * of the file and is clipped at its end.
+ */
+struct file_range {
+    long long offset;
+    long long length; /* -1 until resolved against the file size */
+};
+
+static const char *file_range_resolve(struct file_range *range, long long file_size) {
+    if (range->offset < 0) return "offset must not be negative";
+    if (range->offset > file_size) return "offset beyond end of file";
+    if (range->length < 0 || range->length > file_size - range->offset) {
+        range->length = file_size - range->offset;
+    }
+    return NULL;
+}
+
+/* CRC-32 as used by zlib and gzip, so the host can check ranges with any standard library */
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    pthread_once(&crc32_table_once, crc32_build_table);
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+ * Page cache policy
+ *
+ * Moving a large file through the page cache pushes the workload's hot
+ * pages out of it, and the workload pays for that in refaults long after
+ * the transfer is done. file_read and file_write take a "cache" mode:
+ *
+ *   normal    the kernel's usual caching (the default)
+ *   dontneed  drop the pages the transfer brought in once they have been
+ *             moved. Reads check residency with mincore() first, so pages
+ *             the workload already had cached stay where they are.
+ *   direct    file_write only: O_DIRECT from an aligned buffer, so the data
+ *             never enters the page cache. Falls back to dontneed where the
+ *             filesystem or the range doesn't allow it.
+ */
+#define DIRECT_IO_ALIGN 4096
+
+enum cache_mode { CACHE_NORMAL, CACHE_DONTNEED, CACHE_DIRECT, CACHE_MODE_COUNT };
+
+static const char *cache_mode_names[CACHE_MODE_COUNT] = { "normal", "dontneed", "direct" };
+
+/* NULL means normal */
+static int cache_mode_parse(const char *name, enum cache_mode *mode) {
+    if (!name) {
+        *mode = CACHE_NORMAL;
+        return 0;
+    }
+    for (int i = 0; i < CACHE_MODE_COUNT; i++) {
+        if (strcmp(name, cache_mode_names[i]) == 0) {
+            *mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Tracks a sequential read of [offset, offset + len): which of its pages
+ * were cached before it started, one byte per page like mincore(), and how
+ * far it has released the rest. Residency is taken for the whole range up
+ * front because readahead runs ahead of each chunk.
+ */
+struct cache_guard {
+    long page_size;
+    off_t base;     /* page-aligned start of the range */
+    size_t pages;
+    unsigned char *was_cached; /* NULL when nothing is to be dropped */
+    size_t dropped; /* pages released so far */
+};
+
+/* Which pages of fd [offset, offset + pages) are in the page cache. -1 if it can't be told. */
+static int cache_residency(int fd, off_t offset, size_t pages, long page_size, unsigned char *vec) {
+    void *map = mmap(NULL, pages * page_size, PROT_READ, MAP_SHARED, fd, offset);
+    if (map == MAP_FAILED) return -1;
+    int rc = mincore(map, pages * page_size, vec);
+    munmap(map, pages * page_size);
+    return rc;
+}
+
+static int cache_guard_init(struct cache_guard *g, struct arena *arena, enum cache_mode mode, int fd, off_t offset,
+                            size_t len) {
+    memset(g, 0, sizeof(*g));
+    if (mode != CACHE_DONTNEED || len == 0) return 0;
+
+    g->page_size = sysconf(_SC_PAGESIZE);
+    g->base = offset - offset % g->page_size;
+    g->pages = (offset + len - g->base + g->page_size - 1) / g->page_size;
+    g->was_cached = arena_alloc(arena, g->pages);
+    if (!g->was_cached) return -1;
+    if (cache_residency(fd, g->base, g->pages, g->page_size, g->was_cached) < 0) {
+        /* Never drop what we couldn't see */
+        g->was_cached = NULL;
     }
+    return 0;
+}
+
+/*
+ * Drop the pages wholly below end (all of them with end < 0) that weren't
+ * cached beforehand. Pages still mapped or held by an in-flight send are
+ * skipped by the kernel, so callers release a chunk behind and once more at
+ * the end.
+ */
+static void cache_guard_drop(struct cache_guard *g, int fd, off_t end) {
+    if (!g->was_cached) return;
+    size_t target = end < 0 ? g->pages : (size_t)(end - g->base) / g->page_size;
+    if (target > g->pages) target = g->pages;
+
+    /* The final pass goes over everything again for pages that were still busy */
+    size_t i = end < 0 ? 0 : g->dropped;
+    while (i < target) {
+        if (g->was_cached[i] & 1) {
+            i++;
+            continue;
+        }
+        size_t run = i;
+        while (run < target && !(g->was_cached[run] & 1)) run++;
+        posix_fadvise(fd, g->base + i * g->page_size, (run - i) * g->page_size, POSIX_FADV_DONTNEED);
+        i = run;
+    }
+    if (target > g->dropped) g->dropped = target;
+}
+
+/*
+ * Release freshly written pages: start writeback of [offset, offset + len)
+ * and drop the previous range, [prev, offset), once it is on disk. Dirty
+ * pages can't be dropped, and waiting a range behind keeps the device busy.
+ */
+static void cache_release_written(int fd, off_t prev, off_t offset, size_t len) {
+    if (len > 0) sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    if (offset > prev) {
+        sync_file_range(fd, prev, offset - prev,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, prev, offset - prev, POSIX_FADV_DONTNEED);
+    }
+}
 
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+static char *handle_file_read(const struct agent_request *req, const char *path, struct file_range range,
+                              const char *compression, enum cache_mode cache) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
-        free(data);
         char *err = NULL;
         asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
         return err;
     }
 
-    ssize_t written = write(fd, data, data_len);
-    int write_errno = errno;
-    close(fd);
-    free(data);
-
-    if (written < 0) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
         char *err = NULL;
-        asprintf(&err, "{\"success\":false,\"error\":\"write: %s\"}\n", strerror(write_errno));
+        asprintf(&err, "{\"success\":false,\"error\":\"fstat: %s\"}\n", strerror(errno));
         return err;
     }
 
-    char *response = NULL;
-    asprintf(&response, "{\"success\":true,\"data\":{\"bytes_written\":%zd}}\n", written);
-    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
-}
-
-static char *handle_file_stat(const char *path) {
-    struct stat st;
-    if (stat(path, &st) < 0) {
+    const char *bad_range = file_range_resolve(&range, st.st_size);
+    if (bad_range) {
+        close(fd);
         char *err = NULL;
-        asprintf(&err, "{\"success\":false,\"error\":\"stat: %s\"}\n", strerror(errno));
+        asprintf(&err, "{\"success\":false,\"error\":\"%s\"}\n", bad_range);
         return err;
     }
 
-    char mode[16];
-    snprintf(mode, sizeof(mode), "%o", st.st_mode & 07777);
+    if (range.length > MAX_REQUEST_SIZE) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"file too large\"}\n");
+    }
 
-    char mod_time[64];
-    struct tm *tm = gmtime(&st.st_mtime);
-    strftime(mod_time, sizeof(mod_time), "%Y-%m-%dT%H:%M:%SZ", tm);
+    unsigned char *buf = arena_alloc(req->arena, range.length);
+    struct cache_guard guard;
+    if (!buf || cache_guard_init(&guard, req->arena, cache, fd, range.offset, range.length) < 0) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
 
-    char *response = NULL;
-    asprintf(&response,
-        "{\"success\":true,\"data\":{\"path\":\"%s\",\"size\":%ld,\"mode\":\"%s\",\"mod_time\":\"%s\",\"is_dir\":%s}}\n",
-        path, (long)st.st_size, mode, mod_time, S_ISDIR(st.st_mode) ? "true" : "false");
+    /* Read in chunks so an abandoned request stops early */
+    size_t n = 0;
+    while (n < (size_t)range.length) {
+        const char *why = request_cancelled(req);
+        if (why) {
+            cache_guard_drop(&guard, fd, -1);
+            close(fd);
+            return cancelled_response(why);
+        }
 
-    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+        size_t want = (size_t)range.length - n;
+        if (want > FILE_IO_CHUNK) want = FILE_IO_CHUNK;
+        if ((why = bulk_throttle(req, want)) != NULL) {
+            cache_guard_drop(&guard, fd, -1);
+            close(fd);
+            return cancelled_response(why);
+        }
+        ssize_t r = pread(fd, buf + n, want, range.offset + n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            int read_errno = errno;
+            cache_guard_drop(&guard, fd, -1);
+            close(fd);
+            char *err = NULL;
+            asprintf(&err, "{\"success\":false,\"error\":\"read: %s\"}\n", strerror(read_errno));
+            return err;
+        }
+        if (r == 0) break;
+        n += r;
+        cache_guard_drop(&guard, fd, range.offset + n);
+    }
+    cache_guard_drop(&guard, fd, -1);
+    close(fd);
+
+    /* Sized up front so the payload is encoded without the buffer moving */
+    struct writer w = { 0 };
+    writer_reserve(&w, BASE64_ENCODE_SIZE(n) + 256);
+    writer_printf(&w, "{\"success\":true,\"data\":{\"size\":%zu,\"offset\":%lld,\"file_size\":%lld,\"cache\":\"%s\"",
+        n, range.offset, (long long)st.st_size, cache_mode_names[cache]);
+
+    /* Optional compression; the host decodes according to "encoding" */
+    const unsigned char *payload = buf;
+    size_t payload_len = n;
+    int codec = codec_parse(compression);
+    if (codec > CODEC_NONE) {
+        struct compress_result c;
+        const char *skipped = compress_payload(req->arena, codec, buf, n, &c);
+        if (skipped) {
+            writer_printf(&w, ",\"encoding\":\"none\",\"compression_skipped\":\"%s\"", skipped);
+        } else {
+            writer_printf(&w, ",\"encoding\":\"%s\",\"compressed_size\":%zu,\"ratio\":%.2f,\"compress_us\":%lld",
+                codec_names[codec], c.len, (double)n / c.len, c.time_us);
+            payload = c.data;
+            payload_len = c.len;
+        }
+    }
+
+    writer_printf(&w, ",\"content\":\"");
+    writer_base64(&w, payload, payload_len);
+    writer_printf(&w, "\"}}\n");
+    return writer_finish(&w);
 }
 
-static char *handle_file_delete(const char *path) {
-    if (unlink(path) < 0) {
-        if (errno == EISDIR) {
-            if (rmdir(path) < 0) {
-                char *err = NULL;
-                asprintf(&err, "{\"success\":false,\"error\":\"rmdir: %s\"}\n", strerror(errno));
-                return err;
+/*
+ * encoding is NULL/"none", "lz4" or "zstd"; compressed payloads also need
+ * their decoded size.
+ * With offset >= 0 the data is written in place into an existing file (a
+ * range of a file_alloc'ed upload) instead of replacing it. crc32, when not
+ * -1, is checked against the decoded data before anything is written.
+ */
+static char *handle_file_write(const struct agent_request *req, const char *path, const char *content,
+                               size_t content_len, const char *encoding, int decoded_size, long long offset,
+                               long long crc32, enum cache_mode cache) {
+    size_t data_len;
+    unsigned char *data = base64_decode(req->arena, content, content_len, &data_len);
+
+    if (!data) {
+        return strdup("{\"success\":false,\"error\":\"base64 decode failed\"}\n");
+    }
+
+    int codec = codec_parse(encoding);
+    if (codec < 0) {
+        return strdup("{\"success\":false,\"error\":\"unsupported encoding\"}\n");
+    }
+    if (codec != CODEC_NONE) {
+        char *err;
+        if (decoded_size < 0 || decoded_size > MAX_REQUEST_SIZE) {
+            asprintf(&err, "{\"success\":false,\"error\":\"%s content needs a valid size\"}\n", codec_names[codec]);
+            return err;
+        }
+        unsigned char *decoded = arena_alloc(req->arena, decoded_size);
+        if (!decoded) {
+            return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+        }
+        if (decompress_payload(codec, data, data_len, decoded, decoded_size) < 0) {
+            asprintf(&err, "{\"success\":false,\"error\":\"%s decode failed\"}\n", codec_names[codec]);
+            return err;
+        }
+        data = decoded;
+        data_len = decoded_size;
+    }
+
+    if (crc32 != -1 && crc32_update(0, data, data_len) != (uint32_t)crc32) {
+        return strdup("{\"success\":false,\"error\":\"crc32 mismatch\"}\n");
+    }
+
+    /* O_DIRECT needs a block-aligned file offset and buffer; chunks are copied into the buffer */
+    unsigned char *aligned = NULL;
+    if (cache == CACHE_DIRECT &&
+        ((offset > 0 && offset % DIRECT_IO_ALIGN != 0) ||
+         posix_memalign((void **)&aligned, DIRECT_IO_ALIGN, FILE_IO_CHUNK) != 0)) {
+        aligned = NULL;
+        cache = CACHE_DONTNEED;
+    }
+
+    int flags = offset >= 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(path, flags | O_CLOEXEC | (cache == CACHE_DIRECT ? O_DIRECT : 0), 0644);
+    if (fd < 0 && cache == CACHE_DIRECT && errno == EINVAL) {
+        /* Filesystems without direct IO refuse it at open */
+        cache = CACHE_DONTNEED;
+        fd = open(path, flags | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        free(aligned);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    off_t base = offset >= 0 ? offset : 0;
+    off_t released = base; /* written pages below this are out of the page cache */
+    bool direct = cache == CACHE_DIRECT;
+    size_t written = 0;
+    while (written < data_len) {
+        const char *why = request_cancelled(req);
+        if (why) {
+            close(fd);
+            free(aligned);
+            return cancelled_response(why);
+        }
+
+        size_t want = data_len - written;
+        if (want > FILE_IO_CHUNK) want = FILE_IO_CHUNK;
+        if (direct && want % DIRECT_IO_ALIGN != 0) {
+            want -= want % DIRECT_IO_ALIGN;
+            if (want == 0) {
+                /* The unaligned tail goes through the page cache and is dropped below */
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+                want = data_len - written;
             }
+        }
+        if ((why = bulk_throttle(req, want)) != NULL) {
+            close(fd);
+            free(aligned);
+            return cancelled_response(why);
+        }
+
+        ssize_t w;
+        if (direct) {
+            memcpy(aligned, data + written, want);
+            w = pwrite(fd, aligned, want, base + written);
         } else {
+            w = pwrite(fd, data + written, want, base + written);
+        }
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && direct) {
+                /* The device's block size is larger than the buffer alignment */
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+                cache = CACHE_DONTNEED;
+                continue;
+            }
+            int write_errno = errno;
+            close(fd);
+            free(aligned);
             char *err = NULL;
-            asprintf(&err, "{\"success\":false,\"error\":\"unlink: %s\"}\n", strerror(errno));
+            asprintf(&err, "{\"success\":false,\"error\":\"write: %s\"}\n", strerror(write_errno));
             return err;
         }
+
+        if (direct) {
+            released = base + written + w;
+        } else if (cache != CACHE_NORMAL) {
+            cache_release_written(fd, released, base + written, w);
+            released = base + written;
+        }
+        written += w;
+    }
+    if (cache != CACHE_NORMAL) cache_release_written(fd, released, base + written, 0);
+    close(fd);
+    free(aligned);
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"bytes_written\":%zu,\"cache\":\"%s\"}}\n", written,
+             cache_mode_names[cache]);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+/*
+ * Parallel uploads
+ *
+ * file_alloc creates a hidden partial file next to the target and reserves
+ * its full size up front, so ranges written concurrently with "offset" land
+ * in place and a full disk fails before any data moves. file_commit checks
+ * the size, flushes, and renames the partial file over the target.
+ */
+#define PARTIAL_SUFFIX ".hfpart-"
+
+static char *handle_file_alloc(const char *path, long long size) {
+    if (size < 0) {
+        return strdup("{\"success\":false,\"error\":\"missing size\"}\n");
+    }
+
+    char partial[PATH_MAX];
+    if (snprintf(partial, sizeof(partial), "%s" PARTIAL_SUFFIX "XXXXXX", path) >= (int)sizeof(partial)) {
+        return strdup("{\"success\":false,\"error\":\"path too long\"}\n");
+    }
+
+    int fd = mkstemp(partial);
+    if (fd < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"create: %s\"}\n", strerror(errno));
+        return err;
+    }
+    fchmod(fd, 0644);
+
+    int rc = size > 0 ? posix_fallocate(fd, 0, size) : 0;
+    if (rc == EOPNOTSUPP || rc == EINVAL) {
+        /* Filesystems without preallocation still get the final size */
+        rc = ftruncate(fd, size) < 0 ? errno : 0;
+    }
+    close(fd);
+    if (rc != 0) {
+        unlink(partial);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"allocate: %s\"}\n", strerror(rc));
+        return err;
+    }
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"partial_path\":\"");
+    writer_json_escaped(&w, partial, strlen(partial));
+    writer_printf(&w, "\",\"size\":%lld}}\n", size);
+    return writer_finish(&w);
+}
+
+static char *handle_file_commit(const char *partial, const char *target, long long size) {
+    if (size < 0) {
+        return strdup("{\"success\":false,\"error\":\"missing size\"}\n");
+    }
+
+    /* Only ever rename a partial file onto the target it was allocated for */
+    size_t target_len = strlen(target);
+    if (strncmp(partial, target, target_len) != 0 ||
+        strncmp(partial + target_len, PARTIAL_SUFFIX, strlen(PARTIAL_SUFFIX)) != 0) {
+        return strdup("{\"success\":false,\"error\":\"path is not a partial file of target\"}\n");
+    }
+
+    int fd = open(partial, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int stat_errno = errno;
+        close(fd);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"fstat: %s\"}\n", strerror(stat_errno));
+        return err;
+    }
+    if (st.st_size != size) {
+        close(fd);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"size mismatch: expected %lld, found %lld\"}\n",
+            size, (long long)st.st_size);
+        return err;
+    }
+
+    if (fsync(fd) < 0) {
+        int sync_errno = errno;
+        close(fd);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"fsync: %s\"}\n", strerror(sync_errno));
+        return err;
+    }
+    close(fd);
+
+    if (rename(partial, target) < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"rename: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    /* The rename only survives a crash once the directory holding it is synced too */
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", target);
+    char *slash = strrchr(parent, '/');
+    if (slash) slash[slash == parent ? 1 : 0] = '\0';
+    int dir = open(slash ? parent : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0 || fsync(dir) < 0) {
+        int sync_errno = errno;
+        if (dir >= 0) close(dir);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"fsync directory: %s\"}\n", strerror(sync_errno));
+        return err;
+    }
+    close(dir);
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"size\":%lld}}\n", (long long)st.st_size);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+static char *handle_file_stat(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"stat: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    char mode[16];
+    snprintf(mode, sizeof(mode), "%o", st.st_mode & 07777);
+
+    char mod_time[64];
+    struct tm *tm = gmtime(&st.st_mtime);
+    strftime(mod_time, sizeof(mod_time), "%Y-%m-%dT%H:%M:%SZ", tm);
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"path\":\"");
+    writer_json_escaped(&w, path, strlen(path));
+    writer_printf(&w, "\",\"size\":%ld,\"mode\":\"%s\",\"mod_time\":\"%s\",\"is_dir\":%s}}\n",
+        (long)st.st_size, mode, mod_time, S_ISDIR(st.st_mode) ? "true" : "false");
+    return writer_finish(&w);
+}
+
+static char *handle_file_delete(const char *path) {
+    if (unlink(path) < 0) {
+        if (errno == EISDIR) {
+            if (rmdir(path) < 0) {
+                char *err = NULL;
+                asprintf(&err, "{\"success\":false,\"error\":\"rmdir: %s\"}\n", strerror(errno));
+                return err;
+            }
+        } else {
+            char *err = NULL;
+            asprintf(&err, "{\"success\":false,\"error\":\"unlink: %s\"}\n", strerror(errno));
+            return err;
+        }
+    }
+
+    return strdup("{\"success\":true,\"data\":{}}\n");
+}
+
+/*
+ * cache_status reports how much of a file, or of a range of it with
+ * "offset" and "length", is in the page cache, from mincore() over a
+ * mapping that is never touched, so asking doesn't fault anything in.
+ * Cached extents are listed up to CACHE_STATUS_MAX_EXTENTS.
+ */
+#define CACHE_STATUS_MAX_EXTENTS 64
+#define CACHE_STATUS_BATCH_PAGES 65536 /* residency bytes fetched per mincore() */
+
+struct cache_extent {
+    long long offset;
+    long long length;
+};
+
+/* Pages round an extent out to page boundaries; record the part inside the range */
+static void cache_extent_add(struct cache_extent *extents, int *n, bool *truncated, struct file_range range,
+                             long long from, long long to) {
+    if (*n == CACHE_STATUS_MAX_EXTENTS) {
+        *truncated = true;
+        return;
+    }
+    if (from < range.offset) from = range.offset;
+    if (to > range.offset + range.length) to = range.offset + range.length;
+    extents[(*n)++] = (struct cache_extent){ .offset = from, .length = to - from };
+}
+
+static char *handle_cache_status(const struct agent_request *req, const char *path, struct file_range range) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"cache status needs a regular file\"}\n");
+    }
+
+    const char *bad_range = file_range_resolve(&range, st.st_size);
+    if (bad_range) {
+        close(fd);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"%s\"}\n", bad_range);
+        return err;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t base = range.offset - range.offset % page_size;
+    long long end = range.offset + range.length;
+    size_t pages = (end - base + page_size - 1) / page_size;
+    unsigned char *vec = arena_alloc(req->arena, CACHE_STATUS_BATCH_PAGES);
+    if (!vec) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+
+    struct cache_extent extents[CACHE_STATUS_MAX_EXTENTS];
+    int nextents = 0;
+    bool truncated = false;
+    size_t cached = 0;
+    long long cached_bytes = 0, extent_start = -1;
+
+    for (size_t done = 0; done < pages; done += CACHE_STATUS_BATCH_PAGES) {
+        size_t count = pages - done < CACHE_STATUS_BATCH_PAGES ? pages - done : CACHE_STATUS_BATCH_PAGES;
+        if (cache_residency(fd, base + done * page_size, count, page_size, vec) < 0) {
+            int map_errno = errno;
+            close(fd);
+            char *err = NULL;
+            asprintf(&err, "{\"success\":false,\"error\":\"mincore: %s\"}\n", strerror(map_errno));
+            return err;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            long long at = base + (long long)(done + i) * page_size;
+            if (vec[i] & 1) {
+                /* Only the part of the page inside the range counts */
+                long long from = at > range.offset ? at : range.offset;
+                long long to = at + page_size < end ? at + page_size : end;
+                cached++;
+                cached_bytes += to - from;
+                if (extent_start < 0) extent_start = at;
+            } else if (extent_start >= 0) {
+                cache_extent_add(extents, &nextents, &truncated, range, extent_start, at);
+                extent_start = -1;
+            }
+        }
+    }
+    if (extent_start >= 0) cache_extent_add(extents, &nextents, &truncated, range, extent_start, end);
+    close(fd);
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"path\":\"");
+    writer_json_escaped(&w, path, strlen(path));
+    writer_printf(&w,
+        "\",\"file_size\":%lld,\"offset\":%lld,\"length\":%lld,\"page_size\":%ld,"
+        "\"pages\":%zu,\"cached_pages\":%zu,\"cached_bytes\":%lld,\"extents\":[",
+        (long long)st.st_size, range.offset, range.length, page_size, pages, cached, cached_bytes);
+    for (int i = 0; i < nextents; i++) {
+        writer_printf(&w, "%s{\"offset\":%lld,\"length\":%lld}", i ? "," : "", extents[i].offset,
+                      extents[i].length);
+    }
+    writer_printf(&w, "],\"extents_truncated\":%s}}\n", truncated ? "true" : "false");
+    return writer_finish(&w);
+}
+
+/*
+ * Raw downloads
+ *
+ * With "framing":"raw", file_read answers with a JSON header line carrying
+ * the size, followed by exactly that many raw bytes. Without base64 the
+ * bytes never have to pass through user space: sendfile() sends straight
+ * from the page cache, and MSG_ZEROCOPY sends from an mmap of the file,
+ * with the kernel pinning the pages and reporting on the socket error queue
+ * once it's done with them. Zerocopy falls back to sendfile() wherever the
+ * kernel or the vsock transport doesn't support it.
+ */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#define ZEROCOPY_MIN_SIZE (256 * 1024) /* below this, pinning pages costs more than copying */
+#define ZEROCOPY_DRAIN_IDLE_MS 10000   /* give up on completions after this long without one */
+
+enum send_mode { SEND_COPY, SEND_SENDFILE, SEND_ZEROCOPY, SEND_MODE_COUNT };
+
+static const char *send_mode_names[SEND_MODE_COUNT] = { "copy", "sendfile", "zerocopy" };
+
+struct send_stats {
+    enum send_mode mode;         /* mode the transfer finished in */
+    bool fallback;               /* a faster mode was requested but not available */
+    unsigned int zc_sends;       /* MSG_ZEROCOPY sends issued */
+    unsigned int zc_completions; /* sends the kernel has released */
+    unsigned int zc_copied;      /* completions where the kernel copied after all */
+};
+
+/* NULL or "auto" picks zerocopy for large payloads and sendfile otherwise */
+static int send_mode_parse(const char *name, size_t size, enum send_mode *mode) {
+    if (!name || strcmp(name, "auto") == 0) {
+        *mode = size >= ZEROCOPY_MIN_SIZE ? SEND_ZEROCOPY : SEND_SENDFILE;
+        return 0;
+    }
+    for (int i = 0; i < SEND_MODE_COUNT; i++) {
+        if (strcmp(name, send_mode_names[i]) == 0) {
+            *mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static long long clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Collect zerocopy completions, waiting up to timeout_ms for the first. Returns how many sends completed. */
+static unsigned int zerocopy_reap(int sock, struct send_stats *stats, int timeout_ms) {
+    if (timeout_ms > 0) {
+        /* Error queue readiness is reported as POLLERR, which needs no request */
+        struct pollfd pfd = { .fd = sock, .events = 0 };
+        poll(&pfd, 1, timeout_ms);
+    }
+
+    unsigned int reaped = 0;
+    for (;;) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err ee;
+            if (cm->cmsg_len < CMSG_LEN(sizeof(ee))) continue;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            /* Sends are numbered from 0; each notification covers ee_info..ee_data */
+            unsigned int n = ee.ee_data - ee.ee_info + 1;
+            stats->zc_completions += n;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) stats->zc_copied += n;
+            reaped += n;
+        }
+    }
+    return reaped;
+}
+
+/*
+ * Send len bytes of fd, starting at offset, to sock. Returns NULL once
+ * everything was sent, or why it stopped; the peer then sees a short body.
+ */
+static const char *stream_file(const struct agent_request *req, int sock, int fd, off_t offset, size_t len,
+                               enum send_mode mode, enum cache_mode cache, struct send_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    struct cache_guard guard;
+    if (cache_guard_init(&guard, req->arena, cache, fd, offset, len) < 0) return "out of memory";
+
+    uint8_t *map = MAP_FAILED;
+    size_t map_len = 0, map_skip = 0;
+    if (mode == SEND_ZEROCOPY) {
+        int one = 1;
+        /* mmap offsets must be page aligned */
+        map_skip = offset % sysconf(_SC_PAGESIZE);
+        map_len = len + map_skip;
+        if (len == 0 || setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0 ||
+            (map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, offset - map_skip)) == MAP_FAILED) {
+            mode = SEND_SENDFILE;
+            stats->fallback = len > 0;
+        }
+    }
+
+    char *buf = NULL;
+    const char *why = NULL;
+    size_t done = 0;
+
+    while (done < len) {
+        if ((why = request_cancelled(req)) != NULL) break;
+
+        size_t want = len - done;
+        if (want > FILE_IO_CHUNK) want = FILE_IO_CHUNK;
+        if ((why = bulk_throttle(req, want)) != NULL) break;
+
+        ssize_t n;
+        if (mode == SEND_ZEROCOPY) {
+            n = send(sock, map + map_skip + done, want, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n >= 0) {
+                stats->zc_sends++;
+                zerocopy_reap(sock, stats, 0);
+            } else if (errno == ENOBUFS && stats->zc_sends > stats->zc_completions) {
+                /* Too much pinned memory in flight; wait for the kernel to release some */
+                zerocopy_reap(sock, stats, 100);
+                continue;
+            } else if (errno == ENOBUFS || errno == EOPNOTSUPP || errno == EINVAL) {
+                /* Finish the transfer the ordinary way */
+                mode = SEND_SENDFILE;
+                stats->fallback = true;
+                continue;
+            }
+        } else if (mode == SEND_SENDFILE) {
+            off_t pos = offset + done;
+            n = sendfile(sock, fd, &pos, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                /* Files without page cache backing (procfs and friends) can't be spliced */
+                mode = SEND_COPY;
+                continue;
+            }
+        } else {
+            if (!buf && !(buf = malloc(FILE_IO_CHUNK))) {
+                why = "out of memory";
+                break;
+            }
+            n = pread(fd, buf, want, offset + done);
+            if (n > 0 && write_all(sock, buf, n) < 0) n = -1;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_debug("stream %s: %s", send_mode_names[mode], strerror(errno));
+            why = "send failed";
+            break;
+        }
+        if (n == 0) {
+            why = "file shrank while sending";
+            break;
+        }
+        done += n;
+        /* A chunk behind, since the socket may still hold the last one's pages */
+        if (done > FILE_IO_CHUNK) cache_guard_drop(&guard, fd, offset + done - FILE_IO_CHUNK);
+    }
+
+    /* The pages must stay mapped until the kernel has let go of them */
+    long long idle_since = monotonic_ms();
+    while (stats->zc_completions < stats->zc_sends && !request_cancelled(req) &&
+           monotonic_ms() - idle_since < ZEROCOPY_DRAIN_IDLE_MS) {
+        if (zerocopy_reap(sock, stats, 100) > 0) idle_since = monotonic_ms();
+    }
+
+    if (map != MAP_FAILED) munmap(map, map_len);
+    cache_guard_drop(&guard, fd, -1);
+    free(buf);
+    stats->mode = mode;
+    return why;
+}
+
+static char *handle_file_read_raw(const struct agent_request *req, const char *path, struct file_range range,
+                                  const char *send_mode, enum cache_mode cache) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"open: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"raw framing needs a regular file\"}\n");
+    }
+
+    const char *bad_range = file_range_resolve(&range, st.st_size);
+    if (bad_range) {
+        close(fd);
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"%s\"}\n", bad_range);
+        return err;
+    }
+
+    enum send_mode mode;
+    if (send_mode_parse(send_mode, range.length, &mode) < 0) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"unknown send_mode\"}\n");
+    }
+
+    char *header = NULL;
+    asprintf(&header,
+        "{\"success\":true,\"data\":{\"size\":%lld,\"offset\":%lld,\"file_size\":%lld,"
+        "\"framing\":\"raw\",\"send_mode\":\"%s\",\"cache\":\"%s\"}}\n",
+        range.length, range.offset, (long long)st.st_size, send_mode_names[mode], cache_mode_names[cache]);
+    if (!header) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+    int rc = write_all(req->client_fd, header, strlen(header));
+    free(header);
+
+    if (rc == 0) {
+        struct send_stats stats;
+        const char *why = stream_file(req, req->client_fd, fd, range.offset, range.length, mode, cache, &stats);
+        if (why) {
+            log_warn("raw read of %s stopped: %s", path, why);
+        } else {
+            log_debug("raw read of %s: %lld bytes via %s (zerocopy %u sends, %u copied)", path,
+                range.length, send_mode_names[stats.mode], stats.zc_sends, stats.zc_copied);
+        }
+    }
+    close(fd);
+
+    /* The reply has already been streamed */
+    return NULL;
+}
+
+/*
+ * transfer_bench streams the same in-memory payload once per send mode and
+ * reports throughput plus the CPU time spent per GiB, both by the sending
+ * thread and by the guest as a whole (softirqs, virtio completions). Each
+ * run is announced by a {"segment":"<mode>","size":N} line; the host
+ * discards the bytes and reads the results from the final response line.
+ */
+#define BENCH_DEFAULT_MB 64
+#define BENCH_MAX_MB 1024
+#define BENCH_MEMORY_SHARE 2 /* largest payload, as a fraction of MemAvailable */
+
+/* Busy time of all CPUs from /proc/stat, in microseconds */
+static long long guest_busy_us(void) {
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f) return 0;
+    unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+        &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(f);
+    if (n < 4) return 0;
+    return (long long)(user + nice + system + irq + softirq + steal) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
+
+static char *handle_transfer_bench(const struct agent_request *req, const char *json) {
+    int size_mb = BENCH_DEFAULT_MB;
+    json_get_int(json, "size_mb", &size_mb);
+    if (size_mb < 1 || size_mb > BENCH_MAX_MB) {
+        return strdup("{\"success\":false,\"error\":\"size_mb must be between 1 and 1024\"}\n");
+    }
+    size_t size = (size_t)size_mb * 1024 * 1024;
+    /* The payload stays resident for the whole run; don't push the guest into reclaim for it */
+    unsigned long long available = 0;
+    if (read_counter("/proc/meminfo", "MemAvailable", &available) && size > available / BENCH_MEMORY_SHARE) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"size_mb is over 1/%d of available memory (%llu MiB)\"}\n",
+                 BENCH_MEMORY_SHARE, available / (1024 * 1024));
+        return err;
+    }
+
+    enum send_mode modes[SEND_MODE_COUNT] = { SEND_COPY, SEND_SENDFILE, SEND_ZEROCOPY };
+    int mode_count = SEND_MODE_COUNT;
+    char *names[SEND_MODE_COUNT + 1];
+    int named = json_get_string_array(req->arena, json, "modes", names, SEND_MODE_COUNT);
+    if (named > 0) {
+        bool valid = true;
+        for (int i = 0; i < named; i++) {
+            if (strcmp(names[i], "auto") == 0 || send_mode_parse(names[i], size, &modes[i]) < 0) valid = false;
+        }
+        if (!valid) return strdup("{\"success\":false,\"error\":\"unknown send mode\"}\n");
+        mode_count = named;
+    }
+
+    /* Fill a memfd so every mode sends the same resident pages */
+    int fd = memfd_create("transfer_bench", MFD_CLOEXEC);
+    if (fd < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"memfd_create: %s\"}\n", strerror(errno));
+        return err;
+    }
+    char *fill = arena_alloc(req->arena, FILE_IO_CHUNK);
+    if (!fill) {
+        close(fd);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+    getrandom(fill, FILE_IO_CHUNK, 0);
+    for (size_t off = 0; off < size; off += FILE_IO_CHUNK) {
+        if (pwrite(fd, fill, FILE_IO_CHUNK, off) != FILE_IO_CHUNK) {
+            close(fd);
+            return strdup("{\"success\":false,\"error\":\"not enough memory for the payload\"}\n");
+        }
+    }
+
+    char results[SEND_MODE_COUNT * 320] = "";
+    size_t results_len = 0;
+
+    for (int i = 0; i < mode_count; i++) {
+        char segment[96];
+        int segment_len = snprintf(segment, sizeof(segment), "{\"segment\":\"%s\",\"size\":%zu}\n",
+            send_mode_names[modes[i]], size);
+        if (write_all(req->client_fd, segment, segment_len) < 0) {
+            close(fd);
+            return NULL;
+        }
+
+        long long wall0 = clock_us(CLOCK_MONOTONIC);
+        long long cpu0 = clock_us(CLOCK_THREAD_CPUTIME_ID);
+        long long guest0 = guest_busy_us();
+
+        struct send_stats stats;
+        const char *why = stream_file(req, req->client_fd, fd, 0, size, modes[i], CACHE_NORMAL, &stats);
+        if (why) {
+            /* The segment is short, so nothing after it could be parsed */
+            log_warn("transfer_bench %s stopped: %s", send_mode_names[modes[i]], why);
+            close(fd);
+            return NULL;
+        }
+
+        double seconds = (clock_us(CLOCK_MONOTONIC) - wall0) / 1e6;
+        double cpu_ms = (clock_us(CLOCK_THREAD_CPUTIME_ID) - cpu0) / 1e3;
+        double guest_cpu_ms = (guest_busy_us() - guest0) / 1e3;
+        double gib = (double)size / (1024.0 * 1024 * 1024);
+
+        results_len += snprintf(results + results_len, sizeof(results) - results_len,
+            "%s{\"mode\":\"%s\",\"used\":\"%s\",\"fallback\":%s,\"seconds\":%.3f,\"mb_per_s\":%.1f,"
+            "\"cpu_ms_per_gib\":%.1f,\"guest_cpu_ms_per_gib\":%.1f,\"zerocopy_sends\":%u,\"zerocopy_copied\":%u}",
+            i > 0 ? "," : "", send_mode_names[modes[i]], send_mode_names[stats.mode],
+            stats.fallback ? "true" : "false", seconds, seconds > 0 ? size / 1048576.0 / seconds : 0.0,
+            cpu_ms / gib, guest_cpu_ms / gib, stats.zc_sends, stats.zc_copied);
+    }
+    close(fd);
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"size\":%zu,\"results\":[%s]}}\n", size, results);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+/*
+ * Agent-owned child processes
+ *
+ * The main loop reaps every zombie, which would steal exit statuses from
+ * exec and session supervisors waiting on their own children. Pids
+ * registered here are left for their owner to collect.
+ */
+#define MAX_TRACKED_CHILDREN 256
+
+static pid_t tracked_children[MAX_TRACKED_CHILDREN];
+static int tracked_count = 0;
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* fork() and register the child before the reaper can see it exit */
+static pid_t fork_tracked(void) {
+    pthread_mutex_lock(&children_lock);
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Don't let host workloads inherit the agent's control priority */
+        setpriority(PRIO_PROCESS, 0, 0);
+    } else if (pid > 0) {
+        if (tracked_count < MAX_TRACKED_CHILDREN) {
+            tracked_children[tracked_count++] = pid;
+        } else {
+            log_warn("child tracking table full, pid %d may lose its exit status", pid);
+        }
+    }
+    if (pid != 0) pthread_mutex_unlock(&children_lock);
+    return pid;
+}
+
+static void untrack_child(pid_t pid) {
+    pthread_mutex_lock(&children_lock);
+    for (int i = 0; i < tracked_count; i++) {
+        if (tracked_children[i] == pid) {
+            tracked_children[i] = tracked_children[--tracked_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&children_lock);
+}
+
+static bool child_is_tracked(pid_t pid) {
+    for (int i = 0; i < tracked_count; i++) {
+        if (tracked_children[i] == pid) return true;
+    }
+    return false;
+}
+
+/*
+ * Jobs
+ *
+ * Every exec runs as a job: its own process group, and (when cgroup v2 is
+ * available) its own cgroup under /sys/fs/cgroup/hyperfleet. The host can
+ * signal the group or freeze/thaw the cgroup while the exec is in flight.
+ */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define JOB_CGROUP_ROOT CGROUP_ROOT "/hyperfleet"
+#define MAX_JOBS 64
+#define JOB_ID_MAX 64
+#define JOB_FREEZE_WAIT_MS 1000
+
+struct exec_job {
+    bool in_use;
+    char id[JOB_ID_MAX];
+    pid_t pid;
+    bool has_cgroup;
+    bool frozen;
+    long long started_ms;
+    long long frozen_since_ms;
+    long long frozen_total_ms;
+};
+
+static bool cgroups_available = false;
+static struct exec_job jobs[MAX_JOBS];
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long next_job_seq = 1;
+
+static int setup_cgroups(void) {
+    if (mount_fs("cgroup2", CGROUP_ROOT, "cgroup2", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) {
+        return -1;
+    }
+    if (mkdir(JOB_CGROUP_ROOT, 0755) != 0 && errno != EEXIST) {
+        log_warn("mkdir %s: %s", JOB_CGROUP_ROOT, strerror(errno));
+        return -1;
+    }
+    /* Let jobs be given memory and pid limits; either may be missing from the kernel */
+    static const char *controllers[] = { "+memory", "+pids" };
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (write_file(CGROUP_ROOT "/cgroup.subtree_control", controllers[i]) < 0 ||
+            write_file(JOB_CGROUP_ROOT "/cgroup.subtree_control", controllers[i]) < 0) {
+            log_debug("cgroup controller %s unavailable: %s", controllers[i] + 1, strerror(errno));
+        }
+    }
+    cgroups_available = true;
+    log_debug("cgroup v2 job hierarchy ready");
+    return 0;
+}
+
+static bool job_id_valid(const char *id) {
+    size_t len = strlen(id);
+    if (len == 0 || len >= JOB_ID_MAX || id[0] == '.') return false;
+    for (size_t i = 0; i < len; i++) {
+        char c = id[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void job_cgroup_path(const char *id, const char *file, char *out, size_t out_len) {
+    if (file) {
+        snprintf(out, out_len, "%s/%s/%s", JOB_CGROUP_ROOT, id, file);
+    } else {
+        snprintf(out, out_len, "%s/%s", JOB_CGROUP_ROOT, id);
+    }
+}
+
+/* Reserve a job slot. Returns NULL if the id is taken or the table is full. */
+static struct exec_job *job_register(const char *id) {
+    struct exec_job *job = NULL;
+
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && strcmp(jobs[i].id, id) == 0) {
+            pthread_mutex_unlock(&jobs_lock);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (!jobs[i].in_use) {
+            job = &jobs[i];
+            memset(job, 0, sizeof(*job));
+            job->in_use = true;
+            snprintf(job->id, sizeof(job->id), "%s", id);
+            job->started_ms = monotonic_ms();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return job;
+}
+
+static void job_unregister(struct exec_job *job) {
+    if (job->has_cgroup) {
+        char path[256];
+        job_cgroup_path(job->id, NULL, path, sizeof(path));
+        /* Fails with EBUSY if the job left background processes behind */
+        if (rmdir(path) != 0 && errno != ENOENT) {
+            log_debug("job %s cgroup kept: %s", job->id, strerror(errno));
+        }
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job->in_use = false;
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+/* Create the job's cgroup and return an fd for cgroup.procs, or -1 */
+static int job_cgroup_open(struct exec_job *job) {
+    if (!cgroups_available) return -1;
+
+    char path[256];
+    job_cgroup_path(job->id, NULL, path, sizeof(path));
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        log_warn("mkdir %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    job_cgroup_path(job->id, "cgroup.procs", path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_warn("open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    job->has_cgroup = true;
+    return fd;
+}
+
+/* Time the job has been runnable, excluding periods it spent frozen */
+static long long job_active_ms(struct exec_job *job) {
+    pthread_mutex_lock(&jobs_lock);
+    long long now = monotonic_ms();
+    long long frozen = job->frozen_total_ms;
+    if (job->frozen) frozen += now - job->frozen_since_ms;
+    long long active = now - job->started_ms - frozen;
+    pthread_mutex_unlock(&jobs_lock);
+    return active;
+}
+
+static struct exec_job *job_find_locked(const char *id) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && strcmp(jobs[i].id, id) == 0) return &jobs[i];
+    }
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    int sig;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+    { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "WINCH", SIGWINCH }, { "ALRM", SIGALRM },
+    { NULL, 0 }
+};
+
+/* Accepts "signal": 15, "signal": "TERM" or "signal": "SIGTERM" */
+static int json_get_signal(struct arena *arena, const char *json) {
+    int sig;
+    char *name = json_get_string(arena, json, "signal");
+    if (name) {
+        const char *n = strncmp(name, "SIG", 3) == 0 ? name + 3 : name;
+        sig = -1;
+        for (int i = 0; signal_names[i].name; i++) {
+            if (strcmp(n, signal_names[i].name) == 0) {
+                sig = signal_names[i].sig;
+                break;
+            }
+        }
+        return sig;
+    }
+    if (json_get_int(json, "signal", &sig) != 0) return -1;
+    return (sig > 0 && sig < NSIG) ? sig : -1;
+}
+
+static char *handle_job_signal(const struct agent_request *req, const char *json) {
+    char *id = json_get_string(req->arena, json, "job_id");
+    if (!id) {
+        return strdup("{\"success\":false,\"error\":\"missing job_id\"}\n");
+    }
+
+    int sig = json_get_signal(req->arena, json);
+    if (sig < 0) {
+        return strdup("{\"success\":false,\"error\":\"invalid signal\"}\n");
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    struct exec_job *job = job_find_locked(id);
+    pid_t pgid = job ? job->pid : 0;
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (pgid <= 0) {
+        return strdup("{\"success\":false,\"error\":\"unknown job\"}\n");
+    }
+
+    if (kill(-pgid, sig) < 0) {
+        char *err = NULL;
+        asprintf(&err, "{\"success\":false,\"error\":\"kill: %s\"}\n", strerror(errno));
+        return err;
+    }
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"signal\":%d}}\n", sig);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+/* Wait until cgroup.events reports the requested frozen state */
+static bool job_wait_frozen(const char *id, bool frozen) {
+    char path[256];
+    job_cgroup_path(id, "cgroup.events", path, sizeof(path));
+    const char *want = frozen ? "frozen 1" : "frozen 0";
+
+    for (int waited = 0; waited <= JOB_FREEZE_WAIT_MS; waited += 5) {
+        char buf[256];
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n > 0) {
+            buf[n] = '\0';
+            if (strstr(buf, want)) return true;
+        }
+        usleep(5000);
+    }
+    return false;
+}
+
+static char *job_set_frozen(const struct agent_request *req, const char *json, bool freeze) {
+    char *id = json_get_string(req->arena, json, "job_id");
+    if (!id) {
+        return strdup("{\"success\":false,\"error\":\"missing job_id\"}\n");
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    struct exec_job *job = job_find_locked(id);
+    pid_t pgid = job ? job->pid : 0;
+    bool has_cgroup = job && job->has_cgroup;
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (pgid <= 0) {
+        return strdup("{\"success\":false,\"error\":\"unknown job\"}\n");
+    }
+
+    const char *method;
+    bool settled = true;
+    if (has_cgroup) {
+        char path[256];
+        job_cgroup_path(id, "cgroup.freeze", path, sizeof(path));
+        if (write_file(path, freeze ? "1" : "0") < 0) {
+            char *err = NULL;
+            asprintf(&err, "{\"success\":false,\"error\":\"cgroup.freeze: %s\"}\n", strerror(errno));
+            return err;
+        }
+        settled = job_wait_frozen(id, freeze);
+        method = "cgroup";
+    } else {
+        /* No cgroup v2: stop the process group instead */
+        if (kill(-pgid, freeze ? SIGSTOP : SIGCONT) < 0) {
+            char *err = NULL;
+            asprintf(&err, "{\"success\":false,\"error\":\"kill: %s\"}\n", strerror(errno));
+            return err;
+        }
+        method = "signal";
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job = job_find_locked(id);
+    if (job && job->frozen != freeze) {
+        long long now = monotonic_ms();
+        if (freeze) {
+            job->frozen_since_ms = now;
+        } else {
+            job->frozen_total_ms += now - job->frozen_since_ms;
+        }
+        job->frozen = freeze;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"frozen\":%s,\"settled\":%s,\"method\":\"%s\"}}\n",
+        freeze ? "true" : "false", settled ? "true" : "false", method);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+static char *handle_job_freeze(const struct agent_request *req, const char *json) {
+    return job_set_frozen(req, json, true);
+}
+
+static char *handle_job_thaw(const struct agent_request *req, const char *json) {
+    return job_set_frozen(req, json, false);
+}
+
+static char *handle_job_list(void) {
+    size_t cap = 64 + MAX_JOBS * (JOB_ID_MAX + 96);
+    char *response = malloc(cap);
+    if (!response) return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+
+    size_t len = snprintf(response, cap, "{\"success\":true,\"data\":{\"jobs\":[");
+    bool first = true;
+
+    pthread_mutex_lock(&jobs_lock);
+    long long now = monotonic_ms();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (!jobs[i].in_use || jobs[i].pid <= 0) continue;
+        len += snprintf(response + len, cap - len,
+            "%s{\"job_id\":\"%s\",\"pid\":%d,\"frozen\":%s,\"elapsed_ms\":%lld}",
+            first ? "" : ",", jobs[i].id, jobs[i].pid,
+            jobs[i].frozen ? "true" : "false", now - jobs[i].started_ms);
+        first = false;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    snprintf(response + len, cap - len, "]}}\n");
+    return response;
+}
+
+/*
+ * Job sandboxes
+ *
+ * An exec with "sandbox" runs in fresh mount, pid, ipc and uts namespaces,
+ * plus a network namespace holding only loopback when "network" is false,
+ * so several untrusted jobs can share one VM without seeing each other.
+ * Its root is either:
+ *   "overlay"  the VM's root filesystem under a private upper layer that is
+ *              thrown away when the job exits (the default)
+ *   "tmpfs"    an empty tmpfs with /bin, /sbin, /usr, /lib, /lib64 and /etc
+ *              bound read-only
+ * Either way the job gets its own /proc, /tmp and /run, a /dev holding only
+ * the basic character devices, and loses the capabilities that would let
+ * it undo the isolation (mounting, raw I/O, device nodes, module loading,
+ * ptrace, network configuration, ...). "memory_mb" and "pids_max" cap the
+ * job's cgroup. The kernel tears it all down, including anything the job
+ * left running, once the job exits.
+ *
+ * The exec child unshares and forks pid 1 of the new pid namespace, which
+ * forks the command and reaps what it leaves behind. Pid 1 of a namespace
+ * ignores signals it has no handler for, so the command isn't run as pid 1:
+ * job_signal reaches it like any other job. The exec child exits the way
+ * the command did, so the exec loop and job control are unchanged.
+ */
+#define SANDBOX_DIR "/run/hyperfleet-sandbox"
+#define SANDBOX_ROOT SANDBOX_DIR "/root"
+
+enum sandbox_root { SANDBOX_ROOT_OVERLAY, SANDBOX_ROOT_TMPFS };
+
+struct sandbox_opts {
+    bool enabled;
+    enum sandbox_root root;
+    bool network;
+    int memory_mb;
+    int pids_max;
+};
+
+static const struct {
+    const char *name;
+    unsigned int major;
+    unsigned int minor;
+} sandbox_devices[] = {
+    { "null", 1, 3 }, { "zero", 1, 5 }, { "full", 1, 7 },
+    { "random", 1, 8 }, { "urandom", 1, 9 }, { "tty", 5, 0 },
+};
+
+/* Bound read-only into a tmpfs root */
+static const char *sandbox_system_dirs[] = { "bin", "sbin", "usr", "lib", "lib64", "etc" };
+
+/*
+ * The only capabilities a sandboxed job keeps; every other one, including
+ * ones this build doesn't know about, leaves its bounding set. Notably gone:
+ * CAP_DAC_READ_SEARCH (open_by_handle_at reaches any inode on the
+ * filesystems bound into the root) and CAP_SYS_RESOURCE.
+ */
+static const int sandbox_kept_caps[] = {
+    CAP_CHOWN, CAP_DAC_OVERRIDE, CAP_FOWNER, CAP_FSETID, CAP_KILL, CAP_SETGID,
+    CAP_SETUID, CAP_SETPCAP, CAP_NET_BIND_SERVICE, CAP_AUDIT_WRITE,
+};
+
+static bool sandbox_cap_kept(int cap) {
+    for (size_t i = 0; i < sizeof(sandbox_kept_caps) / sizeof(sandbox_kept_caps[0]); i++) {
+        if (sandbox_kept_caps[i] == cap) return true;
+    }
+    return false;
+}
+
+/*
+ * Close every descriptor above stdio: the vsock listeners, client
+ * connections and files other requests have open must not reach the job
+ */
+static void sandbox_close_fds(void) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0) return;
+#endif
+    /* Kernels before 5.9 */
+    struct rlimit rl;
+    int max_fd = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur : 65536;
+    for (int fd = 3; fd < max_fd; fd++) close(fd);
+}
+
+/* "sandbox": true or {"root","network","memory_mb","pids_max"}. Returns NULL or an error. */
+static const char *sandbox_parse(struct arena *arena, const char *json, struct sandbox_opts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->network = true;
+
+    const char *value = json_find_key(json, "sandbox");
+    if (!value) return NULL;
+    if (json_get_bool(json, "sandbox", &opts->enabled) == 0) return NULL;
+    if (*value != '{') return "sandbox must be a boolean or an object";
+    opts->enabled = true;
+
+    char *root = json_get_string(arena, value, "root");
+    if (root && strcmp(root, "tmpfs") == 0) {
+        opts->root = SANDBOX_ROOT_TMPFS;
+    } else if (root && strcmp(root, "overlay") != 0) {
+        return "sandbox.root must be overlay or tmpfs";
+    }
+    json_get_bool(value, "network", &opts->network);
+    json_get_int(value, "memory_mb", &opts->memory_mb);
+    json_get_int(value, "pids_max", &opts->pids_max);
+    if (opts->memory_mb < 0 || opts->pids_max < 0) return "sandbox limits must be positive";
+    if (opts->memory_mb > 0 && !cgroups_available) return "sandbox.memory_mb needs cgroup v2";
+    if (opts->pids_max > 0 && !cgroups_available) return "sandbox.pids_max needs cgroup v2";
+    return NULL;
+}
+
+/* Apply the sandbox's cgroup limits before the job is started in it */
+static int sandbox_limit_cgroup(struct exec_job *job, const struct sandbox_opts *opts) {
+    char path[256], value[32];
+    if (opts->memory_mb > 0) {
+        job_cgroup_path(job->id, "memory.max", path, sizeof(path));
+        snprintf(value, sizeof(value), "%lld", (long long)opts->memory_mb * 1024 * 1024);
+        if (write_file(path, value) < 0) return -1;
+        /* Don't let it swap its way past the limit */
+        job_cgroup_path(job->id, "memory.swap.max", path, sizeof(path));
+        write_file(path, "0");
+    }
+    if (opts->pids_max > 0) {
+        job_cgroup_path(job->id, "pids.max", path, sizeof(path));
+        snprintf(value, sizeof(value), "%d", opts->pids_max);
+        if (write_file(path, value) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Runs in the forked job: report why the sandbox couldn't be built, without the logger's locks */
+static void sandbox_fail(const char *what) {
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg), "sandbox: %s: %s\n", what, strerror(errno));
+    write(STDERR_FILENO, msg, len);
+    _exit(126);
+}
+
+static void sandbox_mount(const char *source, const char *target, const char *fstype,
+                          unsigned long flags, const char *data) {
+    mkdir(target, 0755);
+    if (mount(source, target, fstype, flags, data) != 0) sandbox_fail(target);
+}
+
+static void sandbox_bind_ro(const char *source, const char *target) {
+    sandbox_mount(source, target, NULL, MS_BIND | MS_REC, NULL);
+    if (mount(NULL, target, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV, NULL) != 0) {
+        sandbox_fail(target);
+    }
+}
+
+/* Build the job's root under SANDBOX_ROOT and switch to it */
+static void sandbox_enter_root(const struct sandbox_opts *opts) {
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) sandbox_fail("make mounts private");
+
+    /* Only this mount namespace sees the scratch tmpfs, so jobs can't collide on it */
+    mkdir(SANDBOX_DIR, 0700);
+    sandbox_mount("tmpfs", SANDBOX_DIR, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0700");
+
+    char path[PATH_MAX];
+    if (opts->root == SANDBOX_ROOT_OVERLAY) {
+        mkdir(SANDBOX_DIR "/upper", 0755);
+        mkdir(SANDBOX_DIR "/work", 0755);
+        sandbox_mount("overlay", SANDBOX_ROOT, "overlay", 0,
+                      "lowerdir=/,upperdir=" SANDBOX_DIR "/upper,workdir=" SANDBOX_DIR "/work");
+    } else {
+        sandbox_mount("tmpfs", SANDBOX_ROOT, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755");
+        for (size_t i = 0; i < sizeof(sandbox_system_dirs) / sizeof(sandbox_system_dirs[0]); i++) {
+            char source[64], link[PATH_MAX];
+            struct stat st;
+            snprintf(source, sizeof(source), "/%s", sandbox_system_dirs[i]);
+            snprintf(path, sizeof(path), "%s%s", SANDBOX_ROOT, source);
+            if (lstat(source, &st) != 0) continue;
+            if (S_ISLNK(st.st_mode)) {
+                /* Merged-/usr layouts: /bin -> usr/bin */
+                ssize_t n = readlink(source, link, sizeof(link) - 1);
+                if (n > 0) {
+                    link[n] = '\0';
+                    symlink(link, path);
+                }
+            } else if (S_ISDIR(st.st_mode)) {
+                sandbox_bind_ro(source, path);
+            }
+        }
+    }
+
+    sandbox_mount("proc", SANDBOX_ROOT "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+    sandbox_mount("sysfs", SANDBOX_ROOT "/sys", "sysfs", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_RDONLY, NULL);
+    sandbox_mount("tmpfs", SANDBOX_ROOT "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777");
+    sandbox_mount("tmpfs", SANDBOX_ROOT "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755");
+    sandbox_mount("tmpfs", SANDBOX_ROOT "/dev", "tmpfs", MS_NOSUID, "mode=0755");
+    for (size_t i = 0; i < sizeof(sandbox_devices) / sizeof(sandbox_devices[0]); i++) {
+        snprintf(path, sizeof(path), "%s/dev/%s", SANDBOX_ROOT, sandbox_devices[i].name);
+        if (mknod(path, S_IFCHR | 0666, makedev(sandbox_devices[i].major, sandbox_devices[i].minor)) != 0) {
+            sandbox_fail(path);
+        }
+    }
+    sandbox_mount("tmpfs", SANDBOX_ROOT "/dev/shm", "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777");
+    symlink("/proc/self/fd", SANDBOX_ROOT "/dev/fd");
+    symlink("/proc/self/fd/0", SANDBOX_ROOT "/dev/stdin");
+    symlink("/proc/self/fd/1", SANDBOX_ROOT "/dev/stdout");
+    symlink("/proc/self/fd/2", SANDBOX_ROOT "/dev/stderr");
+
+    /* Root may write to (or read) these without any capability */
+    sandbox_bind_ro(SANDBOX_ROOT "/proc/sys", SANDBOX_ROOT "/proc/sys");
+    static const char *masked[] = { SANDBOX_ROOT "/proc/sysrq-trigger", SANDBOX_ROOT "/proc/kcore" };
+    for (size_t i = 0; i < sizeof(masked) / sizeof(masked[0]); i++) {
+        if (access(masked[i], F_OK) == 0) sandbox_mount(SANDBOX_ROOT "/dev/null", masked[i], NULL, MS_BIND, NULL);
+    }
+
+    if (chdir(SANDBOX_ROOT) != 0) sandbox_fail("chdir");
+    mkdir(".oldroot", 0700);
+    if (syscall(SYS_pivot_root, ".", ".oldroot") == 0) {
+        if (chroot(".") != 0 || umount2("/.oldroot", MNT_DETACH) != 0) sandbox_fail("detach old root");
+        rmdir("/.oldroot");
+    } else if (chroot(".") != 0) {
+        /* An initramfs root can't be pivoted away from; without CAP_SYS_CHROOT the job can't leave it either */
+        sandbox_fail("chroot");
+    }
+    if (chdir("/") != 0) sandbox_fail("chdir");
+}
+
+/* Ignore what the job's process group is sent: the job gets it directly and decides */
+static void sandbox_ignore_signals(const sigset_t *saved_mask) {
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sig != SIGKILL && sig != SIGSTOP && sig != SIGCHLD) signal(sig, SIG_IGN);
+    }
+    sigprocmask(SIG_SETMASK, saved_mask, NULL);
+}
+
+/* Pid 1 of the sandbox: reap whatever the job orphans and pass its status out once it exits */
+static void sandbox_init(pid_t job, int status_fd, const sigset_t *saved_mask) {
+    sandbox_ignore_signals(saved_mask);
+
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) != job) {
+        if (pid < 0 && errno != EINTR) break;
+    }
+    /* A namespace's init can't kill itself with the job's signal, so the supervisor does */
+    write(status_fd, &status, sizeof(status));
+    _exit(0);
+}
+
+/* Outside the namespaces: exit the way the job did, so the exec loop sees its status */
+static void sandbox_supervise(pid_t init, int status_fd, const sigset_t *saved_mask) {
+    sandbox_ignore_signals(saved_mask);
+
+    int status = 0;
+    while (waitpid(init, &status, 0) < 0 && errno == EINTR)
+        ;
+    int job_status;
+    if (read(status_fd, &job_status, sizeof(job_status)) == sizeof(job_status)) status = job_status;
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/* Called in the exec child after it joined the job's group and cgroup; returns in the sandboxed job */
+static void sandbox_enter(const struct sandbox_opts *opts, const char *job_id) {
+    int flags = CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS;
+    if (!opts->network) flags |= CLONE_NEWNET;
+    if (unshare(flags) != 0) sandbox_fail("unshare");
+
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) != 0) sandbox_fail("pipe");
+
+    /* Signals wait until each process has its dispositions set */
+    sigset_t all, saved;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &saved);
+    pid_t pid = fork();
+    if (pid < 0) sandbox_fail("fork");
+    if (pid > 0) {
+        close(status_pipe[1]);
+        sandbox_supervise(pid, status_pipe[0], &saved);
+    }
+
+    /* Pid 1 of the new namespace */
+    close(status_pipe[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    sethostname(job_id, strlen(job_id));
+    if (!opts->network) {
+        /* The new network namespace only has lo, and it starts down */
+        struct ifreq ifr = { 0 };
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        strncpy(ifr.ifr_name, "lo", IFNAMSIZ);
+        ifr.ifr_flags = IFF_UP | IFF_RUNNING;
+        if (sock < 0 || ioctl(sock, SIOCSIFFLAGS, &ifr) != 0) sandbox_fail("loopback");
+        close(sock);
+    }
+    sandbox_enter_root(opts);
+
+    pid = fork();
+    if (pid < 0) sandbox_fail("fork");
+    if (pid > 0) sandbox_init(pid, status_pipe[1], &saved);
+
+    /* The job itself */
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    sandbox_close_fds();
+    for (int cap = 0; cap < 64; cap++) {
+        if (sandbox_cap_kept(cap)) continue;
+        if (prctl(PR_CAPBSET_DROP, cap, 0, 0, 0) != 0) {
+            /* Past the last capability this kernel knows */
+            if (errno == EINVAL) break;
+            sandbox_fail("drop capabilities");
+        }
+    }
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) sandbox_fail("no_new_privs");
+}
+
+/*
+ * Exec output
+ *
+ * stdout and stderr are captured by length, so NUL bytes and binary data
+ * survive. How they're put in the reply depends on "output_encoding":
+ *   "text"   (default) escaped strings; invalid UTF-8 becomes U+FFFD and
+ *            "<name>_lossy" is set
+ *   "base64" always base64, with "<name>_encoding":"base64"
+ *   "auto"   text when the stream is valid UTF-8, base64 otherwise
+ * "compression":"lz4" or "zstd" takes precedence for large, compressible
+ * output.
+ *
+ * With "framing":"raw" nothing is buffered: output is forwarded as it
+ * arrives in {"segment":"stdout"|"stderr","size":N} frames followed by N raw
+ * bytes, and the final line only reports the totals. Streams are then not
+ * limited by MAX_RESPONSE_SIZE.
+ */
+#define EXEC_STREAM_CHUNK (64 * 1024)
+
+enum output_encoding { OUTPUT_TEXT, OUTPUT_BASE64, OUTPUT_AUTO };
+
+struct exec_output {
+    const char *name;
+    int fd;
+    bool open;
+    bool streaming;
+    char *buf;  /* whole output, or one chunk when streaming */
+    size_t len; /* bytes captured or streamed so far */
+};
+
+/*
+ * Read what the child has written so far. Returns the bytes read, 0 when
+ * there's nothing (more) to read, or -1 once the client can't be written to.
+ */
+static ssize_t exec_output_read(const struct agent_request *req, struct exec_output *out) {
+    if (!out->open) return 0;
+
+    ssize_t n = out->streaming ? read(out->fd, out->buf, EXEC_STREAM_CHUNK)
+                               : read(out->fd, out->buf + out->len, MAX_RESPONSE_SIZE - out->len);
+    if (n == 0) {
+        out->open = false;
+        return 0;
+    }
+    if (n < 0) return 0;
+
+    if (out->streaming) {
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "{\"segment\":\"%s\",\"size\":%zd}\n", out->name, n);
+        if (write_all(req->client_fd, header, header_len) < 0 || write_all(req->client_fd, out->buf, n) < 0) {
+            return -1;
+        }
+    }
+    out->len += n;
+    return n;
+}
+
+/* Render one captured stream as JSON members */
+static void exec_write_output(const struct agent_request *req, struct writer *w, const struct exec_output *out,
+                              enum output_encoding encoding, enum codec codec) {
+    const char *name = out->name;
+
+    if (codec != CODEC_NONE) {
+        struct compress_result c;
+        if (!compress_payload(req->arena, codec, (const uint8_t *)out->buf, out->len, &c)) {
+            writer_printf(w, ",\"%s\":\"", name);
+            writer_base64(w, c.data, c.len);
+            writer_printf(w, "\",\"%s_encoding\":\"%s\",\"%s_size\":%zu,\"%s_ratio\":%.2f,\"%s_compress_us\":%lld",
+                name, codec_names[codec], name, out->len, name, (double)out->len / c.len, name, c.time_us);
+            return;
+        }
+    }
+
+    bool valid = encoding == OUTPUT_BASE64 ? false : utf8_valid(out->buf, out->len);
+    if (encoding == OUTPUT_BASE64 || (encoding == OUTPUT_AUTO && !valid)) {
+        writer_printf(w, ",\"%s\":\"", name);
+        writer_base64(w, (const unsigned char *)out->buf, out->len);
+        writer_printf(w, "\",\"%s_encoding\":\"base64\"", name);
+        return;
+    }
+
+    writer_printf(w, ",\"%s\":\"", name);
+    writer_json_escaped(w, out->buf, out->len);
+    writer_append(w, "\"", 1);
+    if (!valid) writer_printf(w, ",\"%s_lossy\":true", name);
+}
+
+static char *handle_exec(const struct agent_request *req, const char *json) {
+    char *argv[256];
+    int argc = json_get_string_array(req->arena, json, "cmd", argv, 255);
+
+    if (argc < 0) {
+        return strdup("{\"success\":false,\"error\":\"missing cmd\"}\n");
+    }
+    if (argc == 0) {
+        return strdup("{\"success\":false,\"error\":\"empty command\"}\n");
+    }
+
+    int timeout_ms = 30000;
+    json_get_int(json, "timeout", &timeout_ms);
+
+    enum output_encoding encoding = OUTPUT_TEXT;
+    char *output_encoding = json_get_string(req->arena, json, "output_encoding");
+    if (output_encoding) {
+        if (strcmp(output_encoding, "base64") == 0) encoding = OUTPUT_BASE64;
+        else if (strcmp(output_encoding, "auto") == 0) encoding = OUTPUT_AUTO;
+        else if (strcmp(output_encoding, "text") != 0) {
+            return strdup("{\"success\":false,\"error\":\"unknown output_encoding\"}\n");
+        }
+    }
+
+    char *framing = json_get_string(req->arena, json, "framing");
+    bool streaming = framing && strcmp(framing, "raw") == 0;
+    if (framing && !streaming && strcmp(framing, "json") != 0) {
+        return strdup("{\"success\":false,\"error\":\"unsupported framing\"}\n");
+    }
+
+    struct sandbox_opts sandbox;
+    const char *sandbox_error = sandbox_parse(req->arena, json, &sandbox);
+    if (sandbox_error) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"%s\"}\n", sandbox_error);
+        return response;
+    }
+
+    char job_id[JOB_ID_MAX];
+    char *requested_id = json_get_string(req->arena, json, "job_id");
+    if (requested_id) {
+        if (!job_id_valid(requested_id)) {
+            return strdup("{\"success\":false,\"error\":\"invalid job_id\"}\n");
+        }
+        snprintf(job_id, sizeof(job_id), "%s", requested_id);
+    } else {
+        pthread_mutex_lock(&jobs_lock);
+        snprintf(job_id, sizeof(job_id), "job-%lu", next_job_seq++);
+        pthread_mutex_unlock(&jobs_lock);
+    }
+
+    struct exec_job *job = job_register(job_id);
+    if (!job) {
+        return strdup("{\"success\":false,\"error\":\"job_id in use or too many jobs\"}\n");
+    }
+
+    int stdout_pipe[2], stderr_pipe[2];
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0 || pipe2(stderr_pipe, O_CLOEXEC) < 0) {
+        job_unregister(job);
+        return strdup("{\"success\":false,\"error\":\"pipe failed\"}\n");
+    }
+
+    int cgroup_fd = job_cgroup_open(job);
+    if ((sandbox.memory_mb > 0 || sandbox.pids_max > 0) &&
+        (cgroup_fd < 0 || sandbox_limit_cgroup(job, &sandbox) != 0)) {
+        close(stdout_pipe[0]); close(stdout_pipe[1]);
+        close(stderr_pipe[0]); close(stderr_pipe[1]);
+        if (cgroup_fd >= 0) close(cgroup_fd);
+        job_unregister(job);
+        return strdup("{\"success\":false,\"error\":\"cannot apply sandbox limits\"}\n");
+    }
+
+    pid_t pid = fork_tracked();
+    if (pid < 0) {
+        close(stdout_pipe[0]); close(stdout_pipe[1]);
+        close(stderr_pipe[0]); close(stderr_pipe[1]);
+        if (cgroup_fd >= 0) close(cgroup_fd);
+        job_unregister(job);
+        return strdup("{\"success\":false,\"error\":\"fork failed\"}\n");
+    }
+
+    if (pid == 0) {
+        /* Join the job's process group and cgroup before running anything */
+        setpgid(0, 0);
+        if (cgroup_fd >= 0) {
+            write(cgroup_fd, "0", 1);
+            close(cgroup_fd);
+        }
+
+        close(stdout_pipe[0]);
+        close(stderr_pipe[0]);
+        dup2(stdout_pipe[1], STDOUT_FILENO);
+        dup2(stderr_pipe[1], STDERR_FILENO);
+        close(stdout_pipe[1]);
+        close(stderr_pipe[1]);
+
+        int fd = open("/dev/null", O_RDONLY);
+        if (fd >= 0) { dup2(fd, STDIN_FILENO); close(fd); }
+
+        if (sandbox.enabled) sandbox_enter(&sandbox, job_id);
+
+        char **envp = (char **)exec_default_env;
+
+        execve(argv[0], argv, envp);
+
+        /* If execve failed, try with /bin/sh -c */
+        char cmd_line[4096] = "";
+        for (int i = 0; argv[i]; i++) {
+            if (i > 0) strcat(cmd_line, " ");
+            strcat(cmd_line, argv[i]);
+        }
+        char *sh_argv[] = { "/bin/sh", "-c", cmd_line, NULL };
+        execve("/bin/sh", sh_argv, envp);
+
+        _exit(127);
+    }
+
+    /* Also set it here so signals sent before the child runs reach the group */
+    setpgid(pid, pid);
+    if (cgroup_fd >= 0) close(cgroup_fd);
+
+    pthread_mutex_lock(&jobs_lock);
+    job->pid = pid;
+    pthread_mutex_unlock(&jobs_lock);
+
+
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+
+    /* Set non-blocking */
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(stderr_pipe[0], F_SETFL, O_NONBLOCK);
+
+    struct exec_output outputs[2] = {
+        { .name = "stdout", .fd = stdout_pipe[0], .open = true, .streaming = streaming },
+        { .name = "stderr", .fd = stderr_pipe[0], .open = true, .streaming = streaming },
+    };
+    for (int i = 0; i < 2; i++) {
+        outputs[i].buf = arena_alloc(req->arena, streaming ? EXEC_STREAM_CHUNK : MAX_RESPONSE_SIZE);
+    }
+
+    if (!outputs[0].buf || !outputs[1].buf) {
+        close(stdout_pipe[0]);
+        close(stderr_pipe[0]);
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        untrack_child(pid);
+        job_unregister(job);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+
+    int status = 0;
+    bool done = false;
+    bool timed_out = false;
+    const char *cancelled = NULL;
+
+    while (!done) {
+        /* Wake on output or when the host hangs up; the timeout paces waitpid */
+        struct pollfd pfds[3];
+        int nfds = 0;
+        for (int i = 0; i < 2; i++) {
+            if (outputs[i].open) pfds[nfds++] = (struct pollfd){ .fd = outputs[i].fd, .events = POLLIN };
+        }
+        pfds[nfds++] = (struct pollfd){ .fd = req->client_fd, .events = POLLRDHUP };
+        poll(pfds, nfds, 10);
+
+        bool client_gone = false;
+        for (int i = 0; i < 2; i++) {
+            if (exec_output_read(req, &outputs[i]) < 0) client_gone = true;
+        }
+
+        int wpid = client_gone ? 0 : waitpid(pid, &status, WNOHANG);
+        if (wpid > 0) {
+            /* Read any remaining data */
+            for (int i = 0; i < 2; i++) {
+                ssize_t n;
+                while ((n = exec_output_read(req, &outputs[i])) > 0)
+                    ;
+                if (n < 0) cancelled = "client disconnected";
+            }
+            done = true;
+        } else if (!client_gone && job_active_ms(job) > timeout_ms) {
+            /* SIGKILL also terminates a frozen cgroup */
+            kill(-pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            timed_out = true;
+            done = true;
+        } else if (client_gone || (cancelled = request_cancelled(req)) != NULL) {
+            /* Nobody is left to read the result, so don't leave the job running */
+            if (!cancelled) cancelled = "client disconnected";
+            log_debug("exec %s cancelled: %s", job_id, cancelled);
+            kill(-pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            done = true;
+        }
+    }
+
+    untrack_child(pid);
+    job_unregister(job);
+
+    close(stdout_pipe[0]);
+    close(stderr_pipe[0]);
+
+    if (cancelled) {
+        return cancelled_response(cancelled);
+    }
+
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    int term_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+
+    struct writer w = { 0 };
+    if (streaming) {
+        /* The output has already gone out in segments */
+        writer_printf(&w, "{\"success\":true,\"data\":{\"exit_code\":%d,\"stdout_size\":%zu,\"stderr_size\":%zu",
+            exit_code, outputs[0].len, outputs[1].len);
+    } else {
+        char *compression = json_get_string(req->arena, json, "compression");
+        int codec = codec_parse(compression);
+        if (codec < 0) codec = CODEC_NONE;
+
+        writer_reserve(&w, outputs[0].len + outputs[1].len + 256);
+        writer_printf(&w, "{\"success\":true,\"data\":{\"exit_code\":%d", exit_code);
+        exec_write_output(req, &w, &outputs[0], encoding, codec);
+        exec_write_output(req, &w, &outputs[1], encoding, codec);
+    }
+    writer_printf(&w, ",\"job_id\":\"%s\",\"signal\":%d,\"timed_out\":%s}}\n",
+        job_id, term_signal, timed_out ? "true" : "false");
+    return writer_finish(&w);
+}
+
+/*
+ * Shell sessions
+ *
+ * A session is a long-lived /bin/sh whose stdin is fed one command at a
+ * time, so cwd, exported variables and sourced environments persist between
+ * session_exec calls. Each command is followed by a unique marker written to
+ * stdout (with the exit status) and stderr, which delimits its output.
+ */
+#define MAX_SESSIONS 16
+#define SESSION_DEFAULT_TIMEOUT_MS 30000
+#define SESSION_CLOSE_GRACE_MS 1000
+#define SESSION_MAX_ENV 64
+
+struct shell_session {
+    bool in_use;
+    bool ready;
+    int id;
+    pid_t pid;
+    int stdin_fd;
+    int stdout_fd;
+    int stderr_fd;
+    unsigned long seq;
+    pthread_mutex_t lock; /* serializes commands on this session */
+};
+
+struct session_capture {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static struct shell_session sessions[MAX_SESSIONS];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_session_id = 1;
+
+static void sessions_init(void) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        pthread_mutex_init(&sessions[i].lock, NULL);
+        sessions[i].stdin_fd = -1;
+        sessions[i].stdout_fd = -1;
+        sessions[i].stderr_fd = -1;
+    }
+}
+
+/*
+ * Find a ready session and return it with its lock held, or NULL. Waiting
+ * behind another command on the same session counts against the deadline.
+ */
+static struct shell_session *session_acquire(const struct agent_request *req, int id) {
+    struct shell_session *s = NULL;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].in_use && sessions[i].ready && sessions[i].id == id) {
+            s = &sessions[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (!s) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    long long remaining = request_remaining_ms(req);
+    if (remaining < 0) {
+        pthread_mutex_lock(&s->lock);
+    } else {
+        /* pthread_mutex_timedlock only takes CLOCK_REALTIME */
+        struct timespec abs;
+        clock_gettime(CLOCK_REALTIME, &abs);
+        abs.tv_sec += remaining / 1000;
+        abs.tv_nsec += (remaining % 1000) * 1000000;
+        if (abs.tv_nsec >= 1000000000) {
+            abs.tv_sec++;
+            abs.tv_nsec -= 1000000000;
+        }
+        if (pthread_mutex_timedlock(&s->lock, &abs) != 0) {
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+    }
+    if (!s->in_use || !s->ready || s->id != id) {
+        /* Closed while we were waiting for the previous command */
+        pthread_mutex_unlock(&s->lock);
+        errno = ENOENT;
+        return NULL;
+    }
+    return s;
+}
+
+static void session_release_slot(struct shell_session *s) {
+    pthread_mutex_lock(&sessions_lock);
+    s->in_use = false;
+    s->ready = false;
+    s->pid = 0;
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+/* Stop the shell and free the slot. Caller holds s->lock. */
+static int session_teardown(struct shell_session *s, bool graceful) {
+    int status = 0;
+    bool reaped = false;
+
+    if (s->stdin_fd >= 0) {
+        close(s->stdin_fd);
+        s->stdin_fd = -1;
+    }
+
+    if (graceful) {
+        /* EOF on stdin makes the shell exit on its own */
+        for (int waited = 0; waited < SESSION_CLOSE_GRACE_MS; waited += 10) {
+            if (waitpid(s->pid, &status, WNOHANG) != 0) {
+                reaped = true;
+                break;
+            }
+            usleep(10000);
+        }
+    }
+
+    if (!reaped) {
+        kill(-s->pid, SIGKILL);
+        if (waitpid(s->pid, &status, 0) < 0) status = -1;
+    } else {
+        /* Take down anything the shell left running in the background */
+        kill(-s->pid, SIGKILL);
+    }
+    untrack_child(s->pid);
+
+    close(s->stdout_fd);
+    close(s->stderr_fd);
+    s->stdout_fd = -1;
+    s->stderr_fd = -1;
+
+    log_debug("session %d closed (pid %d)", s->id, s->pid);
+    session_release_slot(s);
+
+    return (status >= 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
+
+static int capture_append(struct session_capture *c, const char *data, size_t n) {
+    if (c->len + n + 1 > c->cap) {
+        size_t cap = c->cap ? c->cap : 64 * 1024;
+        while (c->len + n + 1 > cap) cap *= 2;
+        if (cap > MAX_RESPONSE_SIZE) return -1;
+        char *buf = realloc(c->buf, cap);
+        if (!buf) return -1;
+        c->buf = buf;
+        c->cap = cap;
+    }
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+    c->buf[c->len] = '\0';
+    return 0;
+}
+
+/* Single-quote str for the shell: ' becomes '\'' */
+static char *shell_quote(struct arena *arena, const char *str) {
+    size_t quotes = 0;
+    for (const char *p = str; *p; p++) quotes += *p == '\'';
+
+    char *out = arena_alloc(arena, strlen(str) + quotes * 3 + 3);
+    if (!out) return NULL;
+    char *o = out;
+    *o++ = '\'';
+    for (const char *p = str; *p; p++) {
+        if (*p == '\'') {
+            memcpy(o, "'\\''", 4);
+            o += 4;
+        } else {
+            *o++ = *p;
+        }
+    }
+    *o++ = '\'';
+    *o = '\0';
+    return out;
+}
+
+static char *handle_session_open(const struct agent_request *req, const char *json) {
+    char *cwd = json_get_string(req->arena, json, "cwd");
+    if (cwd) {
+        struct stat st;
+        if (stat(cwd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            return strdup("{\"success\":false,\"error\":\"cwd is not a directory\"}\n");
+        }
+    }
+
+    if (access("/bin/sh", X_OK) < 0) {
+        return strdup("{\"success\":false,\"error\":\"/bin/sh not available\"}\n");
+    }
+
+    /* Caller-supplied variables first, then defaults they don't override */
+    char *extra[SESSION_MAX_ENV + 1];
+    int extrac = json_get_string_array(req->arena, json, "env", extra, SESSION_MAX_ENV);
+    if (extrac < 0) extrac = 0;
+
+    const char *envp[SESSION_MAX_ENV + 8];
+    int envc = 0;
+    for (int i = 0; i < extrac; i++) {
+        if (strchr(extra[i], '=')) envp[envc++] = extra[i];
+    }
+    for (int i = 0; exec_default_env[i]; i++) {
+        size_t name_len = strchr(exec_default_env[i], '=') - exec_default_env[i];
+        bool overridden = false;
+        for (int j = 0; j < extrac; j++) {
+            if (strncmp(extra[j], exec_default_env[i], name_len + 1) == 0) {
+                overridden = true;
+                break;
+            }
+        }
+        if (!overridden) envp[envc++] = exec_default_env[i];
+    }
+    envp[envc] = NULL;
+
+    struct shell_session *s = NULL;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (!sessions[i].in_use) {
+            s = &sessions[i];
+            s->in_use = true;
+            s->ready = false;
+            s->id = next_session_id++;
+            s->seq = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    char *response = NULL;
+    int in_pipe[2] = { -1, -1 }, out_pipe[2] = { -1, -1 }, err_pipe[2] = { -1, -1 };
+
+    if (!s) {
+        response = strdup("{\"success\":false,\"error\":\"too many sessions\"}\n");
+        goto out;
+    }
+
+    if (pipe2(in_pipe, O_CLOEXEC) < 0 || pipe2(out_pipe, O_CLOEXEC) < 0 ||
+        pipe2(err_pipe, O_CLOEXEC) < 0) {
+        response = strdup("{\"success\":false,\"error\":\"pipe failed\"}\n");
+        goto fail;
+    }
+
+    pid_t pid = fork_tracked();
+    if (pid < 0) {
+        response = strdup("{\"success\":false,\"error\":\"fork failed\"}\n");
+        goto fail;
+    }
+
+    if (pid == 0) {
+        /* Own process group so the whole session can be signalled at once */
+        setsid();
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        if (cwd && chdir(cwd) < 0) _exit(126);
+
+        char *sh_argv[] = { "sh", NULL };
+        execve("/bin/sh", sh_argv, (char **)envp);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(err_pipe[0], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_lock(&s->lock);
+    s->pid = pid;
+    s->stdin_fd = in_pipe[1];
+    s->stdout_fd = out_pipe[0];
+    s->stderr_fd = err_pipe[0];
+    pthread_mutex_lock(&sessions_lock);
+    s->ready = true;
+    pthread_mutex_unlock(&sessions_lock);
+    pthread_mutex_unlock(&s->lock);
+
+    log_debug("session %d opened (pid %d)", s->id, pid);
+    asprintf(&response, "{\"success\":true,\"data\":{\"session_id\":%d,\"pid\":%d}}\n", s->id, pid);
+    if (!response) response = strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    goto out;
+
+fail:
+    for (int i = 0; i < 2; i++) {
+        if (in_pipe[i] >= 0) close(in_pipe[i]);
+        if (out_pipe[i] >= 0) close(out_pipe[i]);
+        if (err_pipe[i] >= 0) close(err_pipe[i]);
+    }
+    session_release_slot(s);
+out:
+    return response;
+}
+
+static char *handle_session_exec(const struct agent_request *req, const char *json) {
+    int id;
+    if (json_get_int(json, "session_id", &id) != 0) {
+        return strdup("{\"success\":false,\"error\":\"missing session_id\"}\n");
+    }
+
+    char *command = json_get_string(req->arena, json, "command");
+    if (!command) {
+        return strdup("{\"success\":false,\"error\":\"missing command\"}\n");
+    }
+
+    int timeout_ms = SESSION_DEFAULT_TIMEOUT_MS;
+    json_get_int(json, "timeout", &timeout_ms);
+
+    struct shell_session *s = session_acquire(req, id);
+    if (!s) {
+        if (errno == ETIMEDOUT) return cancelled_response("deadline exceeded");
+        return strdup("{\"success\":false,\"error\":\"unknown session\"}\n");
+    }
+
+    unsigned int nonce = 0;
+    if (getrandom(&nonce, sizeof(nonce), GRND_NONBLOCK) != sizeof(nonce)) {
+        nonce = (unsigned int)monotonic_ms() ^ (unsigned int)s->pid;
+    }
+
+    char marker[64];
+    snprintf(marker, sizeof(marker), "__HF_%d_%lu_%08x__", s->id, ++s->seq, nonce);
+    size_t marker_len = strlen(marker);
+
+    /*
+     * The brace group keeps cd/export in the shell itself; stdin is detached
+     * so commands that read input can't swallow the markers. The command is
+     * parsed by eval, so a syntax error fails just this command (exit 2)
+     * instead of the shell reading it; "command" stops a failing eval, a
+     * special builtin, from exiting the shell.
+     */
+    char *quoted = shell_quote(req->arena, command);
+    char *script = quoted ? arena_printf(req->arena,
+        "{ command eval %s\n} </dev/null\nprintf '%%s%%d\\n' '%s' \"$?\"; printf '%%s\\n' '%s' >&2\n",
+        quoted, marker, marker) : NULL;
+
+    if (!script) {
+        pthread_mutex_unlock(&s->lock);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+
+    struct session_capture out = { 0 }, err = { 0 };
+    ssize_t out_end = -1, err_end = -1;
+    int exit_code = -1;
+    bool timed_out = false, closed = false, overflow = false;
+    const char *cancelled = NULL;
+
+    if (write_all(s->stdin_fd, script, strlen(script)) < 0) {
+        closed = true;
+    }
+
+    long long deadline = monotonic_ms() + timeout_ms;
+    char chunk[64 * 1024];
+
+    while (!closed && (out_end < 0 || err_end < 0)) {
+        long long remaining = deadline - monotonic_ms();
+        if (remaining <= 0) {
+            timed_out = true;
+            break;
+        }
+        if ((cancelled = request_cancelled(req)) != NULL) {
+            /* The shell is mid-command with no one waiting, so it can't be reused */
+            log_debug("session %d command cancelled: %s", s->id, cancelled);
+            break;
+        }
+
+        struct pollfd pfds[3];
+        int nfds = 0;
+        if (out_end < 0) pfds[nfds++] = (struct pollfd){ .fd = s->stdout_fd, .events = POLLIN };
+        if (err_end < 0) pfds[nfds++] = (struct pollfd){ .fd = s->stderr_fd, .events = POLLIN };
+        pfds[nfds++] = (struct pollfd){ .fd = req->client_fd, .events = POLLRDHUP };
+
+        int rc = poll(pfds, nfds, remaining > 100 ? 100 : (int)remaining);
+        if (rc < 0 && errno != EINTR) {
+            closed = true;
+            break;
+        }
+        if (rc <= 0) continue;
+
+        for (int i = 0; i < nfds && !closed; i++) {
+            if (pfds[i].fd == req->client_fd) continue;
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            bool is_out = pfds[i].fd == s->stdout_fd;
+            struct session_capture *cap = is_out ? &out : &err;
+            ssize_t n = read(pfds[i].fd, chunk, sizeof(chunk));
+            if (n == 0) {
+                closed = true;
+                break;
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) closed = true;
+                continue;
+            }
+
+            size_t scan_from = cap->len > marker_len ? cap->len - marker_len : 0;
+            if (capture_append(cap, chunk, n) < 0) {
+                overflow = true;
+                closed = true;
+                break;
+            }
+
+            char *hit = memmem(cap->buf + scan_from, cap->len - scan_from, marker, marker_len);
+            if (!hit) continue;
+
+            if (is_out) {
+                /* Marker is followed by the exit status and a newline */
+                char *nl = memchr(hit + marker_len, '\n', cap->buf + cap->len - (hit + marker_len));
+                if (!nl) continue;
+                exit_code = atoi(hit + marker_len);
+                out_end = hit - cap->buf;
+            } else {
+                err_end = hit - cap->buf;
+            }
+        }
+    }
+
+    if (out_end >= 0) out.len = out_end;
+    if (err_end >= 0) err.len = err_end;
+    if (out.buf) out.buf[out.len] = '\0';
+    if (err.buf) err.buf[err.len] = '\0';
+
+    if (timed_out || closed || cancelled) {
+        int shell_status = session_teardown(s, false);
+        if (closed && !overflow && out_end < 0) exit_code = shell_status;
+        closed = true;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (cancelled) {
+        free(out.buf);
+        free(err.buf);
+        return cancelled_response(cancelled);
+    }
+
+    char *response;
+    if (overflow) {
+        response = strdup("{\"success\":false,\"error\":\"output too large, session closed\"}\n");
+    } else {
+        struct writer w = { 0 };
+        writer_reserve(&w, out.len + err.len + 256);
+        writer_printf(&w, "{\"success\":true,\"data\":{\"exit_code\":%d,\"stdout\":\"", exit_code);
+        writer_json_escaped(&w, out.buf ? out.buf : "", out.len);
+        writer_printf(&w, "\",\"stderr\":\"");
+        writer_json_escaped(&w, err.buf ? err.buf : "", err.len);
+        writer_printf(&w, "\",\"timed_out\":%s,\"session_closed\":%s}}\n",
+            timed_out ? "true" : "false", closed ? "true" : "false");
+        response = writer_finish(&w);
+    }
+
+    free(out.buf);
+    free(err.buf);
+    return response;
+}
+
+static char *handle_session_close(const struct agent_request *req, const char *json) {
+    int id;
+    if (json_get_int(json, "session_id", &id) != 0) {
+        return strdup("{\"success\":false,\"error\":\"missing session_id\"}\n");
+    }
+
+    struct shell_session *s = session_acquire(req, id);
+    if (!s) {
+        if (errno == ETIMEDOUT) return cancelled_response("deadline exceeded");
+        return strdup("{\"success\":false,\"error\":\"unknown session\"}\n");
+    }
+
+    int exit_code = session_teardown(s, true);
+    pthread_mutex_unlock(&s->lock);
+
+    char *response = NULL;
+    asprintf(&response, "{\"success\":true,\"data\":{\"exit_code\":%d}}\n", exit_code);
+    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+}
+
+/*
+ * Health probes
+ *
+ * The host hands init a set of probes as one line on the host channel:
+ *   {"probes":[{"name":"web","type":"http","port":8080,"path":"/healthz",
+ *               "interval_ms":10000,"timeout_ms":1000,
+ *               "healthy_threshold":1,"unhealthy_threshold":3}]}
+ * and init runs them itself: "tcp" connects to a localhost port, "http"
+ * sends GET "path" to one and wants a 2xx or 3xx status, "exec" runs
+ * "command" and wants exit 0, and "file" wants "path" modified within
+ * "max_age_ms". A probe turns healthy after "healthy_threshold" passes in a
+ * row and unhealthy after "unhealthy_threshold" failures in a row, and only
+ * those transitions go back to the host:
+ *   {"probe":{"name":"web","status":"unhealthy","previous":"healthy","detail":"HTTP 503"}}
+ * so a fleet of healthy guests sends nothing at all. A new set keeps the
+ * state of probes it doesn't change and repeats their current status, so a
+ * restarted host catches up by sending the set again.
+ *
+ * One thread runs every probe in turn, each bounded by its timeout.
+ */
+#define PROBE_MAX 32
+#define PROBE_DEFAULT_INTERVAL_MS 10000
+#define PROBE_DEFAULT_TIMEOUT_MS 1000
+#define PROBE_MIN_INTERVAL_MS 100
+#define PROBE_ARGS_MAX 1024
+#define PROBE_DETAIL_MAX 128
+
+enum probe_type { PROBE_TCP, PROBE_HTTP, PROBE_EXEC, PROBE_FILE };
+enum probe_status { PROBE_UNKNOWN, PROBE_HEALTHY, PROBE_UNHEALTHY };
+
+static const char *probe_type_names[] = { "tcp", "http", "exec", "file" };
+static const char *probe_status_names[] = { "unknown", "healthy", "unhealthy" };
+
+/* Self-contained, so the prober can run a copy without holding the lock */
+struct probe {
+    char name[JOB_ID_MAX];
+    enum probe_type type;
+    int port;
+    char path[PATH_MAX];       /* http request path, or the file to check */
+    char args[PROBE_ARGS_MAX]; /* exec command, NUL-separated */
+    int argc;
+    long long interval_ms;
+    long long timeout_ms;
+    long long max_age_ms;
+    int healthy_threshold;
+    int unhealthy_threshold;
+
+    enum probe_status status;
+    int passes;   /* in a row */
+    int failures; /* in a row */
+    long long next_ms;
+    char detail[PROBE_DETAIL_MAX];
+};
+
+static struct probe probes[PROBE_MAX];
+static int probe_count;
+static pthread_mutex_t probes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probes_cond;
+static bool probe_thread_started;
+/* Transitions travel to the host channel thread over this pair */
+static int probe_report_fd[2] = { -1, -1 };
+
+static void probe_report(const struct probe *p, enum probe_status previous) {
+    if (probe_report_fd[1] < 0) return;
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"probe\":{\"name\":\"%s\",\"status\":\"%s\",\"previous\":\"%s\",\"detail\":\"",
+        p->name, probe_status_names[p->status], probe_status_names[previous]);
+    writer_json_escaped(&w, p->detail, strlen(p->detail));
+    writer_printf(&w, "\"}}\n");
+    char *line = writer_finish(&w);
+    if (!line) return;
+    ssize_t len = strlen(line);
+    if (send(probe_report_fd[1], line, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        log_warn("probe %s: report dropped", p->name);
+    }
+    free(line);
+}
+
+/* Connect to a localhost port within the deadline. Returns the socket or -1 with detail set. */
+static int probe_connect(const struct probe *p, long long deadline_ms, char *detail) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(p->port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (fd < 0) {
+        snprintf(detail, PROBE_DETAIL_MAX, "socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        snprintf(detail, PROBE_DETAIL_MAX, "connect: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    long long wait = deadline_ms - monotonic_ms();
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (wait <= 0 || poll(&pfd, 1, (int)wait) <= 0) {
+        snprintf(detail, PROBE_DETAIL_MAX, "connect: timed out");
+    } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err) {
+        snprintf(detail, PROBE_DETAIL_MAX, "connect: %s", strerror(err ? err : errno));
+    } else {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static bool probe_http(const struct probe *p, long long deadline_ms, char *detail) {
+    int fd = probe_connect(p, deadline_ms, detail);
+    if (fd < 0) return false;
+
+    char request[PATH_MAX + 128];
+    int len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.0\r\nHost: localhost\r\nUser-Agent: hyperfleet-probe\r\nConnection: close\r\n\r\n", p->path);
+    if (send(fd, request, len, MSG_NOSIGNAL) != len) {
+        snprintf(detail, PROBE_DETAIL_MAX, "send: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    /* The status line is all we need */
+    char status_line[64];
+    size_t got = 0;
+    while (got < sizeof(status_line) - 1 && !memchr(status_line, '\n', got)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        long long wait = deadline_ms - monotonic_ms();
+        if (wait <= 0 || poll(&pfd, 1, (int)wait) <= 0) break;
+        ssize_t n = recv(fd, status_line + got, sizeof(status_line) - 1 - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    status_line[got] = '\0';
+
+    int code = 0;
+    if (sscanf(status_line, "HTTP/%*d.%*d %d", &code) != 1) {
+        snprintf(detail, PROBE_DETAIL_MAX, got ? "not an HTTP response" : "no response");
+        return false;
+    }
+    snprintf(detail, PROBE_DETAIL_MAX, "HTTP %d", code);
+    return code >= 200 && code < 400;
+}
+
+static bool probe_exec(const struct probe *p, long long deadline_ms, char *detail) {
+    char *argv[PROBE_ARGS_MAX / 2 + 1];
+    const char *arg = p->args;
+    for (int i = 0; i < p->argc; i++) {
+        argv[i] = (char *)arg;
+        arg += strlen(arg) + 1;
+    }
+    argv[p->argc] = NULL;
+
+    pid_t pid = fork_tracked();
+    if (pid < 0) {
+        snprintf(detail, PROBE_DETAIL_MAX, "fork: %s", strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    pid_t done;
+    while ((done = waitpid(pid, &status, WNOHANG)) == 0 && monotonic_ms() < deadline_ms) {
+        usleep(10000);
+    }
+    if (done == 0) {
+        kill(-pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        untrack_child(pid);
+        snprintf(detail, PROBE_DETAIL_MAX, "timed out");
+        return false;
+    }
+    untrack_child(pid);
+    if (WIFSIGNALED(status)) {
+        snprintf(detail, PROBE_DETAIL_MAX, "killed by signal %d", WTERMSIG(status));
+        return false;
+    }
+    snprintf(detail, PROBE_DETAIL_MAX, "exit %d", WEXITSTATUS(status));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool probe_file(const struct probe *p, char *detail) {
+    struct stat st;
+    if (stat(p->path, &st) < 0) {
+        snprintf(detail, PROBE_DETAIL_MAX, "stat: %s", strerror(errno));
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long age_ms = (now.tv_sec - st.st_mtim.tv_sec) * 1000LL + (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+    snprintf(detail, PROBE_DETAIL_MAX, "modified %lldms ago", age_ms < 0 ? 0 : age_ms);
+    return age_ms <= p->max_age_ms;
+}
+
+static bool probe_run(const struct probe *p, char *detail) {
+    long long deadline_ms = monotonic_ms() + p->timeout_ms;
+    detail[0] = '\0';
+    switch (p->type) {
+    case PROBE_TCP: {
+        int fd = probe_connect(p, deadline_ms, detail);
+        if (fd < 0) return false;
+        close(fd);
+        return true;
+    }
+    case PROBE_HTTP:
+        return probe_http(p, deadline_ms, detail);
+    case PROBE_EXEC:
+        return probe_exec(p, deadline_ms, detail);
+    case PROBE_FILE:
+        return probe_file(p, detail);
+    }
+    return false;
+}
+
+/* Count a result and report the transition it completes. Called with probes_lock held. */
+static void probe_record(struct probe *p, bool passed, const char *detail) {
+    snprintf(p->detail, sizeof(p->detail), "%s", detail);
+    p->passes = passed ? p->passes + 1 : 0;
+    p->failures = passed ? 0 : p->failures + 1;
+
+    enum probe_status previous = p->status;
+    if (passed && p->status != PROBE_HEALTHY && p->passes >= p->healthy_threshold) {
+        p->status = PROBE_HEALTHY;
+    } else if (!passed && p->status != PROBE_UNHEALTHY && p->failures >= p->unhealthy_threshold) {
+        p->status = PROBE_UNHEALTHY;
+    }
+    if (p->status != previous) {
+        log_info("probe %s: %s -> %s (%s)", p->name, probe_status_names[previous], probe_status_names[p->status],
+            p->detail);
+        probe_report(p, previous);
+    }
+}
+
+/* Two probes check the same thing the same way */
+static bool probe_same(const struct probe *a, const struct probe *b) {
+    return a->type == b->type && a->port == b->port && a->argc == b->argc && a->max_age_ms == b->max_age_ms &&
+        a->healthy_threshold == b->healthy_threshold && a->unhealthy_threshold == b->unhealthy_threshold &&
+        strcmp(a->path, b->path) == 0 && memcmp(a->args, b->args, sizeof(a->args)) == 0;
+}
+
+static void *probe_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&probes_lock);
+    while (!shutdown_requested && !reboot_requested) {
+        struct probe *next = NULL;
+        for (int i = 0; i < probe_count; i++) {
+            if (!next || probes[i].next_ms < next->next_ms) next = &probes[i];
+        }
+        long long now = monotonic_ms();
+        if (!next || next->next_ms > now) {
+            /* Sleep until the next probe is due or the set changes */
+            long long wake_ms = next ? next->next_ms : now + 60000;
+            struct timespec until = { .tv_sec = wake_ms / 1000, .tv_nsec = (wake_ms % 1000) * 1000000 };
+            pthread_cond_timedwait(&probes_cond, &probes_lock, &until);
+            continue;
+        }
+
+        struct probe copy = *next;
+        pthread_mutex_unlock(&probes_lock);
+        char detail[PROBE_DETAIL_MAX];
+        bool passed = probe_run(&copy, detail);
+        pthread_mutex_lock(&probes_lock);
+
+        /* A new set may have replaced the probe while it ran */
+        for (int i = 0; i < probe_count; i++) {
+            if (strcmp(probes[i].name, copy.name) != 0) continue;
+            if (probe_same(&probes[i], &copy)) {
+                probe_record(&probes[i], passed, detail);
+                probes[i].next_ms = monotonic_ms() + probes[i].interval_ms;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&probes_lock);
+    return NULL;
+}
+
+static bool probe_parse(struct arena *arena, const char *json, struct probe *p) {
+    memset(p, 0, sizeof(*p));
+    char *name = json_get_string(arena, json, "name");
+    char *type = json_get_string(arena, json, "type");
+    if (!name || !job_id_valid(name) || !type) return false;
+    snprintf(p->name, sizeof(p->name), "%s", name);
+
+    int type_index = -1;
+    for (int i = 0; i < (int)(sizeof(probe_type_names) / sizeof(probe_type_names[0])); i++) {
+        if (strcmp(type, probe_type_names[i]) == 0) type_index = i;
+    }
+    if (type_index < 0) return false;
+    p->type = type_index;
+
+    p->interval_ms = PROBE_DEFAULT_INTERVAL_MS;
+    p->timeout_ms = PROBE_DEFAULT_TIMEOUT_MS;
+    p->healthy_threshold = 1;
+    p->unhealthy_threshold = 3;
+    json_get_long(json, "interval_ms", &p->interval_ms);
+    json_get_long(json, "timeout_ms", &p->timeout_ms);
+    json_get_int(json, "healthy_threshold", &p->healthy_threshold);
+    json_get_int(json, "unhealthy_threshold", &p->unhealthy_threshold);
+    if (p->interval_ms < PROBE_MIN_INTERVAL_MS) p->interval_ms = PROBE_MIN_INTERVAL_MS;
+    if (p->timeout_ms <= 0 || p->timeout_ms > p->interval_ms) p->timeout_ms = p->interval_ms;
+    if (p->healthy_threshold < 1) p->healthy_threshold = 1;
+    if (p->unhealthy_threshold < 1) p->unhealthy_threshold = 1;
+
+    char *path = json_get_string(arena, json, "path");
+    switch (p->type) {
+    case PROBE_TCP:
+    case PROBE_HTTP:
+        if (json_get_int(json, "port", &p->port) != 0 || p->port < 1 || p->port > 65535) return false;
+        snprintf(p->path, sizeof(p->path), "%s", path && path[0] == '/' ? path : "/");
+        /* Anything that could end the request line early */
+        return !strpbrk(p->path, " \r\n");
+    case PROBE_EXEC: {
+        char *argv[PROBE_ARGS_MAX / 2 + 1];
+        int argc = json_get_string_array(arena, json, "command", argv, PROBE_ARGS_MAX / 2);
+        size_t used = 0;
+        for (int i = 0; i < argc; i++) {
+            size_t len = strlen(argv[i]) + 1;
+            if (used + len > sizeof(p->args)) return false;
+            memcpy(p->args + used, argv[i], len);
+            used += len;
+        }
+        p->argc = argc;
+        return argc > 0;
+    }
+    case PROBE_FILE:
+        if (!path || path[0] != '/' || json_get_long(json, "max_age_ms", &p->max_age_ms) != 0) return false;
+        snprintf(p->path, sizeof(p->path), "%s", path);
+        return true;
+    }
+    return false;
+}
+
+/* Replace the probe set with a host line's "probes" array */
+static void probes_configure(const char *json) {
+    const char *p = json_find_key(json, "probes");
+    if (!p || *p != '[') return;
+
+    static struct probe parsed[PROBE_MAX];
+    struct arena arena = { 0 };
+    int count = 0;
+    p = json_skip_ws(p + 1);
+    while (*p == '{' && count < PROBE_MAX) {
+        if (probe_parse(&arena, p, &parsed[count])) {
+            count++;
+        } else {
+            log_warn("ignoring invalid probe");
+        }
+        p = json_skip_ws(json_skip_value(p));
+        if (*p == ',') p = json_skip_ws(p + 1);
+    }
+    arena_release(&arena);
+
+    pthread_mutex_lock(&probes_lock);
+    long long now = monotonic_ms();
+    for (int i = 0; i < count; i++) {
+        struct probe *n = &parsed[i];
+        n->next_ms = now;
+        for (int j = 0; j < probe_count; j++) {
+            if (strcmp(probes[j].name, n->name) != 0 || !probe_same(&probes[j], n)) continue;
+            /* Unchanged: keep its state, and tell a host that may have forgotten it */
+            n->status = probes[j].status;
+            n->passes = probes[j].passes;
+            n->failures = probes[j].failures;
+            n->next_ms = probes[j].next_ms;
+            snprintf(n->detail, sizeof(n->detail), "%s", probes[j].detail);
+            if (n->status != PROBE_UNKNOWN) probe_report(n, PROBE_UNKNOWN);
+        }
+    }
+    memcpy(probes, parsed, count * sizeof(parsed[0]));
+    probe_count = count;
+    if (!probe_thread_started && count > 0) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&probes_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_t thread;
+        probe_thread_started = pthread_create(&thread, NULL, probe_thread, NULL) == 0;
+        if (probe_thread_started) pthread_detach(thread);
+    }
+    if (probe_thread_started) pthread_cond_signal(&probes_cond);
+    pthread_mutex_unlock(&probes_lock);
+    log_info("%d health probe(s) configured", count);
+}
+
+static char *handle_probe_list(void) {
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"probes\":[");
+    pthread_mutex_lock(&probes_lock);
+    long long now = monotonic_ms();
+    for (int i = 0; i < probe_count; i++) {
+        const struct probe *p = &probes[i];
+        writer_printf(&w, "%s{\"name\":\"%s\",\"type\":\"%s\",\"status\":\"%s\",\"detail\":\"",
+            i ? "," : "", p->name, probe_type_names[p->type], probe_status_names[p->status]);
+        writer_json_escaped(&w, p->detail, strlen(p->detail));
+        writer_printf(&w, "\",\"passes\":%d,\"failures\":%d,\"next_in_ms\":%lld}",
+            p->passes, p->failures, p->next_ms > now ? p->next_ms - now : 0);
+    }
+    pthread_mutex_unlock(&probes_lock);
+    writer_printf(&w, "]}}\n");
+    return writer_finish(&w);
+}
+
+/*
+ * Listening ports
+ *
+ * Init tells the host which ports the guest serves on, so the reverse proxy
+ * can route to a service as soon as it starts listening instead of waiting
+ * for its port to be declared. Listening TCP sockets and bound, unconnected
+ * UDP sockets come from a NETLINK_SOCK_DIAG dump (or /proc/net on kernels
+ * built without it), each with the process holding it, and the set goes
+ * over the host channel whenever it changes and each time the host
+ * connects:
+ *   {"ports":[{"protocol":"tcp","address":"0.0.0.0","port":8080,"pid":412,"process":"node"}]}
+ *
+ * sock_diag only announces sockets going away, not sockets starting to
+ * listen, so the channel thread dumps the listeners every PORTS_SCAN_MS
+ * while the host is connected, and at once when a listener is destroyed.
+ * A dump of a handful of listeners is a few hundred bytes; the /proc scan
+ * that finds a socket's owner only runs for sockets not seen before.
+ */
+#define PORTS_MAX 256
+#define PORTS_SCAN_MS 1000
+#define PORTS_PROCESS_MAX 16
+
+struct listen_port {
+    bool udp;
+    int family;
+    char address[INET6_ADDRSTRLEN];
+    int port;
+    unsigned long inode;
+    bool owner_known;
+    pid_t pid;
+    char process[PORTS_PROCESS_MAX];
+};
+
+static void ports_add(struct listen_port *ports, int *count, bool udp, int family, const void *address, int port,
+                      unsigned long inode) {
+    if (*count == PORTS_MAX || port == 0) return;
+    struct listen_port *p = &ports[(*count)++];
+    memset(p, 0, sizeof(*p));
+    p->udp = udp;
+    p->family = family;
+    p->port = port;
+    p->inode = inode;
+    if (!inet_ntop(family, address, p->address, sizeof(p->address))) p->address[0] = '\0';
+}
+
+/* One family and protocol over sock_diag. Returns -1 if the kernel can't dump it. */
+static int ports_dump_diag(int nl, int family, int protocol, struct listen_port *ports, int *count) {
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } request = {
+        .nlh = { .nlmsg_len = sizeof(request), .nlmsg_type = SOCK_DIAG_BY_FAMILY,
+                 .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP },
+        .req = { .sdiag_family = family, .sdiag_protocol = protocol,
+                 /* Unconnected UDP sockets are in TCP_CLOSE */
+                 .idiag_states = protocol == IPPROTO_TCP ? 1 << TCP_LISTEN : 1 << TCP_CLOSE },
+    };
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    if (sendto(nl, &request, sizeof(request), 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) return -1;
+
+    char reply[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        ssize_t n = recv(nl, reply, sizeof(reply), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        int remaining = (int)n;
+        for (struct nlmsghdr *h = (struct nlmsghdr *)reply; NLMSG_OK(h, remaining); h = NLMSG_NEXT(h, remaining)) {
+            if (h->nlmsg_type == NLMSG_DONE) return 0;
+            if (h->nlmsg_type == NLMSG_ERROR) return -1;
+            if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg))) continue;
+            struct inet_diag_msg *m = NLMSG_DATA(h);
+            if (protocol == IPPROTO_UDP && m->id.idiag_dport != 0) continue;
+            ports_add(ports, count, protocol == IPPROTO_UDP, family, m->id.idiag_src, ntohs(m->id.idiag_sport),
+                      m->idiag_inode);
+        }
+    }
+}
+
+/* The same from /proc/net/{tcp,udp}{,6}, for kernels without INET_DIAG */
+static void ports_read_proc(const char *path, bool udp, int family, struct listen_port *ports, int *count) {
+    FILE *f = fopen(path, "re");
+    if (!f) return;
+    char line[512];
+    if (!fgets(line, sizeof(line), f)) goto out; /* header */
+    while (fgets(line, sizeof(line), f)) {
+        char local[33], remote[33];
+        unsigned int port, remote_port, state;
+        unsigned long inode;
+        if (sscanf(line, " %*d: %32[0-9A-Fa-f]:%x %32[0-9A-Fa-f]:%x %x %*s %*s %*s %*s %*s %lu", local, &port, remote,
+                   &remote_port, &state, &inode) != 6) {
+            continue;
+        }
+        if (udp ? state != TCP_CLOSE || remote_port != 0 : state != TCP_LISTEN) continue;
+
+        /* The address is printed as native-endian 32-bit words */
+        uint32_t words[4] = { 0 };
+        for (int i = 0; i < (family == AF_INET ? 1 : 4); i++) {
+            char word[9] = { 0 };
+            memcpy(word, local + i * 8, 8);
+            words[i] = (uint32_t)strtoul(word, NULL, 16);
+        }
+        ports_add(ports, count, udp, family, words, (int)port, inode);
+    }
+out:
+    fclose(f);
+}
+
+static int ports_compare(const void *a, const void *b) {
+    const struct listen_port *x = a, *y = b;
+    if (x->udp != y->udp) return x->udp - y->udp;
+    if (x->port != y->port) return x->port - y->port;
+    return strcmp(x->address, y->address);
+}
+
+/*
+ * Find the process holding each socket whose owner isn't known yet by
+ * walking /proc/<pid>/fd. Sockets held by nobody (or by a process that has
+ * exited since) keep pid 0 and aren't looked for again.
+ */
+static void ports_find_owners(struct listen_port *ports, int count) {
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        if (!ports[i].owner_known) missing++;
+    }
+    if (missing == 0) return;
+
+    DIR *proc = opendir("/proc");
+    struct dirent *de;
+    while (proc && missing > 0 && (de = readdir(proc)) != NULL) {
+        char *end;
+        long pid = strtol(de->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0) continue;
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+        DIR *fds = opendir(path);
+        struct dirent *fd;
+        while (fds && missing > 0 && (fd = readdir(fds)) != NULL) {
+            char target[64];
+            ssize_t n = readlinkat(dirfd(fds), fd->d_name, target, sizeof(target) - 1);
+            unsigned long inode;
+            if (n <= 0) continue;
+            target[n] = '\0';
+            if (sscanf(target, "socket:[%lu]", &inode) != 1) continue;
+
+            for (int i = 0; i < count; i++) {
+                struct listen_port *p = &ports[i];
+                if (p->owner_known || p->inode != inode) continue;
+                p->owner_known = true;
+                p->pid = (pid_t)pid;
+                snprintf(path, sizeof(path), "/proc/%ld/comm", pid);
+                int comm = open(path, O_RDONLY | O_CLOEXEC);
+                ssize_t len = comm >= 0 ? read(comm, p->process, sizeof(p->process) - 1) : -1;
+                if (comm >= 0) close(comm);
+                p->process[len > 0 ? len : 0] = '\0';
+                p->process[strcspn(p->process, "\n")] = '\0';
+                missing--;
+            }
+        }
+        if (fds) closedir(fds);
+    }
+    if (proc) closedir(proc);
+    for (int i = 0; i < count; i++) ports[i].owner_known = true;
+}
+
+/*
+ * Every listening socket in the guest's network namespace, sorted, with
+ * owners carried over from `known` where the socket is the same. Sandboxed
+ * jobs have their own namespace and don't show up, which is right: nothing
+ * outside can reach them.
+ */
+static int ports_scan(struct listen_port *ports, const struct listen_port *known, int known_count) {
+    static const struct { int family; int protocol; const char *proc; } sources[] = {
+        { AF_INET, IPPROTO_TCP, "/proc/net/tcp" },
+        { AF_INET6, IPPROTO_TCP, "/proc/net/tcp6" },
+        { AF_INET, IPPROTO_UDP, "/proc/net/udp" },
+        { AF_INET6, IPPROTO_UDP, "/proc/net/udp6" },
+    };
+    int count = 0;
+    int nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        int before = count;
+        if (nl < 0 || ports_dump_diag(nl, sources[i].family, sources[i].protocol, ports, &count) < 0) {
+            count = before;
+            ports_read_proc(sources[i].proc, sources[i].protocol == IPPROTO_UDP, sources[i].family, ports, &count);
+        }
+    }
+    if (nl >= 0) close(nl);
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < known_count; j++) {
+            if (known[j].inode != ports[i].inode || known[j].port != ports[i].port) continue;
+            ports[i].owner_known = true;
+            ports[i].pid = known[j].pid;
+            memcpy(ports[i].process, known[j].process, sizeof(ports[i].process));
+            break;
+        }
+    }
+    ports_find_owners(ports, count);
+    qsort(ports, count, sizeof(ports[0]), ports_compare);
+    return count;
+}
+
+static void ports_write(struct writer *w, const struct listen_port *ports, int count) {
+    writer_printf(w, "\"ports\":[");
+    for (int i = 0; i < count; i++) {
+        const struct listen_port *p = &ports[i];
+        writer_printf(w, "%s{\"protocol\":\"%s\",\"address\":\"%s\",\"port\":%d,\"pid\":%d,\"process\":\"",
+            i ? "," : "", p->udp ? "udp" : "tcp", p->address, p->port, (int)p->pid);
+        writer_json_escaped(w, p->process, strlen(p->process));
+        writer_printf(w, "\"}");
+    }
+    writer_printf(w, "]");
+}
+
+/*
+ * A socket subscribed to sock_diag's destroy broadcasts, or -1 where the
+ * kernel has none. Needs CAP_NET_ADMIN, which init has.
+ */
+static int ports_watch_open(void) {
+    /* Bound rather than joined by setsockopt: broadcasts skip sockets without a port id */
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1 << (SKNLGRP_INET_TCP_DESTROY - 1) | 1 << (SKNLGRP_INET_UDP_DESTROY - 1) |
+                     1 << (SKNLGRP_INET6_TCP_DESTROY - 1) | 1 << (SKNLGRP_INET6_UDP_DESTROY - 1),
+    };
+    int nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_SOCK_DIAG);
+    if (nl < 0) return -1;
+    if (bind(nl, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_debug("sock_diag destroy events unavailable: %s", strerror(errno));
+        close(nl);
+        return -1;
+    }
+    return nl;
+}
+
+/*
+ * Drain destroy broadcasts. True if one was for a listener in `ports`: the
+ * same local port with no peer, which leaves out the connections a busy
+ * server closes all the time. A lost broadcast counts as one.
+ */
+static bool ports_watch_read(int nl, const struct listen_port *ports, int count) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    bool changed = false;
+    ssize_t n;
+    while ((n = recv(nl, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+        if (n < 0) {
+            if (errno == ENOBUFS) changed = true;
+            if (errno == EINTR || errno == ENOBUFS) continue;
+            break;
+        }
+        int remaining = (int)n;
+        for (struct nlmsghdr *h = (struct nlmsghdr *)buf; NLMSG_OK(h, remaining); h = NLMSG_NEXT(h, remaining)) {
+            if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg))) continue;
+            struct inet_diag_msg *m = NLMSG_DATA(h);
+            if (m->id.idiag_dport != 0) continue;
+            for (int i = 0; i < count && !changed; i++) {
+                changed = ports[i].port == ntohs(m->id.idiag_sport);
+            }
+        }
+    }
+    return changed;
+}
+
+static char *handle_port_list(void) {
+    struct listen_port *ports = malloc(PORTS_MAX * sizeof(*ports));
+    if (!ports) return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    int count = ports_scan(ports, NULL, 0);
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{");
+    ports_write(&w, ports, count);
+    writer_printf(&w, "}}\n");
+    free(ports);
+    return writer_finish(&w);
+}
+
+/*
+ * Host channel
+ *
+ * Workloads connect to HOST_CHANNEL_SOCKET and write one JSON object per
+ * line ("ready", "checkpoint now", a custom metric, ...). Init relays each
+ * line to the host over an outbound vsock connection to CID 2, which
+ * Firecracker hands to the host's "<uds_path>_<port>" listener:
+ *   {"client":3,"pid":412,"message":{...}}
+ * The host writes back on the same connection:
+ *   {"client":3,"message":{...}}
+ * and the message is delivered as one line to that workload, or to every
+ * connected workload when "client" is 0 or missing.
+ *
+ * Messages are queued while the host isn't listening and flushed once it
+ * is. One thread polls every descriptor, so none of this takes a lock.
+ */
+#define HOST_CHANNEL_SOCKET "/run/hyperfleet.sock"
+#define HOST_CHANNEL_PORT 1052
+#define HOST_CHANNEL_MAX_CLIENTS 32
+#define HOST_CHANNEL_MAX_MESSAGE (64 * 1024)
+#define HOST_CHANNEL_QUEUE 256            /* messages kept while the host is away */
+#define HOST_CHANNEL_RETRY_MS 1000
+#define HOST_CHANNEL_MAX_RETRY_MS 30000
+#define HOST_CHANNEL_SEND_TIMEOUT_MS 1000 /* a host that stops reading counts as gone */
+
+static bool host_channel_enabled = true;
+
+struct channel_buffer {
+    char data[HOST_CHANNEL_MAX_MESSAGE];
+    size_t len;
+};
+
+struct channel_client {
+    int fd;
+    unsigned int id;
+    pid_t pid;
+    struct channel_buffer in;
+};
+
+static struct {
+    int listen_fd;
+    int host_fd;
+    long long retry_ms;
+    long long next_connect_ms;
+    unsigned int next_client_id;
+    struct channel_client *clients[HOST_CHANNEL_MAX_CLIENTS];
+    char *queue[HOST_CHANNEL_QUEUE];
+    size_t queue_head;
+    size_t queue_len;
+    struct channel_buffer host_in;
+    struct channel_buffer probe_in;
+    int ports_fd;          /* sock_diag destroy broadcasts */
+    long long ports_scan_ms;
+    struct listen_port ports[PORTS_MAX];
+    int port_count;
+    char *ports_line;      /* last set sent */
+} channel = { .listen_fd = -1, .host_fd = -1, .retry_ms = HOST_CHANNEL_RETRY_MS, .ports_fd = -1 };
+
+static void channel_enqueue(char *line) {
+    if (channel.queue_len == HOST_CHANNEL_QUEUE) {
+        log_warn("host channel queue full, dropping oldest message");
+        free(channel.queue[channel.queue_head]);
+        channel.queue_head = (channel.queue_head + 1) % HOST_CHANNEL_QUEUE;
+        channel.queue_len--;
+    }
+    channel.queue[(channel.queue_head + channel.queue_len) % HOST_CHANNEL_QUEUE] = line;
+    channel.queue_len++;
+}
+
+static void channel_host_close(void) {
+    close(channel.host_fd);
+    channel.host_fd = -1;
+    channel.host_in.len = 0;
+    channel.next_connect_ms = monotonic_ms() + channel.retry_ms;
+    log_info("host channel disconnected");
+}
+
+/* Send queued messages in order; stops at the first failure */
+static void channel_flush(void) {
+    while (channel.host_fd >= 0 && channel.queue_len > 0) {
+        char *line = channel.queue[channel.queue_head];
+        if (write_all(channel.host_fd, line, strlen(line)) < 0) {
+            channel_host_close();
+            return;
+        }
+        free(line);
+        channel.queue_head = (channel.queue_head + 1) % HOST_CHANNEL_QUEUE;
+        channel.queue_len--;
+    }
+}
+
+/* Rescan the listening ports and send them if they changed, or anyway when `always` */
+static void channel_update_ports(bool always) {
+    static struct listen_port scanned[PORTS_MAX];
+    int count = ports_scan(scanned, channel.ports, channel.port_count);
+    channel.ports_scan_ms = monotonic_ms() + PORTS_SCAN_MS;
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{");
+    ports_write(&w, scanned, count);
+    writer_printf(&w, "}\n");
+    char *line = writer_finish(&w);
+    if (!line) return;
+    memcpy(channel.ports, scanned, count * sizeof(scanned[0]));
+    channel.port_count = count;
+    if (!always && channel.ports_line && strcmp(line, channel.ports_line) == 0) {
+        free(line);
+        return;
+    }
+
+    free(channel.ports_line);
+    channel.ports_line = line;
+    char *out = strdup(line);
+    if (!out) return;
+    channel_enqueue(out);
+    channel_flush();
+}
+
+static void channel_host_connect(void) {
+    int fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_HOST,
+        .svm_port = HOST_CHANNEL_PORT,
+    };
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        /* Nobody listening yet; back off so an idle guest doesn't keep knocking */
+        channel.next_connect_ms = monotonic_ms() + channel.retry_ms;
+        channel.retry_ms = channel.retry_ms * 2 > HOST_CHANNEL_MAX_RETRY_MS ? HOST_CHANNEL_MAX_RETRY_MS
+                                                                           : channel.retry_ms * 2;
+        return;
+    }
+
+    struct timeval tv = { .tv_sec = HOST_CHANNEL_SEND_TIMEOUT_MS / 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    channel.host_fd = fd;
+    channel.retry_ms = HOST_CHANNEL_RETRY_MS;
+    log_info("host channel connected on port %d", HOST_CHANNEL_PORT);
+    channel_flush();
+    /* A host that just connected may have missed any change, or be new */
+    if (channel.host_fd >= 0) channel_update_ports(true);
+}
+
+static void channel_client_close(int slot) {
+    struct channel_client *c = channel.clients[slot];
+    log_debug("host channel client %u closed", c->id);
+    close(c->fd);
+    free(c);
+    channel.clients[slot] = NULL;
+}
+
+/* A workload's line: wrap it with its origin and pass it to the host */
+static void channel_relay(struct channel_client *c, const char *line) {
+    const char *p = json_skip_ws(line);
+    if (*p == '\0') return;
+    if (*p != '{' || *json_skip_ws(json_skip_value(p)) != '\0') {
+        static const char error[] = "{\"error\":\"messages must be single-line JSON objects\"}\n";
+        send(c->fd, error, sizeof(error) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return;
+    }
+
+    char *out = NULL;
+    if (asprintf(&out, "{\"client\":%u,\"pid\":%d,\"message\":%s}\n", c->id, (int)c->pid, p) < 0) return;
+    channel_enqueue(out);
+    if (channel.host_fd < 0) {
+        /* Don't wait out the backoff when there's something to say */
+        channel.next_connect_ms = 0;
+    }
+    channel_flush();
+}
+
+/* A host line: hand its message to the workload(s) it names */
+static void channel_deliver(const char *line) {
+    if (json_find_key(line, "probes")) {
+        probes_configure(line);
+        return;
+    }
+
+    int id = 0;
+    json_get_int(line, "client", &id);
+    const char *message = json_find_key(line, "message");
+    if (!message || *message != '{') {
+        log_warn("host channel: ignoring line without a message object");
+        return;
+    }
+    size_t len = json_skip_value(message) - message;
+
+    for (int i = 0; i < HOST_CHANNEL_MAX_CLIENTS; i++) {
+        struct channel_client *c = channel.clients[i];
+        if (!c || (id != 0 && c->id != (unsigned int)id)) continue;
+
+        /* A workload that doesn't read its socket gets dropped rather than stall everyone */
+        struct iovec iov[2] = { { (void *)message, len }, { "\n", 1 } };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+        if (sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len + 1) {
+            log_warn("host channel client %u not reading, disconnecting", c->id);
+            channel_client_close(i);
+        }
+    }
+}
+
+/*
+ * Read what's available on fd into b and pass each complete line to the
+ * callback. Returns -1 when the peer closed or sent a line that's too long.
+ */
+static int channel_read_lines(int fd, struct channel_buffer *b, void (*on_line)(void *ctx, char *line), void *ctx) {
+    ssize_t n = recv(fd, b->data + b->len, sizeof(b->data) - b->len, MSG_DONTWAIT);
+    if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (n == 0) return -1;
+    b->len += n;
+
+    size_t start = 0;
+    char *nl;
+    while ((nl = memchr(b->data + start, '\n', b->len - start)) != NULL) {
+        *nl = '\0';
+        on_line(ctx, b->data + start);
+        start = nl - b->data + 1;
+    }
+    memmove(b->data, b->data + start, b->len - start);
+    b->len -= start;
+    return b->len == sizeof(b->data) ? -1 : 0;
+}
+
+static void channel_on_client_line(void *ctx, char *line) {
+    channel_relay(ctx, line);
+}
+
+static void channel_on_host_line(void *ctx, char *line) {
+    (void)ctx;
+    channel_deliver(line);
+}
+
+/* A probe transition: init's own, so it goes to the host as is */
+static void channel_on_probe_line(void *ctx, char *line) {
+    (void)ctx;
+    char *out = NULL;
+    if (asprintf(&out, "%s\n", line) < 0) return;
+    channel_enqueue(out);
+    if (channel.host_fd < 0) channel.next_connect_ms = 0;
+    channel_flush();
+}
+
+static void channel_accept(void) {
+    int fd = accept4(channel.listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+
+    int slot = -1;
+    for (int i = 0; i < HOST_CHANNEL_MAX_CLIENTS && slot < 0; i++) {
+        if (!channel.clients[i]) slot = i;
+    }
+    struct channel_client *c = slot >= 0 ? malloc(sizeof(*c)) : NULL;
+    if (!c) {
+        static const char error[] = "{\"error\":\"too many clients\"}\n";
+        send(fd, error, sizeof(error) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+
+    struct ucred cred = { 0 };
+    socklen_t cred_len = sizeof(cred);
+    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len);
+    c->fd = fd;
+    c->id = ++channel.next_client_id;
+    c->pid = cred.pid;
+    c->in.len = 0;
+    channel.clients[slot] = c;
+    log_debug("host channel client %u connected (pid %d)", c->id, (int)c->pid);
+}
+
+static void *host_channel_thread(void *arg) {
+    (void)arg;
+
+    channel.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", HOST_CHANNEL_SOCKET);
+    unlink(HOST_CHANNEL_SOCKET);
+    if (channel.listen_fd < 0 || bind(channel.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(channel.listen_fd, 16) < 0) {
+        log_error("host channel socket %s: %s", HOST_CHANNEL_SOCKET, strerror(errno));
+        if (channel.listen_fd >= 0) close(channel.listen_fd);
+        channel.listen_fd = -1;
+        return NULL;
+    }
+    /* Any workload may talk to the host, whatever user it runs as */
+    chmod(HOST_CHANNEL_SOCKET, 0666);
+    log_info("host channel listening on %s", HOST_CHANNEL_SOCKET);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, probe_report_fd) < 0) {
+        log_warn("probe reports disabled: %s", strerror(errno));
+    }
+    channel.ports_fd = ports_watch_open();
+
+    while (!shutdown_requested && !reboot_requested) {
+        if (channel.host_fd < 0 && monotonic_ms() >= channel.next_connect_ms) {
+            channel_host_connect();
+        }
+
+        struct pollfd pfds[4 + HOST_CHANNEL_MAX_CLIENTS];
+        int slots[4 + HOST_CHANNEL_MAX_CLIENTS];
+        int nfds = 0;
+        pfds[nfds] = (struct pollfd){ .fd = channel.listen_fd, .events = POLLIN };
+        slots[nfds++] = -1;
+        if (channel.host_fd >= 0) {
+            pfds[nfds] = (struct pollfd){ .fd = channel.host_fd, .events = POLLIN };
+            slots[nfds++] = -2;
+        }
+        if (probe_report_fd[0] >= 0) {
+            pfds[nfds] = (struct pollfd){ .fd = probe_report_fd[0], .events = POLLIN };
+            slots[nfds++] = -3;
+        }
+        if (channel.ports_fd >= 0) {
+            pfds[nfds] = (struct pollfd){ .fd = channel.ports_fd, .events = POLLIN };
+            slots[nfds++] = -4;
+        }
+        for (int i = 0; i < HOST_CHANNEL_MAX_CLIENTS; i++) {
+            if (!channel.clients[i]) continue;
+            pfds[nfds] = (struct pollfd){ .fd = channel.clients[i]->fd, .events = POLLIN };
+            slots[nfds++] = i;
+        }
+
+        /* Ports are only watched while there's a host to tell */
+        long long wait = (channel.host_fd < 0 ? channel.next_connect_ms : channel.ports_scan_ms) - monotonic_ms();
+        int ready = poll(pfds, nfds, wait < 0 ? 0 : (int)wait);
+        if (channel.host_fd >= 0 && monotonic_ms() >= channel.ports_scan_ms) {
+            channel_update_ports(false);
+        }
+        if (ready <= 0) continue;
+
+        for (int i = 0; i < nfds; i++) {
+            if (!pfds[i].revents) continue;
+            if (slots[i] == -1) {
+                channel_accept();
+            } else if (slots[i] == -2) {
+                if (channel.host_fd >= 0 &&
+                    channel_read_lines(channel.host_fd, &channel.host_in, channel_on_host_line, NULL) < 0) {
+                    channel_host_close();
+                }
+            } else if (slots[i] == -3) {
+                channel_read_lines(probe_report_fd[0], &channel.probe_in, channel_on_probe_line, NULL);
+            } else if (slots[i] == -4) {
+                if (ports_watch_read(channel.ports_fd, channel.ports, channel.port_count) && channel.host_fd >= 0) {
+                    channel_update_ports(false);
+                }
+            } else if (channel.clients[slots[i]]) {
+                struct channel_client *c = channel.clients[slots[i]];
+                if (channel_read_lines(c->fd, &c->in, channel_on_client_line, c) < 0) {
+                    channel_client_close(slots[i]);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Shared directories
+ *
+ * Firecracker has no virtio-fs, so "share_mount" mounts a FUSE filesystem
+ * whose operations the host answers over vsock (CID 2, SHARE_PORT, which
+ * Firecracker hands to "<uds_path>_1053"). Each request is one JSON line
+ * naming the share and a path relative to its root:
+ *   {"op":"lookup","share":"data","path":"/models/a.bin"}
+ * and each reply is {"ok":true,...} or {"ok":false,"errno":N}. A "read"
+ * reply is followed by "size" raw bytes, as is a "write" request.
+ *
+ * The kernel caches attributes, entries (including misses) and symlinks for
+ * "cache_ms", opened files keep their page cache, and readahead asks for up
+ * to 1 MiB at a time. A read-mostly dataset costs a few round trips per file
+ * and is then served from guest memory.
+ *
+ * Every worker thread has its own host connection and handles one request
+ * at a time, so concurrent readers and readahead overlap.
+ */
+#define SHARE_PORT 1053
+#define MAX_SHARES 16
+#define SHARE_WORKERS 4
+#define SHARE_MAX_IO (1024 * 1024)
+#define SHARE_DEFAULT_CACHE_MS 60000
+#define SHARE_NODE_BUCKETS 4096
+#define SHARE_NAME_MAX 64
+#define SHARE_MAX_REPLY (16 * 1024 * 1024) /* large directory listings */
+#define SHARE_ROOT_ID FUSE_ROOT_ID
+
+/* nodeid -> path. The kernel holds nodeids until it forgets every lookup. */
+struct share_node {
+    char *path;  /* relative to the share root; NULL while free */
+    uint64_t nlookup;
+    uint64_t generation;
+    size_t next; /* hash chain, or free list while free; 0 = end */
+};
+
+struct share {
+    char name[SHARE_NAME_MAX];
+    char target[PATH_MAX];
+    bool writable;
+    long long cache_ms;
+    int fuse_fd;
+    int workers; /* guarded by shares_lock */
+
+    pthread_mutex_t lock; /* guards everything below */
+    struct share_node *nodes;
+    size_t nnodes;
+    size_t cap;
+    size_t free_head;
+    uint64_t next_generation;
+    size_t buckets[SHARE_NODE_BUCKETS];
+};
+
+static struct share *shares[MAX_SHARES];
+static pthread_mutex_t shares_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t share_path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h % SHARE_NODE_BUCKETS;
+}
+
+/* Find or add the node for a path and count one lookup. Returns 0 when out of memory. */
+static uint64_t share_node_ref(struct share *s, const char *path, uint64_t *generation) {
+    uint32_t b = share_path_hash(path);
+    pthread_mutex_lock(&s->lock);
+
+    for (size_t i = s->buckets[b]; i; i = s->nodes[i].next) {
+        if (strcmp(s->nodes[i].path, path) == 0) {
+            s->nodes[i].nlookup++;
+            *generation = s->nodes[i].generation;
+            pthread_mutex_unlock(&s->lock);
+            return i;
+        }
+    }
+
+    size_t id = s->free_head;
+    if (id) {
+        s->free_head = s->nodes[id].next;
+    } else {
+        if (s->nnodes == s->cap) {
+            size_t cap = s->cap * 2;
+            struct share_node *grown = realloc(s->nodes, cap * sizeof(*grown));
+            if (!grown) {
+                pthread_mutex_unlock(&s->lock);
+                return 0;
+            }
+            s->nodes = grown;
+            s->cap = cap;
+        }
+        id = s->nnodes++;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        s->nodes[id] = (struct share_node){ .next = s->free_head };
+        s->free_head = id;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    /* A reused nodeid needs a new generation so the kernel can tell them apart */
+    s->nodes[id] = (struct share_node){
+        .path = copy, .nlookup = 1, .generation = ++s->next_generation, .next = s->buckets[b],
+    };
+    s->buckets[b] = id;
+    *generation = s->nodes[id].generation;
+    pthread_mutex_unlock(&s->lock);
+    return id;
+}
+
+static void share_node_forget(struct share *s, uint64_t id, uint64_t nlookup) {
+    pthread_mutex_lock(&s->lock);
+    if (id == SHARE_ROOT_ID || id >= s->nnodes || !s->nodes[id].path) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    struct share_node *node = &s->nodes[id];
+    node->nlookup = nlookup < node->nlookup ? node->nlookup - nlookup : 0;
+    if (node->nlookup == 0) {
+        size_t *link = &s->buckets[share_path_hash(node->path)];
+        while (*link != id) link = &s->nodes[*link].next;
+        *link = node->next;
+        free(node->path);
+        node->path = NULL;
+        node->next = s->free_head;
+        s->free_head = id;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Copy a node's path, optionally joined with a child name. Returns an errno. */
+static int share_node_path(struct share *s, uint64_t id, const char *name, char *out, size_t out_len) {
+    pthread_mutex_lock(&s->lock);
+    if (id >= s->nnodes || !s->nodes[id].path) {
+        pthread_mutex_unlock(&s->lock);
+        return ESTALE;
+    }
+    const char *base = s->nodes[id].path;
+    int n = !name ? snprintf(out, out_len, "%s", base)
+                  : snprintf(out, out_len, "%s/%s", strcmp(base, "/") == 0 ? "" : base, name);
+    pthread_mutex_unlock(&s->lock);
+    return n < 0 || (size_t)n >= out_len ? ENAMETOOLONG : 0;
+}
+
+/* A worker's connection to the host and its buffers */
+struct share_conn {
+    int fd;
+    struct writer req;
+    char *in;         /* reply bytes read so far */
+    size_t in_len;
+    size_t in_cap;
+    size_t line_len;  /* length of the current reply line, newline included */
+};
+
+static void share_conn_close(struct share_conn *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->in_len = 0;
+    c->line_len = 0;
+}
+
+static int share_conn_open(struct share_conn *c) {
+    c->fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_HOST,
+        .svm_port = SHARE_PORT,
+    };
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        share_conn_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+/* Start a request line; the caller adds fields and ends it with share_call */
+static void share_request(struct share *s, struct share_conn *c, const char *op, const char *path) {
+    c->req.len = 0;
+    c->req.failed = false;
+    writer_printf(&c->req, "{\"op\":\"%s\",\"share\":\"%s\",\"path\":\"", op, s->name);
+    writer_json_escaped(&c->req, path, strlen(path));
+    writer_append(&c->req, "\"", 1);
+}
+
+/* Drop the current reply line, keeping whatever followed it */
+static void share_reply_done(struct share_conn *c) {
+    memmove(c->in, c->in + c->line_len, c->in_len - c->line_len);
+    c->in_len -= c->line_len;
+    c->line_len = 0;
+}
+
+/*
+ * Send the request (plus an optional raw body) and wait for the reply line,
+ * which is left NUL-terminated in c->in until share_reply_done. Returns 0,
+ * or an errno from the host (the line is then already dropped).
+ */
+static int share_call(struct share_conn *c, const void *body, size_t body_len) {
+    writer_append(&c->req, "}\n", 2);
+    if (c->req.failed) return ENOMEM;
+    if (c->fd < 0 && share_conn_open(c) < 0) return EIO;
+
+    if (write_all(c->fd, c->req.buf, c->req.len) < 0 || (body_len && write_all(c->fd, body, body_len) < 0)) {
+        share_conn_close(c);
+        return EIO;
+    }
+
+    for (;;) {
+        char *nl = c->in_len ? memchr(c->in, '\n', c->in_len) : NULL;
+        if (nl) {
+            *nl = '\0';
+            c->line_len = nl - c->in + 1;
+            break;
+        }
+        if (c->in_len == c->in_cap) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : 64 * 1024;
+            char *grown = cap <= SHARE_MAX_REPLY ? realloc(c->in, cap) : NULL;
+            if (!grown) {
+                share_conn_close(c);
+                return EIO;
+            }
+            c->in = grown;
+            c->in_cap = cap;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            share_conn_close(c);
+            return EIO;
+        }
+        c->in_len += n;
+    }
+
+    bool ok = false;
+    if (json_get_bool(c->in, "ok", &ok) == 0 && ok) return 0;
+
+    int err = EIO;
+    json_get_int(c->in, "errno", &err);
+    share_reply_done(c);
+    return err > 0 ? err : EIO;
+}
+
+/* Read the raw body that followed a reply line */
+static int share_read_body(struct share_conn *c, char *dst, size_t len) {
+    size_t done = len < c->in_len ? len : c->in_len;
+    memcpy(dst, c->in, done);
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done;
+
+    while (done < len) {
+        ssize_t n = read(c->fd, dst + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            share_conn_close(c);
+            return EIO;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void share_parse_attr(const char *reply, struct fuse_attr *attr) {
+    static const struct { const char *key; size_t offset; size_t size; } fields[] = {
+#define SHARE_ATTR_FIELD(name) { #name, offsetof(struct fuse_attr, name), sizeof(((struct fuse_attr *)0)->name) }
+        SHARE_ATTR_FIELD(ino), SHARE_ATTR_FIELD(size), SHARE_ATTR_FIELD(blocks),
+        SHARE_ATTR_FIELD(atime), SHARE_ATTR_FIELD(mtime), SHARE_ATTR_FIELD(ctime),
+        SHARE_ATTR_FIELD(atimensec), SHARE_ATTR_FIELD(mtimensec), SHARE_ATTR_FIELD(ctimensec),
+        SHARE_ATTR_FIELD(mode), SHARE_ATTR_FIELD(nlink), SHARE_ATTR_FIELD(uid), SHARE_ATTR_FIELD(gid),
+        SHARE_ATTR_FIELD(rdev),
+#undef SHARE_ATTR_FIELD
+    };
+
+    memset(attr, 0, sizeof(*attr));
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        long long value;
+        if (json_get_long(reply, fields[i].key, &value) != 0) continue;
+        char *field = (char *)attr + fields[i].offset;
+        if (fields[i].size == sizeof(uint64_t)) {
+            *(uint64_t *)field = value;
+        } else {
+            *(uint32_t *)field = value;
+        }
+    }
+    attr->blksize = 4096;
+}
+
+/* Directory listing fetched at opendir and served from memory by readdir */
+struct share_dir {
+    struct arena arena;
+    size_t count;
+    struct share_dirent {
+        uint64_t ino;
+        uint32_t type;
+        const char *name;
+    } *entries;
+};
+
+static int share_dir_load(struct share_conn *c, struct share_dir *dir) {
+    const char *p = json_find_key(c->in, "entries");
+    if (!p || *p != '[') return EIO;
+
+    size_t count = 0;
+    for (const char *q = json_skip_ws(p + 1); *q == '{';) {
+        count++;
+        q = json_skip_ws(json_skip_value(q));
+        if (*q == ',') q = json_skip_ws(q + 1);
+    }
+
+    dir->entries = arena_alloc(&dir->arena, (count ? count : 1) * sizeof(*dir->entries));
+    if (!dir->entries) return ENOMEM;
+
+    for (const char *q = json_skip_ws(p + 1); *q == '{' && dir->count < count;) {
+        struct share_dirent *e = &dir->entries[dir->count];
+        long long ino = 0;
+        int type = DT_UNKNOWN;
+        json_get_long(q, "ino", &ino);
+        json_get_int(q, "type", &type);
+        e->ino = ino;
+        e->type = type;
+        e->name = json_get_string(&dir->arena, q, "name");
+        if (e->name) dir->count++;
+        q = json_skip_ws(json_skip_value(q));
+        if (*q == ',') q = json_skip_ws(q + 1);
+    }
+    return 0;
+}
+
+static void fuse_reply(int fd, uint64_t unique, int err, const void *data, size_t len) {
+    if (err) len = 0;
+    struct fuse_out_header out = { .len = sizeof(out) + len, .error = -err, .unique = unique };
+    struct iovec iov[2] = { { &out, sizeof(out) }, { (void *)data, len } };
+    if (writev(fd, iov, len ? 2 : 1) < 0 && errno != ENOENT) {
+        /* ENOENT means the request was interrupted and nobody waits for the reply */
+        log_debug("fuse reply: %s", strerror(errno));
+    }
+}
+
+static void share_fill_entry(struct share *s, struct fuse_entry_out *entry, uint64_t nodeid, uint64_t generation) {
+    entry->nodeid = nodeid;
+    entry->generation = generation;
+    entry->entry_valid = entry->attr_valid = s->cache_ms / 1000;
+    entry->entry_valid_nsec = entry->attr_valid_nsec = (s->cache_ms % 1000) * 1000000;
+}
+
+/* Answer a lookup-like request whose reply line carries the attributes */
+static void share_reply_entry(struct share *s, struct share_conn *c, uint64_t unique, const char *path) {
+    struct fuse_entry_out entry = { 0 };
+    share_parse_attr(c->in, &entry.attr);
+    share_reply_done(c);
+
+    uint64_t generation = 0;
+    uint64_t nodeid = share_node_ref(s, path, &generation);
+    if (!nodeid) {
+        fuse_reply(s->fuse_fd, unique, ENOMEM, NULL, 0);
+        return;
+    }
+    share_fill_entry(s, &entry, nodeid, generation);
+    fuse_reply(s->fuse_fd, unique, 0, &entry, sizeof(entry));
+}
+
+static void share_init(struct share *s, uint64_t unique, const struct fuse_init_in *in) {
+    struct fuse_init_out out = {
+        .major = FUSE_KERNEL_VERSION,
+        .minor = in->minor < FUSE_KERNEL_MINOR_VERSION ? in->minor : FUSE_KERNEL_MINOR_VERSION,
+        .max_readahead = SHARE_MAX_IO,
+        .flags = in->flags & (FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_MAX_PAGES | FUSE_AUTO_INVAL_DATA |
+                              FUSE_PARALLEL_DIROPS | FUSE_CACHE_SYMLINKS),
+        .max_background = 16,
+        .congestion_threshold = 12,
+        .max_write = SHARE_MAX_IO,
+        .time_gran = 1,
+        .max_pages = SHARE_MAX_IO / 4096,
+    };
+    if (in->major != FUSE_KERNEL_VERSION) {
+        fuse_reply(s->fuse_fd, unique, EPROTO, NULL, 0);
+        return;
+    }
+    fuse_reply(s->fuse_fd, unique, 0, &out, out.minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+}
+
+/* Handle one request from the kernel; read replies go out of data */
+static void share_handle(struct share *s, struct share_conn *c, const struct fuse_in_header *in, const char *arg,
+                         char *data) {
+    char path[PATH_MAX];
+    int fd = s->fuse_fd;
+    int err;
+
+    switch (in->opcode) {
+    case FUSE_INIT:
+        share_init(s, in->unique, (const struct fuse_init_in *)arg);
+        return;
+
+    case FUSE_DESTROY:
+        fuse_reply(fd, in->unique, 0, NULL, 0);
+        return;
+
+    case FUSE_FORGET:
+        share_node_forget(s, in->nodeid, ((const struct fuse_forget_in *)arg)->nlookup);
+        return;
+
+    case FUSE_BATCH_FORGET: {
+        const struct fuse_batch_forget_in *batch = (const struct fuse_batch_forget_in *)arg;
+        const struct fuse_forget_one *items = (const struct fuse_forget_one *)(batch + 1);
+        for (uint32_t i = 0; i < batch->count; i++) {
+            share_node_forget(s, items[i].nodeid, items[i].nlookup);
+        }
+        return;
+    }
+
+    case FUSE_INTERRUPT:
+        /* Requests finish quickly; let them */
+        return;
+
+    case FUSE_LOOKUP:
+        if ((err = share_node_path(s, in->nodeid, arg, path, sizeof(path))) != 0) break;
+        share_request(s, c, "lookup", path);
+        if ((err = share_call(c, NULL, 0)) == ENOENT) {
+            /* Cache the miss too */
+            struct fuse_entry_out entry = { 0 };
+            share_fill_entry(s, &entry, 0, 0);
+            fuse_reply(fd, in->unique, 0, &entry, sizeof(entry));
+            return;
+        }
+        if (err) break;
+        share_reply_entry(s, c, in->unique, path);
+        return;
+
+    case FUSE_GETATTR:
+    case FUSE_SETATTR: {
+        if ((err = share_node_path(s, in->nodeid, NULL, path, sizeof(path))) != 0) break;
+        /*
+         * Only truncation is passed on. Mode, owner and time changes fail
+         * rather than appearing to work; the time update a truncate carries
+         * happens on the host anyway.
+         */
+        const struct fuse_setattr_in *set = (const struct fuse_setattr_in *)arg;
+        uint32_t unapplied = FATTR_MODE | FATTR_UID | FATTR_GID;
+        if (!(set->valid & FATTR_SIZE)) unapplied |= FATTR_ATIME | FATTR_MTIME;
+        if (in->opcode == FUSE_SETATTR && (set->valid & unapplied)) {
+            err = EPERM;
+            break;
+        }
+        if (in->opcode == FUSE_SETATTR && (set->valid & FATTR_SIZE)) {
+            if (!s->writable) {
+                err = EROFS;
+                break;
+            }
+            share_request(s, c, "truncate", path);
+            writer_printf(&c->req, ",\"size\":%llu", (unsigned long long)set->size);
+        } else {
+            share_request(s, c, "getattr", path);
+        }
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+
+        struct fuse_attr_out out = {
+            .attr_valid = s->cache_ms / 1000,
+            .attr_valid_nsec = (s->cache_ms % 1000) * 1000000,
+        };
+        share_parse_attr(c->in, &out.attr);
+        share_reply_done(c);
+        fuse_reply(fd, in->unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READLINK: {
+        if ((err = share_node_path(s, in->nodeid, NULL, path, sizeof(path))) != 0) break;
+        share_request(s, c, "readlink", path);
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+        struct arena scratch = { 0 };
+        size_t len = 0;
+        const char *target = json_get_string_raw(&scratch, c->in, "target", &len);
+        if (target && len < PATH_MAX) {
+            fuse_reply(fd, in->unique, 0, target, len);
+        } else {
+            fuse_reply(fd, in->unique, EIO, NULL, 0);
+        }
+        share_reply_done(c);
+        arena_release(&scratch);
+        return;
+    }
+
+    case FUSE_OPEN: {
+        const struct fuse_open_in *open_in = (const struct fuse_open_in *)arg;
+        if (!s->writable && (open_in->flags & O_ACCMODE) != O_RDONLY) {
+            err = EROFS;
+            break;
+        }
+        /* Keep cached pages across opens; FUSE_AUTO_INVAL_DATA drops them when mtime changes */
+        struct fuse_open_out out = { .open_flags = FOPEN_KEEP_CACHE };
+        fuse_reply(fd, in->unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READ: {
+        const struct fuse_read_in *read_in = (const struct fuse_read_in *)arg;
+        if ((err = share_node_path(s, in->nodeid, NULL, path, sizeof(path))) != 0) break;
+        size_t want = read_in->size < SHARE_MAX_IO ? read_in->size : SHARE_MAX_IO;
+        share_request(s, c, "read", path);
+        writer_printf(&c->req, ",\"offset\":%llu,\"size\":%zu", (unsigned long long)read_in->offset, want);
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+
+        long long size = -1;
+        json_get_long(c->in, "size", &size);
+        share_reply_done(c);
+        if (size < 0 || (size_t)size > want) {
+            share_conn_close(c);
+            err = EIO;
+            break;
+        }
+        if ((err = share_read_body(c, data, size)) != 0) break;
+        fuse_reply(fd, in->unique, 0, data, size);
+        return;
+    }
+
+    case FUSE_WRITE: {
+        const struct fuse_write_in *write_in = (const struct fuse_write_in *)arg;
+        if (!s->writable) {
+            err = EROFS;
+            break;
+        }
+        if ((err = share_node_path(s, in->nodeid, NULL, path, sizeof(path))) != 0) break;
+        share_request(s, c, "write", path);
+        writer_printf(&c->req, ",\"offset\":%llu,\"size\":%u", (unsigned long long)write_in->offset, write_in->size);
+        if ((err = share_call(c, write_in + 1, write_in->size)) != 0) break;
+
+        long long size = 0;
+        json_get_long(c->in, "size", &size);
+        share_reply_done(c);
+        struct fuse_write_out out = { .size = size };
+        fuse_reply(fd, in->unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_CREATE:
+    case FUSE_MKDIR: {
+        if (!s->writable) {
+            err = EROFS;
+            break;
+        }
+        bool is_create = in->opcode == FUSE_CREATE;
+        uint32_t mode = is_create ? ((const struct fuse_create_in *)arg)->mode : ((const struct fuse_mkdir_in *)arg)->mode;
+        const char *name = arg + (is_create ? sizeof(struct fuse_create_in) : sizeof(struct fuse_mkdir_in));
+        if ((err = share_node_path(s, in->nodeid, name, path, sizeof(path))) != 0) break;
+        share_request(s, c, is_create ? "create" : "mkdir", path);
+        writer_printf(&c->req, ",\"mode\":%u", mode & 07777);
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+
+        struct {
+            struct fuse_entry_out entry;
+            struct fuse_open_out open;
+        } out = { .open.open_flags = FOPEN_KEEP_CACHE };
+        share_parse_attr(c->in, &out.entry.attr);
+        share_reply_done(c);
+        uint64_t generation = 0;
+        uint64_t nodeid = share_node_ref(s, path, &generation);
+        if (!nodeid) {
+            err = ENOMEM;
+            break;
+        }
+        share_fill_entry(s, &out.entry, nodeid, generation);
+        fuse_reply(fd, in->unique, 0, &out, is_create ? sizeof(out) : sizeof(out.entry));
+        return;
+    }
+
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+        if (!s->writable) {
+            err = EROFS;
+            break;
+        }
+        if ((err = share_node_path(s, in->nodeid, arg, path, sizeof(path))) != 0) break;
+        share_request(s, c, in->opcode == FUSE_UNLINK ? "unlink" : "rmdir", path);
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+        share_reply_done(c);
+        fuse_reply(fd, in->unique, 0, NULL, 0);
+        return;
+
+    case FUSE_OPENDIR: {
+        if ((err = share_node_path(s, in->nodeid, NULL, path, sizeof(path))) != 0) break;
+        share_request(s, c, "readdir", path);
+        if ((err = share_call(c, NULL, 0)) != 0) break;
+
+        struct share_dir *dir = calloc(1, sizeof(*dir));
+        err = dir ? share_dir_load(c, dir) : ENOMEM;
+        share_reply_done(c);
+        if (err) {
+            if (dir) arena_release(&dir->arena);
+            free(dir);
+            break;
+        }
+        struct fuse_open_out out = { .fh = (uintptr_t)dir, .open_flags = FOPEN_KEEP_CACHE | FOPEN_CACHE_DIR };
+        fuse_reply(fd, in->unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READDIR: {
+        const struct fuse_read_in *read_in = (const struct fuse_read_in *)arg;
+        const struct share_dir *dir = (const struct share_dir *)(uintptr_t)read_in->fh;
+        size_t cap = read_in->size < SHARE_MAX_IO ? read_in->size : SHARE_MAX_IO;
+        size_t len = 0;
+        for (uint64_t i = read_in->offset; i < dir->count; i++) {
+            const struct share_dirent *e = &dir->entries[i];
+            size_t namelen = strlen(e->name);
+            size_t entry_len = FUSE_DIRENT_SIZE(&(struct fuse_dirent){ .namelen = namelen });
+            if (len + entry_len > cap) break;
+
+            struct fuse_dirent *d = (struct fuse_dirent *)(data + len);
+            d->ino = e->ino;
+            d->off = i + 1;
+            d->namelen = namelen;
+            d->type = e->type;
+            memcpy(d->name, e->name, namelen);
+            memset(d->name + namelen, 0, entry_len - FUSE_NAME_OFFSET - namelen);
+            len += entry_len;
+        }
+        fuse_reply(fd, in->unique, 0, data, len);
+        return;
+    }
+
+    case FUSE_RELEASEDIR: {
+        struct share_dir *dir = (struct share_dir *)(uintptr_t)((const struct fuse_release_in *)arg)->fh;
+        arena_release(&dir->arena);
+        free(dir);
+        fuse_reply(fd, in->unique, 0, NULL, 0);
+        return;
+    }
+
+    case FUSE_RELEASE:
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        /* Writes go straight to the host, so there's nothing to flush */
+        fuse_reply(fd, in->unique, 0, NULL, 0);
+        return;
+
+    case FUSE_STATFS: {
+        struct fuse_statfs_out out = { .st = { .bsize = 4096, .frsize = 4096, .namelen = 255 } };
+        fuse_reply(fd, in->unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    default:
+        err = ENOSYS;
+        break;
+    }
+
+    fuse_reply(fd, in->unique, err, NULL, 0);
+}
+
+static void share_free(struct share *s) {
+    for (size_t i = 0; i < s->nnodes; i++) free(s->nodes[i].path);
+    free(s->nodes);
+    pthread_mutex_destroy(&s->lock);
+    if (s->fuse_fd >= 0) close(s->fuse_fd);
+    free(s);
+}
+
+static void *share_worker(void *arg) {
+    struct share *s = arg;
+    struct share_conn conn = { .fd = -1 };
+    size_t buf_size = SHARE_MAX_IO + 64 * 1024; /* a full write plus its headers */
+    char *buf = malloc(buf_size);
+    char *data = malloc(SHARE_MAX_IO);
+
+    while (buf && data) {
+        ssize_t n = read(s->fuse_fd, buf, buf_size);
+        if (n < 0) {
+            /* ENOENT: the request was interrupted before we got it */
+            if (errno == EINTR || errno == EAGAIN || errno == ENOENT) continue;
+            break; /* ENODEV once unmounted */
+        }
+        if ((size_t)n < sizeof(struct fuse_in_header)) continue;
+        share_handle(s, &conn, (const struct fuse_in_header *)buf, buf + sizeof(struct fuse_in_header), data);
+    }
+
+    share_conn_close(&conn);
+    free(conn.req.buf);
+    free(conn.in);
+    free(buf);
+    free(data);
+
+    /* The last worker out frees the share */
+    pthread_mutex_lock(&shares_lock);
+    bool last = --s->workers == 0;
+    if (last) {
+        for (int i = 0; i < MAX_SHARES; i++) {
+            if (shares[i] == s) shares[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&shares_lock);
+    if (last) {
+        log_info("share %s unmounted from %s", s->name, s->target);
+        share_free(s);
+    }
+    return NULL;
+}
+
+static int mkdir_parents(const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s", path) >= (int)sizeof(tmp)) return -1;
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(tmp, 0755) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+static char *handle_share_mount(const struct agent_request *req, const char *json) {
+    char *name = json_get_string(req->arena, json, "share");
+    char *target = json_get_string(req->arena, json, "target");
+    bool writable = false;
+    long long cache_ms = SHARE_DEFAULT_CACHE_MS;
+    json_get_bool(json, "writable", &writable);
+    json_get_long(json, "cache_ms", &cache_ms);
+
+    if (!name || !job_id_valid(name) || strlen(name) >= SHARE_NAME_MAX) {
+        return strdup("{\"success\":false,\"error\":\"invalid share\"}\n");
+    }
+    if (!target || target[0] != '/' || strlen(target) >= PATH_MAX) {
+        return strdup("{\"success\":false,\"error\":\"target must be an absolute path\"}\n");
+    }
+    if (cache_ms < 0) cache_ms = 0;
+
+    struct share *s = calloc(1, sizeof(*s));
+    if (!s) return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    snprintf(s->target, sizeof(s->target), "%s", target);
+    s->writable = writable;
+    s->cache_ms = cache_ms;
+    s->fuse_fd = -1;
+    s->cap = 1024;
+    s->nnodes = SHARE_ROOT_ID + 1;
+    s->nodes = calloc(s->cap, sizeof(*s->nodes));
+    pthread_mutex_init(&s->lock, NULL);
+    if (!s->nodes || !(s->nodes[SHARE_ROOT_ID].path = strdup("/"))) {
+        share_free(s);
+        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+    s->nodes[SHARE_ROOT_ID].nlookup = 1;
+    s->buckets[share_path_hash("/")] = SHARE_ROOT_ID;
+
+    /* Fail now rather than on first access if the host doesn't serve the share */
+    struct share_conn probe = { .fd = -1 };
+    share_request(s, &probe, "getattr", "/");
+    int err = share_call(&probe, NULL, 0);
+    share_conn_close(&probe);
+    free(probe.req.buf);
+    free(probe.in);
+    if (err) {
+        share_free(s);
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"host does not serve share: %s\"}\n",
+            err == EIO ? "no connection" : strerror(err));
+        return response;
+    }
+
+    /* Kernels with CONFIG_FUSE_FS but no devtmpfs entry yet */
+    mknod("/dev/fuse", S_IFCHR | 0666, makedev(10, 229));
+    s->fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    char options[256];
+    snprintf(options, sizeof(options),
+        "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other,default_permissions,max_read=%d",
+        s->fuse_fd, SHARE_MAX_IO);
+    unsigned long flags = MS_NOSUID | MS_NODEV | (writable ? 0 : MS_RDONLY);
+    if (s->fuse_fd < 0 || mkdir_parents(target) < 0 ||
+        mount("hyperfleet", target, "fuse.hyperfleet", flags, options) < 0) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"mount: %s\"}\n", strerror(errno));
+        share_free(s);
+        return response;
+    }
+
+    pthread_mutex_lock(&shares_lock);
+    int slot = -1;
+    for (int i = 0; i < MAX_SHARES && slot < 0; i++) {
+        if (!shares[i]) slot = i;
+    }
+    if (slot >= 0) {
+        shares[slot] = s;
+        for (int i = 0; i < SHARE_WORKERS; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, share_worker, s) == 0) {
+                pthread_detach(thread);
+                s->workers++;
+            }
+        }
+        if (s->workers == 0) shares[slot] = NULL;
+    }
+    pthread_mutex_unlock(&shares_lock);
+
+    if (slot < 0 || s->workers == 0) {
+        umount2(target, MNT_DETACH);
+        share_free(s);
+        return strdup("{\"success\":false,\"error\":\"too many shares\"}\n");
+    }
+
+    log_info("share %s mounted on %s (%s, cache %lld ms)", s->name, s->target, writable ? "rw" : "ro", cache_ms);
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"share\":\"%s\",\"target\":\"", s->name);
+    writer_json_escaped(&w, target, strlen(target));
+    writer_printf(&w, "\",\"writable\":%s,\"cache_ms\":%lld}}\n", writable ? "true" : "false", cache_ms);
+    return writer_finish(&w);
+}
+
+static char *handle_share_unmount(const struct agent_request *req, const char *json) {
+    char *target = json_get_string(req->arena, json, "target");
+    if (!target) return strdup("{\"success\":false,\"error\":\"missing target\"}\n");
+
+    bool found = false;
+    pthread_mutex_lock(&shares_lock);
+    for (int i = 0; i < MAX_SHARES && !found; i++) {
+        found = shares[i] && strcmp(shares[i]->target, target) == 0;
+    }
+    pthread_mutex_unlock(&shares_lock);
+    if (!found) return strdup("{\"success\":false,\"error\":\"no share mounted there\"}\n");
+
+    /* Workers see ENODEV and clean up once the last user lets go */
+    if (umount2(target, MNT_DETACH) < 0) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"umount: %s\"}\n", strerror(errno));
+        return response;
+    }
+    return strdup("{\"success\":true,\"data\":{}}\n");
+}
+
+/*
+ * Workspaces
+ *
+ * A workspace is an overlayfs mounted on "target": a writable upper layer
+ * over a stack of read-only layers, such as a prepared dependency cache.
+ *   workspace_reset   unmounts, renames the upper layer into a trash
+ *                     directory and remounts on a fresh one, so a job starts
+ *                     from the base again however much the last one wrote.
+ *                     The trash is deleted by a background thread.
+ *   workspace_commit  turns the upper layer into a new named layer by
+ *                     renaming it, and remounts the workspace on top of it.
+ *                     Later workspaces can start from that layer.
+ * Both are constant time: nothing is copied or deleted while the caller
+ * waits. Overlayfs honors whiteouts in lower layers, so files a job deleted
+ * stay deleted in the layers committed after it.
+ *
+ * Everything lives under WORKSPACE_DIR on the root disk, which must support
+ * overlayfs upper layers (ext4 does). A layer is a "diff" directory plus a
+ * "base" file naming the layer beneath it; a base may also be an absolute
+ * path to an existing directory. Workspaces don't survive a reboot, layers
+ * do.
+ */
+#define WORKSPACE_DIR "/var/lib/hyperfleet/workspaces"
+#define WORKSPACE_LAYERS WORKSPACE_DIR "/layers"
+#define WORKSPACE_TRASH WORKSPACE_DIR "/trash"
+#define WORKSPACE_EMPTY WORKSPACE_DIR "/empty"
+/* Its own directory, so a workspace can't be named after the ones above */
+#define WORKSPACE_ROOTS WORKSPACE_DIR "/ws"
+#define MAX_WORKSPACES 32
+#define WORKSPACE_MAX_DEPTH 32 /* layers under one workspace; overlayfs allows a few hundred */
+#define WORKSPACE_BASE_PATH_MAX 256 /* so the deepest stack still fits mount's one-page options */
+
+struct workspace {
+    char name[JOB_ID_MAX]; /* empty while the slot is free */
+    char target[PATH_MAX];
+    char base[PATH_MAX];   /* layer name, absolute directory, or empty */
+};
+
+static struct workspace workspaces[MAX_WORKSPACES];
+static pthread_mutex_t workspaces_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int workspace_purge_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_DP ? rmdir(path) : unlink(path)) log_debug("purge %s: %s", path, strerror(errno));
+    return 0;
+}
+
+static void *workspace_purge(void *arg) {
+    char *path = arg;
+    nftw(path, workspace_purge_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(path);
+    return NULL;
+}
+
+/* Delete a tree in the background. Takes ownership of path. */
+static void workspace_purge_start(char *path) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workspace_purge, path) != 0) {
+        free(path); /* left for the next boot's sweep */
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Move a directory out of the way and delete it in the background */
+static int workspace_discard(const char *path) {
+    uint64_t id = 0;
+    char *trashed = NULL;
+    /* Unique across boots, so leftovers from the last one never collide */
+    getrandom(&id, sizeof(id), 0);
+    if (mkdir_parents(WORKSPACE_TRASH) < 0 ||
+        asprintf(&trashed, "%s/%016llx", WORKSPACE_TRASH, (unsigned long long)id) < 0) {
+        return -1;
+    }
+    if (rename(path, trashed) < 0) {
+        int err = errno;
+        free(trashed);
+        errno = err;
+        return err == ENOENT ? 0 : -1;
+    }
+    workspace_purge_start(trashed);
+    return 0;
+}
+
+/* Finish deleting whatever the last boot didn't get round to */
+static void workspace_sweep(void) {
+    DIR *dir = opendir(WORKSPACE_TRASH);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        char *path = NULL;
+        if (entry->d_name[0] == '.') continue;
+        if (asprintf(&path, "%s/%s", WORKSPACE_TRASH, entry->d_name) >= 0) workspace_purge_start(path);
+    }
+    if (dir) closedir(dir);
+}
+
+static bool workspace_base_valid(const char *base) {
+    if (base[0] == '/') {
+        struct stat st;
+        /* ':' and ',' would split overlayfs' options */
+        return strlen(base) < WORKSPACE_BASE_PATH_MAX && !strpbrk(base, ":,") && stat(base, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    char diff[PATH_MAX];
+    snprintf(diff, sizeof(diff), "%s/%s/diff", WORKSPACE_LAYERS, base);
+    return job_id_valid(base) && access(diff, F_OK) == 0;
+}
+
+/* The layer a layer was committed on, or "" */
+static void workspace_layer_base(const char *layer, char *base, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/base", WORKSPACE_LAYERS, layer);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, base, size - 1) : 0;
+    if (fd >= 0) close(fd);
+    base[n > 0 ? n : 0] = '\0';
+}
+
+static int workspace_set_layer_base(const char *layer, const char *base) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/base", WORKSPACE_LAYERS, layer);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    int rc = write_all(fd, base, strlen(base));
+    if (close(fd) < 0) rc = -1;
+    return rc;
+}
+
+/* overlayfs "lowerdir" for a base, top layer first. Returns the number of layers or -1. */
+static int workspace_lowerdir(const char *base, char *out, size_t size) {
+    char layer[PATH_MAX];
+    snprintf(layer, sizeof(layer), "%s", base);
+    size_t len = 0;
+    int depth = 0;
+    out[0] = '\0';
+
+    while (layer[0]) {
+        if (++depth > WORKSPACE_MAX_DEPTH) return -1;
+        int n = layer[0] == '/'
+            ? snprintf(out + len, size - len, "%s%s", len ? ":" : "", layer)
+            : snprintf(out + len, size - len, "%s%s/%s/diff", len ? ":" : "", WORKSPACE_LAYERS, layer);
+        if (n < 0 || (size_t)n >= size - len) return -1;
+        len += n;
+        if (layer[0] == '/') break;
+        char next[PATH_MAX];
+        workspace_layer_base(layer, next, sizeof(next));
+        snprintf(layer, sizeof(layer), "%s", next);
+    }
+    if (depth == 0) {
+        /* overlayfs needs a lower layer even when there's nothing in it */
+        if (mkdir_parents(WORKSPACE_EMPTY) < 0) return -1;
+        snprintf(out, size, "%s", WORKSPACE_EMPTY);
+    }
+    return depth;
+}
+
+/* Mount a workspace on fresh upper and work directories. Called with workspaces_lock held. */
+static int workspace_mount(const struct workspace *ws) {
+    char upper[PATH_MAX], work[PATH_MAX], lower[PATH_MAX], options[PATH_MAX];
+    snprintf(upper, sizeof(upper), "%s/%s/upper", WORKSPACE_ROOTS, ws->name);
+    snprintf(work, sizeof(work), "%s/%s/work", WORKSPACE_ROOTS, ws->name);
+
+    if (workspace_lowerdir(ws->base, lower, sizeof(lower)) < 0) {
+        errno = ELOOP;
+        return -1;
+    }
+    if (mkdir_parents(upper) < 0 || mkdir_parents(work) < 0 || mkdir_parents(ws->target) < 0) return -1;
+    if (snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work) >=
+        (int)sizeof(options)) {
+        errno = E2BIG;
+        return -1;
+    }
+    return mount("overlay", ws->target, "overlay", 0, options);
+}
+
+/* Unmount and throw the upper layer away. Called with workspaces_lock held. */
+static int workspace_unmount(const struct workspace *ws) {
+    /* A lazy unmount would leave running jobs writing to the old layer */
+    if (umount2(ws->target, 0) < 0 && errno != EINVAL) return -1;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s", WORKSPACE_ROOTS, ws->name);
+    return workspace_discard(dir);
+}
+
+static struct workspace *workspace_find(const char *name) {
+    for (int i = 0; i < MAX_WORKSPACES; i++) {
+        if (strcmp(workspaces[i].name, name) == 0) return &workspaces[i];
+    }
+    return NULL;
+}
+
+static char *workspace_error(const char *what) {
+    char *response = NULL;
+    asprintf(&response, "{\"success\":false,\"error\":\"%s: %s\"}\n", what, strerror(errno));
+    return response;
+}
+
+/* "base":"deps" or "base":null */
+static void workspace_write_base(struct writer *w, const char *base) {
+    if (!base[0]) {
+        writer_printf(w, ",\"base\":null");
+        return;
+    }
+    writer_printf(w, ",\"base\":\"");
+    writer_json_escaped(w, base, strlen(base));
+    writer_printf(w, "\"");
+}
+
+static void workspace_write(struct writer *w, const struct workspace *ws) {
+    writer_printf(w, "{\"workspace\":\"%s\",\"target\":\"", ws->name);
+    writer_json_escaped(w, ws->target, strlen(ws->target));
+    writer_printf(w, "\"");
+    workspace_write_base(w, ws->base);
+    writer_printf(w, "}");
+}
+
+static char *workspace_response(const struct workspace *ws) {
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":");
+    workspace_write(&w, ws);
+    writer_printf(&w, "}\n");
+    return writer_finish(&w);
+}
+
+static char *handle_workspace_create(const struct agent_request *req, const char *json) {
+    char *name = json_get_string(req->arena, json, "workspace");
+    char *target = json_get_string(req->arena, json, "target");
+    char *base = json_get_string(req->arena, json, "base");
+
+    if (!name || !job_id_valid(name)) return strdup("{\"success\":false,\"error\":\"invalid workspace\"}\n");
+    if (!target || target[0] != '/' || strlen(target) >= PATH_MAX) {
+        return strdup("{\"success\":false,\"error\":\"target must be an absolute path\"}\n");
+    }
+    if (base && !workspace_base_valid(base)) return strdup("{\"success\":false,\"error\":\"unknown base\"}\n");
+
+    pthread_mutex_lock(&workspaces_lock);
+    static bool swept = false;
+    if (!swept) workspace_sweep();
+    swept = true;
+
+    struct workspace *ws = NULL;
+    const char *error = NULL;
+    for (int i = 0; i < MAX_WORKSPACES && !error; i++) {
+        if (strcmp(workspaces[i].name, name) == 0) error = "workspace exists";
+        else if (workspaces[i].name[0] && strcmp(workspaces[i].target, target) == 0) error = "target in use";
+        else if (!ws && !workspaces[i].name[0]) ws = &workspaces[i];
+    }
+    if (!error && !ws) error = "too many workspaces";
+    if (error) {
+        pthread_mutex_unlock(&workspaces_lock);
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"%s\"}\n", error);
+        return response;
+    }
+
+    snprintf(ws->name, sizeof(ws->name), "%s", name);
+    snprintf(ws->target, sizeof(ws->target), "%s", target);
+    snprintf(ws->base, sizeof(ws->base), "%s", base ? base : "");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s", WORKSPACE_ROOTS, name);
+    /* Left over from before a reboot */
+    if (workspace_discard(dir) < 0 || workspace_mount(ws) < 0) {
+        char *response = workspace_error("mount");
+        ws->name[0] = '\0';
+        pthread_mutex_unlock(&workspaces_lock);
+        return response;
+    }
+    char *response = workspace_response(ws);
+    pthread_mutex_unlock(&workspaces_lock);
+    log_info("workspace %s mounted on %s", name, target);
+    return response;
+}
+
+static char *handle_workspace_reset(const struct agent_request *req, const char *json) {
+    char *name = json_get_string(req->arena, json, "workspace");
+    if (!name) return strdup("{\"success\":false,\"error\":\"missing workspace\"}\n");
+
+    pthread_mutex_lock(&workspaces_lock);
+    struct workspace *ws = workspace_find(name);
+    char *response;
+    if (!ws) {
+        response = strdup("{\"success\":false,\"error\":\"unknown workspace\"}\n");
+    } else if (workspace_unmount(ws) < 0) {
+        response = workspace_error(errno == EBUSY ? "workspace in use" : "unmount");
+    } else if (workspace_mount(ws) < 0) {
+        response = workspace_error("mount");
+    } else {
+        response = workspace_response(ws);
+    }
+    pthread_mutex_unlock(&workspaces_lock);
+    return response;
+}
+
+static char *handle_workspace_commit(const struct agent_request *req, const char *json) {
+    char *name = json_get_string(req->arena, json, "workspace");
+    char *layer = json_get_string(req->arena, json, "layer");
+    if (!name) return strdup("{\"success\":false,\"error\":\"missing workspace\"}\n");
+    if (!layer || !job_id_valid(layer)) return strdup("{\"success\":false,\"error\":\"invalid layer\"}\n");
+
+    char layer_dir[PATH_MAX], diff[PATH_MAX], upper[PATH_MAX], lower[PATH_MAX];
+    snprintf(layer_dir, sizeof(layer_dir), "%s/%s", WORKSPACE_LAYERS, layer);
+    snprintf(diff, sizeof(diff), "%s/%s/diff", WORKSPACE_LAYERS, layer);
+
+    pthread_mutex_lock(&workspaces_lock);
+    struct workspace *ws = workspace_find(name);
+    char *response = NULL;
+    if (!ws) {
+        response = strdup("{\"success\":false,\"error\":\"unknown workspace\"}\n");
+        goto out;
+    }
+    if (access(diff, F_OK) == 0) {
+        response = strdup("{\"success\":false,\"error\":\"layer exists\"}\n");
+        goto out;
+    }
+    int depth = workspace_lowerdir(ws->base, lower, sizeof(lower));
+    if (depth < 0 || depth >= WORKSPACE_MAX_DEPTH) {
+        response = strdup("{\"success\":false,\"error\":\"too many layers\"}\n");
+        goto out;
+    }
+    if (umount2(ws->target, 0) < 0 && errno != EINVAL) {
+        response = workspace_error(errno == EBUSY ? "workspace in use" : "unmount");
+        goto out;
+    }
+
+    /* The diff appears last, so a half-made layer is never used */
+    snprintf(upper, sizeof(upper), "%s/%s/upper", WORKSPACE_ROOTS, ws->name);
+    if (workspace_discard(layer_dir) < 0 || mkdir_parents(layer_dir) < 0 ||
+        (ws->base[0] && workspace_set_layer_base(layer, ws->base) < 0) || rename(upper, diff) < 0) {
+        response = workspace_error("commit");
+        workspace_discard(layer_dir);
+        workspace_mount(ws);
+        goto out;
+    }
+    snprintf(ws->base, sizeof(ws->base), "%s", layer);
+    if (workspace_unmount(ws) < 0 || workspace_mount(ws) < 0) {
+        response = workspace_error("mount");
+        goto out;
+    }
+    response = workspace_response(ws);
+    log_info("workspace %s committed as layer %s", name, layer);
+out:
+    pthread_mutex_unlock(&workspaces_lock);
+    return response;
+}
+
+/* Whether any workspace or other layer is built on a layer. Called with workspaces_lock held. */
+static bool workspace_layer_in_use(const char *layer) {
+    for (int i = 0; i < MAX_WORKSPACES; i++) {
+        char current[PATH_MAX];
+        snprintf(current, sizeof(current), "%s", workspaces[i].name[0] ? workspaces[i].base : "");
+        for (int depth = 0; current[0] && current[0] != '/' && depth < WORKSPACE_MAX_DEPTH; depth++) {
+            if (strcmp(current, layer) == 0) return true;
+            char next[PATH_MAX];
+            workspace_layer_base(current, next, sizeof(next));
+            snprintf(current, sizeof(current), "%s", next);
+        }
+    }
+
+    DIR *dir = opendir(WORKSPACE_LAYERS);
+    struct dirent *entry;
+    bool used = false;
+    while (dir && !used && (entry = readdir(dir)) != NULL) {
+        char base[PATH_MAX];
+        if (entry->d_name[0] == '.') continue;
+        workspace_layer_base(entry->d_name, base, sizeof(base));
+        used = strcmp(base, layer) == 0;
+    }
+    if (dir) closedir(dir);
+    return used;
+}
+
+static char *handle_workspace_delete(const struct agent_request *req, const char *json) {
+    char *name = json_get_string(req->arena, json, "workspace");
+    char *layer = json_get_string(req->arena, json, "layer");
+    if (!name && !layer) return strdup("{\"success\":false,\"error\":\"missing workspace or layer\"}\n");
+
+    pthread_mutex_lock(&workspaces_lock);
+    char *response = NULL;
+    if (name) {
+        struct workspace *ws = workspace_find(name);
+        if (!ws) {
+            response = strdup("{\"success\":false,\"error\":\"unknown workspace\"}\n");
+        } else if (workspace_unmount(ws) < 0) {
+            response = workspace_error(errno == EBUSY ? "workspace in use" : "unmount");
+        } else {
+            ws->name[0] = '\0';
+        }
+    }
+    if (!response && layer) {
+        char layer_dir[PATH_MAX];
+        snprintf(layer_dir, sizeof(layer_dir), "%s/%s", WORKSPACE_LAYERS, layer);
+        if (!job_id_valid(layer) || access(layer_dir, F_OK) != 0) {
+            response = strdup("{\"success\":false,\"error\":\"unknown layer\"}\n");
+        } else if (workspace_layer_in_use(layer)) {
+            response = strdup("{\"success\":false,\"error\":\"layer in use\"}\n");
+        } else if (workspace_discard(layer_dir) < 0) {
+            response = workspace_error("delete");
+        }
+    }
+    pthread_mutex_unlock(&workspaces_lock);
+    return response ? response : strdup("{\"success\":true,\"data\":{}}\n");
+}
+
+static char *handle_workspace_list(void) {
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"workspaces\":[");
+    pthread_mutex_lock(&workspaces_lock);
+    bool first = true;
+    for (int i = 0; i < MAX_WORKSPACES; i++) {
+        const struct workspace *ws = &workspaces[i];
+        if (!ws->name[0]) continue;
+        if (!first) writer_printf(&w, ",");
+        workspace_write(&w, ws);
+        first = false;
+    }
+
+    writer_printf(&w, "],\"layers\":[");
+    DIR *dir = opendir(WORKSPACE_LAYERS);
+    struct dirent *entry;
+    first = true;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        char diff[PATH_MAX], base[PATH_MAX];
+        snprintf(diff, sizeof(diff), "%s/%s/diff", WORKSPACE_LAYERS, entry->d_name);
+        if (entry->d_name[0] == '.' || !job_id_valid(entry->d_name) || access(diff, F_OK) != 0) continue;
+        workspace_layer_base(entry->d_name, base, sizeof(base));
+        writer_printf(&w, "%s{\"layer\":\"%s\"", first ? "" : ",", entry->d_name);
+        workspace_write_base(&w, base);
+        writer_printf(&w, "}");
+        first = false;
+    }
+    if (dir) closedir(dir);
+    pthread_mutex_unlock(&workspaces_lock);
+    writer_printf(&w, "]}}\n");
+    return writer_finish(&w);
+}
+
+/*
+ * Network block root
+ *
+ * With "hyperfleet.nbd_root=<export>" on the kernel command line, init runs
+ * from an initramfs holding nothing but itself. Before anything else it
+ * dials the host's block server (CID 2, NBD_ROOT_PORT, which Firecracker
+ * hands to "<uds_path>_1054"), names the export in one JSON line and reads
+ * one back:
+ *   {"export":"root"}
+ *   {"ok":true,"size":1073741824,"block_size":4096,"flags":5}
+ * From then on the socket speaks the NBD transmission protocol and belongs
+ * to the kernel's NBD client, which gets it through generic netlink. The
+ * ext4 on /dev/nbd0 becomes the root and init carries on in the same
+ * process. Blocks only cross vsock when the guest reads them.
+ *
+ * If the host side goes away (the API restarting, say) the kernel holds
+ * I/O for up to NBD_DEAD_CONN_TIMEOUT seconds; a thread watches the socket
+ * and hands the kernel a fresh one.
+ */
+#define NBD_ROOT_PORT 1054
+#define NBD_ROOT_INDEX 0
+#define NBD_DEAD_CONN_TIMEOUT 600
+#define NBD_HANDSHAKE_MAX 512
+
+struct nbd_export {
+    long long size;
+    long long block_size;
+    long long flags;
+};
+
+static char nbd_root_export[JOB_ID_MAX];
+static int nbd_root_fd = -1; /* our reference to the socket the kernel is using */
+static uint16_t nbd_genl_family;
+static uint32_t nbd_genl_seq;
+
+/* Read the kernel command line from a /proc that only lives for the check */
+static bool nbd_root_requested(void) {
+    if (mount_fs("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) return false;
+
+    char cmdline[4096];
+    int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, cmdline, sizeof(cmdline) - 1) : -1;
+    if (fd >= 0) close(fd);
+    umount2("/proc", MNT_DETACH);
+    if (n <= 0) return false;
+    cmdline[n] = '\0';
+
+    char *save = NULL;
+    for (char *tok = strtok_r(cmdline, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+        if (strncmp(tok, "hyperfleet.nbd_root=", 20) == 0) {
+            snprintf(nbd_root_export, sizeof(nbd_root_export), "%s", tok + 20);
+            return job_id_valid(nbd_root_export);
+        }
+    }
+    return false;
+}
+
+/* Connect and agree on the export. Returns the socket, positioned at the NBD stream. */
+static int nbd_root_dial(struct nbd_export *ex) {
+    int fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_HOST,
+        .svm_port = NBD_ROOT_PORT,
+    };
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto fail;
+
+    char line[NBD_HANDSHAKE_MAX];
+    int len = snprintf(line, sizeof(line), "{\"export\":\"%s\"}\n", nbd_root_export);
+    if (write_all(fd, line, len) < 0) goto fail;
+
+    /* A byte at a time, so nothing past the newline is taken from the kernel */
+    size_t got = 0;
+    for (;;) {
+        if (got == sizeof(line) - 1) goto fail;
+        ssize_t n = read(fd, line + got, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto fail;
+        if (line[got] == '\n') break;
+        got++;
+    }
+    line[got] = '\0';
+
+    bool ok = false;
+    *ex = (struct nbd_export){ 0 };
+    if (json_get_bool(line, "ok", &ok) != 0 || !ok ||
+        json_get_long(line, "size", &ex->size) != 0 || ex->size <= 0 ||
+        json_get_long(line, "block_size", &ex->block_size) != 0) {
+        log_error("nbd root: host refused export %s: %s", nbd_root_export, line);
+        errno = ENOENT;
+        goto fail;
+    }
+    json_get_long(line, "flags", &ex->flags);
+    return fd;
+
+fail:
+    if (fd >= 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
+
+/* A generic netlink request under construction */
+struct nl_msg {
+    char buf[256] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t len;
+};
+
+static void nl_start(struct nl_msg *m, uint16_t family, uint8_t cmd) {
+    memset(m, 0, sizeof(*m));
+    struct genlmsghdr *g = (struct genlmsghdr *)(m->buf + NLMSG_HDRLEN);
+    ((struct nlmsghdr *)m->buf)->nlmsg_type = family;
+    g->cmd = cmd;
+    g->version = 1;
+    m->len = NLMSG_HDRLEN + GENL_HDRLEN;
+}
+
+/* Append an attribute; nested ones are opened with no data and closed by nl_nest_end */
+static struct nlattr *nl_attr(struct nl_msg *m, uint16_t type, const void *data, size_t size) {
+    struct nlattr *a = (struct nlattr *)(m->buf + m->len);
+    a->nla_type = type;
+    a->nla_len = NLA_HDRLEN + size;
+    if (size) memcpy((char *)a + NLA_HDRLEN, data, size);
+    m->len += NLA_ALIGN(a->nla_len);
+    return a;
+}
+
+static void nl_nest_end(struct nl_msg *m, struct nlattr *a) {
+    a->nla_len = m->buf + m->len - (char *)a;
+}
+
+/*
+ * Send a request and wait for its ack. If want_attr is set, a u16 or u32
+ * attribute of that type found in the reply is stored in *value.
+ * Returns 0 or an errno.
+ */
+static int nl_call(int nl, struct nl_msg *m, uint16_t want_attr, uint32_t *value) {
+    struct nlmsghdr *h = (struct nlmsghdr *)m->buf;
+    h->nlmsg_len = m->len;
+    h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    h->nlmsg_seq = ++nbd_genl_seq;
+
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    if (sendto(nl, m->buf, m->len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) return errno;
+
+    char reply[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        ssize_t n = recv(nl, reply, sizeof(reply), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+
+        int remaining = n;
+        for (struct nlmsghdr *r = (struct nlmsghdr *)reply; NLMSG_OK(r, remaining); r = NLMSG_NEXT(r, remaining)) {
+            if (r->nlmsg_seq != h->nlmsg_seq) continue;
+            if (r->nlmsg_type == NLMSG_ERROR) {
+                return -((struct nlmsgerr *)NLMSG_DATA(r))->error;
+            }
+            if (!want_attr || r->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN) continue;
+
+            char *attrs = (char *)NLMSG_DATA(r) + GENL_HDRLEN;
+            int attrs_len = r->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+            for (struct nlattr *a = (struct nlattr *)attrs; attrs_len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN &&
+                 a->nla_len <= attrs_len; attrs_len -= NLA_ALIGN(a->nla_len),
+                 a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len))) {
+                if ((a->nla_type & NLA_TYPE_MASK) != want_attr) continue;
+                if (a->nla_len == NLA_HDRLEN + sizeof(uint16_t)) {
+                    uint16_t v;
+                    memcpy(&v, (char *)a + NLA_HDRLEN, sizeof(v));
+                    *value = v;
+                } else if (a->nla_len >= NLA_HDRLEN + sizeof(uint32_t)) {
+                    memcpy(value, (char *)a + NLA_HDRLEN, sizeof(*value));
+                }
+            }
+        }
+    }
+}
+
+/* Give the kernel's NBD client a connected socket: NBD_CMD_CONNECT or NBD_CMD_RECONFIGURE */
+static int nbd_root_attach(uint8_t cmd, int sock_fd, const struct nbd_export *ex) {
+    int nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (nl < 0) return errno;
+
+    struct nl_msg m;
+    int err = 0;
+    if (!nbd_genl_family) {
+        uint32_t family = 0;
+        nl_start(&m, GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+        nl_attr(&m, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME, sizeof(NBD_GENL_FAMILY_NAME));
+        err = nl_call(nl, &m, CTRL_ATTR_FAMILY_ID, &family);
+        if (!err && !family) err = ENODEV;
+        nbd_genl_family = family;
+    }
+
+    if (!err) {
+        uint32_t index = NBD_ROOT_INDEX;
+        uint32_t fd = sock_fd;
+        nl_start(&m, nbd_genl_family, cmd);
+        nl_attr(&m, NBD_ATTR_INDEX, &index, sizeof(index));
+        if (cmd == NBD_CMD_CONNECT) {
+            uint64_t size = ex->size, block_size = ex->block_size, flags = ex->flags;
+            uint64_t dead_conn_timeout = NBD_DEAD_CONN_TIMEOUT;
+            nl_attr(&m, NBD_ATTR_SIZE_BYTES, &size, sizeof(size));
+            nl_attr(&m, NBD_ATTR_BLOCK_SIZE_BYTES, &block_size, sizeof(block_size));
+            nl_attr(&m, NBD_ATTR_SERVER_FLAGS, &flags, sizeof(flags));
+            nl_attr(&m, NBD_ATTR_DEAD_CONN_TIMEOUT, &dead_conn_timeout, sizeof(dead_conn_timeout));
+        }
+        struct nlattr *sockets = nl_attr(&m, NBD_ATTR_SOCKETS | NLA_F_NESTED, NULL, 0);
+        struct nlattr *item = nl_attr(&m, NBD_SOCK_ITEM | NLA_F_NESTED, NULL, 0);
+        nl_attr(&m, NBD_SOCK_FD, &fd, sizeof(fd));
+        nl_nest_end(&m, item);
+        nl_nest_end(&m, sockets);
+        err = nl_call(nl, &m, 0, NULL);
+    }
+
+    close(nl);
+    return err;
+}
+
+/* Watch the socket the kernel is using and replace it if the host end closes */
+static void *nbd_root_watch(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        /* Only hangups are asked for; the kernel consumes the data */
+        struct pollfd pfd = { .fd = nbd_root_fd, .events = POLLRDHUP };
+        if (poll(&pfd, 1, -1) < 0 || !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) continue;
+
+        log_warn("nbd root: lost the host block server, reconnecting");
+        close(nbd_root_fd);
+
+        /* Until the kernel notices the old socket is dead, it refuses a new one with ENOSPC */
+        for (unsigned delay_ms = 100;; delay_ms = delay_ms < 2000 ? delay_ms * 2 : 2000) {
+            struct nbd_export ex;
+            int fd = nbd_root_dial(&ex);
+            int err = fd < 0 ? errno : nbd_root_attach(NBD_CMD_RECONFIGURE, fd, &ex);
+            if (!err) {
+                nbd_root_fd = fd;
+                log_info("nbd root: reconnected");
+                break;
+            }
+            if (fd >= 0) close(fd);
+            log_debug("nbd root: reconnect: %s", strerror(err));
+            usleep(delay_ms * 1000);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Mount the network block device as the new root and move into it.
+ * Runs before setup_filesystems, which mounts /proc and /dev again inside it.
+ */
+static int nbd_root_mount(void) {
+    if (mount_fs("devtmpfs", "/dev", "devtmpfs", MS_NOSUID, "mode=0755") != 0) return -1;
+
+    /* The host listens before the VM boots; allow a moment for vsock to come up */
+    struct nbd_export ex;
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && (fd = nbd_root_dial(&ex)) < 0; attempt++) {
+        usleep(100 * 1000);
+    }
+    if (fd < 0) {
+        log_error("nbd root: cannot reach the host block server: %s", strerror(errno));
+        return -1;
+    }
+
+    int err = nbd_root_attach(NBD_CMD_CONNECT, fd, &ex);
+    if (err) {
+        log_error("nbd root: connect: %s", strerror(err));
+        close(fd);
+        return -1;
+    }
+    nbd_root_fd = fd;
+
+    char dev[32];
+    struct stat st;
+    snprintf(dev, sizeof(dev), "/dev/nbd%d", NBD_ROOT_INDEX);
+    if (stat(dev, &st) != 0 && mknod(dev, S_IFBLK | 0600, makedev(43, NBD_ROOT_INDEX)) != 0) {
+        log_error("mknod %s: %s", dev, strerror(errno));
+        return -1;
+    }
+    if (mount_fs(dev, "/newroot", "ext4", 0, NULL) != 0) return -1;
+    log_info("root filesystem on %s (%lld MiB, export %s)", dev, ex.size >> 20, nbd_root_export);
+
+    /* The initramfs can't be unmounted, but its copy of init can be freed */
+    unlink("/init");
+    umount2("/dev", MNT_DETACH);
+    if (chdir("/newroot") != 0 || mount(".", "/", NULL, MS_MOVE, NULL) != 0 ||
+        chroot(".") != 0 || chdir("/") != 0) {
+        log_error("switching root: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, nbd_root_watch, NULL) != 0) {
+        log_warn("nbd root: no reconnect watcher: %s", strerror(errno));
+    }
+    return 0;
+}
+
+/*
+ * Working set estimation
+ *
+ * "working_set" watches guest memory for window_ms and sorts it into hot
+ * (used in the second half of the window), warm (used only in the first
+ * half) and cold (untouched), so the host can size the VM from data rather
+ * than guesses. It uses the best source the kernel offers:
+ *   damon        DAMON physical address monitoring, through sysfs. A region
+ *                that is idle for less than half the window is hot, for
+ *                nearly all of it cold. Free pages are never accessed, so
+ *                MemFree is taken off cold.
+ *   page_idle    Marks every page idle, reads back which were touched at
+ *                half time, marks again and reads at the end. Only pages on
+ *                the LRU lists (process and page cache memory) are counted.
+ *   memory_stat  The kernel's active/inactive LRU split, with the pages
+ *                refaulted during the window (evicted, then needed again)
+ *                counted as warm instead of cold.
+ * Every method also reports refaults per second: a VM that keeps refaulting
+ * is already too small, whatever its idle memory says.
+ */
+#define WORKING_SET_DEFAULT_MS 10000
+#define WORKING_SET_MIN_MS 200
+#define WORKING_SET_MAX_MS 300000
+#define DAMON_ADMIN "/sys/kernel/mm/damon/admin/kdamonds"
+#define DAMON_MIN_REGIONS "100" /* default 10 is too coarse to size a VM by */
+#define PAGE_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+#define PAGE_IDLE_CHUNK_WORDS 4096
+#define KPF_LRU 5
+#define MAX_RAM_RANGES 32
+
+struct ram_range {
+    unsigned long long start;
+    unsigned long long end; /* exclusive */
+};
+
+struct working_set {
+    const char *method;
+    unsigned long long hot;
+    unsigned long long warm;
+    unsigned long long cold;
+};
+
+static pthread_mutex_t working_set_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Physical address ranges of RAM, from the top level of /proc/iomem */
+static int ram_ranges(struct ram_range *ranges, int max) {
+    FILE *f = fopen("/proc/iomem", "re");
+    char line[256];
+    int n = 0;
+
+    while (f && n < max && fgets(line, sizeof(line), f)) {
+        unsigned long long start, end;
+        if (line[0] == ' ') continue; /* nested entries are parts of these */
+        if (sscanf(line, "%llx-%llx", &start, &end) == 2 && strstr(line, ": System RAM") && end > start) {
+            ranges[n].start = start;
+            ranges[n].end = end + 1;
+            n++;
+        }
+    }
+    if (f) fclose(f);
+    return n;
+}
+
+static unsigned long long refaulted_pages(void) {
+    unsigned long long anon = 0, file = 0;
+    read_counter("/proc/vmstat", "workingset_refault_anon", &anon);
+    /* Kernels before 5.9 only count page cache, under the old name */
+    if (!read_counter("/proc/vmstat", "workingset_refault_file", &file)) {
+        read_counter("/proc/vmstat", "workingset_refault", &file);
+    }
+    return anon + file;
+}
+
+/* Sleep in short steps so a cancelled request stops early. Returns why it was cancelled, or NULL. */
+static const char *working_set_sleep(const struct agent_request *req, long long ms) {
+    long long until = monotonic_ms() + ms;
+    for (;;) {
+        const char *why = request_cancelled(req);
+        if (why) return why;
+        long long left = until - monotonic_ms();
+        if (left <= 0) return NULL;
+        usleep((left < 100 ? left : 100) * 1000);
+    }
+}
+
+static int damon_set(const char *value, const char *fmt, ...) {
+    char path[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = snprintf(path, sizeof(path), "%s/", DAMON_ADMIN);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    if (write_file(path, value) < 0) {
+        log_debug("damon: %s = %s: %s", path, value, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the value of a numeric DAMON file, or -1 */
+static long long damon_get(const char *fmt, ...) {
+    char path[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = snprintf(path, sizeof(path), "%s/", DAMON_ADMIN);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    char buf[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    if (fd >= 0) close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    return strtoll(buf, NULL, 10);
+}
+
+/* Each method returns 0, -1 if it isn't available here, or -2 if the request was cancelled (*why set) */
+static int working_set_damon(const struct agent_request *req, long long window_ms,
+                             struct working_set *ws, const char **why) {
+    struct ram_range ranges[MAX_RAM_RANGES];
+    int nranges = ram_ranges(ranges, MAX_RAM_RANGES);
+    /* Taking kdamond 0 fails with EBUSY if one is already running */
+    if (nranges == 0 || damon_set("1", "nr_kdamonds") < 0) return -1;
+
+    #define DAMON_CTX "0/contexts/0/"
+    #define DAMON_SCHEME DAMON_CTX "schemes/0/"
+    char value[32];
+    snprintf(value, sizeof(value), "%d", nranges);
+    bool ok = damon_set("1", "0/contexts/nr_contexts") == 0 &&
+              damon_set("paddr", DAMON_CTX "operations") == 0 &&
+              damon_set("1", DAMON_CTX "targets/nr_targets") == 0 &&
+              damon_set(value, DAMON_CTX "targets/0/regions/nr_regions") == 0 &&
+              damon_set(DAMON_MIN_REGIONS, DAMON_CTX "monitoring_attrs/nr_regions/min") == 0;
+    for (int i = 0; ok && i < nranges; i++) {
+        /* Set end first: a new region starts out as 0-0 and start may not pass end */
+        snprintf(value, sizeof(value), "%llu", ranges[i].end);
+        ok = damon_set(value, DAMON_CTX "targets/0/regions/%d/end", i) == 0;
+        snprintf(value, sizeof(value), "%llu", ranges[i].start);
+        ok = ok && damon_set(value, DAMON_CTX "targets/0/regions/%d/start", i) == 0;
+    }
+    /* A "stat" scheme matching every region, only so the regions can be read back.
+     * Kernels before 6.2 can't do that, so don't spend the window finding out. */
+    ok = ok && damon_set("1", DAMON_CTX "schemes/nr_schemes") == 0 &&
+         access(DAMON_ADMIN "/" DAMON_SCHEME "tried_regions", F_OK) == 0 &&
+         damon_set("stat", DAMON_SCHEME "action") == 0 &&
+         damon_set("18446744073709551615", DAMON_SCHEME "access_pattern/sz/max") == 0 &&
+         damon_set("4294967295", DAMON_SCHEME "access_pattern/nr_accesses/max") == 0 &&
+         damon_set("4294967295", DAMON_SCHEME "access_pattern/age/max") == 0 &&
+         damon_set("on", "0/state") == 0;
+
+    long long aggr_us = damon_get(DAMON_CTX "monitoring_attrs/intervals/aggr_us");
+    int rc = -1;
+    if (ok && aggr_us > 0) {
+        *why = working_set_sleep(req, window_ms);
+        rc = *why ? -2 : -1;
+    }
+
+    if (rc == -1 && *why == NULL && ok && damon_set("update_schemes_tried_regions", "0/state") == 0) {
+        long long window_us = window_ms * 1000;
+        ws->method = "damon";
+        /* Region directories are not numbered contiguously */
+        DIR *dir = opendir(DAMON_ADMIN "/" DAMON_SCHEME "tried_regions");
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+            const char *r = entry->d_name;
+            long long start = damon_get(DAMON_SCHEME "tried_regions/%s/start", r);
+            long long end = damon_get(DAMON_SCHEME "tried_regions/%s/end", r);
+            if (start < 0 || end <= start) continue;
+            long long idle_us = damon_get(DAMON_SCHEME "tried_regions/%s/nr_accesses", r) > 0
+                ? 0 : damon_get(DAMON_SCHEME "tried_regions/%s/age", r) * aggr_us;
+            unsigned long long size = end - start;
+            if (idle_us < window_us / 2) ws->hot += size;
+            else if (idle_us < window_us * 9 / 10) ws->warm += size;
+            else ws->cold += size;
+            rc = 0;
+        }
+        if (dir) closedir(dir);
+
+        /* Regions include free pages, which are never accessed: take them off the coldest first */
+        unsigned long long free_bytes = 0;
+        read_counter("/proc/meminfo", "MemFree", &free_bytes);
+        unsigned long long *classes[] = { &ws->cold, &ws->warm, &ws->hot };
+        for (int i = 0; i < 3; i++) {
+            unsigned long long taken = free_bytes < *classes[i] ? free_bytes : *classes[i];
+            *classes[i] -= taken;
+            free_bytes -= taken;
+        }
+    }
+    #undef DAMON_SCHEME
+    #undef DAMON_CTX
+
+    damon_set("off", "0/state");
+    damon_set("0", "nr_kdamonds");
+    return rc;
+}
+
+/* Mark every page in the RAM ranges idle */
+static int page_idle_mark(int bitmap, const struct ram_range *ranges, int nranges, long page_size) {
+    static const uint64_t ones[PAGE_IDLE_CHUNK_WORDS] = { [0 ... PAGE_IDLE_CHUNK_WORDS - 1] = ~0ULL };
+    for (int i = 0; i < nranges; i++) {
+        unsigned long long word = ranges[i].start / page_size / 64;
+        unsigned long long end = (ranges[i].end / page_size + 63) / 64;
+        while (word < end) {
+            size_t count = end - word < PAGE_IDLE_CHUNK_WORDS ? end - word : PAGE_IDLE_CHUNK_WORDS;
+            if (pwrite(bitmap, ones, count * 8, word * 8) < 0) return -1;
+            word += count;
+        }
+    }
+    return 0;
+}
+
+/* Record which pages were touched since they were marked: one bit per pfn in accessed */
+static int page_idle_collect(int bitmap, const struct ram_range *ranges, int nranges, long page_size,
+                             uint64_t *accessed) {
+    for (int i = 0; i < nranges; i++) {
+        unsigned long long word = ranges[i].start / page_size / 64;
+        unsigned long long end = (ranges[i].end / page_size + 63) / 64;
+        while (word < end) {
+            size_t count = end - word < PAGE_IDLE_CHUNK_WORDS ? end - word : PAGE_IDLE_CHUNK_WORDS;
+            ssize_t n = pread(bitmap, accessed + word, count * 8, word * 8);
+            if (n <= 0) return -1;
+            for (size_t j = 0; j < (size_t)n / 8; j++) accessed[word + j] = ~accessed[word + j];
+            word += n / 8;
+        }
+    }
+    return 0;
+}
+
+static int working_set_page_idle(const struct agent_request *req, long long window_ms,
+                                 struct working_set *ws, const char **why) {
+    struct ram_range ranges[MAX_RAM_RANGES];
+    int nranges = ram_ranges(ranges, MAX_RAM_RANGES);
+    int bitmap = open(PAGE_IDLE_BITMAP, O_RDWR | O_CLOEXEC);
+    int kpageflags = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    unsigned long long max_pfn = 0;
+    for (int i = 0; i < nranges; i++) {
+        if (ranges[i].end / page_size > max_pfn) max_pfn = ranges[i].end / page_size;
+    }
+    size_t words = (max_pfn + 63) / 64;
+    uint64_t *first = words ? arena_alloc(req->arena, words * 8) : NULL;
+    uint64_t *second = words ? arena_alloc(req->arena, words * 8) : NULL;
+    uint64_t *flags = arena_alloc(req->arena, PAGE_IDLE_CHUNK_WORDS * 8);
+
+    int rc = -1;
+    if (bitmap >= 0 && kpageflags >= 0 && first && second && flags &&
+        page_idle_mark(bitmap, ranges, nranges, page_size) == 0) {
+        memset(first, 0, words * 8);
+        memset(second, 0, words * 8);
+        if ((*why = working_set_sleep(req, window_ms / 2)) != NULL) {
+            rc = -2;
+        } else if (page_idle_collect(bitmap, ranges, nranges, page_size, first) == 0 &&
+                   page_idle_mark(bitmap, ranges, nranges, page_size) == 0) {
+            if ((*why = working_set_sleep(req, window_ms - window_ms / 2)) != NULL) {
+                rc = -2;
+            } else if (page_idle_collect(bitmap, ranges, nranges, page_size, second) == 0) {
+                rc = 0;
+            }
+        }
+    }
+
+    /* Count only what is on the LRU lists: kernel memory is never marked idle */
+    for (int i = 0; rc == 0 && i < nranges; i++) {
+        unsigned long long pfn = ranges[i].start / page_size;
+        unsigned long long end = ranges[i].end / page_size;
+        while (rc == 0 && pfn < end) {
+            size_t count = end - pfn < PAGE_IDLE_CHUNK_WORDS ? end - pfn : PAGE_IDLE_CHUNK_WORDS;
+            ssize_t n = pread(kpageflags, flags, count * 8, pfn * 8);
+            if (n <= 0) {
+                rc = -1;
+                break;
+            }
+            for (size_t j = 0; j < (size_t)n / 8; j++, pfn++) {
+                if (!(flags[j] & (1ULL << KPF_LRU))) continue;
+                uint64_t bit = 1ULL << (pfn % 64);
+                if (second[pfn / 64] & bit) ws->hot += page_size;
+                else if (first[pfn / 64] & bit) ws->warm += page_size;
+                else ws->cold += page_size;
+            }
+        }
+    }
+
+    if (bitmap >= 0) close(bitmap);
+    if (kpageflags >= 0) close(kpageflags);
+    if (rc == 0) ws->method = "page_idle";
+    return rc;
+}
+
+static int working_set_memory_stat(const struct agent_request *req, long long window_ms,
+                                   struct working_set *ws, const char **why) {
+    unsigned long long refaults_before = refaulted_pages();
+    if ((*why = working_set_sleep(req, window_ms)) != NULL) return -2;
+    unsigned long long refaulted = (refaulted_pages() - refaults_before) * sysconf(_SC_PAGESIZE);
+
+    /* The root cgroup's memory.stat where there is one, the same split from meminfo otherwise */
+    static const char *sources[][5] = {
+        { CGROUP_ROOT "/memory.stat", "active_anon", "active_file", "inactive_anon", "inactive_file" },
+        { "/proc/meminfo", "Active(anon)", "Active(file)", "Inactive(anon)", "Inactive(file)" },
+    };
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        unsigned long long lru[4];
+        bool found = true;
+        for (int j = 0; j < 4 && found; j++) found = read_counter(sources[i][0], sources[i][j + 1], &lru[j]);
+        if (!found) continue;
+
+        unsigned long long inactive = lru[2] + lru[3];
+        ws->method = "memory_stat";
+        ws->hot = lru[0] + lru[1];
+        ws->warm = refaulted < inactive ? refaulted : inactive;
+        ws->cold = inactive - ws->warm;
+        return 0;
+    }
+    return -1;
+}
+
+static char *handle_working_set(const struct agent_request *req, const char *json) {
+    int window_ms = WORKING_SET_DEFAULT_MS;
+    json_get_int(json, "window_ms", &window_ms);
+    if (window_ms < WORKING_SET_MIN_MS || window_ms > WORKING_SET_MAX_MS) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"window_ms must be between %d and %d\"}\n",
+                 WORKING_SET_MIN_MS, WORKING_SET_MAX_MS);
+        return response;
+    }
+    long long left = request_remaining_ms(req);
+    if (left >= 0 && left < window_ms) {
+        return strdup("{\"success\":false,\"error\":\"window_ms is longer than the request's budget\"}\n");
+    }
+
+    static const struct {
+        const char *name;
+        int (*run)(const struct agent_request *, long long, struct working_set *, const char **);
+    } methods[] = {
+        { "damon", working_set_damon },
+        { "page_idle", working_set_page_idle },
+        { "memory_stat", working_set_memory_stat },
+    };
+    char *method = json_get_string(req->arena, json, "method");
+    bool known = !method;
+    for (size_t i = 0; method && i < sizeof(methods) / sizeof(methods[0]); i++) {
+        known = known || strcmp(method, methods[i].name) == 0;
+    }
+    if (!known) return strdup("{\"success\":false,\"error\":\"method must be damon, page_idle or memory_stat\"}\n");
+
+    /* The methods change global kernel state; one estimate at a time */
+    if (pthread_mutex_trylock(&working_set_lock) != 0) {
+        return busy_response("working set estimate in progress", window_ms);
+    }
+
+    long long started = monotonic_ms();
+    unsigned long long refaults_before = refaulted_pages();
+    struct working_set ws = { 0 };
+    const char *why = NULL;
+    int rc = -1;
+    for (size_t i = 0; rc == -1 && i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (method && strcmp(method, methods[i].name) != 0) continue;
+        /* A method that gave up after watching leaves no time for another */
+        left = request_remaining_ms(req);
+        if (left >= 0 && left < window_ms) break;
+        ws = (struct working_set){ 0 };
+        rc = methods[i].run(req, window_ms, &ws, &why);
+        if (rc == -1) log_debug("working_set: %s unavailable", methods[i].name);
+    }
+    unsigned long long refaulted = (refaulted_pages() - refaults_before) * sysconf(_SC_PAGESIZE);
+    long long elapsed_ms = monotonic_ms() - started;
+    pthread_mutex_unlock(&working_set_lock);
+
+    if (rc == -2) return cancelled_response(why);
+    if (rc != 0) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"%s unavailable on this kernel\"}\n",
+                 method ? method : "working set estimation");
+        return response;
+    }
+
+    unsigned long long total = 0, free_bytes = 0, available = 0;
+    read_counter("/proc/meminfo", "MemTotal", &total);
+    read_counter("/proc/meminfo", "MemFree", &free_bytes);
+    read_counter("/proc/meminfo", "MemAvailable", &available);
+
+    char *response = NULL;
+    asprintf(&response,
+        "{\"success\":true,\"data\":{\"method\":\"%s\",\"window_ms\":%lld,"
+        "\"hot_bytes\":%llu,\"warm_bytes\":%llu,\"cold_bytes\":%llu,\"working_set_bytes\":%llu,"
+        "\"total_bytes\":%llu,\"free_bytes\":%llu,\"available_bytes\":%llu,\"refault_bytes_per_sec\":%llu}}\n",
+        ws.method, elapsed_ms, ws.hot, ws.warm, ws.cold, ws.hot + ws.warm,
+        total, free_bytes, available, elapsed_ms > 0 ? refaulted * 1000 / elapsed_ms : 0);
+    return response;
+}
+
+/*
+ * Memory status
+ *
+ * "memory_status" is the instant counterpart to working_set: the meminfo
+ * counters and memory pressure that the host's balloon controller polls to
+ * decide whether a VM can give memory back or needs some returned. It runs
+ * on the control lane so it still answers when the guest is short of memory.
+ */
+static char *handle_memory_status(void) {
+    unsigned long long total = 0, free_bytes = 0, available = 0, swap_total = 0, swap_free = 0;
+    read_counter("/proc/meminfo", "MemTotal", &total);
+    read_counter("/proc/meminfo", "MemFree", &free_bytes);
+    read_counter("/proc/meminfo", "MemAvailable", &available);
+    read_counter("/proc/meminfo", "SwapTotal", &swap_total);
+    read_counter("/proc/meminfo", "SwapFree", &swap_free);
+
+    /* "some": share of time at least one task stalled on memory; "full": all of them did */
+    double some10 = 0, some60 = 0, full10 = 0, full60 = 0;
+    int found = 0;
+    FILE *f = fopen("/proc/pressure/memory", "re");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "some avg10=%lf avg60=%lf", &some10, &some60) == 2) found++;
+        else if (sscanf(line, "full avg10=%lf avg60=%lf", &full10, &full60) == 2) found++;
+    }
+    if (f) fclose(f);
+
+    char psi[160] = "null";
+    if (found > 0) {
+        snprintf(psi, sizeof(psi),
+                 "{\"some_avg10\":%.2f,\"some_avg60\":%.2f,\"full_avg10\":%.2f,\"full_avg60\":%.2f}",
+                 some10, some60, full10, full60);
+    }
+
+    char *response = NULL;
+    asprintf(&response,
+        "{\"success\":true,\"data\":{\"total_bytes\":%llu,\"free_bytes\":%llu,\"available_bytes\":%llu,"
+        "\"swap_total_bytes\":%llu,\"swap_free_bytes\":%llu,\"refaulted_bytes\":%llu,\"psi\":%s}}\n",
+        total, free_bytes, available, swap_total, swap_free,
+        refaulted_pages() * sysconf(_SC_PAGESIZE), psi);
+    return response;
+}
+
+/*
+ * Latency tracing
+ *
+ * "latency_trace" answers "why is this VM slow" with nothing installed in
+ * the image: it enables a few tracepoints through tracefs for duration_ms,
+ * reads the events from trace_pipe as they come and boils them down to
+ * latency histograms before replying.
+ *   io       block_rq_issue/complete: request latency per device, split
+ *            into reads, writes and the rest (flushes, discards)
+ *   sched    sched_switch/wakeup: per process, time on CPU, time waiting
+ *            for a CPU once runnable (wakeup or preemption to running),
+ *            and time blocked, split into sleep (S) and uninterruptible
+ *            wait (D, nearly always IO)
+ *   syscall  raw_syscalls enter/exit: time in syscalls per process, and
+ *            the syscalls that took longest overall
+ * syscall fires on every system call and costs the most, so it is only
+ * traced when asked for; io and sched are the default.
+ *
+ * Tracing happens in a tracefs instance of its own, so it neither disturbs
+ * nor is disturbed by anyone using the top-level buffer, and the instance
+ * is removed afterwards. Histogram buckets are powers of two: each counts
+ * the events shorter than its bound ("lt_us") and not shorter than the
+ * previous bucket's.
+ */
+#define TRACEFS_DIR "/sys/kernel/tracing"
+#define TRACE_INSTANCE TRACEFS_DIR "/instances/hyperfleet"
+#define TRACE_DEFAULT_MS 5000
+#define TRACE_MIN_MS 100
+#define TRACE_MAX_MS 60000
+#define TRACE_BUFFER_KB "2048" /* per CPU; overruns are reported as lost_events */
+#define TRACE_READ_CHUNK (256 * 1024)
+#define TRACE_HIST_BUCKETS 32
+#define TRACE_MAX_TASKS 4096
+#define TRACE_MAX_INFLIGHT 8192
+#define TRACE_MAX_DEVICES 16
+#define TRACE_MAX_SYSCALLS 1024
+#define TRACE_DEFAULT_TOP 10
+#define TRACE_MAX_TOP 100
+
+enum trace_group {
+    TRACE_IO,
+    TRACE_SCHED,
+    TRACE_SYSCALL,
+    TRACE_GROUP_COUNT,
+};
+
+static const struct {
+    const char *name;
+    const char *events[4];
+} trace_groups[TRACE_GROUP_COUNT] = {
+    [TRACE_IO] = { "io", { "block/block_rq_issue", "block/block_rq_complete" } },
+    [TRACE_SCHED] = { "sched", { "sched/sched_switch", "sched/sched_wakeup", "sched/sched_wakeup_new" } },
+    [TRACE_SYSCALL] = { "syscall", { "raw_syscalls/sys_enter", "raw_syscalls/sys_exit" } },
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t buckets[TRACE_HIST_BUCKETS]; /* bucket b: shorter than 2^b us */
+};
+
+struct trace_task {
+    int tid; /* 0 = free slot */
+    int tgid;
+    char comm[16];
+    long long in_us;  /* switched in at, or -1 */
+    long long out_us; /* switched out at, or -1 */
+    char out_state;   /* prev_state when switched out */
+    long long wake_us;
+    long long syscall_us;
+    long syscall_nr;
+    uint64_t on_cpu_us, sleep_us, io_wait_us;
+    int threads;
+    struct latency_hist run_queue, io_wait, syscalls;
+};
+
+struct trace_request {
+    bool used;
+    unsigned int dev;
+    unsigned long long sector;
+    long long issue_us;
+    int kind;
+};
+
+struct trace_device {
+    unsigned int major, minor;
+    uint64_t bytes[3];
+    struct latency_hist latency[3]; /* read, write, other */
+};
+
+struct trace_syscall {
+    uint64_t count, total_us, max_us;
+};
+
+struct trace_state {
+    struct trace_task *tasks;
+    int task_count;
+    struct trace_request *inflight;
+    struct trace_device devices[TRACE_MAX_DEVICES];
+    int device_count;
+    struct trace_syscall *syscalls;
+    struct latency_hist run_queue, syscall_latency;
+    uint64_t events, unmatched;
+    long long first_us, last_us;
+    int self_tid;
+};
+
+static void hist_add(struct latency_hist *h, long long us) {
+    if (us < 0) return;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll((unsigned long long)us);
+    h->buckets[b < TRACE_HIST_BUCKETS ? b : TRACE_HIST_BUCKETS - 1]++;
+    h->count++;
+    h->total_us += us;
+    if ((uint64_t)us > h->max_us) h->max_us = us;
+}
+
+static void hist_merge(struct latency_hist *into, const struct latency_hist *h) {
+    into->count += h->count;
+    into->total_us += h->total_us;
+    if (h->max_us > into->max_us) into->max_us = h->max_us;
+    for (int b = 0; b < TRACE_HIST_BUCKETS; b++) into->buckets[b] += h->buckets[b];
+}
+
+/* Upper bound of the bucket holding the given share of events */
+static unsigned long long hist_percentile(const struct latency_hist *h, double share) {
+    uint64_t want = (uint64_t)(h->count * share + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int b = 0; b < TRACE_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) return 1ULL << b < h->max_us ? 1ULL << b : h->max_us;
+    }
+    return h->max_us;
+}
+
+static void writer_hist(struct writer *w, const struct latency_hist *h) {
+    writer_printf(w, "{\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"buckets\":[",
+                  (unsigned long long)h->count, (unsigned long long)h->total_us, (unsigned long long)h->max_us,
+                  hist_percentile(h, 0.5), hist_percentile(h, 0.99));
+    bool first = true;
+    for (int b = 0; b < TRACE_HIST_BUCKETS; b++) {
+        if (!h->buckets[b]) continue;
+        writer_printf(w, "%s[%llu,%u]", first ? "" : ",", 1ULL << b, h->buckets[b]);
+        first = false;
+    }
+    writer_printf(w, "]}");
+}
+
+static struct trace_task *trace_task(struct trace_state *st, int tid) {
+    if (tid <= 0) return NULL;
+    for (unsigned int i = 0, h = (unsigned int)tid * 2654435761u; i < TRACE_MAX_TASKS; i++) {
+        struct trace_task *t = &st->tasks[(h + i) % TRACE_MAX_TASKS];
+        if (t->tid == tid) return t;
+        if (t->tid == 0) {
+            /* Keep a slot free so lookups always end */
+            if (st->task_count >= TRACE_MAX_TASKS - 1) return NULL;
+            st->task_count++;
+            t->tid = tid;
+            t->in_us = t->out_us = t->wake_us = t->syscall_us = -1;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void trace_set_comm(struct trace_task *t, const char *comm, size_t len) {
+    if (!t) return;
+    if (len >= sizeof(t->comm)) len = sizeof(t->comm) - 1;
+    memcpy(t->comm, comm, len);
+    t->comm[len] = '\0';
+}
+
+/*
+ * The value after "key" in an event's "key=value key=value" text. Values
+ * run to the next space, except comms, which may hold spaces and run to
+ * the key after them.
+ */
+static const char *trace_field(const char *text, const char *key, const char *next_key, size_t *len) {
+    size_t key_len = strlen(key);
+    const char *p = text;
+    while ((p = strstr(p, key)) != NULL && p != text && p[-1] != ' ') p += key_len;
+    if (!p) return NULL;
+    p += key_len;
+    const char *end = next_key ? strstr(p, next_key) : NULL;
+    if (!end) end = p + strcspn(p, " ");
+    *len = end - p;
+    return p;
+}
+
+static long trace_field_long(const char *text, const char *key) {
+    size_t len;
+    const char *v = trace_field(text, key, NULL, &len);
+    return v ? strtol(v, NULL, 10) : -1;
+}
+
+static void trace_block(struct trace_state *st, bool issue, const char *text, long long ts) {
+    unsigned int major, minor;
+    char rwbs[16];
+    unsigned long long sector;
+    const char *cmd_end = strchr(text, ')');
+    if (sscanf(text, "%u,%u %15s", &major, &minor, rwbs) != 3 || !cmd_end ||
+        sscanf(cmd_end + 1, " %llu", &sector) != 1) {
+        return;
+    }
+    unsigned int dev = major << 20 | minor;
+    unsigned int h = (unsigned int)(sector * 2654435761u) ^ dev;
+    if (issue) {
+        for (int i = 0; i < TRACE_MAX_INFLIGHT; i++) {
+            struct trace_request *r = &st->inflight[(h + i) % TRACE_MAX_INFLIGHT];
+            if (r->used) continue;
+            int kind = strchr(rwbs, 'R') ? 0 : strchr(rwbs, 'W') ? 1 : 2;
+            *r = (struct trace_request){ .used = true, .dev = dev, .sector = sector, .issue_us = ts, .kind = kind };
+            unsigned int bytes = 0;
+            sscanf(text, "%*u,%*u %*s %u", &bytes);
+            struct trace_device *d = NULL;
+            for (int j = 0; j < st->device_count && !d; j++) {
+                if (st->devices[j].major == major && st->devices[j].minor == minor) d = &st->devices[j];
+            }
+            if (!d && st->device_count < TRACE_MAX_DEVICES) {
+                d = &st->devices[st->device_count++];
+                d->major = major;
+                d->minor = minor;
+            }
+            if (d) d->bytes[kind] += bytes;
+            return;
+        }
+        st->unmatched++;
+        return;
+    }
+
+    /* Freed slots stay marked, so a probe only stops at one never used */
+    for (int i = 0; i < TRACE_MAX_INFLIGHT; i++) {
+        struct trace_request *r = &st->inflight[(h + i) % TRACE_MAX_INFLIGHT];
+        if (!r->used && r->issue_us == 0) break;
+        if (!r->used || r->dev != dev || r->sector != sector) continue;
+        r->used = false;
+        for (int j = 0; j < st->device_count; j++) {
+            if (st->devices[j].major == major && st->devices[j].minor == minor) {
+                hist_add(&st->devices[j].latency[r->kind], ts - r->issue_us);
+            }
+        }
+        return;
+    }
+    st->unmatched++;
+}
+
+static void trace_sched_switch(struct trace_state *st, const char *text, long long ts) {
+    size_t prev_len, next_len, state_len;
+    const char *prev_comm = trace_field(text, "prev_comm=", " prev_pid=", &prev_len);
+    const char *next_comm = trace_field(text, "next_comm=", " next_pid=", &next_len);
+    const char *state = trace_field(text, "prev_state=", NULL, &state_len);
+    if (!prev_comm || !next_comm || !state) return;
+
+    struct trace_task *prev = trace_task(st, (int)trace_field_long(text, "prev_pid="));
+    if (prev) {
+        trace_set_comm(prev, prev_comm, prev_len);
+        if (prev->in_us >= 0) prev->on_cpu_us += ts - prev->in_us;
+        prev->in_us = -1;
+        prev->out_us = ts;
+        prev->out_state = state[0];
+        /* Preempted: it waits for a CPU from now on */
+        prev->wake_us = state[0] == 'R' ? ts : -1;
+    }
+
+    struct trace_task *next = trace_task(st, (int)trace_field_long(text, "next_pid="));
+    if (next) {
+        trace_set_comm(next, next_comm, next_len);
+        if (next->wake_us >= 0 && next->tid != st->self_tid) {
+            hist_add(&next->run_queue, ts - next->wake_us);
+            hist_add(&st->run_queue, ts - next->wake_us);
+        }
+        next->wake_us = -1;
+        next->out_us = -1;
+        next->in_us = ts;
+    }
+}
+
+static void trace_sched_wakeup(struct trace_state *st, const char *text, long long ts) {
+    size_t comm_len;
+    const char *comm = trace_field(text, "comm=", " pid=", &comm_len);
+    struct trace_task *t = comm ? trace_task(st, (int)trace_field_long(text, "pid=")) : NULL;
+    if (!t || t->in_us >= 0) return;
+    trace_set_comm(t, comm, comm_len);
+    if (t->out_us >= 0 && t->out_state != 'R') {
+        long long blocked = ts - t->out_us;
+        if (t->out_state == 'D') {
+            t->io_wait_us += blocked;
+            hist_add(&t->io_wait, blocked);
+        } else {
+            t->sleep_us += blocked;
+        }
+    }
+    t->out_us = -1;
+    if (t->wake_us < 0) t->wake_us = ts;
+}
+
+static void trace_syscall(struct trace_state *st, struct trace_task *t, bool enter, const char *text, long long ts) {
+    long nr;
+    if (!t || sscanf(text, "NR %ld", &nr) != 1) return;
+    if (enter) {
+        t->syscall_us = ts;
+        t->syscall_nr = nr;
+        return;
+    }
+    if (t->syscall_us < 0 || t->syscall_nr != nr) return;
+    long long us = ts - t->syscall_us;
+    t->syscall_us = -1;
+    hist_add(&t->syscalls, us);
+    hist_add(&st->syscall_latency, us);
+    if (nr >= 0 && nr < TRACE_MAX_SYSCALLS) {
+        struct trace_syscall *s = &st->syscalls[nr];
+        s->count++;
+        s->total_us += us;
+        if ((uint64_t)us > s->max_us) s->max_us = us;
+    }
+}
+
+/* "<comm>-<tid> [<cpu>] <flags> <secs>.<usecs>: <event>: <text>" */
+static void trace_line(struct trace_state *st, char *line) {
+    char *bracket = line;
+    while ((bracket = strstr(bracket, " [")) != NULL) {
+        char *end;
+        strtol(bracket + 2, &end, 10);
+        if (end != bracket + 2 && *end == ']') break;
+        bracket += 2;
+    }
+    if (!bracket) return;
+    char *dash = bracket;
+    while (dash > line && dash[-1] == ' ') dash--;
+    char *tid_end = dash;
+    while (dash > line && dash[-1] >= '0' && dash[-1] <= '9') dash--;
+    if (dash == tid_end || dash == line || dash[-1] != '-') return;
+    int tid = atoi(dash);
+    char *comm = line + strspn(line, " ");
+    size_t comm_len = dash - 1 > comm ? (size_t)(dash - 1 - comm) : 0;
+
+    /* The timestamp is the first token ending in ':' */
+    char *p = strchr(bracket, ']') + 1, *end = NULL;
+    long long secs = -1, usecs = 0;
+    while (*p) {
+        while (*p == ' ') p++;
+        secs = strtoll(p, &end, 10);
+        if (end != p && *end == '.') {
+            char *frac = end + 1;
+            usecs = strtoll(frac, &end, 10);
+            for (ptrdiff_t digits = end - frac; digits < 6; digits++) usecs *= 10;
+            if (*end == ':') break;
+        }
+        p += strcspn(p, " ");
+        secs = -1;
+    }
+    if (secs < 0 || end[1] != ' ') return;
+    char *event = end + 2;
+    char *colon = strchr(event, ':');
+    if (!colon) return;
+    *colon = '\0';
+    const char *text = colon[1] == ' ' ? colon + 2 : colon + 1;
+    long long ts = secs * 1000000 + usecs;
+    if (st->first_us == 0) st->first_us = ts;
+    st->last_us = ts;
+    st->events++;
+
+    if (strcmp(event, "sched_switch") == 0) {
+        trace_sched_switch(st, text, ts);
+    } else if (strcmp(event, "sched_wakeup") == 0 || strcmp(event, "sched_wakeup_new") == 0) {
+        trace_sched_wakeup(st, text, ts);
+    } else if (strcmp(event, "block_rq_issue") == 0 || strcmp(event, "block_rq_complete") == 0) {
+        trace_block(st, strcmp(event, "block_rq_issue") == 0, text, ts);
+    } else if (strcmp(event, "sys_enter") == 0 || strcmp(event, "sys_exit") == 0) {
+        if (tid == st->self_tid) return;
+        struct trace_task *t = trace_task(st, tid);
+        /* Tasks never seen switching only have the name in the line's header */
+        if (t && !t->comm[0]) trace_set_comm(t, comm, comm_len);
+        trace_syscall(st, t, strcmp(event, "sys_enter") == 0, text, ts);
+    }
+}
+
+/* Feed the complete lines in buf[0..len) to the aggregator; returns how many bytes were used */
+static size_t trace_consume(struct trace_state *st, char *buf, size_t len) {
+    size_t used = 0;
+    for (char *nl; (nl = memchr(buf + used, '\n', len - used)) != NULL; used = nl - buf + 1) {
+        *nl = '\0';
+        trace_line(st, buf + used);
+    }
+    return used;
+}
+
+static int trace_write(const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), TRACE_INSTANCE "/%s", file);
+    return write_file(path, value);
+}
+
+static void trace_instance_remove(void) {
+    trace_write("tracing_on", "0");
+    if (rmdir(TRACE_INSTANCE) != 0 && errno != ENOENT) log_warn("rmdir %s: %s", TRACE_INSTANCE, strerror(errno));
+}
+
+/* Events the ring buffer dropped because trace_pipe wasn't read fast enough */
+static unsigned long long trace_overruns(void) {
+    unsigned long long total = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < cpus; cpu++) {
+        char path[PATH_MAX];
+        unsigned long long overrun = 0;
+        snprintf(path, sizeof(path), TRACE_INSTANCE "/per_cpu/cpu%ld/stats", cpu);
+        if (read_counter(path, "overrun", &overrun)) total += overrun;
+    }
+    return total;
+}
+
+/* Fold threads into their processes: each process ends up in its first thread's slot */
+static int trace_compare_tgid(const void *a, const void *b) {
+    const struct trace_task *x = a, *y = b;
+    if (x->tgid != y->tgid) return x->tgid < y->tgid ? -1 : 1;
+    return x->tid < y->tid ? -1 : x->tid > y->tid;
+}
+
+static int trace_compare_waiting(const void *a, const void *b) {
+    const struct trace_task *x = a, *y = b;
+    uint64_t wx = x->run_queue.total_us + x->io_wait_us, wy = y->run_queue.total_us + y->io_wait_us;
+    if (wx != wy) return wx > wy ? -1 : 1;
+    return x->on_cpu_us > y->on_cpu_us ? -1 : x->on_cpu_us < y->on_cpu_us;
+}
+
+static int trace_group_processes(struct trace_state *st) {
+    int n = 0;
+    for (int i = 0; i < TRACE_MAX_TASKS; i++) {
+        struct trace_task *t = &st->tasks[i];
+        if (t->tid == 0) continue;
+        /* Still on a CPU when tracing stopped */
+        if (t->in_us >= 0) t->on_cpu_us += st->last_us - t->in_us;
+        char path[64];
+        unsigned long long tgid = 0;
+        snprintf(path, sizeof(path), "/proc/%d/status", t->tid);
+        t->tgid = read_counter(path, "Tgid", &tgid) && tgid > 0 ? (int)tgid : t->tid;
+        t->threads = 1;
+        st->tasks[n++] = *t;
+    }
+    qsort(st->tasks, n, sizeof(struct trace_task), trace_compare_tgid);
+
+    int processes = 0;
+    for (int i = 0; i < n; i++) {
+        struct trace_task *t = &st->tasks[i];
+        struct trace_task *p = processes ? &st->tasks[processes - 1] : NULL;
+        if (!p || p->tgid != t->tgid) {
+            st->tasks[processes++] = *t;
+            continue;
+        }
+        p->threads++;
+        p->on_cpu_us += t->on_cpu_us;
+        p->sleep_us += t->sleep_us;
+        p->io_wait_us += t->io_wait_us;
+        hist_merge(&p->run_queue, &t->run_queue);
+        hist_merge(&p->io_wait, &t->io_wait);
+        hist_merge(&p->syscalls, &t->syscalls);
+    }
+    for (int i = 0; i < processes; i++) {
+        struct trace_task *p = &st->tasks[i];
+        if (p->tgid == p->tid) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/comm", p->tgid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t len = fd >= 0 ? read(fd, p->comm, sizeof(p->comm) - 1) : -1;
+        if (fd >= 0) close(fd);
+        if (len > 0) p->comm[len - (p->comm[len - 1] == '\n')] = '\0';
+    }
+    qsort(st->tasks, processes, sizeof(struct trace_task), trace_compare_waiting);
+    return processes;
+}
+
+static int trace_compare_syscalls(const void *a, const void *b) {
+    const struct trace_syscall *x = *(const struct trace_syscall *const *)a;
+    const struct trace_syscall *y = *(const struct trace_syscall *const *)b;
+    return x->total_us > y->total_us ? -1 : x->total_us < y->total_us;
+}
+
+static char *latency_trace_report(struct trace_state *st, const bool *groups, long long elapsed_ms,
+                                  unsigned long long lost, int top, struct arena *arena) {
+    static const char *const kinds[] = { "read", "write", "other" };
+    int processes = groups[TRACE_SCHED] || groups[TRACE_SYSCALL] ? trace_group_processes(st) : 0;
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"duration_ms\":%lld,\"events\":[", elapsed_ms);
+    bool first = true;
+    for (int g = 0; g < TRACE_GROUP_COUNT; g++) {
+        if (!groups[g]) continue;
+        writer_printf(&w, "%s\"%s\"", first ? "" : ",", trace_groups[g].name);
+        first = false;
+    }
+    writer_printf(&w, "],\"events_seen\":%llu,\"lost_events\":%llu", (unsigned long long)st->events, lost);
+
+    if (groups[TRACE_IO]) {
+        writer_printf(&w, ",\"unmatched_requests\":%llu,\"devices\":[", (unsigned long long)st->unmatched);
+        for (int i = 0; i < st->device_count; i++) {
+            const struct trace_device *d = &st->devices[i];
+            char link[PATH_MAX], target[PATH_MAX] = "";
+            snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", d->major, d->minor);
+            ssize_t n = readlink(link, target, sizeof(target) - 1);
+            target[n > 0 ? n : 0] = '\0';
+            const char *name = strrchr(target, '/');
+            writer_printf(&w, "%s{\"device\":\"%s\",\"dev\":\"%u:%u\"", i ? "," : "", name ? name + 1 : "",
+                          d->major, d->minor);
+            for (int k = 0; k < 3; k++) {
+                writer_printf(&w, ",\"%s_bytes\":%llu,\"%s\":", kinds[k], (unsigned long long)d->bytes[k], kinds[k]);
+                writer_hist(&w, &d->latency[k]);
+            }
+            writer_printf(&w, "}");
+        }
+        writer_printf(&w, "]");
+    }
+    if (groups[TRACE_SCHED]) {
+        writer_printf(&w, ",\"run_queue\":");
+        writer_hist(&w, &st->run_queue);
+    }
+    if (groups[TRACE_SYSCALL]) {
+        writer_printf(&w, ",\"syscalls\":");
+        writer_hist(&w, &st->syscall_latency);
+        const struct trace_syscall **order = arena_alloc(arena, TRACE_MAX_SYSCALLS * sizeof(*order));
+        int count = 0;
+        for (int nr = 0; order && nr < TRACE_MAX_SYSCALLS; nr++) {
+            if (st->syscalls[nr].count) order[count++] = &st->syscalls[nr];
+        }
+        if (order) qsort(order, count, sizeof(*order), trace_compare_syscalls);
+        writer_printf(&w, ",\"top_syscalls\":[");
+        for (int i = 0; i < count && i < top; i++) {
+            writer_printf(&w, "%s{\"nr\":%td,\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu}", i ? "," : "",
+                          order[i] - st->syscalls, (unsigned long long)order[i]->count,
+                          (unsigned long long)order[i]->total_us, (unsigned long long)order[i]->max_us);
+        }
+        writer_printf(&w, "]");
+    }
+    if (groups[TRACE_SCHED] || groups[TRACE_SYSCALL]) {
+        writer_printf(&w, ",\"processes\":[");
+        for (int i = 0; i < processes && i < top; i++) {
+            const struct trace_task *p = &st->tasks[i];
+            writer_printf(&w, "%s{\"pid\":%d,\"comm\":\"", i ? "," : "", p->tgid);
+            writer_json_escaped(&w, p->comm, strlen(p->comm));
+            writer_printf(&w, "\",\"threads\":%d", p->threads);
+            if (groups[TRACE_SCHED]) {
+                writer_printf(&w, ",\"on_cpu_us\":%llu,\"sleep_us\":%llu,\"io_wait_us\":%llu,\"run_queue\":",
+                              (unsigned long long)p->on_cpu_us, (unsigned long long)p->sleep_us,
+                              (unsigned long long)p->io_wait_us);
+                writer_hist(&w, &p->run_queue);
+                writer_printf(&w, ",\"io_wait\":");
+                writer_hist(&w, &p->io_wait);
+            }
+            if (groups[TRACE_SYSCALL]) {
+                writer_printf(&w, ",\"syscalls\":");
+                writer_hist(&w, &p->syscalls);
+            }
+            writer_printf(&w, "}");
+        }
+        writer_printf(&w, "]");
+    }
+    writer_printf(&w, "}}\n");
+    return writer_finish(&w);
+}
+
+static char *handle_latency_trace(const struct agent_request *req, const char *json) {
+    int duration_ms = TRACE_DEFAULT_MS;
+    json_get_int(json, "duration_ms", &duration_ms);
+    if (duration_ms < TRACE_MIN_MS || duration_ms > TRACE_MAX_MS) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"duration_ms must be between %d and %d\"}\n",
+                 TRACE_MIN_MS, TRACE_MAX_MS);
+        return response;
+    }
+    long long left = request_remaining_ms(req);
+    if (left >= 0 && left < duration_ms) {
+        return strdup("{\"success\":false,\"error\":\"duration_ms is longer than the request's budget\"}\n");
+    }
+    int top = TRACE_DEFAULT_TOP;
+    json_get_int(json, "top", &top);
+    if (top < 1 || top > TRACE_MAX_TOP) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"top must be between 1 and %d\"}\n", TRACE_MAX_TOP);
+        return response;
+    }
+
+    bool groups[TRACE_GROUP_COUNT] = { [TRACE_IO] = true, [TRACE_SCHED] = true };
+    char *names[TRACE_GROUP_COUNT + 1];
+    int count = json_get_string_array(req->arena, json, "events", names, TRACE_GROUP_COUNT);
+    if (count > 0) {
+        memset(groups, 0, sizeof(groups));
+        for (int i = 0; i < count; i++) {
+            int g = 0;
+            while (g < TRACE_GROUP_COUNT && strcmp(names[i], trace_groups[g].name) != 0) g++;
+            if (g == TRACE_GROUP_COUNT) {
+                return strdup("{\"success\":false,\"error\":\"events must be io, sched or syscall\"}\n");
+            }
+            groups[g] = true;
+        }
+    }
+
+    struct stat st_dir;
+    if (stat(TRACEFS_DIR "/instances", &st_dir) != 0 &&
+        mount_fs("tracefs", TRACEFS_DIR, "tracefs", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) {
+        return strdup("{\"success\":false,\"error\":\"tracing is not available in this kernel\"}\n");
+    }
+
+    /* The instance and its events are global; one trace at a time */
+    if (pthread_mutex_trylock(&trace_lock) != 0) {
+        return busy_response("latency trace in progress", duration_ms);
+    }
+    /* Left behind if init died mid-trace */
+    rmdir(TRACE_INSTANCE);
+    if (mkdir(TRACE_INSTANCE, 0700) != 0) {
+        pthread_mutex_unlock(&trace_lock);
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"cannot create trace instance: %s\"}\n", strerror(errno));
+        return response;
+    }
+
+    struct trace_state st = { .self_tid = gettid() };
+    st.tasks = arena_alloc(req->arena, TRACE_MAX_TASKS * sizeof(*st.tasks));
+    st.inflight = arena_alloc(req->arena, TRACE_MAX_INFLIGHT * sizeof(*st.inflight));
+    st.syscalls = arena_alloc(req->arena, TRACE_MAX_SYSCALLS * sizeof(*st.syscalls));
+    char *buf = arena_alloc(req->arena, TRACE_READ_CHUNK + 1);
+    const char *failure = NULL;
+    if (!st.tasks || !st.inflight || !st.syscalls || !buf) {
+        failure = "out of memory";
+    } else {
+        memset(st.tasks, 0, TRACE_MAX_TASKS * sizeof(*st.tasks));
+        memset(st.inflight, 0, TRACE_MAX_INFLIGHT * sizeof(*st.inflight));
+        memset(st.syscalls, 0, TRACE_MAX_SYSCALLS * sizeof(*st.syscalls));
+    }
+
+    /* Our own reads would otherwise show up as syscalls and wakeups */
+    char filter[64];
+    snprintf(filter, sizeof(filter), "common_pid != %d", st.self_tid);
+    trace_write("buffer_size_kb", TRACE_BUFFER_KB);
+    trace_write("trace_clock", "mono");
+    for (int g = 0; g < TRACE_GROUP_COUNT && !failure; g++) {
+        for (int i = 0; groups[g] && i < 4 && trace_groups[g].events[i]; i++) {
+            char path[128];
+            snprintf(path, sizeof(path), "events/%s/enable", trace_groups[g].events[i]);
+            if (trace_write(path, "1") != 0) {
+                /* sched_wakeup_new is missing on some kernels; the rest are required */
+                if (strcmp(trace_groups[g].events[i], "sched/sched_wakeup_new") == 0) continue;
+                failure = arena_printf(req->arena, "%s tracepoint unavailable", trace_groups[g].events[i]);
+                break;
+            }
+            snprintf(path, sizeof(path), "events/%s/filter", trace_groups[g].events[i]);
+            if (g == TRACE_SYSCALL) trace_write(path, filter);
+        }
+    }
+
+    int pipe_fd = failure ? -1 : open(TRACE_INSTANCE "/trace_pipe", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (!failure && pipe_fd < 0) failure = "cannot open trace_pipe";
+
+    long long started = monotonic_ms();
+    long long stop_at = started + duration_ms;
+    const char *cancelled = NULL;
+    size_t pending = 0;
+    while (!failure) {
+        long long now = monotonic_ms();
+        bool stopping = now >= stop_at;
+        if (stopping) trace_write("tracing_on", "0");
+        if (!stopping) {
+            struct pollfd pfd = { .fd = pipe_fd, .events = POLLIN };
+            poll(&pfd, 1, stop_at - now < 100 ? (int)(stop_at - now) : 100);
+        }
+        /* After tracing stops, drain what is left; trace_pipe then reports no data */
+        for (;;) {
+            ssize_t n = read(pipe_fd, buf + pending, TRACE_READ_CHUNK - pending);
+            if (n <= 0) break;
+            pending += n;
+            size_t used = trace_consume(&st, buf, pending);
+            if (used == 0 && pending == TRACE_READ_CHUNK) used = pending; /* no newline in a whole chunk */
+            memmove(buf, buf + used, pending - used);
+            pending -= used;
+        }
+        if (stopping) break;
+        if ((cancelled = request_cancelled(req)) != NULL) break;
+    }
+    long long elapsed_ms = monotonic_ms() - started;
+    unsigned long long lost = failure ? 0 : trace_overruns();
+    if (pipe_fd >= 0) close(pipe_fd);
+    trace_instance_remove();
+    pthread_mutex_unlock(&trace_lock);
+
+    if (cancelled) return cancelled_response(cancelled);
+    if (failure) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"%s\"}\n", failure);
+        return response;
+    }
+    return latency_trace_report(&st, groups, elapsed_ms, lost, top, req->arena);
+}
+
+/*
+ * Log streaming
+ *
+ * "log_read" returns kernel records from /dev/kmsg and init's own lines
+ * from its log ring, merged in time order, so a guest can boot quiet and
+ * the host still gets the full log. Each source numbers its records; the
+ * reply says where to continue ("kernel_seq", "init_seq") so the host can
+ * resume without repeats or gaps, and counts the records that were
+ * overwritten before it got to them ("kernel_dropped", "init_dropped").
+ * Numbering restarts with every boot: cursors sent with another "boot_id"
+ * are ignored.
+ *
+ * "level" keeps records at that syslog level or more severe. With
+ * "wait_ms" a request that finds nothing waits for the next record rather
+ * than answering empty, which lets the host follow the log.
+ */
+#define LOG_READ_DEFAULT_LIMIT 1000
+#define LOG_READ_MAX_LIMIT 10000
+#define LOG_READ_MAX_WAIT_MS 60000
+#define LOG_READ_WAIT_SLICE_MS 250 /* how often a waiting request looks at init's ring */
+#define KMSG_RECORD_MAX 8192
+
+enum log_source {
+    LOG_SOURCE_KERNEL,
+    LOG_SOURCE_INIT,
+    LOG_SOURCE_COUNT,
+};
+
+static const char *const log_source_names[LOG_SOURCE_COUNT] = { "kernel", "init" };
+
+static const char *const syslog_level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+struct log_record {
+    uint64_t seq;
+    long long ts_us;
+    int level;     /* syslog scale */
+    uint64_t gap;  /* records lost just before this one */
+    char *text;
+    size_t len;
+};
+
+struct log_batch {
+    struct log_record *records;
+    int count;
+    uint64_t next_seq; /* first record not looked at yet */
+    uint64_t gap;      /* records lost since the last one kept */
+};
+
+/* init's levels on the syslog scale the kernel uses */
+static int log_syslog_level(int level) {
+    switch (level) {
+        case LOG_ERROR: return 3;
+        case LOG_WARN:  return 4;
+        case LOG_INFO:  return 6;
+        default:        return 7;
+    }
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void log_batch_keep(struct log_batch *b, struct log_record *r) {
+    r->gap = b->gap;
+    b->gap = 0;
+    b->records[b->count++] = *r;
+}
+
+/*
+ * Parse a /dev/kmsg record, "prio,seq,ts_us,flags;text\n" followed by
+ * " KEY=value" dictionary lines. The kernel writes non-printable bytes of
+ * the text as \xNN; they are decoded so UTF-8 survives.
+ */
+static bool kmsg_parse(struct arena *arena, const char *buf, size_t len, struct log_record *r) {
+    unsigned long long prio, seq;
+    long long ts_us;
+    const char *text = memchr(buf, ';', len);
+    if (!text || sscanf(buf, "%llu,%llu,%lld", &prio, &seq, &ts_us) != 3) return false;
+    text++;
+    const char *end = memchr(text, '\n', buf + len - text);
+    if (!end) end = buf + len;
+
+    char *out = arena_alloc(arena, end - text + 1);
+    if (!out) return false;
+    size_t n = 0;
+    for (const char *p = text; p < end; p++) {
+        int hi, lo;
+        if (p[0] == '\\' && end - p >= 4 && p[1] == 'x' && (hi = hex_digit(p[2])) >= 0 && (lo = hex_digit(p[3])) >= 0) {
+            out[n++] = (char)(hi << 4 | lo);
+            p += 3;
+        } else {
+            out[n++] = *p;
+        }
+    }
+    out[n] = '\0';
+    *r = (struct log_record){ .seq = seq, .ts_us = ts_us, .level = prio & 7, .text = out, .len = n };
+    return true;
+}
+
+/* Read the kernel records from b->next_seq on that aren't already read from fd */
+static void kmsg_collect(struct arena *arena, int fd, int max_level, int limit, struct log_batch *b) {
+    char buf[KMSG_RECORD_MAX + 1];
+    while (b->count < limit) {
+        ssize_t n = read(fd, buf, KMSG_RECORD_MAX);
+        if (n < 0) {
+            /* EPIPE: the next record was overwritten; the read after it continues with the oldest */
+            if (errno == EINTR || errno == EPIPE) continue;
+            break;
+        }
+        struct log_record r;
+        if (n == 0 || !kmsg_parse(arena, buf, n, &r) || r.seq < b->next_seq) continue;
+        b->gap += r.seq - b->next_seq;
+        b->next_seq = r.seq + 1;
+        if (r.level <= max_level) log_batch_keep(b, &r);
+    }
+}
+
+static void log_ring_collect(struct arena *arena, int max_level, int limit, struct log_batch *b) {
+    pthread_mutex_lock(&log_lock);
+    uint64_t oldest = log_next_seq > LOG_RING_LINES ? log_next_seq - LOG_RING_LINES : 0;
+    if (b->next_seq < oldest) {
+        b->gap += oldest - b->next_seq;
+        b->next_seq = oldest;
+    }
+    for (; b->next_seq < log_next_seq && b->count < limit; b->next_seq++) {
+        const struct log_line *line = &log_ring[b->next_seq % LOG_RING_LINES];
+        struct log_record r = { .seq = line->seq, .ts_us = line->ts_us, .level = log_syslog_level(line->level) };
+        if (r.level > max_level) continue;
+        r.len = strlen(line->text);
+        r.text = arena_alloc(arena, r.len + 1);
+        if (!r.text) break;
+        memcpy(r.text, line->text, r.len + 1);
+        log_batch_keep(b, &r);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* The level named by "level", as a number or a syslog name; debug if absent */
+static int log_read_level(struct arena *arena, const char *json) {
+    int level = 7;
+    if (json_get_int(json, "level", &level) == 0) return level >= 0 && level <= 7 ? level : -1;
+    char *name = json_get_string(arena, json, "level");
+    if (!name) return 7;
+    for (int i = 0; i < 8; i++) {
+        if (strcmp(name, syslog_level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static void read_boot_id(char *out, size_t size) {
+    out[0] = '\0';
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n = read(fd, out, size - 1);
+    close(fd);
+    out[n > 0 ? n : 0] = '\0';
+    char *nl = strchr(out, '\n');
+    if (nl) *nl = '\0';
+}
+
+static char *handle_log_read(const struct agent_request *req, const char *json) {
+    bool wanted[LOG_SOURCE_COUNT] = { true, true };
+    char *source = json_get_string(req->arena, json, "source");
+    if (source) {
+        bool known = false;
+        for (int i = 0; i < LOG_SOURCE_COUNT; i++) {
+            wanted[i] = strcmp(source, log_source_names[i]) == 0;
+            known |= wanted[i];
+        }
+        if (!known) return strdup("{\"success\":false,\"error\":\"source must be kernel or init\"}\n");
+    }
+    int max_level = log_read_level(req->arena, json);
+    if (max_level < 0) {
+        return strdup("{\"success\":false,\"error\":\"level must be 0-7 or a syslog level name\"}\n");
+    }
+    int limit = LOG_READ_DEFAULT_LIMIT;
+    json_get_int(json, "limit", &limit);
+    if (limit < 1 || limit > LOG_READ_MAX_LIMIT) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"limit must be between 1 and %d\"}\n", LOG_READ_MAX_LIMIT);
+        return response;
+    }
+    int wait_ms = 0;
+    json_get_int(json, "wait_ms", &wait_ms);
+    if (wait_ms < 0 || wait_ms > LOG_READ_MAX_WAIT_MS) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"wait_ms must be between 0 and %d\"}\n",
+                 LOG_READ_MAX_WAIT_MS);
+        return response;
+    }
+
+    char boot_id[64];
+    read_boot_id(boot_id, sizeof(boot_id));
+    char *client_boot_id = json_get_string(req->arena, json, "boot_id");
+    bool resume = !client_boot_id || strcmp(client_boot_id, boot_id) == 0;
+
+    struct log_batch batches[LOG_SOURCE_COUNT] = { 0 };
+    const char *cursor_keys[LOG_SOURCE_COUNT] = { "kernel_seq", "init_seq" };
+    for (int i = 0; i < LOG_SOURCE_COUNT; i++) {
+        long long seq = 0;
+        if (resume && json_get_long(json, cursor_keys[i], &seq) == 0 && seq > 0) batches[i].next_seq = seq;
+        batches[i].records = wanted[i] ? arena_alloc(req->arena, limit * sizeof(struct log_record)) : NULL;
+        if (wanted[i] && !batches[i].records) return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+    }
+
+    /* Opened at the oldest record the kernel still holds */
+    int kmsg_fd = -1;
+    if (wanted[LOG_SOURCE_KERNEL]) {
+        kmsg_fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (kmsg_fd < 0) {
+            char *response = NULL;
+            asprintf(&response, "{\"success\":false,\"error\":\"cannot open /dev/kmsg: %s\"}\n", strerror(errno));
+            return response;
+        }
+    }
+
+    long long wait_until = monotonic_ms() + wait_ms;
+    long long remaining = request_remaining_ms(req);
+    if (remaining >= 0 && monotonic_ms() + remaining < wait_until) wait_until = monotonic_ms() + remaining;
+    const char *cancelled = NULL;
+    for (;;) {
+        if (kmsg_fd >= 0) kmsg_collect(req->arena, kmsg_fd, max_level, limit, &batches[LOG_SOURCE_KERNEL]);
+        if (wanted[LOG_SOURCE_INIT]) log_ring_collect(req->arena, max_level, limit, &batches[LOG_SOURCE_INIT]);
+        long long left = wait_until - monotonic_ms();
+        if (batches[LOG_SOURCE_KERNEL].count + batches[LOG_SOURCE_INIT].count > 0 || left <= 0) break;
+        if ((cancelled = request_cancelled(req)) != NULL) break;
+
+        /* Woken early by a new kernel record; init's ring is checked every slice */
+        struct pollfd pfd = { .fd = kmsg_fd, .events = POLLIN };
+        poll(&pfd, 1, left < LOG_READ_WAIT_SLICE_MS ? (int)left : LOG_READ_WAIT_SLICE_MS);
+    }
+    if (kmsg_fd >= 0) close(kmsg_fd);
+    if (cancelled) return cancelled_response(cancelled);
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"boot_id\":\"%s\",\"records\":[", boot_id);
+    int taken[LOG_SOURCE_COUNT] = { 0 };
+    uint64_t dropped[LOG_SOURCE_COUNT] = { 0 };
+    for (int written = 0; written < limit; written++) {
+        struct log_batch *k = &batches[LOG_SOURCE_KERNEL], *in = &batches[LOG_SOURCE_INIT];
+        int src;
+        if (taken[LOG_SOURCE_KERNEL] < k->count && taken[LOG_SOURCE_INIT] < in->count) {
+            src = k->records[taken[LOG_SOURCE_KERNEL]].ts_us <= in->records[taken[LOG_SOURCE_INIT]].ts_us
+                      ? LOG_SOURCE_KERNEL : LOG_SOURCE_INIT;
+        } else if (taken[LOG_SOURCE_KERNEL] < k->count) {
+            src = LOG_SOURCE_KERNEL;
+        } else if (taken[LOG_SOURCE_INIT] < in->count) {
+            src = LOG_SOURCE_INIT;
+        } else {
+            break;
+        }
+        const struct log_record *r = &batches[src].records[taken[src]++];
+        dropped[src] += r->gap;
+        writer_printf(&w, "%s{\"source\":\"%s\",\"seq\":%llu,\"ts_us\":%lld,\"level\":%d,\"text\":\"",
+                      written ? "," : "", log_source_names[src], (unsigned long long)r->seq, r->ts_us, r->level);
+        writer_json_escaped(&w, r->text, r->len);
+        writer_printf(&w, "\"}");
+    }
+
+    /* A source cut short by the limit resumes at its first record left out */
+    writer_printf(&w, "]");
+    for (int i = 0; i < LOG_SOURCE_COUNT; i++) {
+        const struct log_batch *b = &batches[i];
+        if (!wanted[i]) continue;
+        uint64_t next = taken[i] < b->count ? b->records[taken[i]].seq : b->next_seq;
+        dropped[i] += taken[i] < b->count ? b->records[taken[i]].gap : b->gap;
+        writer_printf(&w, ",\"%s\":%llu,\"%s_dropped\":%llu", cursor_keys[i], (unsigned long long)next,
+                      log_source_names[i], (unsigned long long)dropped[i]);
+    }
+    writer_printf(&w, "}}\n");
+    return writer_finish(&w);
+}
+
+/*
+ * Metrics history
+ *
+ * By the time someone asks why a VM misbehaved five minutes ago, a reading
+ * taken now says little. Init samples the core counters every second into
+ * a ring in its own memory, so "metrics_history" can return what happened
+ * without the host storing anything per VM:
+ *   - CPU ticks by state, context switches, runnable and blocked tasks
+ *   - available, free and cached memory and free swap
+ *   - stall time from /proc/pressure/{cpu,memory,io}
+ *   - disk operations and bytes, network bytes and packets (loopback aside)
+ *   - the processes that used the most CPU during the second
+ *
+ * The ring is a fixed number of blocks. Each block starts from zero and
+ * stores every value as a zigzag varint of its delta-of-delta, so a counter
+ * rising at a steady rate and a gauge holding still both cost a byte per
+ * sample, and a process name is stored the first time it shows up in the
+ * block. When the ring is full the oldest block is dropped: the memory is
+ * fixed (--metrics-history-kib) and the time covered depends on how busy
+ * the guest is, about two hours at the default for an idle one.
+ */
+#define METRICS_INTERVAL_MS 1000
+#define METRICS_DEFAULT_KIB 256
+#define METRICS_BLOCK_BYTES 4096
+#define METRICS_SAMPLE_MAX 512    /* largest encoded sample */
+#define METRICS_TOP 3
+#define METRICS_COMM_MAX 16
+#define METRICS_BLOCK_NAMES 64
+#define METRICS_TRACKED_PROCS 4096
+#define METRICS_DEFAULT_MAX_SAMPLES 3600
+#define METRICS_MAX_SAMPLES 86400
+
+enum metrics_field {
+    M_CPU_USER, M_CPU_NICE, M_CPU_SYSTEM, M_CPU_IDLE, M_CPU_IOWAIT, M_CPU_IRQ, M_CPU_SOFTIRQ, M_CPU_STEAL,
+    M_CONTEXT_SWITCHES, M_PROCS_RUNNING, M_PROCS_BLOCKED,
+    M_MEM_TOTAL, M_MEM_AVAILABLE, M_MEM_FREE, M_MEM_CACHED, M_SWAP_FREE,
+    M_PSI_CPU_SOME, M_PSI_MEMORY_SOME, M_PSI_MEMORY_FULL, M_PSI_IO_SOME, M_PSI_IO_FULL,
+    M_DISK_READS, M_DISK_READ_SECTORS, M_DISK_WRITES, M_DISK_WRITE_SECTORS,
+    M_NET_RX_BYTES, M_NET_RX_PACKETS, M_NET_TX_BYTES, M_NET_TX_PACKETS,
+    M_FIELDS
+};
+
+/* Counters are reported as their increase over the sample's interval, gauges as they were */
+static const struct {
+    const char *name;
+    bool counter;
+    unsigned int scale; /* stored unit to reported unit */
+} metrics_fields[M_FIELDS] = {
+    [M_CPU_USER] = { "cpu_user_ticks", true, 1 },
+    [M_CPU_NICE] = { "cpu_nice_ticks", true, 1 },
+    [M_CPU_SYSTEM] = { "cpu_system_ticks", true, 1 },
+    [M_CPU_IDLE] = { "cpu_idle_ticks", true, 1 },
+    [M_CPU_IOWAIT] = { "cpu_iowait_ticks", true, 1 },
+    [M_CPU_IRQ] = { "cpu_irq_ticks", true, 1 },
+    [M_CPU_SOFTIRQ] = { "cpu_softirq_ticks", true, 1 },
+    [M_CPU_STEAL] = { "cpu_steal_ticks", true, 1 },
+    [M_CONTEXT_SWITCHES] = { "context_switches", true, 1 },
+    [M_PROCS_RUNNING] = { "procs_running", false, 1 },
+    [M_PROCS_BLOCKED] = { "procs_blocked", false, 1 },
+    [M_MEM_TOTAL] = { "mem_total_bytes", false, 1024 },
+    [M_MEM_AVAILABLE] = { "mem_available_bytes", false, 1024 },
+    [M_MEM_FREE] = { "mem_free_bytes", false, 1024 },
+    [M_MEM_CACHED] = { "mem_cached_bytes", false, 1024 },
+    [M_SWAP_FREE] = { "swap_free_bytes", false, 1024 },
+    [M_PSI_CPU_SOME] = { "psi_cpu_some_us", true, 1 },
+    [M_PSI_MEMORY_SOME] = { "psi_memory_some_us", true, 1 },
+    [M_PSI_MEMORY_FULL] = { "psi_memory_full_us", true, 1 },
+    [M_PSI_IO_SOME] = { "psi_io_some_us", true, 1 },
+    [M_PSI_IO_FULL] = { "psi_io_full_us", true, 1 },
+    [M_DISK_READS] = { "disk_reads", true, 1 },
+    [M_DISK_READ_SECTORS] = { "disk_read_bytes", true, 512 },
+    [M_DISK_WRITES] = { "disk_writes", true, 1 },
+    [M_DISK_WRITE_SECTORS] = { "disk_write_bytes", true, 512 },
+    [M_NET_RX_BYTES] = { "net_rx_bytes", true, 1 },
+    [M_NET_RX_PACKETS] = { "net_rx_packets", true, 1 },
+    [M_NET_TX_BYTES] = { "net_tx_bytes", true, 1 },
+    [M_NET_TX_PACKETS] = { "net_tx_packets", true, 1 },
+};
+
+struct metrics_proc {
+    pid_t pid;
+    char comm[METRICS_COMM_MAX];
+    unsigned long long ticks; /* CPU used during the interval */
+};
+
+struct metrics_sample {
+    long long t_ms; /* wall clock */
+    unsigned long long v[M_FIELDS];
+    int top_count;
+    struct metrics_proc top[METRICS_TOP];
+};
+
+/* What encoding and decoding a block carry from one sample to the next */
+struct metrics_codec {
+    int samples;
+    long long prev_t;
+    unsigned long long prev[M_FIELDS];
+    unsigned long long prev_delta[M_FIELDS];
+    int name_count;
+    struct {
+        pid_t pid;
+        char comm[METRICS_COMM_MAX];
+    } names[METRICS_BLOCK_NAMES];
+};
+
+struct metrics_block {
+    long long first_ms;
+    long long last_ms;
+    int count;
+    size_t used;
+    unsigned char data[METRICS_BLOCK_BYTES];
+};
+
+static int metrics_history_kib = METRICS_DEFAULT_KIB;
+
+static struct {
+    pthread_mutex_t lock;
+    struct metrics_block *blocks; /* NULL while disabled */
+    int count;
+    int head;   /* block being filled */
+    int filled; /* blocks holding samples, head included */
+    struct metrics_codec codec;
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static long long realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t metrics_put_varint(unsigned char *out, unsigned long long v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+static bool metrics_get_varint(const unsigned char *in, size_t len, size_t *pos, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        unsigned char b = in[(*pos)++];
+        *v |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static unsigned long long zigzag(long long v) {
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static long long unzigzag(unsigned long long v) {
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static void metrics_codec_reset(struct metrics_codec *c, long long first_ms) {
+    memset(c, 0, sizeof(*c));
+    c->prev_t = first_ms - METRICS_INTERVAL_MS;
+}
+
+static int metrics_name_find(const struct metrics_codec *c, pid_t pid) {
+    for (int i = 0; i < c->name_count; i++) {
+        if (c->names[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+/* Encoder and decoder both call this on a named entry, so their tables match */
+static void metrics_name_set(struct metrics_codec *c, pid_t pid, const char *comm) {
+    int i = metrics_name_find(c, pid);
+    if (i < 0 && c->name_count < METRICS_BLOCK_NAMES) i = c->name_count++;
+    if (i < 0) return;
+    c->names[i].pid = pid;
+    memcpy(c->names[i].comm, comm, sizeof(c->names[i].comm));
+}
+
+/* A value as it goes on the wire: the raw value first, then its delta-of-delta */
+static unsigned long long metrics_encode_value(struct metrics_codec *c, int field, unsigned long long v) {
+    unsigned long long delta = c->samples ? v - c->prev[field] : 0;
+    unsigned long long out = c->samples ? zigzag((long long)(delta - c->prev_delta[field])) : v;
+    c->prev[field] = v;
+    c->prev_delta[field] = delta;
+    return out;
+}
+
+static unsigned long long metrics_decode_value(struct metrics_codec *c, int field, unsigned long long in) {
+    unsigned long long delta = c->samples ? c->prev_delta[field] + (unsigned long long)unzigzag(in) : 0;
+    unsigned long long v = c->samples ? c->prev[field] + delta : in;
+    c->prev[field] = v;
+    c->prev_delta[field] = delta;
+    return v;
+}
+
+static size_t metrics_encode(struct metrics_codec *c, const struct metrics_sample *s, unsigned char *out) {
+    size_t n = metrics_put_varint(out, zigzag(s->t_ms - c->prev_t - METRICS_INTERVAL_MS));
+    c->prev_t = s->t_ms;
+    for (int i = 0; i < M_FIELDS; i++) {
+        n += metrics_put_varint(out + n, metrics_encode_value(c, i, s->v[i]));
+    }
+
+    out[n++] = (unsigned char)s->top_count;
+    for (int i = 0; i < s->top_count; i++) {
+        const struct metrics_proc *p = &s->top[i];
+        int known = metrics_name_find(c, p->pid);
+        bool named = known < 0 || strcmp(c->names[known].comm, p->comm) != 0;
+        n += metrics_put_varint(out + n, (unsigned long long)p->pid << 1 | named);
+        if (named) {
+            size_t len = strlen(p->comm);
+            out[n++] = (unsigned char)len;
+            memcpy(out + n, p->comm, len);
+            n += len;
+            metrics_name_set(c, p->pid, p->comm);
+        }
+        n += metrics_put_varint(out + n, p->ticks);
+    }
+    c->samples++;
+    return n;
+}
+
+static bool metrics_decode(struct metrics_codec *c, const struct metrics_block *b, size_t *pos,
+                           struct metrics_sample *s) {
+    unsigned long long v;
+    if (!metrics_get_varint(b->data, b->used, pos, &v)) return false;
+    s->t_ms = c->prev_t + METRICS_INTERVAL_MS + unzigzag(v);
+    c->prev_t = s->t_ms;
+    for (int i = 0; i < M_FIELDS; i++) {
+        if (!metrics_get_varint(b->data, b->used, pos, &v)) return false;
+        s->v[i] = metrics_decode_value(c, i, v);
+    }
+
+    if (*pos >= b->used || b->data[*pos] > METRICS_TOP) return false;
+    s->top_count = b->data[(*pos)++];
+    for (int i = 0; i < s->top_count; i++) {
+        struct metrics_proc *p = &s->top[i];
+        if (!metrics_get_varint(b->data, b->used, pos, &v)) return false;
+        p->pid = (pid_t)(v >> 1);
+        memset(p->comm, 0, sizeof(p->comm));
+        if (v & 1) {
+            size_t len = *pos < b->used ? b->data[(*pos)++] : METRICS_COMM_MAX;
+            if (len >= METRICS_COMM_MAX || *pos + len > b->used) return false;
+            memcpy(p->comm, b->data + *pos, len);
+            *pos += len;
+            metrics_name_set(c, p->pid, p->comm);
+        } else {
+            int known = metrics_name_find(c, p->pid);
+            if (known >= 0) memcpy(p->comm, c->names[known].comm, sizeof(p->comm));
+        }
+        if (!metrics_get_varint(b->data, b->used, pos, &p->ticks)) return false;
+    }
+    c->samples++;
+    return true;
+}
+
+static void metrics_append(const struct metrics_sample *s) {
+    unsigned char buf[METRICS_SAMPLE_MAX];
+    pthread_mutex_lock(&metrics.lock);
+    struct metrics_block *b = &metrics.blocks[metrics.head];
+    struct metrics_codec next = metrics.codec;
+    size_t n = metrics_encode(&next, s, buf);
+    if (metrics.filled == 0 || b->used + n > sizeof(b->data)) {
+        /* Start a block, over the oldest once they're all used */
+        if (metrics.filled > 0) metrics.head = (metrics.head + 1) % metrics.count;
+        if (metrics.filled < metrics.count) metrics.filled++;
+        b = &metrics.blocks[metrics.head];
+        b->first_ms = s->t_ms;
+        b->count = 0;
+        b->used = 0;
+        metrics_codec_reset(&next, s->t_ms);
+        n = metrics_encode(&next, s, buf);
+    }
+    memcpy(b->data + b->used, buf, n);
+    b->used += n;
+    b->count++;
+    b->last_ms = s->t_ms;
+    metrics.codec = next;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static void metrics_read_stat(struct metrics_sample *s) {
+    FILE *f = fopen("/proc/stat", "re");
+    char line[1024];
+    /* The intr line is longer than the buffer; its pieces start with digits and match nothing */
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "cpu ", 4) == 0) {
+            sscanf(line + 4, "%llu %llu %llu %llu %llu %llu %llu %llu", &s->v[M_CPU_USER], &s->v[M_CPU_NICE],
+                   &s->v[M_CPU_SYSTEM], &s->v[M_CPU_IDLE], &s->v[M_CPU_IOWAIT], &s->v[M_CPU_IRQ],
+                   &s->v[M_CPU_SOFTIRQ], &s->v[M_CPU_STEAL]);
+        } else if (sscanf(line, "ctxt %llu", &s->v[M_CONTEXT_SWITCHES]) == 1) {
+            continue;
+        } else if (sscanf(line, "procs_running %llu", &s->v[M_PROCS_RUNNING]) == 1) {
+            continue;
+        } else {
+            sscanf(line, "procs_blocked %llu", &s->v[M_PROCS_BLOCKED]);
+        }
+    }
+    if (f) fclose(f);
+}
+
+static void metrics_read_meminfo(struct metrics_sample *s) {
+    static const struct {
+        const char *name;
+        int field;
+    } wanted[] = {
+        { "MemTotal:", M_MEM_TOTAL }, { "MemAvailable:", M_MEM_AVAILABLE }, { "MemFree:", M_MEM_FREE },
+        { "Cached:", M_MEM_CACHED },  { "SwapFree:", M_SWAP_FREE },
+    };
+    FILE *f = fopen("/proc/meminfo", "re");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++) {
+            size_t len = strlen(wanted[i].name);
+            if (strncmp(line, wanted[i].name, len) == 0) s->v[wanted[i].field] = strtoull(line + len, NULL, 10);
+        }
+    }
+    if (f) fclose(f);
+}
+
+/* Cumulative stall time in microseconds; full < 0 to skip it */
+static void metrics_read_pressure(const char *path, struct metrics_sample *s, int some, int full) {
+    FILE *f = fopen(path, "re");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        char *total = strstr(line, "total=");
+        if (!total) continue;
+        if (strncmp(line, "some", 4) == 0) s->v[some] = strtoull(total + 6, NULL, 10);
+        else if (full >= 0 && strncmp(line, "full", 4) == 0) s->v[full] = strtoull(total + 6, NULL, 10);
+    }
+    if (f) fclose(f);
+}
+
+static void metrics_read_diskstats(struct metrics_sample *s) {
+    FILE *f = fopen("/proc/diskstats", "re");
+    char line[512];
+    while (f && fgets(line, sizeof(line), f)) {
+        char name[64], path[96];
+        unsigned long long reads, read_sectors, writes, write_sectors;
+        if (sscanf(line, " %*u %*u %63s %llu %*u %llu %*u %llu %*u %llu", name, &reads, &read_sectors, &writes,
+                   &write_sectors) != 5) {
+            continue;
+        }
+        /* Whole disks only: partitions would count their IO twice, loop devices their backing disk's */
+        snprintf(path, sizeof(path), "/sys/block/%s", name);
+        if (strncmp(name, "loop", 4) == 0 || strncmp(name, "ram", 3) == 0 || access(path, F_OK) != 0) continue;
+        s->v[M_DISK_READS] += reads;
+        s->v[M_DISK_READ_SECTORS] += read_sectors;
+        s->v[M_DISK_WRITES] += writes;
+        s->v[M_DISK_WRITE_SECTORS] += write_sectors;
+    }
+    if (f) fclose(f);
+}
+
+static void metrics_read_netdev(struct metrics_sample *s) {
+    FILE *f = fopen("/proc/net/dev", "re");
+    char line[512];
+    while (f && fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        unsigned long long rx_bytes, rx_packets, tx_bytes, tx_packets;
+        if (!colon) continue;
+        *colon = '\0';
+        if (strcmp(line + strspn(line, " "), "lo") == 0) continue;
+        if (sscanf(colon + 1, "%llu %llu %*u %*u %*u %*u %*u %*u %llu %llu", &rx_bytes, &rx_packets, &tx_bytes,
+                   &tx_packets) != 4) {
+            continue;
+        }
+        s->v[M_NET_RX_BYTES] += rx_bytes;
+        s->v[M_NET_RX_PACKETS] += rx_packets;
+        s->v[M_NET_TX_BYTES] += tx_bytes;
+        s->v[M_NET_TX_PACKETS] += tx_packets;
+    }
+    if (f) fclose(f);
+}
+
+struct metrics_ticks {
+    pid_t pid;
+    unsigned long long ticks;
+};
+
+/*
+ * CPU ticks of every process into `now`, and the METRICS_TOP that used the
+ * most since the scan in `before` into the sample. /proc lists processes in
+ * pid order, so the two scans are merged in one pass. Returns the number of
+ * processes scanned.
+ */
+static int metrics_read_procs(struct metrics_ticks *now, const struct metrics_ticks *before, int before_count,
+                              struct metrics_sample *s) {
+    DIR *proc = opendir("/proc");
+    struct dirent *de;
+    int count = 0, j = 0;
+    while (proc && count < METRICS_TRACKED_PROCS && (de = readdir(proc)) != NULL) {
+        char *end;
+        long pid = strtol(de->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0) continue;
+
+        char path[64], buf[512];
+        snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+        if (fd >= 0) close(fd);
+        if (n <= 0) continue;
+        buf[n] = '\0';
+
+        /* "pid (comm) state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime" */
+        char *open_paren = strchr(buf, '('), *close_paren = strrchr(buf, ')');
+        unsigned long long utime, stime;
+        if (!open_paren || !close_paren || close_paren < open_paren ||
+            sscanf(close_paren + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+            continue;
+        }
+        now[count].pid = (pid_t)pid;
+        now[count].ticks = utime + stime;
+        count++;
+        if (before_count < 0) continue;
+
+        while (j < before_count && before[j].pid < pid) j++;
+        /* A process started since the last scan used all its ticks in this interval */
+        unsigned long long used = utime + stime - (j < before_count && before[j].pid == pid ? before[j].ticks : 0);
+        int at = s->top_count;
+        while (at > 0 && s->top[at - 1].ticks < used) at--;
+        if (used == 0 || at == METRICS_TOP) continue;
+        if (s->top_count < METRICS_TOP) s->top_count++;
+        memmove(&s->top[at + 1], &s->top[at], (s->top_count - at - 1) * sizeof(s->top[0]));
+        struct metrics_proc *p = &s->top[at];
+        size_t len = close_paren - open_paren - 1;
+        if (len >= sizeof(p->comm)) len = sizeof(p->comm) - 1;
+        memset(p->comm, 0, sizeof(p->comm));
+        memcpy(p->comm, open_paren + 1, len);
+        p->pid = (pid_t)pid;
+        p->ticks = used;
     }
-
-    return strdup("{\"success\":true,\"data\":{}}\n");
+    if (proc) closedir(proc);
+    return count;
 }
 
-static char *handle_exec(const char *json) {
-    /* Parse cmd array - simple parsing for ["cmd", "arg1", "arg2"] */
-    char *argv[256];
-    int argc = 0;
+static void *metrics_thread(void *arg) {
+    (void)arg;
+    struct metrics_ticks *before = malloc(METRICS_TRACKED_PROCS * sizeof(*before));
+    struct metrics_ticks *now = malloc(METRICS_TRACKED_PROCS * sizeof(*now));
+    if (!before || !now) {
+        free(before);
+        free(now);
+        return NULL;
+    }
+    nice(5);
 
-    /* Find the cmd array */
-    const char *arr_start = strstr(json, "\"cmd\"");
-    if (!arr_start) {
-        return strdup("{\"success\":false,\"error\":\"missing cmd\"}\n");
+    int before_count = -1;
+    long long next_ms = monotonic_ms();
+    while (!shutdown_requested && !reboot_requested) {
+        struct metrics_sample s = { .t_ms = realtime_ms() };
+        metrics_read_stat(&s);
+        metrics_read_meminfo(&s);
+        metrics_read_pressure("/proc/pressure/cpu", &s, M_PSI_CPU_SOME, -1);
+        metrics_read_pressure("/proc/pressure/memory", &s, M_PSI_MEMORY_SOME, M_PSI_MEMORY_FULL);
+        metrics_read_pressure("/proc/pressure/io", &s, M_PSI_IO_SOME, M_PSI_IO_FULL);
+        metrics_read_diskstats(&s);
+        metrics_read_netdev(&s);
+        int count = metrics_read_procs(now, before, before_count, &s);
+        struct metrics_ticks *swap = before;
+        before = now;
+        now = swap;
+        before_count = count;
+        metrics_append(&s);
+
+        /* After a pause (a snapshot, a stalled guest) carry on rather than catch up */
+        next_ms += METRICS_INTERVAL_MS;
+        long long wait = next_ms - monotonic_ms();
+        if (wait < 0) {
+            next_ms -= wait;
+            wait = 0;
+        }
+        usleep(wait * 1000);
+    }
+    return NULL;
+}
+
+static void metrics_start(void) {
+    int count = metrics_history_kib * 1024 / (int)sizeof(struct metrics_block);
+    if (metrics_history_kib <= 0) return;
+    if (count < 2) count = 2;
+    metrics.blocks = calloc(count, sizeof(struct metrics_block));
+    if (!metrics.blocks) {
+        log_warn("metrics history disabled: out of memory");
+        return;
     }
-    arr_start = strchr(arr_start, '[');
-    if (!arr_start) {
-        return strdup("{\"success\":false,\"error\":\"cmd must be an array\"}\n");
+    metrics.count = count;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread, NULL) != 0) {
+        log_warn("metrics history disabled: %s", strerror(errno));
+        free(metrics.blocks);
+        metrics.blocks = NULL;
+        return;
     }
+    pthread_detach(thread);
+}
 
-    if (arr_start) {
-        arr_start++;
-        const char *p = arr_start;
+static void metrics_write_sample(struct writer *w, const struct metrics_sample *s, const struct metrics_sample *prev,
+                                 bool first) {
+    writer_printf(w, "%s{\"t\":%lld,\"v\":[", first ? "" : ",", s->t_ms);
+    for (int i = 0; i < M_FIELDS; i++) {
+        unsigned long long v = s->v[i];
+        /* A counter that went backwards was reset (a device went away) */
+        if (metrics_fields[i].counter) v = v >= prev->v[i] ? v - prev->v[i] : 0;
+        writer_printf(w, "%s%llu", i ? "," : "", v * metrics_fields[i].scale);
+    }
+    writer_printf(w, "],\"top\":[");
+    for (int i = 0; i < s->top_count; i++) {
+        writer_printf(w, "%s[%d,\"", i ? "," : "", (int)s->top[i].pid);
+        writer_json_escaped(w, s->top[i].comm, strlen(s->top[i].comm));
+        writer_printf(w, "\",%llu]", s->top[i].ticks);
+    }
+    writer_printf(w, "]}");
+}
 
-        while (*p && *p != ']' && argc < 255) {
-            while (*p && (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n')) p++;
-            if (*p == '"') {
-                p++;
-                const char *end = p;
-                while (*end && *end != '"') {
-                    if (*end == '\\' && *(end + 1)) end++;
-                    end++;
-                }
-                size_t len = end - p;
-                argv[argc] = malloc(len + 1);
-                if (argv[argc]) {
-                    size_t j = 0;
-                    for (size_t i = 0; i < len; i++) {
-                        if (p[i] == '\\' && i + 1 < len) {
-                            i++;
-                            switch (p[i]) {
-                                case 'n': argv[argc][j++] = '\n'; break;
-                                case 't': argv[argc][j++] = '\t'; break;
-                                default: argv[argc][j++] = p[i]; break;
-                            }
-                        } else {
-                            argv[argc][j++] = p[i];
-                        }
-                    }
-                    argv[argc][j] = '\0';
-                    argc++;
+static char *handle_metrics_history(const char *json) {
+    long long from_ms = 0, to_ms = LLONG_MAX, last_seconds = 0;
+    int max_samples = METRICS_DEFAULT_MAX_SAMPLES;
+    json_get_long(json, "from_ms", &from_ms);
+    json_get_long(json, "to_ms", &to_ms);
+    if (json_get_long(json, "last_seconds", &last_seconds) == 0) {
+        if (last_seconds <= 0) return strdup("{\"success\":false,\"error\":\"last_seconds must be positive\"}\n");
+        from_ms = realtime_ms() - last_seconds * 1000;
+    }
+    json_get_int(json, "max_samples", &max_samples);
+    if (max_samples < 1 || max_samples > METRICS_MAX_SAMPLES) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"max_samples must be between 1 and %d\"}\n",
+                 METRICS_MAX_SAMPLES);
+        return response;
+    }
+    if (!metrics.blocks) return strdup("{\"success\":false,\"error\":\"metrics history is disabled\"}\n");
+
+    struct writer w = { 0 };
+    writer_printf(&w, "{\"success\":true,\"data\":{\"interval_ms\":%d,\"clock_ticks_per_sec\":%ld,\"fields\":[",
+                  METRICS_INTERVAL_MS, sysconf(_SC_CLK_TCK));
+    for (int i = 0; i < M_FIELDS; i++) writer_printf(&w, "%s\"%s\"", i ? "," : "", metrics_fields[i].name);
+    writer_printf(&w, "],\"samples\":[");
+
+    /* Counters need the sample before, so every block is decoded from the oldest on */
+    struct metrics_sample s, prev;
+    struct metrics_codec codec;
+    bool have_prev = false;
+    long long oldest_ms = 0, next_from_ms = -1;
+    int written = 0;
+    pthread_mutex_lock(&metrics.lock);
+    for (int k = 0; k < metrics.filled && next_from_ms < 0; k++) {
+        const struct metrics_block *b = &metrics.blocks[(metrics.head - metrics.filled + 1 + k + metrics.count) %
+                                                        metrics.count];
+        size_t pos = 0;
+        metrics_codec_reset(&codec, b->first_ms);
+        for (int i = 0; i < b->count && next_from_ms < 0; i++) {
+            if (!metrics_decode(&codec, b, &pos, &s)) break;
+            if (have_prev && s.t_ms >= from_ms && s.t_ms <= to_ms) {
+                if (written == max_samples) {
+                    next_from_ms = s.t_ms;
+                    break;
                 }
-                p = end;
-                if (*p == '"') p++;
-            } else if (*p && *p != ']') {
-                p++;
+                metrics_write_sample(&w, &s, &prev, written++ == 0);
             }
+            if (!have_prev) oldest_ms = s.t_ms;
+            prev = s;
+            have_prev = true;
         }
     }
-    argv[argc] = NULL;
+    pthread_mutex_unlock(&metrics.lock);
 
-    if (argc == 0) {
-        return strdup("{\"success\":false,\"error\":\"empty command\"}\n");
-    }
+    writer_printf(&w, "],\"oldest_ms\":%lld,\"next_from_ms\":", oldest_ms);
+    if (next_from_ms < 0) writer_printf(&w, "null}}\n");
+    else writer_printf(&w, "%lld}}\n", next_from_ms);
+    return writer_finish(&w);
+}
 
-    int timeout_ms = 30000;
-    json_get_int(json, "timeout", &timeout_ms);
+/*
+ * Capability negotiation
+ *
+ * "hello" tells the host what this init binary supports, so it can pick the
+ * best path per guest instead of assuming every image runs the latest agent.
+ */
+static bool control_port_enabled = true;
 
-    int stdout_pipe[2], stderr_pipe[2];
-    if (pipe(stdout_pipe) < 0 || pipe(stderr_pipe) < 0) {
-        for (int i = 0; i < argc; i++) free(argv[i]);
-        return strdup("{\"success\":false,\"error\":\"pipe failed\"}\n");
+/* CPU flags worth reporting; the host uses them to choose codecs */
+static const char *interesting_cpu_features[] = {
+    "sse4_2", "avx", "avx2", "avx512f", "aes", "pclmulqdq", "sha_ni", "bmi2", /* x86 */
+    "asimd", "crc32", "pmull", "sha2", "sve",                                 /* arm64 */
+    NULL,
+};
+
+static void hello_write_cpu_features(struct writer *w) {
+    FILE *f = fopen("/proc/cpuinfo", "re");
+    char line[4096];
+    char *flags = NULL;
+
+    while (f && fgets(line, sizeof(line), f)) {
+        /* "flags" on x86, "Features" on arm64 */
+        if (strncmp(line, "flags", 5) == 0 || strncmp(line, "Features", 8) == 0) {
+            char *colon = strchr(line, ':');
+            if (colon) flags = colon + 1;
+            break;
+        }
     }
+    if (f) fclose(f);
+
+    bool first = true;
+    for (int i = 0; flags && interesting_cpu_features[i]; i++) {
+        const char *feature = interesting_cpu_features[i];
+        size_t feature_len = strlen(feature);
+        for (const char *p = flags; (p = strstr(p, feature)) != NULL; p += feature_len) {
+            bool starts = p == flags || p[-1] == ' ' || p[-1] == '\t';
+            bool ends = p[feature_len] == ' ' || p[feature_len] == '\n' || p[feature_len] == '\0';
+            if (starts && ends) {
+                writer_printf(w, "%s\"%s\"", first ? "" : ",", feature);
+                first = false;
+                break;
+            }
+        }
+    }
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        for (int i = 0; i < argc; i++) free(argv[i]);
-        close(stdout_pipe[0]); close(stdout_pipe[1]);
-        close(stderr_pipe[0]); close(stderr_pipe[1]);
-        return strdup("{\"success\":false,\"error\":\"fork failed\"}\n");
+static char *handle_hello(void) {
+    struct writer w = { 0 };
+    writer_printf(&w,
+        "{\"success\":true,\"data\":{\"agent\":\"hyperfleet-init\",\"version\":\"%s\","
+        "\"protocol_versions\":[%d],\"operations\":[\"batch\"",
+        AGENT_VERSION, PROTOCOL_VERSION);
+    for (size_t i = 0; i < OP_CLASS_COUNT; i++) {
+        writer_printf(&w, ",\"%s\"", op_classes[i].operation);
     }
+    writer_printf(&w,
+        "],\"framing\":[\"json\",\"raw\"],\"codecs\":[\"base64\",\"lz4\",\"zstd\"],"
+        "\"cache_modes\":[\"normal\",\"dontneed\",\"direct\"],"
+        "\"output_encodings\":[\"text\",\"base64\",\"auto\"],\"sandbox_roots\":[\"overlay\",\"tmpfs\"],"
+        "\"limits\":{\"max_request_size\":%d,\"max_response_size\":%d,\"max_batch_items\":%d,"
+        "\"max_sessions\":%d,\"max_jobs\":%d,\"control_workers\":%d,\"bulk_workers\":%d,"
+        "\"max_connections\":%d},"
+        "\"control_port\":%d,\"host_channel_port\":%d,\"share_port\":%d,\"cgroups\":%s,\"cpus\":%ld,\"cpu_features\":[",
+        MAX_REQUEST_SIZE, MAX_RESPONSE_SIZE, MAX_BATCH_ITEMS, MAX_SESSIONS, MAX_JOBS,
+        lanes[LANE_CONTROL].limit, lanes[LANE_BULK].limit, max_connections,
+        control_port_enabled ? VSOCK_CONTROL_PORT : 0, host_channel_enabled ? HOST_CHANNEL_PORT : 0, SHARE_PORT,
+        cgroups_available ? "true" : "false", sysconf(_SC_NPROCESSORS_ONLN));
+    hello_write_cpu_features(&w);
+    writer_printf(&w, "]}}\n");
+    return writer_finish(&w);
+}
 
-    if (pid == 0) {
-        close(stdout_pipe[0]);
-        close(stderr_pipe[0]);
-        dup2(stdout_pipe[1], STDOUT_FILENO);
-        dup2(stderr_pipe[1], STDERR_FILENO);
-        close(stdout_pipe[1]);
-        close(stderr_pipe[1]);
+/* Run a single operation. Returns a malloc'd JSON response line. */
+static char *dispatch_operation(const struct agent_request *req, const char *operation, const char *request) {
+    char *response = NULL;
 
-        int fd = open("/dev/null", O_RDONLY);
-        if (fd >= 0) { dup2(fd, STDIN_FILENO); close(fd); }
+    if (strcmp(operation, "ping") == 0) {
+        response = strdup("{\"success\":true,\"data\":{\"pong\":true}}\n");
+    } else if (strcmp(operation, "hello") == 0) {
+        response = handle_hello();
+    } else if (strcmp(operation, "file_read") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        char *compression = json_get_string(req->arena, request, "compression");
+        char *framing = json_get_string(req->arena, request, "framing");
+        char *send_mode = json_get_string(req->arena, request, "send_mode");
+        enum cache_mode cache;
+        struct file_range range = { .offset = 0, .length = -1 };
+        json_get_long(request, "offset", &range.offset);
+        json_get_long(request, "length", &range.length);
+        if (!path) {
+            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
+        } else if (cache_mode_parse(json_get_string(req->arena, request, "cache"), &cache) < 0) {
+            response = strdup("{\"success\":false,\"error\":\"unknown cache mode\"}\n");
+        } else if (cache == CACHE_DIRECT) {
+            response = strdup("{\"success\":false,\"error\":\"cache mode direct is only for file_write\"}\n");
+        } else if (framing && strcmp(framing, "raw") == 0) {
+            response = handle_file_read_raw(req, path, range, send_mode, cache);
+        } else if (framing && strcmp(framing, "json") != 0) {
+            response = strdup("{\"success\":false,\"error\":\"unsupported framing\"}\n");
+        } else {
+            response = handle_file_read(req, path, range, compression, cache);
+        }
+    } else if (strcmp(operation, "transfer_bench") == 0) {
+        response = handle_transfer_bench(req, request);
+    } else if (strcmp(operation, "working_set") == 0) {
+        response = handle_working_set(req, request);
+    } else if (strcmp(operation, "file_write") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        size_t content_len = 0;
+        const char *content = json_get_string_raw(req->arena, request, "content", &content_len);
+        char *encoding = json_get_string(req->arena, request, "encoding");
+        enum cache_mode cache;
+        int size = -1;
+        long long offset = -1, crc32 = -1;
+        json_get_int(request, "size", &size);
+        json_get_long(request, "offset", &offset);
+        json_get_long(request, "crc32", &crc32);
+        if (!path || !content) {
+            response = strdup("{\"success\":false,\"error\":\"missing path or content\"}\n");
+        } else if (cache_mode_parse(json_get_string(req->arena, request, "cache"), &cache) < 0) {
+            response = strdup("{\"success\":false,\"error\":\"unknown cache mode\"}\n");
+        } else {
+            response = handle_file_write(req, path, content, content_len, encoding, size, offset, crc32, cache);
+        }
+    } else if (strcmp(operation, "file_alloc") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        long long size = -1;
+        json_get_long(request, "size", &size);
+        if (path) {
+            response = handle_file_alloc(path, size);
+        } else {
+            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
+        }
+    } else if (strcmp(operation, "file_commit") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        char *target = json_get_string(req->arena, request, "target");
+        long long size = -1;
+        json_get_long(request, "size", &size);
+        if (path && target) {
+            response = handle_file_commit(path, target, size);
+        } else {
+            response = strdup("{\"success\":false,\"error\":\"missing path or target\"}\n");
+        }
+    } else if (strcmp(operation, "file_stat") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        if (path) {
+            response = handle_file_stat(path);
+        } else {
+            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
+        }
+    } else if (strcmp(operation, "file_delete") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        if (path) {
+            response = handle_file_delete(path);
+        } else {
+            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
+        }
+    } else if (strcmp(operation, "cache_status") == 0) {
+        char *path = json_get_string(req->arena, request, "path");
+        struct file_range range = { .offset = 0, .length = -1 };
+        json_get_long(request, "offset", &range.offset);
+        json_get_long(request, "length", &range.length);
+        if (path) {
+            response = handle_cache_status(req, path, range);
+        } else {
+            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
+        }
+    } else if (strcmp(operation, "exec") == 0) {
+        response = handle_exec(req, request);
+    } else if (strcmp(operation, "job_signal") == 0) {
+        response = handle_job_signal(req, request);
+    } else if (strcmp(operation, "job_freeze") == 0) {
+        response = handle_job_freeze(req, request);
+    } else if (strcmp(operation, "job_thaw") == 0) {
+        response = handle_job_thaw(req, request);
+    } else if (strcmp(operation, "job_list") == 0) {
+        response = handle_job_list();
+    } else if (strcmp(operation, "memory_status") == 0) {
+        response = handle_memory_status();
+    } else if (strcmp(operation, "session_open") == 0) {
+        response = handle_session_open(req, request);
+    } else if (strcmp(operation, "session_exec") == 0) {
+        response = handle_session_exec(req, request);
+    } else if (strcmp(operation, "session_close") == 0) {
+        response = handle_session_close(req, request);
+    } else if (strcmp(operation, "share_mount") == 0) {
+        response = handle_share_mount(req, request);
+    } else if (strcmp(operation, "share_unmount") == 0) {
+        response = handle_share_unmount(req, request);
+    } else if (strcmp(operation, "workspace_create") == 0) {
+        response = handle_workspace_create(req, request);
+    } else if (strcmp(operation, "workspace_reset") == 0) {
+        response = handle_workspace_reset(req, request);
+    } else if (strcmp(operation, "workspace_commit") == 0) {
+        response = handle_workspace_commit(req, request);
+    } else if (strcmp(operation, "workspace_delete") == 0) {
+        response = handle_workspace_delete(req, request);
+    } else if (strcmp(operation, "workspace_list") == 0) {
+        response = handle_workspace_list();
+    } else if (strcmp(operation, "probe_list") == 0) {
+        response = handle_probe_list();
+    } else if (strcmp(operation, "port_list") == 0) {
+        response = handle_port_list();
+    } else if (strcmp(operation, "metrics_history") == 0) {
+        response = handle_metrics_history(request);
+    } else if (strcmp(operation, "log_read") == 0) {
+        response = handle_log_read(req, request);
+    } else if (strcmp(operation, "latency_trace") == 0) {
+        response = handle_latency_trace(req, request);
+    } else {
+        response = strdup("{\"success\":false,\"error\":\"unknown operation\"}\n");
+    }
 
-        char *envp[] = {
-            "PATH=/usr/local/bin:/usr/bin:/bin:/usr/local/sbin:/usr/sbin:/sbin",
-            "HOME=/root",
-            "TERM=linux",
-            NULL
-        };
+    return response;
+}
 
-        execve(argv[0], argv, envp);
+/* Admit and run a single operation, for both top-level requests and batch items */
+static char *run_operation(const struct agent_request *req, const char *request, bool control_only) {
+    char *response = NULL;
+    char *operation = json_get_string(req->arena, request, "operation");
+    struct op_class *op = operation ? op_class_find(operation) : NULL;
 
-        /* If execve failed, try with /bin/sh -c */
-        char cmd_line[4096] = "";
-        for (int i = 0; argv[i]; i++) {
-            if (i > 0) strcat(cmd_line, " ");
-            strcat(cmd_line, argv[i]);
+    if (!operation) {
+        response = strdup("{\"success\":false,\"error\":\"missing operation\"}\n");
+    } else if (!op) {
+        response = strdup("{\"success\":false,\"error\":\"unknown operation\"}\n");
+    } else if (control_only && op->lane != LANE_CONTROL) {
+        response = strdup("{\"success\":false,\"error\":\"operation not allowed on control port\"}\n");
+    } else {
+        response = op_enter(req, op);
+        if (!response) {
+            response = dispatch_operation(req, operation, request);
+            op_leave(op);
         }
-        char *sh_argv[] = { "/bin/sh", "-c", cmd_line, NULL };
-        execve("/bin/sh", sh_argv, envp);
-
-        _exit(127);
     }
 
-    for (int i = 0; i < argc; i++) free(argv[i]);
+    return response;
+}
 
-    close(stdout_pipe[1]);
-    close(stderr_pipe[1]);
+/*
+ * Batch requests
+ *
+ * {"operation":"batch","items":[{...},{...}],"stop_on_error":true} runs each
+ * item as if it had arrived on its own connection (same lanes, limits and
+ * deadline) and returns the per-item responses in order. The batch itself
+ * holds no worker slot. With "parallel":true items run concurrently, but
+ * on no more threads than the bulk lane has slots and queue for, so a large
+ * batch doesn't overflow the queue and get its own items refused.
+ * stop_on_error only applies to sequential batches.
+ */
+struct batch_item {
+    struct agent_request req; /* the batch's, but with an arena of its own */
+    struct arena arena;
+    bool control_only;
+    const char *request;      /* points into the batch request */
+    char *response;
+};
 
-    /* Set non-blocking */
-    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
-    fcntl(stderr_pipe[0], F_SETFL, O_NONBLOCK);
+static void *batch_item_run(void *arg) {
+    struct batch_item *item = arg;
+    char *operation = json_get_string(item->req.arena, item->request, "operation");
+    char *framing = json_get_string(item->req.arena, item->request, "framing");
+
+    if (operation && strcmp(operation, "batch") == 0) {
+        item->response = strdup("{\"success\":false,\"error\":\"batch items cannot be batches\"}\n");
+    } else if ((framing && strcmp(framing, "json") != 0) ||
+               (operation && strcmp(operation, "transfer_bench") == 0)) {
+        /* Streamed replies would interleave with the batch response */
+        item->response = strdup("{\"success\":false,\"error\":\"streaming operations cannot be batched\"}\n");
+    } else {
+        item->response = run_operation(&item->req, item->request, item->control_only);
+    }
+    return NULL;
+}
 
-    char *stdout_buf = malloc(MAX_RESPONSE_SIZE);
-    char *stderr_buf = malloc(MAX_RESPONSE_SIZE);
-    size_t stdout_len = 0, stderr_len = 0;
+struct batch_pool {
+    struct batch_item *items;
+    int count;
+    int next; /* next item to start, claimed atomically */
+};
 
-    if (!stdout_buf || !stderr_buf) {
-        free(stdout_buf);
-        free(stderr_buf);
-        close(stdout_pipe[0]);
-        close(stderr_pipe[0]);
-        kill(pid, SIGKILL);
-        waitpid(pid, NULL, 0);
-        return strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+static void *batch_pool_run(void *arg) {
+    struct batch_pool *pool = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        batch_item_run(&pool->items[i]);
     }
+    return NULL;
+}
 
-    time_t start = time(NULL);
-    int status = 0;
-    bool done = false;
+static bool response_succeeded(const char *response) {
+    return response && strncmp(response, "{\"success\":true", 15) == 0;
+}
 
-    while (!done) {
-        ssize_t n;
+static char *handle_batch(const struct agent_request *req, const char *json, bool control_only) {
+    const char *p = json_find_key(json, "items");
+    if (!p || *p != '[') {
+        return strdup("{\"success\":false,\"error\":\"missing items\"}\n");
+    }
 
-        n = read(stdout_pipe[0], stdout_buf + stdout_len, MAX_RESPONSE_SIZE - stdout_len - 1);
-        if (n > 0) stdout_len += n;
+    bool stop_on_error = false, parallel = false;
+    json_get_bool(json, "stop_on_error", &stop_on_error);
+    json_get_bool(json, "parallel", &parallel);
 
-        n = read(stderr_pipe[0], stderr_buf + stderr_len, MAX_RESPONSE_SIZE - stderr_len - 1);
-        if (n > 0) stderr_len += n;
+    struct batch_item items[MAX_BATCH_ITEMS];
+    int count = 0;
+    const char *error = NULL;
 
-        int wpid = waitpid(pid, &status, WNOHANG);
-        if (wpid > 0) {
-            /* Read any remaining data */
-            while ((n = read(stdout_pipe[0], stdout_buf + stdout_len, MAX_RESPONSE_SIZE - stdout_len - 1)) > 0)
-                stdout_len += n;
-            while ((n = read(stderr_pipe[0], stderr_buf + stderr_len, MAX_RESPONSE_SIZE - stderr_len - 1)) > 0)
-                stderr_len += n;
-            done = true;
-        } else if (time(NULL) - start > timeout_ms / 1000) {
-            kill(pid, SIGKILL);
-            waitpid(pid, &status, 0);
-            done = true;
-        } else {
-            usleep(10000);
+    /* Items are parsed in place; lookups stop at the end of their own object */
+    p = json_skip_ws(p + 1);
+    while (*p && *p != ']') {
+        if (*p != '{') {
+            error = "batch items must be objects";
+            break;
         }
+        if (count == MAX_BATCH_ITEMS) {
+            error = "too many batch items";
+            break;
+        }
+
+        struct batch_item *item = &items[count++];
+        item->arena = (struct arena){ 0 };
+        item->req = *req;
+        item->req.arena = &item->arena;
+        item->control_only = control_only;
+        item->request = p;
+        item->response = NULL;
+
+        p = json_skip_ws(json_skip_value(p));
+        if (*p == ',') p = json_skip_ws(p + 1);
     }
 
-    close(stdout_pipe[0]);
-    close(stderr_pipe[0]);
+    if (error) {
+        char *response = NULL;
+        asprintf(&response, "{\"success\":false,\"error\":\"%s\"}\n", error);
+        return response;
+    }
 
-    stdout_buf[stdout_len] = '\0';
-    stderr_buf[stderr_len] = '\0';
+    if (parallel) {
+        struct batch_pool pool = { .items = items, .count = count, .next = 0 };
+        int workers = lanes[LANE_BULK].limit + lanes[LANE_BULK].queue_max;
+        if (workers > count) workers = count;
+        if (workers < 1) workers = 1;
+        pthread_t threads[MAX_BATCH_ITEMS];
+        int started = 0;
+        while (started < workers && pthread_create(&threads[started], NULL, batch_pool_run, &pool) == 0) {
+            started++;
+        }
+        /* Without all its threads the pool finishes here */
+        if (started < workers) batch_pool_run(&pool);
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    } else {
+        bool stopped = false;
+        for (int i = 0; i < count; i++) {
+            const char *why = request_cancelled(req);
+            if (why) {
+                items[i].response = cancelled_response(why);
+            } else if (stopped) {
+                items[i].response = strdup("{\"success\":false,\"error\":\"skipped\",\"skipped\":true}\n");
+            } else {
+                batch_item_run(&items[i]);
+                if (stop_on_error && !response_succeeded(items[i].response)) stopped = true;
+            }
+        }
+    }
 
-    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    /* Item responses are complete JSON objects; splice them into one array */
+    struct writer w = { 0 };
+    int failed = 0;
+    writer_printf(&w, "{\"success\":true,\"data\":{\"results\":[");
+    for (int i = 0; i < count; i++) {
+        const char *r = items[i].response ? items[i].response : "{\"success\":false,\"error\":\"out of memory\"}";
+        size_t rlen = strlen(r);
+        while (rlen > 0 && r[rlen - 1] == '\n') rlen--;
+        if (i > 0) writer_append(&w, ",", 1);
+        writer_append(&w, r, rlen);
+        if (!response_succeeded(r)) failed++;
+
+        free(items[i].response);
+        arena_release(&items[i].arena);
+    }
+    writer_printf(&w, "],\"failed\":%d}}\n", failed);
+    return writer_finish(&w);
+}
 
-    char *stdout_escaped = json_escape(stdout_buf);
-    char *stderr_escaped = json_escape(stderr_buf);
-    free(stdout_buf);
-    free(stderr_buf);
+/* Handle vsock connection */
+struct connection {
+    int fd;
+    bool control_only;
+};
 
-    char *response = NULL;
-    asprintf(&response,
-        "{\"success\":true,\"data\":{\"exit_code\":%d,\"stdout\":\"%s\",\"stderr\":\"%s\"}}\n",
-        exit_code,
-        stdout_escaped ? stdout_escaped : "",
-        stderr_escaped ? stderr_escaped : "");
+#define REQUEST_INITIAL_SIZE (64 * 1024)
+
+/*
+ * Read one newline-terminated request. The buffer starts small and doubles
+ * up to MAX_REQUEST_SIZE, so pings and stats don't pay for the largest
+ * upload. Returns a NUL-terminated buffer the caller frees, or NULL.
+ *
+ * A request that doesn't fit in the first REQUEST_INITIAL_SIZE bytes is
+ * checked for admission from that head before more is read, so an upload
+ * arriving under pressure is refused before its payload is buffered. The
+ * refusal is returned in *refused and the rest of the request is left
+ * unread.
+ */
+static char *read_request(int fd, char **refused) {
+    size_t cap = REQUEST_INITIAL_SIZE;
+    size_t total = 0;
+    char *request = malloc(cap);
+    *refused = NULL;
+    if (!request) return NULL;
+
+    for (;;) {
+        if (total == cap - 1) {
+            if (cap == REQUEST_INITIAL_SIZE) {
+                /* The operation name comes first; batches aren't in the table and admit each item */
+                request[total] = '\0';
+                struct arena arena = { 0 };
+                char *operation = json_get_string(&arena, request, "operation");
+                struct op_class *op = operation ? op_class_find(operation) : NULL;
+                *refused = op ? op_refusal(op) : NULL;
+                arena_release(&arena);
+                if (*refused) {
+                    free(request);
+                    return NULL;
+                }
+            }
+            if (cap >= MAX_REQUEST_SIZE) break;
+            size_t new_cap = cap * 2 > MAX_REQUEST_SIZE ? MAX_REQUEST_SIZE : cap * 2;
+            char *grown = realloc(request, new_cap);
+            if (!grown) break;
+            request = grown;
+            cap = new_cap;
+        }
 
-    free(stdout_escaped);
-    free(stderr_escaped);
+        ssize_t n = read(fd, request + total, cap - total - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
 
-    return response ? response : strdup("{\"success\":false,\"error\":\"out of memory\"}\n");
+        /* Only the new bytes can hold the end of the request */
+        bool complete = memchr(request + total, '\n', n) != NULL;
+        total += n;
+        if (complete) break;
+    }
+
+    request[total] = '\0';
+    return request;
+}
+
+/* Skip the unread rest of a refused request, so the peer isn't reset mid-write */
+static void discard_request(int fd) {
+    char sink[16 * 1024];
+    size_t skipped = 0;
+    while (skipped < MAX_REQUEST_SIZE) {
+        ssize_t n = read(fd, sink, sizeof(sink));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || memchr(sink, '\n', n)) break;
+        skipped += n;
+    }
 }
 
-/* Handle vsock connection */
 static void *handle_connection(void *arg) {
-    int client_fd = (int)(intptr_t)arg;
+    struct connection *conn = arg;
+    int client_fd = conn->fd;
 
-    char *request = malloc(MAX_REQUEST_SIZE);
+    char *refused;
+    char *request = read_request(client_fd, &refused);
     if (!request) {
+        if (refused) {
+            write_all(client_fd, refused, strlen(refused));
+            free(refused);
+            discard_request(client_fd);
+        }
         close(client_fd);
+        free(conn);
+        __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
         return NULL;
     }
 
-    size_t total = 0;
-    ssize_t n;
-
-    while (total < MAX_REQUEST_SIZE - 1) {
-        n = read(client_fd, request + total, MAX_REQUEST_SIZE - total - 1);
-        if (n <= 0) break;
-        total += n;
-
-        /* Check for newline (end of request) */
-        if (memchr(request, '\n', total)) break;
+    struct arena arena = { 0 };
+    struct agent_request req = { .client_fd = client_fd, .deadline_ms = 0, .arena = &arena };
+    int budget_ms;
+    if (json_get_int(request, "budget_ms", &budget_ms) == 0 && budget_ms > 0) {
+        req.deadline_ms = monotonic_ms() + budget_ms;
     }
 
-    request[total] = '\0';
-
     char *response = NULL;
-    char *operation = json_get_string(request, "operation");
+    char *operation = json_get_string(&arena, request, "operation");
 
-    if (!operation) {
-        response = strdup("{\"success\":false,\"error\":\"missing operation\"}\n");
-    } else if (strcmp(operation, "ping") == 0) {
-        response = strdup("{\"success\":true,\"data\":{\"pong\":true}}\n");
-    } else if (strcmp(operation, "file_read") == 0) {
-        char *path = json_get_string(request, "path");
-        if (path) {
-            response = handle_file_read(path);
-            free(path);
-        } else {
-            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
-        }
-    } else if (strcmp(operation, "file_write") == 0) {
-        char *path = json_get_string(request, "path");
-        char *content = json_get_string(request, "content");
-        if (path && content) {
-            response = handle_file_write(path, content);
-        } else {
-            response = strdup("{\"success\":false,\"error\":\"missing path or content\"}\n");
-        }
-        free(path);
-        free(content);
-    } else if (strcmp(operation, "file_stat") == 0) {
-        char *path = json_get_string(request, "path");
-        if (path) {
-            response = handle_file_stat(path);
-            free(path);
-        } else {
-            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
-        }
-    } else if (strcmp(operation, "file_delete") == 0) {
-        char *path = json_get_string(request, "path");
-        if (path) {
-            response = handle_file_delete(path);
-            free(path);
-        } else {
-            response = strdup("{\"success\":false,\"error\":\"missing path\"}\n");
-        }
-    } else if (strcmp(operation, "exec") == 0) {
-        response = handle_exec(request);
+    if (json_get_int(request, "budget_ms", &budget_ms) == 0 && budget_ms <= 0) {
+        /* The host has already given up; don't start work nobody will read */
+        response = cancelled_response("deadline exceeded");
+    } else if (operation && strcmp(operation, "batch") == 0) {
+        response = handle_batch(&req, request, conn->control_only);
     } else {
-        response = strdup("{\"success\":false,\"error\":\"unknown operation\"}\n");
+        response = run_operation(&req, request, conn->control_only);
     }
 
-    free(operation);
     free(request);
+    arena_release(&arena);
 
+    /* A large reply rarely fits in one write */
     if (response) {
-        write(client_fd, response, strlen(response));
+        if (write_all(client_fd, response, strlen(response)) < 0) {
+            log_debug("failed to send response: %s", strerror(errno));
+        }
         free(response);
     }
 
     close(client_fd);
+    free(conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
     return NULL;
 }
 
 /* Vsock server */
-static int vsock_fd = -1;
+struct vsock_listener {
+    unsigned int port;
+    bool control_only;
+    int fd;
+};
+
+/* The control port, if enabled, only serves control-lane operations */
+static struct vsock_listener listeners[] = {
+    { .port = VSOCK_PORT, .control_only = false, .fd = -1 },
+    { .port = VSOCK_CONTROL_PORT, .control_only = true, .fd = -1 },
+};
 
 static void *vsock_server(void *arg) {
-    (void)arg;
+    struct vsock_listener *l = arg;
 
-    vsock_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-    if (vsock_fd < 0) {
+    /* Connection threads inherit this and drop it if they land in the bulk lane */
+    set_thread_nice(CONTROL_NICE);
+
+    l->fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (l->fd < 0) {
         log_error("vsock socket: %s", strerror(errno));
         return NULL;
     }
@@ -837,40 +9220,63 @@ static void *vsock_server(void *arg) {
     struct sockaddr_vm addr = {
         .svm_family = AF_VSOCK,
         .svm_cid = VMADDR_CID_ANY,
-        .svm_port = VSOCK_PORT,
+        .svm_port = l->port,
     };
 
-    if (bind(vsock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        log_error("vsock bind: %s", strerror(errno));
-        close(vsock_fd);
-        vsock_fd = -1;
+    if (bind(l->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("vsock bind port %u: %s", l->port, strerror(errno));
+        close(l->fd);
+        l->fd = -1;
         return NULL;
     }
 
-    if (listen(vsock_fd, 16) < 0) {
-        log_error("vsock listen: %s", strerror(errno));
-        close(vsock_fd);
-        vsock_fd = -1;
+    if (listen(l->fd, 16) < 0) {
+        log_error("vsock listen port %u: %s", l->port, strerror(errno));
+        close(l->fd);
+        l->fd = -1;
         return NULL;
     }
 
-    log_info("vsock server listening on port %d", VSOCK_PORT);
+    log_info("vsock server listening on port %u%s", l->port, l->control_only ? " (control)" : "");
 
     while (!shutdown_requested && !reboot_requested) {
         struct sockaddr_vm client_addr;
         socklen_t client_len = sizeof(client_addr);
 
-        int client_fd = accept(vsock_fd, (struct sockaddr *)&client_addr, &client_len);
+        int client_fd = accept4(l->fd, (struct sockaddr *)&client_addr, &client_len, SOCK_CLOEXEC);
         if (client_fd < 0) {
             if (errno == EINTR) continue;
             log_error("vsock accept: %s", strerror(errno));
             continue;
         }
 
+        /* Bound the number of connection threads; shed load without reading the request */
+        if (__atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED) > max_connections) {
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            char *busy = busy_response("too many connections", QUEUE_RETRY_AFTER_MS);
+            if (busy) {
+                write_all(client_fd, busy, strlen(busy));
+                free(busy);
+            }
+            close(client_fd);
+            continue;
+        }
+
+        struct connection *conn = malloc(sizeof(*conn));
+        if (!conn) {
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->control_only = l->control_only;
+
         pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_connection, (void *)(intptr_t)client_fd) != 0) {
+        if (pthread_create(&thread, NULL, handle_connection, conn) != 0) {
             log_error("pthread_create: %s", strerror(errno));
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
             close(client_fd);
+            free(conn);
         } else {
             pthread_detach(thread);
         }
@@ -879,15 +9285,67 @@ static void *vsock_server(void *arg) {
     return NULL;
 }
 
+/* Collect pid if it is an exited child nobody else owns. Returns false if there was nothing to collect. */
+static bool reap_untracked(pid_t pid) {
+    int status;
+    pthread_mutex_lock(&children_lock);
+    pid_t reaped = child_is_tracked(pid) ? 0 : waitpid(pid, &status, WNOHANG);
+    pthread_mutex_unlock(&children_lock);
+    if (reaped <= 0) return false;
+
+    if (WIFEXITED(status)) {
+        log_debug("process %d exited with status %d", reaped, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        log_debug("process %d killed by signal %d", reaped, WTERMSIG(status));
+    }
+    return true;
+}
+
+/*
+ * waitid() always reports the same exited child first, so once that is one
+ * the agent owns (a session shell that died while idle, say), the others
+ * can only be found by name: our zombie children in /proc.
+ */
+static void reap_zombies_by_scan(void) {
+    DIR *proc = opendir("/proc");
+    if (!proc) return;
+
+    pid_t self = getpid();
+    struct dirent *de;
+    while ((de = readdir(proc)) != NULL) {
+        pid_t pid = atoi(de->d_name);
+        if (pid <= 0) continue;
+
+        char path[64], stat[512];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ssize_t n = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        stat[n] = '\0';
+
+        /* "pid (comm) state ppid ...", where comm may itself hold ")" */
+        char state;
+        int ppid;
+        char *paren = strrchr(stat, ')');
+        if (!paren || sscanf(paren + 1, " %c %d", &state, &ppid) != 2) continue;
+        if (state == 'Z' && ppid == self) reap_untracked(pid);
+    }
+    closedir(proc);
+}
+
 /* Reap zombie processes */
 static void reap_zombies(void) {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        if (WIFEXITED(status)) {
-            log_debug("process %d exited with status %d", pid, WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            log_debug("process %d killed by signal %d", pid, WTERMSIG(status));
+    for (;;) {
+        /* Peek first so children owned by the agent are left to their supervisor */
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) return;
+
+        if (!reap_untracked(info.si_pid)) {
+            reap_zombies_by_scan();
+            return;
         }
     }
 }
@@ -896,9 +9354,11 @@ static void reap_zombies(void) {
 static void do_shutdown(bool do_reboot) {
     log_info("%s initiated", do_reboot ? "reboot" : "shutdown");
 
-    if (vsock_fd >= 0) {
-        close(vsock_fd);
-        vsock_fd = -1;
+    for (size_t i = 0; i < sizeof(listeners) / sizeof(listeners[0]); i++) {
+        if (listeners[i].fd >= 0) {
+            close(listeners[i].fd);
+            listeners[i].fd = -1;
+        }
     }
 
     log_info("sending SIGTERM to all processes");
@@ -955,15 +9415,58 @@ int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
             log_level = LOG_DEBUG;
+        } else if (strcmp(argv[i], "--no-control-port") == 0) {
+            control_port_enabled = false;
+        } else if (strcmp(argv[i], "--no-host-channel") == 0) {
+            host_channel_enabled = false;
+        } else if (strncmp(argv[i], "--metrics-history-kib=", 22) == 0) {
+            metrics_history_kib = atoi(argv[i] + 22);
+        } else if (strncmp(argv[i], "--control-workers=", 18) == 0) {
+            lanes[LANE_CONTROL].limit = atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--bulk-workers=", 15) == 0) {
+            lanes[LANE_BULK].limit = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--bulk-rate-mb=", 15) == 0) {
+            bulk_bucket.rate = atoll(argv[i] + 15) * 1024 * 1024;
+        } else if (strncmp(argv[i], "--control-queue=", 16) == 0) {
+            lanes[LANE_CONTROL].queue_max = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--bulk-queue=", 13) == 0) {
+            lanes[LANE_BULK].queue_max = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--max-connections=", 18) == 0) {
+            max_connections = atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--limit=", 8) == 0) {
+            if (op_limit_parse(argv[i] + 8) < 0) log_warn("ignoring %s", argv[i]);
+        } else if (strncmp(argv[i], "--psi-cpu=", 10) == 0) {
+            psi_thresholds[PSI_CPU] = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--psi-memory=", 13) == 0) {
+            psi_thresholds[PSI_MEMORY] = atof(argv[i] + 13);
+        } else if (strncmp(argv[i], "--psi-io=", 9) == 0) {
+            psi_thresholds[PSI_IO] = atof(argv[i] + 9);
         }
     }
 
+    for (int i = 0; i < LANE_COUNT; i++) {
+        if (lanes[i].limit < 1) lanes[i].limit = 1;
+        if (lanes[i].queue_max < 0) lanes[i].queue_max = 0;
+    }
+    if (max_connections < 1) max_connections = 1;
+
     print_banner();
     setup_signals();
+    lanes_init();
+    sessions_init();
+
+    if (nbd_root_requested() && nbd_root_mount() != 0) {
+        log_error("failed to mount the network root, staying in the initramfs");
+    }
 
     if (setup_filesystems() != 0) {
         log_error("failed to setup filesystems");
     }
+    setup_console_logging();
+
+    if (setup_cgroups() != 0) {
+        log_warn("cgroup v2 unavailable, job freeze falls back to SIGSTOP");
+    }
 
     setup_hostname();
 
@@ -971,12 +9474,24 @@ int main(int argc, char *argv[]) {
         log_error("failed to setup networking");
     }
 
-    /* Start vsock server in a thread */
-    pthread_t vsock_thread;
-    if (pthread_create(&vsock_thread, NULL, vsock_server, NULL) != 0) {
-        log_error("failed to start vsock server: %s", strerror(errno));
+    /* Start vsock servers, each in a thread */
+    size_t nlisteners = control_port_enabled ? 2 : 1;
+    for (size_t i = 0; i < nlisteners; i++) {
+        pthread_t vsock_thread;
+        if (pthread_create(&vsock_thread, NULL, vsock_server, &listeners[i]) != 0) {
+            log_error("failed to start vsock server on port %u: %s", listeners[i].port, strerror(errno));
+        }
+    }
+
+    if (host_channel_enabled) {
+        pthread_t channel_thread;
+        if (pthread_create(&channel_thread, NULL, host_channel_thread, NULL) != 0) {
+            log_error("failed to start host channel: %s", strerror(errno));
+        }
     }
 
+    metrics_start();
+
     log_info("init ready");
 
     main_loop();
@@ -8,7 +8,9 @@ import {
   RuntimeError,
   PathTraversalError,
   CircuitOpenError,
+  AgentBusyError,
   getHttpStatus,
+  getRetryAfterMs,
 } from "../index";
 
 describe("Error Types", () => {
@@ -121,6 +123,19 @@ describe("Error Types", () => {
       expect(error._tag).toBe("CircuitOpenError");
     });
   });
+
+  describe("AgentBusyError", () => {
+    it("creates error with retry info", () => {
+      const error = new AgentBusyError({
+        message: "busy: memory pressure 42.0%",
+        retryAfterMs: 2000,
+      });
+
+      expect(error.message).toBe("busy: memory pressure 42.0%");
+      expect(error.retryAfterMs).toBe(2000);
+      expect(error._tag).toBe("AgentBusyError");
+    });
+  });
 });
 
 describe("getHttpStatus", () => {
@@ -154,6 +169,11 @@ describe("getHttpStatus", () => {
     expect(getHttpStatus(error)).toBe(503);
   });
 
+  it("returns 503 for AgentBusyError", () => {
+    const error = new AgentBusyError({ message: "test", retryAfterMs: 250 });
+    expect(getHttpStatus(error)).toBe(503);
+  });
+
   it("returns 502 for FirecrackerApiError with 5xx status", () => {
     const error = new FirecrackerApiError({
       message: "test",
@@ -177,3 +197,14 @@ describe("getHttpStatus", () => {
     expect(getHttpStatus(error)).toBe(500);
   });
 });
+
+describe("getRetryAfterMs", () => {
+  it("returns the delay for retryable errors", () => {
+    expect(getRetryAfterMs(new AgentBusyError({ message: "test", retryAfterMs: 250 }))).toBe(250);
+    expect(getRetryAfterMs(new CircuitOpenError({ message: "test", retryAfterMs: 1000 }))).toBe(1000);
+  });
+
+  it("returns undefined for other errors", () => {
+    expect(getRetryAfterMs(new VsockError({ message: "test" }))).toBeUndefined();
+  });
+});
@@ -61,6 +61,14 @@ export const CircuitOpenError = TaggedError("CircuitOpenError")<{
 
 export type CircuitOpenError = InstanceType<typeof CircuitOpenError>;
 
+// Guest agent shed load (PSI pressure, full queue) and asked to retry later
+export const AgentBusyError = TaggedError("AgentBusyError")<{
+  message: string;
+  retryAfterMs: number;
+}>();
+
+export type AgentBusyError = InstanceType<typeof AgentBusyError>;
+
 // Union type for all Hyperfleet errors
 export type HyperfleetError =
   | FirecrackerApiError
@@ -70,7 +78,8 @@ export type HyperfleetError =
   | VsockError
   | RuntimeError
   | PathTraversalError
-  | CircuitOpenError;
+  | CircuitOpenError
+  | AgentBusyError;
 
 /**
  * Get HTTP status code for an error
@@ -88,6 +97,7 @@ export function getHttpStatus(error: HyperfleetError): number {
     case "VsockError":
       return 502;
     case "CircuitOpenError":
+    case "AgentBusyError":
       return 503;
     case "FirecrackerApiError":
       return error.statusCode >= 500 ? 502 : 400;
@@ -96,3 +106,16 @@ export function getHttpStatus(error: HyperfleetError): number {
       return 500;
   }
 }
+
+/**
+ * Get the suggested retry delay for errors that carry one
+ */
+export function getRetryAfterMs(error: HyperfleetError): number | undefined {
+  switch (error._tag) {
+    case "CircuitOpenError":
+    case "AgentBusyError":
+      return error.retryAfterMs;
+    default:
+      return undefined;
+  }
+}
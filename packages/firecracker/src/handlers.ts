@@ -197,7 +197,7 @@ export const AttachDrivesHandler: Handler = async (machine) => {
 
 /**
  * Handler to resolve OCI images to ext4 rootfs
- * Should run before AttachDrivesHandler
+ * Should run before CreateBootSourceHandler and AttachDrivesHandler
  */
 export const ResolveImageHandler: Handler = async (machine) => {
   const { imageRef, imageSizeMib, registryAuth } = machine.config;
@@ -218,6 +218,16 @@ export const ResolveImageHandler: Handler = async (machine) => {
 
   const converted = result.unwrap();
 
+  // The root is served over vsock; the VM only needs init to fetch it
+  if (machine.config.lazyRootfs) {
+    const initramfs = await imageService.resolveInitramfs();
+    if (initramfs.isErr()) {
+      return Result.err(new Error(`Failed to build initramfs: ${initramfs.error.message}`));
+    }
+    machine.config.initrdPath = initramfs.unwrap();
+    return Result.ok(undefined);
+  }
+
   // Update the root drive with the converted image path
   if (!machine.config.drives || machine.config.drives.length === 0) {
     machine.config.drives = [
@@ -294,8 +304,9 @@ export function createDefaultHandlers(): Handlers {
     .append("CreateLogFiles", CreateLogFilesHandler)
     .append("BootstrapLogging", BootstrapLoggingHandler)
     .append("CreateMachine", CreateMachineHandler)
-    .append("CreateBootSource", CreateBootSourceHandler)
+    // Resolved first: a lazy root changes the boot source as well as the drives
     .append("ResolveImage", ResolveImageHandler)
+    .append("CreateBootSource", CreateBootSourceHandler)
     .append("AttachDrives", AttachDrivesHandler)
     .append("CreateNetworkInterfaces", CreateNetworkInterfacesHandler)
     .append("AddVsock", AddVsockHandler)
@@ -59,6 +59,11 @@ export interface MachineConfig {
   imageSizeMib?: number;
   /** Registry authentication for private images */
   registryAuth?: RegistryAuth;
+  /**
+   * Boot from an initramfs and let init fetch the image's blocks over vsock
+   * instead of attaching it as a drive. The host must be serving it.
+   */
+  lazyRootfs?: boolean;
 
   // Network
   networkInterfaces?: NetworkInterface[];
@@ -417,6 +422,13 @@ export class Machine implements Runtime {
     return await this.client.patchBalloon({ amount_mib: amountMib });
   }
 
+  /**
+   * Get the balloon configuration, including its current size
+   */
+  async getBalloonConfig(): Promise<Result<Balloon, Error>> {
+    return await this.client.describeBalloonConfig();
+  }
+
   /**
    * Get balloon statistics
    */
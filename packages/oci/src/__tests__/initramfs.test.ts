@@ -0,0 +1,48 @@
+import { describe, it, expect } from "bun:test";
+import { encodeCpio } from "../initramfs";
+
+/**
+ * Walk a newc archive the way the kernel's initramfs unpacker does
+ */
+function parseCpio(archive: Buffer) {
+  const entries: { name: string; mode: number; rdevMinor: number; data: Buffer }[] = [];
+  let offset = 0;
+  const align = (value: number) => (value + 3) & ~3;
+
+  for (;;) {
+    expect(archive.toString("latin1", offset, offset + 6)).toBe("070701");
+    const field = (index: number) => parseInt(archive.toString("latin1", offset + 6 + index * 8, offset + 14 + index * 8), 16);
+    const nameSize = field(11);
+    const fileSize = field(6);
+    const name = archive.toString("latin1", offset + 110, offset + 110 + nameSize - 1);
+    const dataStart = align(offset + 110 + nameSize);
+    if (name === "TRAILER!!!") break;
+
+    entries.push({
+      name,
+      mode: field(1),
+      rdevMinor: field(10),
+      data: archive.subarray(dataStart, dataStart + fileSize),
+    });
+    offset = align(dataStart + fileSize);
+  }
+  return { entries, end: offset };
+}
+
+describe("encodeCpio", () => {
+  it("writes aligned newc entries followed by a trailer", () => {
+    const init = Buffer.from("\x7fELF not really");
+    const archive = encodeCpio([
+      { name: "dev", mode: 0o040755 },
+      { name: "dev/console", mode: 0o020600, rdev: [5, 1] },
+      { name: "init", mode: 0o100755, data: init },
+    ]);
+
+    expect(archive.length % 4).toBe(0);
+    const { entries } = parseCpio(archive);
+    expect(entries.map((e) => e.name)).toEqual(["dev", "dev/console", "init"]);
+    expect(entries[1].rdevMinor).toBe(1);
+    expect(entries[2].mode).toBe(0o100755);
+    expect(entries[2].data.equals(init)).toBe(true);
+  });
+});
@@ -17,7 +17,7 @@ const DEFAULT_ROOTFS_SIZE_MIB = 1024;
 /**
  * Get the path to the init binary based on architecture
  */
-function getInitBinaryPath(): string | null {
+export function getInitBinaryPath(): string | null {
   // Get the directory of this module
   const __filename = fileURLToPath(import.meta.url);
   const __dirname = dirname(__filename);
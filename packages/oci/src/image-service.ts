@@ -1,10 +1,13 @@
 import { Result } from "better-result";
 import { stat } from "node:fs/promises";
+import { join } from "node:path";
 import type { Logger } from "@hyperfleet/logger";
 import { parseImageRef, toCacheKey } from "./image-ref.js";
 import { ImageCache } from "./cache.js";
-import { ImageConverter } from "./converter.js";
+import { ImageConverter, getInitBinaryPath } from "./converter.js";
+import { buildInitramfs } from "./initramfs.js";
 import {
+  ImageConvertError,
   type ImageServiceConfig,
   type ConvertedImage,
   type ConvertOptions,
@@ -20,6 +23,7 @@ const DEFAULT_ROOTFS_SIZE_MIB = 1024;
  */
 export class ImageService {
   private cache: ImageCache;
+  private cacheDir: string;
   private converter: ImageConverter;
   private defaultRootfsSizeMib: number;
   private logger?: Logger;
@@ -28,6 +32,7 @@ export class ImageService {
   constructor(config: ImageServiceConfig, logger?: Logger) {
     this.logger = logger;
     this.defaultRootfsSizeMib = config.defaultRootfsSizeMib ?? DEFAULT_ROOTFS_SIZE_MIB;
+    this.cacheDir = config.cacheDir;
     this.cache = new ImageCache(
       config.cacheDir,
       config.maxCacheSize ?? DEFAULT_MAX_CACHE_SIZE,
@@ -188,6 +193,42 @@ export class ImageService {
     });
   }
 
+  /**
+   * Get an initramfs holding just the init binary, for machines whose root
+   * filesystem is served over vsock rather than attached as a drive.
+   * Rebuilt whenever the init binary is newer.
+   */
+  async resolveInitramfs(): Promise<Result<string, OciError>> {
+    if (!this.initialized) {
+      const initResult = await this.init();
+      if (initResult.isErr()) {
+        return Result.err(initResult.error);
+      }
+    }
+
+    const initPath = getInitBinaryPath();
+    if (!initPath) {
+      return Result.err(
+        new ImageConvertError({
+          message: "No init binary found. Build the init with 'make' in guest/ or set HYPERFLEET_INIT_PATH",
+          imageRef: "",
+        })
+      );
+    }
+
+    const outputPath = join(this.cacheDir, "initramfs.cpio");
+    const [init, existing] = await Promise.all([
+      stat(initPath),
+      stat(outputPath).catch(() => null),
+    ]);
+    if (existing && existing.mtimeMs >= init.mtimeMs) {
+      return Result.ok(outputPath);
+    }
+
+    this.logger?.info("Building initramfs", { init: initPath, path: outputPath });
+    return buildInitramfs(initPath, outputPath);
+  }
+
   /**
    * Clear the image cache
    */
@@ -2,6 +2,7 @@
 export { ImageService, getImageService } from "./image-service.js";
 export { ImageCache } from "./cache.js";
 export { ImageConverter } from "./converter.js";
+export { buildInitramfs, encodeCpio } from "./initramfs.js";
 export { parseImageRef, toSkopeoRef, toCacheKey } from "./image-ref.js";
 export {
   // Types
@@ -0,0 +1,85 @@
+import { Result } from "better-result";
+import { readFile, rename, writeFile } from "node:fs/promises";
+import { ImageConvertError } from "./types.js";
+
+const S_IFDIR = 0o040000;
+const S_IFCHR = 0o020000;
+const S_IFREG = 0o100000;
+
+interface CpioEntry {
+  name: string;
+  mode: number;
+  data?: Buffer;
+  rdev?: [number, number];
+}
+
+function pad4(length: number): Buffer {
+  return Buffer.alloc((4 - (length % 4)) % 4);
+}
+
+/**
+ * Encode entries as a "newc" cpio archive, the format the kernel unpacks
+ * initramfs images from
+ */
+export function encodeCpio(entries: CpioEntry[]): Buffer {
+  const parts: Buffer[] = [];
+  const hex = (value: number) => value.toString(16).padStart(8, "0");
+
+  [...entries, { name: "TRAILER!!!", mode: 0 }].forEach((entry: CpioEntry, index) => {
+    const data = entry.data ?? Buffer.alloc(0);
+    const name = Buffer.from(`${entry.name}\0`);
+    const [rdevMajor, rdevMinor] = entry.rdev ?? [0, 0];
+    const isDir = (entry.mode & 0o170000) === S_IFDIR;
+    const fields = [
+      index + 1, // ino
+      entry.mode,
+      0, // uid
+      0, // gid
+      isDir ? 2 : 1, // nlink
+      0, // mtime
+      data.length,
+      0, // devmajor
+      0, // devminor
+      rdevMajor,
+      rdevMinor,
+      name.length,
+      0, // check
+    ];
+    const header = Buffer.from(`070701${fields.map(hex).join("")}`);
+    parts.push(header, name, pad4(header.length + name.length), data, pad4(data.length));
+  });
+
+  return Buffer.concat(parts);
+}
+
+/**
+ * Write an initramfs holding only the init binary (as /init) and a console.
+ * Init mounts the real root filesystem itself when the kernel command line
+ * asks for one over the network.
+ */
+export async function buildInitramfs(
+  initPath: string,
+  outputPath: string
+): Promise<Result<string, ImageConvertError>> {
+  return Result.tryPromise({
+    try: async () => {
+      const archive = encodeCpio([
+        { name: "dev", mode: S_IFDIR | 0o755 },
+        { name: "dev/console", mode: S_IFCHR | 0o600, rdev: [5, 1] },
+        { name: "init", mode: S_IFREG | 0o755, data: await readFile(initPath) },
+      ]);
+
+      // Machines may be starting from the current one while it is replaced
+      const tempPath = `${outputPath}.${process.pid}.tmp`;
+      await writeFile(tempPath, archive);
+      await rename(tempPath, outputPath);
+      return outputPath;
+    },
+    catch: (error) =>
+      new ImageConvertError({
+        message: "Failed to build initramfs",
+        imageRef: "",
+        cause: error instanceof Error ? error.message : String(error),
+      }),
+  });
+}